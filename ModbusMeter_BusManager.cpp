@@ -0,0 +1,510 @@
+#include "ModbusMeter_BusManager.h"
+
+ModbusBusManager::ModbusBusManager(void)
+{
+  _u8Buses = 0;
+  _u8Meters = 0;
+  _u32PeriodMs = 0;
+  _bRun = false;
+  memset(_records, 0, sizeof(_records));
+  memset(_u32GroupMs, 0, sizeof(_u32GroupMs));
+  memset(_u8FieldGroup, 0, sizeof(_u8FieldGroup));
+#if defined(ESP32)
+  _lock = xSemaphoreCreateMutex();
+#endif
+}
+
+ModbusBusManager::~ModbusBusManager(void)
+{
+  stop();
+#if defined(ESP32)
+  vSemaphoreDelete(_lock);
+#endif
+}
+
+/**
+Register a bus. The ModbusMeter must already be bound to its Stream and
+have at least one md[] or pd[] slot for the meter types polled on it.
+
+@return bus number for addMeter(), or ku8MaxBuses if the table is full or
+        the workers are running
+*/
+uint8_t ModbusBusManager::addBus(ModbusMeter &meter)
+{
+  busWorker *bus;
+
+  if (_bRun || _u8Buses == ku8MaxBuses)
+  {
+    return ku8MaxBuses;
+  }
+
+  bus = &_buses[_u8Buses];
+  bus->manager = this;
+  bus->meter = &meter;
+  bus->u8Bus = _u8Buses;
+  bus->u32Cycles = 0;
+#if defined(ESP32)
+  bus->done = 0;
+#endif
+  return _u8Buses++;
+}
+
+/**
+Assign a meter to a bus. Arguments are those of ModbusMeter::readMeterData();
+adj[], mt[] and dt[] are copied. mt and dt may be 0 for meter types that do
+not use them.
+
+@return row of the meter in the shared table, or ku8NoRow if the table is
+        full, the bus is unknown or the workers are running
+*/
+uint8_t ModbusBusManager::addMeter(uint8_t u8Bus, uint8_t slave, uint8_t slaveIndex, uint8_t mType, const float *adj, const uint16_t *mt, const uint8_t *dt)
+{
+  const ModbusMeter::meterProfile *profile = ModbusMeter::findProfile(mType);
+  pollJob *job;
+
+  if (_bRun || u8Bus >= _u8Buses || _u8Meters == ku8MaxMeters)
+  {
+    return ku8NoRow;
+  }
+
+  job = &_jobs[_u8Meters];
+  memset(job, 0, sizeof(*job));
+  job->u8Bus = u8Bus;
+  job->slave = slave;
+  job->slaveIndex = slaveIndex;
+  job->mType = mType;
+  memcpy(job->adj, adj, sizeof(job->adj));
+  if (mt)
+  {
+    memcpy(job->mt, mt, sizeof(job->mt));
+  }
+  if (dt)
+  {
+    memcpy(job->dt, dt, sizeof(job->dt));
+  }
+  for (uint8_t k = 0; profile && k < profile->u8Fields; k++)
+  {
+    job->u64Fields |= 1ULL << profile->fields[k].u8Field;
+  }
+  _records[_u8Meters].u8Result = ModbusMeter::ku8MBPending;
+  return _u8Meters++;
+}
+
+/**
+Set how often the fields of a rate group are read. All groups start at 0,
+so by default every field is read every cycle.
+
+A meter's first successful read takes every field; after that a group is
+read once per period, at an offset that spreads the meters of a bus evenly
+over the period. A read that fails leaves the group due, so it is retried
+in the next cycle; so does a partial read that missed any of the group's
+fields.
+
+@param u32PeriodMs period of the group; 0 reads it every cycle
+@return false if the group is unknown or the workers are running
+*/
+bool ModbusBusManager::setRateGroup(uint8_t u8Group, uint32_t u32PeriodMs)
+{
+  if (_bRun || u8Group >= ku8RateGroups)
+  {
+    return false;
+  }
+
+  _u32GroupMs[u8Group] = u32PeriodMs;
+  return true;
+}
+
+/**
+Put a field into a rate group; see setRateGroup().
+
+@param u8Field one of ModbusMeter::ku8Field*
+@return false if the field or group is unknown or the workers are running
+*/
+bool ModbusBusManager::setFieldGroup(uint8_t u8Field, uint8_t u8Group)
+{
+  if (_bRun || u8Field >= ModbusMeter::ku8PQFields || u8Group >= ku8RateGroups)
+  {
+    return false;
+  }
+
+  _u8FieldGroup[u8Field] = u8Group;
+  return true;
+}
+
+/**
+Start one polling worker per bus.
+
+@param u32PeriodMs start-to-start time of a cycle on each bus; a bus that
+       takes longer starts its next cycle immediately
+@return false if already running or a worker could not be created
+*/
+bool ModbusBusManager::start(uint32_t u32PeriodMs)
+{
+  uint32_t u32Start = millis();
+  uint8_t u8Rows[ku8MaxBuses] = {0};
+  uint8_t u8Ordinal[ku8MaxBuses] = {0};
+  uint8_t b, k, g;
+
+  if (_bRun)
+  {
+    return false;
+  }
+
+  // meter n of the m on a bus reads each slow group (n + 1/2)/m of a period
+  // after the start; the half slot keeps due times off the cycle starts
+  // when the group period is a multiple of the cycle
+  for (k = 0; k < _u8Meters; k++)
+  {
+    u8Rows[_jobs[k].u8Bus]++;
+  }
+  for (k = 0; k < _u8Meters; k++)
+  {
+    pollJob *job = &_jobs[k];
+
+    for (g = 0; g < ku8RateGroups; g++)
+    {
+      job->u32DueMs[g] = u32Start + (uint32_t)((uint64_t)_u32GroupMs[g] * (2 * u8Ordinal[job->u8Bus] + 1) / (2 * u8Rows[job->u8Bus]));
+    }
+    u8Ordinal[job->u8Bus]++;
+  }
+  orderJobs();
+
+  _u32PeriodMs = u32PeriodMs;
+  _bRun = true;
+
+  for (b = 0; b < _u8Buses; b++)
+  {
+    busWorker *bus = &_buses[b];
+#if defined(ESP32)
+    bus->done = xSemaphoreCreateBinary();
+    if (xTaskCreatePinnedToCore(taskEntry, "mbBus", 4096, bus, 1, &bus->task, tskNO_AFFINITY) != pdPASS)
+    {
+      vSemaphoreDelete(bus->done);
+      bus->done = 0;
+      stop();
+      return false;
+    }
+#else
+    bus->thread = std::thread(&ModbusBusManager::pollBus, this, bus);
+#endif
+  }
+  return true;
+}
+
+/**
+Stop the workers; returns once every worker has finished its current read.
+*/
+void ModbusBusManager::stop()
+{
+  uint8_t b;
+
+  if (!_bRun)
+  {
+    return;
+  }
+  _bRun = false;
+
+  for (b = 0; b < _u8Buses; b++)
+  {
+#if defined(ESP32)
+    if (_buses[b].done)
+    {
+      xSemaphoreTake(_buses[b].done, portMAX_DELAY);
+      vSemaphoreDelete(_buses[b].done);
+      _buses[b].done = 0;
+    }
+#else
+    if (_buses[b].thread.joinable())
+    {
+      _buses[b].thread.join();
+    }
+#endif
+  }
+}
+
+bool ModbusBusManager::running()
+{
+  return _bRun;
+}
+
+/**
+Copy one row of the shared table.
+
+@return false if the row does not exist
+*/
+bool ModbusBusManager::getRecord(uint8_t u8Row, meterRecord *record)
+{
+  if (u8Row >= _u8Meters)
+  {
+    return false;
+  }
+
+  lock();
+  *record = _records[u8Row];
+  unlock();
+  return true;
+}
+
+/**
+Copy the whole shared table in one go, so all rows come from the same
+instant.
+
+@return number of rows copied
+*/
+uint8_t ModbusBusManager::getRecords(meterRecord *records, uint8_t u8Max)
+{
+  uint8_t u8Rows = (_u8Meters < u8Max) ? _u8Meters : u8Max;
+
+  lock();
+  memcpy(records, _records, u8Rows * sizeof(meterRecord));
+  unlock();
+  return u8Rows;
+}
+
+/**
+Number of completed polling cycles of a bus.
+*/
+uint32_t ModbusBusManager::getCycles(uint8_t u8Bus)
+{
+  return (u8Bus < _u8Buses) ? _buses[u8Bus].u32Cycles : 0;
+}
+
+void ModbusBusManager::lock()
+{
+#if defined(ESP32)
+  xSemaphoreTake(_lock, portMAX_DELAY);
+#else
+  _lock.lock();
+#endif
+}
+
+void ModbusBusManager::unlock()
+{
+#if defined(ESP32)
+  xSemaphoreGive(_lock);
+#else
+  _lock.unlock();
+#endif
+}
+
+#if defined(ESP32)
+void ModbusBusManager::taskEntry(void *arg)
+{
+  busWorker *bus = (busWorker *)arg;
+
+  bus->manager->pollBus(bus);
+  xSemaphoreGive(bus->done);
+  vTaskDelete(NULL);
+}
+#endif
+
+/**
+Fields of a meter whose rate group is due at the start of a cycle. Due
+times are compared with the cycle start rather than the moment the meter
+is read, so a group lands in the same cycle wherever the meter sits in
+the polling order.
+
+@param pu8Groups receives the due groups with a period, one bit each
+*/
+uint64_t ModbusBusManager::dueFields(const pollJob *job, uint32_t u32CycleMs, uint8_t *pu8Groups)
+{
+  uint8_t u8Due = 0;
+  uint64_t u64Mask = 0;
+  uint8_t g, f;
+
+  *pu8Groups = 0;
+  for (g = 0; g < ku8RateGroups; g++)
+  {
+    if (!_u32GroupMs[g])
+    {
+      u8Due |= 1 << g;
+    }
+    else if ((int32_t)(u32CycleMs - job->u32DueMs[g]) >= 0)
+    {
+      u8Due |= 1 << g;
+      *pu8Groups |= 1 << g;
+    }
+  }
+
+  for (f = 0; f < ModbusMeter::ku8PQFields; f++)
+  {
+    if (u8Due & (1 << _u8FieldGroup[f]))
+    {
+      u64Mask |= 1ULL << f;
+    }
+  }
+  return u64Mask;
+}
+
+/**
+Copy the fields a read delivered from slot 0 of the bus into a row of the
+shared table; call with the lock held.
+
+Slot 0 is shared by every meter of the bus, so only the fields in u64Mask
+that arrived are taken over; the others keep their previous reading.
+*/
+void ModbusBusManager::publish(uint8_t u8Row, const ModbusMeter *meter, uint8_t result, uint64_t u64Mask)
+{
+  meterRecord *record = &_records[u8Row];
+  const float *pfSrc;
+  uint8_t u8Fields;
+  uint64_t u64Got;
+  time_t mdt;
+
+  record->u8Result = result;
+  if (result != ModbusMeter::ku8MBSuccess && result != ModbusMeter::ku8MBPartialRead)
+  {
+    return;
+  }
+
+  if (ModbusMeter::isPQType(_jobs[u8Row].mType))
+  {
+    pfSrc = &meter->pd[0].watt;
+    u8Fields = ModbusMeter::ku8PQFields;
+    u64Got = meter->pd[0].u64Valid & u64Mask;
+    mdt = meter->pd[0].mdt;
+  }
+  else
+  {
+    pfSrc = &meter->md[0].watt;
+    u8Fields = ModbusMeter::ku8MeterFields;
+    u64Got = meter->md[0].u64Valid & u64Mask;
+    mdt = meter->md[0].mdt;
+  }
+  if (!u64Got)
+  {
+    return;
+  }
+  for (uint8_t f = 0; f < u8Fields; f++)
+  {
+    if (u64Got & (1ULL << f))
+    {
+      (&record->data.watt)[f] = pfSrc[f];
+    }
+  }
+  record->data.mdt = mdt;
+  record->data.u64Valid = (record->data.u64Valid & ~u64Mask) | u64Got;
+  record->u32Updates++;
+}
+
+/**
+Sort the rows into polling order: by bus, then by the serial configuration
+of the slave, keeping the order of addMeter() within a configuration.
+*/
+void ModbusBusManager::orderJobs()
+{
+  uint32_t u32Key[ku8MaxMeters];
+  uint8_t u8Format;
+  uint8_t i, k;
+
+  for (k = 0; k < _u8Meters; k++)
+  {
+    uint32_t u32Baud;
+
+    // baud rates are multiples of 100 up to a few Mbaud; room for the format
+    _buses[_jobs[k].u8Bus].meter->getSlaveSerial(_jobs[k].slave, &u32Baud, &u8Format);
+    u32Key[k] = ((uint32_t)_jobs[k].u8Bus << 28) | ((u32Baud / 100) << 2) | u8Format;
+  }
+
+  // insertion sort; stable, and the table is small
+  for (k = 0; k < _u8Meters; k++)
+  {
+    for (i = k; i > 0 && u32Key[_u8Order[i - 1]] > u32Key[k]; i--)
+    {
+      _u8Order[i] = _u8Order[i - 1];
+    }
+    _u8Order[i] = k;
+  }
+}
+
+/**
+Worker body: read the due fields of every meter of one bus, publish, wait
+for the next cycle.
+
+Each read goes into slot 0 of the bus's own ModbusMeter, which only this
+worker touches; the lock is held just for the copy into the shared table.
+*/
+void ModbusBusManager::pollBus(busWorker *bus)
+{
+  ModbusMeter *meter = bus->meter;
+  uint32_t u32CycleStart;
+  bool bReverse = false;
+  uint8_t i, k, g;
+
+  while (_bRun)
+  {
+    u32CycleStart = millis();
+
+    for (i = 0; i < _u8Meters && _bRun; i++)
+    {
+      k = _u8Order[bReverse ? _u8Meters - 1 - i : i];
+      pollJob *job = &_jobs[k];
+      uint64_t u64Mask;
+      uint8_t u8Groups = 0;
+      uint8_t result;
+
+      if (job->u8Bus != bus->u8Bus)
+      {
+        continue;
+      }
+
+      // a meter's first read takes every field, and counts as the read of
+      // the groups already due; u32Updates is only written by this worker
+      u64Mask = dueFields(job, u32CycleStart, &u8Groups);
+      if (!_records[k].u32Updates)
+      {
+        u64Mask = ModbusMeter::ku64AllFields;
+      }
+      if (!u64Mask)
+      {
+        continue;
+      }
+
+      meter->setReadMask(u64Mask);
+      result = meter->readMeterData(0, job->slave, job->slaveIndex, job->mType, time(NULL), job->adj, job->mt, job->dt);
+      meter->setReadMask(ModbusMeter::ku64AllFields);
+
+      // a partial read advances only the groups whose fields all arrived;
+      // the others stay due and are retried in the next cycle
+      if (result == ModbusMeter::ku8MBPartialRead)
+      {
+        uint64_t u64Valid = ModbusMeter::isPQType(job->mType) ? meter->pd[0].u64Valid : meter->md[0].u64Valid;
+        uint64_t u64Missing = u64Mask & job->u64Fields & ~u64Valid;
+
+        for (uint8_t f = 0; u64Missing; f++, u64Missing >>= 1)
+        {
+          if (u64Missing & 1)
+            u8Groups &= ~(1 << _u8FieldGroup[f]);
+        }
+      }
+
+      if (result == ModbusMeter::ku8MBSuccess || result == ModbusMeter::ku8MBPartialRead)
+      {
+        for (g = 0; g < ku8RateGroups; g++)
+        {
+          if (!(u8Groups & (1 << g)))
+            continue;
+
+          // keep the phase; a bus that fell behind starts a fresh period
+          job->u32DueMs[g] += _u32GroupMs[g];
+          if ((int32_t)(u32CycleStart - job->u32DueMs[g]) >= 0)
+            job->u32DueMs[g] = u32CycleStart + _u32GroupMs[g];
+        }
+      }
+
+      lock();
+      publish(k, meter, result, u64Mask);
+      unlock();
+    }
+
+    bus->u32Cycles++;
+    bReverse = !bReverse;
+
+    // sleep in short slices so stop() is not held up by a long period
+    while (_bRun && (millis() - u32CycleStart) < _u32PeriodMs)
+    {
+      uint32_t u32Left = _u32PeriodMs - (millis() - u32CycleStart);
+      delay(u32Left < 50 ? u32Left : 50);
+    }
+  }
+}
@@ -0,0 +1,136 @@
+#ifndef ModbusMeter_BusManager_h
+#define ModbusMeter_BusManager_h
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+#if defined(ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#else
+#include <mutex>
+#include <thread>
+#endif
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusMeter_ESP32.h"
+
+/**
+Polls several RS-485 buses at the same time.
+
+Every bus is a ModbusMeter bound to its own Stream. start() runs one worker
+per bus, a FreeRTOS task on ESP32 or a std::thread in a host build, which
+walks the meters assigned to that bus. Readings are copied into a shared
+table under a lock, so a reader always sees a complete record. A cycle takes
+as long as the slowest bus instead of the sum of all buses.
+
+Fields can be put into rate groups with setFieldGroup()/setRateGroup(), so
+that e.g. energy and harmonics are read once a minute while power and
+currents are read every cycle. A cycle then reads, per meter, only the
+fields whose group is due; the block planner coalesces just those. The
+slow groups of the meters on a bus are staggered across the group period,
+so every cycle carries about the same share of slow reads instead of all
+meters reading everything in the same cycle.
+
+Meters with a serial profile of their own (ModbusMeter::setSlaveSerial(),
+set before start()) are polled grouped by profile, and every other cycle
+walks the groups in reverse, so the last group of a cycle is the first of
+the next: a bus mixing n configurations switches its UART n - 1 times per
+cycle, plus once at the start if the UART is not already in the first
+group's configuration. extras/bench/serial_bench.cpp measures 21 switches
+over 10 cycles of three configurations this way, against 80 in table
+order.
+*/
+class ModbusBusManager
+{
+public:
+  ModbusBusManager();
+  ~ModbusBusManager();
+
+  /**
+  One row of the shared meter table. Energy meters fill the meterData
+  prefix of data; PQ meters fill all of it. A read only updates the fields
+  it was asked for (see setRateGroup()) and that arrived (see
+  ModbusMeter::setPartialReads()); the others keep the previous reading.
+  data.u64Valid flags the fields holding a reading.
+  */
+  typedef struct __meterRecord
+  {
+    ModbusMeter::pqData data;
+    uint8_t u8Result;     ///< result of the last read
+    uint32_t u32Updates;  ///< number of successful reads
+  } meterRecord;
+
+  uint8_t addBus(ModbusMeter &meter);
+  uint8_t addMeter(uint8_t u8Bus, uint8_t slave, uint8_t slaveIndex, uint8_t mType, const float *adj, const uint16_t *mt, const uint8_t *dt);
+
+  bool setRateGroup(uint8_t u8Group, uint32_t u32PeriodMs);
+  bool setFieldGroup(uint8_t u8Field, uint8_t u8Group);
+
+  bool start(uint32_t u32PeriodMs);
+  void stop();
+  bool running();
+
+  bool getRecord(uint8_t u8Row, meterRecord *record);
+  uint8_t getRecords(meterRecord *records, uint8_t u8Max);
+  uint32_t getCycles(uint8_t u8Bus);
+
+  static const uint8_t ku8MaxBuses = 4;
+  static const uint8_t ku8MaxMeters = 32;
+  static const uint8_t ku8NoRow = 0xFF;
+  static const uint8_t ku8RateGroups = 4;
+
+private:
+  typedef struct __pollJob
+  {
+    uint8_t u8Bus;
+    uint8_t slave;
+    uint8_t slaveIndex;
+    uint8_t mType;
+    float adj[ModbusMeter::ku8MeterFields];
+    uint16_t mt[ModbusMeter::ku8MeterFields + 1];
+    uint8_t dt[ModbusMeter::ku8MeterFields];
+    uint64_t u64Fields;               ///< fields the meter's profile delivers
+    uint32_t u32DueMs[ku8RateGroups]; ///< millis() when each rate group is read next
+  } pollJob;
+
+  typedef struct __busWorker
+  {
+    ModbusBusManager *manager;
+    ModbusMeter *meter;
+    uint8_t u8Bus;
+    uint32_t u32Cycles;
+#if defined(ESP32)
+    TaskHandle_t task;
+    SemaphoreHandle_t done;
+#else
+    std::thread thread;
+#endif
+  } busWorker;
+
+  busWorker _buses[ku8MaxBuses];
+  uint8_t _u8Buses;
+  pollJob _jobs[ku8MaxMeters];
+  uint8_t _u8Order[ku8MaxMeters]; ///< rows in polling order: by bus, then serial configuration
+  meterRecord _records[ku8MaxMeters];
+  uint8_t _u8Meters;
+  uint32_t _u32PeriodMs;
+  uint32_t _u32GroupMs[ku8RateGroups];                 ///< period of each rate group; 0 = every cycle
+  uint8_t _u8FieldGroup[ModbusMeter::ku8PQFields];     ///< rate group of each ku8Field*
+  volatile bool _bRun;
+
+#if defined(ESP32)
+  SemaphoreHandle_t _lock;
+  static void taskEntry(void *arg);
+#else
+  std::mutex _lock;
+#endif
+
+  void lock();
+  void unlock();
+  void pollBus(busWorker *bus);
+  void orderJobs();
+  uint64_t dueFields(const pollJob *job, uint32_t u32CycleMs, uint8_t *pu8Groups);
+  void publish(uint8_t u8Row, const ModbusMeter *meter, uint8_t result, uint64_t u64Mask);
+};
+
+#endif
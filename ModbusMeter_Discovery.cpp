@@ -0,0 +1,795 @@
+#include "ModbusMeter_Discovery.h"
+
+typedef ModbusMeter MM;
+
+// fingerprint fields, in reading order; a candidate whose voltage is not
+// plausible is dropped before anything else is read
+static const uint8_t kChecks[] = {MM::ku8FieldV0, MM::ku8FieldI0, MM::ku8FieldPf, MM::ku8FieldFreq, MM::ku8FieldThdvr};
+static const uint8_t ku8Checks = sizeof(kChecks);
+
+ModbusDiscovery::ModbusDiscovery(void)
+{
+  _meter = 0;
+  _link = 0;
+  _u8State = ku8StateIdle;
+  _u8Result = MM::ku8MBSuccess;
+  _u8First = 1;
+  _u8Last = 247;
+  _u8Next = 0;
+  _u8Rewinds = 0;
+  _u16ProbeMs = ku16DefaultProbeMs;
+  _bVerify = false;
+  _u8InFlight = 0;
+  _u8Found = 0;
+  _bReading = false;
+}
+
+/**
+Start a scan of slave addresses u8First..u8Last on an RS-485 bus.
+
+The bus must not be used otherwise until the scan is done; the meter is in
+scan mode meanwhile (see ModbusMeter::setScanMode()).
+
+@return false if a scan is running or the range is not within 1..247
+*/
+bool ModbusDiscovery::begin(ModbusMeter &meter, uint8_t u8First, uint8_t u8Last)
+{
+  if (_u8State != ku8StateIdle || !u8First || u8First > u8Last || u8Last > 247)
+  {
+    return false;
+  }
+  _meter = &meter;
+  _link = 0;
+  _u8First = u8First;
+  _u8Last = u8Last;
+  _bVerify = false;
+  _u8Found = 0;
+  start(ku8StateSweep);
+  return true;
+}
+
+/**
+Start a scan through a Modbus TCP gateway, with probes pipelined up to the
+window of the link.
+
+The probe timeout is the link's (see ModbusTcpLink::setTimeout()); the
+gateway's own RS-485 timeout decides how long each absent address holds
+its line, so it should be short.
+*/
+bool ModbusDiscovery::begin(ModbusTcpLink &link, uint8_t u8First, uint8_t u8Last)
+{
+  if (_u8State != ku8StateIdle || !u8First || u8First > u8Last || u8Last > 247)
+  {
+    return false;
+  }
+  _meter = 0;
+  _link = &link;
+  _u8First = u8First;
+  _u8Last = u8Last;
+  _bVerify = false;
+  _u8Found = 0;
+  start(ku8StateSweep);
+  return true;
+}
+
+/**
+Check the slaves of a previous scan or unpack() instead of scanning.
+
+Each cached slave is probed and fingerprinted with its cached type first.
+poll() ends with ku8TopologyChanged if a slave is gone or now fits
+another type; the list is updated either way.
+
+@return false if a scan is running or nothing is cached
+*/
+bool ModbusDiscovery::verify(ModbusMeter &meter)
+{
+  if (_u8State != ku8StateIdle || !_u8Found)
+  {
+    return false;
+  }
+  _meter = &meter;
+  _link = 0;
+  _u8First = 1;
+  _u8Last = 247;
+  _bVerify = true;
+  start(ku8StateConfirm);
+  return true;
+}
+
+bool ModbusDiscovery::verify(ModbusTcpLink &link)
+{
+  if (_u8State != ku8StateIdle || !_u8Found)
+  {
+    return false;
+  }
+  _meter = 0;
+  _link = &link;
+  _u8First = 1;
+  _u8Last = 247;
+  _bVerify = true;
+  start(ku8StateConfirm);
+  return true;
+}
+
+/**
+Set how long the sweep waits for the first byte of an answer on RS-485,
+ku16DefaultProbeMs by default. Slaves slower than this are still found by
+the confirm pass, at the cost of a ku16ConfirmMs probe each.
+
+@param u16TimeoutMs probe timeout [milliseconds]
+*/
+void ModbusDiscovery::setProbeTimeout(uint16_t u16TimeoutMs)
+{
+  _u16ProbeMs = u16TimeoutMs ? u16TimeoutMs : 1;
+}
+
+/**
+Advance the scan.
+
+@return ModbusMeter::ku8MBPending while running; afterwards
+        ModbusMeter::ku8MBSuccess, ku8TopologyChanged after verify(), or
+        ModbusMeter::ku8MBNoConnection if the link could not be opened
+*/
+uint8_t ModbusDiscovery::poll()
+{
+  uint8_t result;
+
+  if (_u8State == ku8StateIdle)
+  {
+    return _u8Result;
+  }
+  if (_link)
+  {
+    _link->poll();
+  }
+
+  if (_u8State == ku8StateFingerprint)
+  {
+    result = fingerprint();
+    if (result != MM::ku8MBPending)
+    {
+      finish(result);
+      return _u8Result;
+    }
+    return MM::ku8MBPending;
+  }
+
+  result = sweep();
+  if (result == MM::ku8MBPending)
+  {
+    return result;
+  }
+  if (result != MM::ku8MBSuccess)
+  {
+    finish(result);
+    return _u8Result;
+  }
+  if (_u8State == ku8StateSweep)
+  {
+    start(ku8StateConfirm);
+  }
+  else
+  {
+    listFound();
+    start(ku8StateFingerprint);
+  }
+  return MM::ku8MBPending;
+}
+
+/**
+Blocking scan: poll() until done, sleeping between polls.
+*/
+uint8_t ModbusDiscovery::run()
+{
+  uint8_t result;
+
+  while ((result = poll()) == MM::ku8MBPending)
+  {
+    delay(1);
+  }
+  return result;
+}
+
+bool ModbusDiscovery::busy()
+{
+  return _u8State != ku8StateIdle;
+}
+
+/**
+Number of slaves found, in address order; at most ku8MaxFound.
+*/
+uint8_t ModbusDiscovery::found()
+{
+  return _u8Found;
+}
+
+bool ModbusDiscovery::getFound(uint8_t u8Index, foundSlave *slave)
+{
+  if (u8Index >= _u8Found)
+  {
+    return false;
+  }
+  *slave = _found[u8Index];
+  return true;
+}
+
+/**
+Serialize the slaves found, for NVS or a file: version, count, three bytes
+per slave and a Modbus CRC over all of it.
+
+@return bytes written; 0 if u16Size is too small
+*/
+uint16_t ModbusDiscovery::pack(uint8_t *pu8Buf, uint16_t u16Size)
+{
+  uint16_t u16Len = 4 + 3 * _u8Found;
+  uint16_t u16CRC;
+  uint8_t *p = pu8Buf;
+
+  if (u16Size < u16Len)
+  {
+    return 0;
+  }
+  *p++ = ku8CacheVersion;
+  *p++ = _u8Found;
+  for (uint8_t i = 0; i < _u8Found; i++)
+  {
+    *p++ = _found[i].slave;
+    *p++ = _found[i].mType;
+    *p++ = _found[i].u8Score;
+  }
+  u16CRC = crc16_block(0xFFFF, pu8Buf, p - pu8Buf);
+  *p++ = lowByte(u16CRC);
+  *p++ = highByte(u16CRC);
+  return u16Len;
+}
+
+/**
+Load slaves saved by pack(), e.g. before verify().
+
+@return false if the blob is damaged or from another version; the list is
+        left unchanged then
+*/
+bool ModbusDiscovery::unpack(const uint8_t *pu8Buf, uint16_t u16Len)
+{
+  uint8_t u8Count;
+
+  if (_u8State != ku8StateIdle || u16Len < 4 || pu8Buf[0] != ku8CacheVersion)
+  {
+    return false;
+  }
+  u8Count = pu8Buf[1];
+  if (u8Count > ku8MaxFound || u16Len != 4 + 3 * u8Count || crc16_block(0xFFFF, pu8Buf, u16Len) != 0)
+  {
+    return false;
+  }
+
+  pu8Buf += 2;
+  for (uint8_t i = 0; i < u8Count; i++, pu8Buf += 3)
+  {
+    _found[i].slave = pu8Buf[0];
+    _found[i].mType = pu8Buf[1];
+    _found[i].u8Score = pu8Buf[2];
+  }
+  _u8Found = u8Count;
+  return true;
+}
+
+void ModbusDiscovery::start(uint8_t u8State)
+{
+  _u8State = u8State;
+  _u8Next = _u8First;
+  _u8InFlight = 0;
+  _u8Rewinds = 0;
+
+  if (u8State == ku8StateSweep)
+  {
+    _u8Result = MM::ku8MBSuccess;
+    memset(_u32Present, 0, sizeof(_u32Present));
+    memset(_u32Suspect, 0, sizeof(_u32Suspect));
+    memset(_u8RecentSlave, 0, sizeof(_u8RecentSlave));
+    _u8RecentHead = 0;
+  }
+  else if (u8State == ku8StateConfirm && _bVerify)
+  {
+    // the cached slaves are the suspects
+    _u8Result = MM::ku8MBSuccess;
+    memset(_u32Present, 0, sizeof(_u32Present));
+    memset(_u32Suspect, 0, sizeof(_u32Suspect));
+    memset(_u8RecentSlave, 0, sizeof(_u8RecentSlave));
+    _u8RecentHead = 0;
+    for (uint8_t i = 0; i < _u8Found; i++)
+    {
+      setBit(_u32Suspect, _found[i].slave);
+    }
+  }
+  else if (u8State == ku8StateFingerprint)
+  {
+    _u8Fp = 0;
+    _bReading = false;
+    prepareSlave();
+  }
+
+  if (_meter)
+  {
+    _meter->setScanMode(u8State == ku8StateSweep ? _u16ProbeMs : ku16ConfirmMs);
+  }
+}
+
+void ModbusDiscovery::finish(uint8_t result)
+{
+  if (_link)
+  {
+    for (uint8_t i = 0; i < _u8InFlight; i++)
+    {
+      _link->cancel(_probes[i].u16Tid);
+    }
+  }
+  if (_meter)
+  {
+    _meter->setScanMode(0);
+  }
+  _u8InFlight = 0;
+  _u8State = ku8StateIdle;
+  if (result != MM::ku8MBSuccess || _u8Result == MM::ku8MBSuccess)
+  {
+    _u8Result = result;
+  }
+}
+
+/**
+Send a read on the bus.
+
+@return ModbusMeter::ku8MBPending once sent; ModbusMeter::ku8MBBusy if it
+        has to wait (bus not quiet yet, link window full); else an error
+*/
+uint8_t ModbusDiscovery::issue(uint8_t slave, uint8_t u8Fn, uint16_t u16Address, uint8_t u8Qty, uint16_t *pu16Tid)
+{
+  if (_link)
+  {
+    return _link->request(slave, u8Fn, u16Address, u8Qty, pu16Tid);
+  }
+  if (!_meter->busQuiet(slave))
+  {
+    return MM::ku8MBBusy;
+  }
+  return _meter->beginTransaction(slave, u16Address, u8Qty, u8Fn);
+}
+
+/**
+Result of a read sent by issue(); on success the payload is in _u8Data.
+*/
+uint8_t ModbusDiscovery::collect(const probe *p, uint8_t u8Qty)
+{
+  MM::responseSpan span;
+  uint8_t u8Words;
+  uint8_t result;
+
+  if (_link)
+  {
+    result = _link->take(p->u16Tid, _u8Data, &u8Words);
+    if (result == MM::ku8MBSuccess && u8Words != u8Qty)
+    {
+      result = MM::ku8MBInvalidLength;
+    }
+    return result;
+  }
+
+  result = _meter->pollTransaction();
+  if (result == MM::ku8MBSuccess)
+  {
+    span = _meter->getResponseSpan();
+    memcpy(_u8Data, span.pu8Data, 2 * span.u8Words);
+  }
+  return result;
+}
+
+/**
+One step of the sweep or the confirm pass: take the answers that are in,
+then send probes while the bus or the link window allows.
+*/
+uint8_t ModbusDiscovery::sweep()
+{
+  uint8_t u8Window = _link ? ModbusTcpLink::ku8MaxInFlight : 1;
+  uint8_t result;
+  uint8_t i = 0;
+
+  while (i < _u8InFlight)
+  {
+    result = collect(&_probes[i], 1);
+    if (result == MM::ku8MBPending)
+    {
+      i++;
+      continue;
+    }
+    classify(_probes[i].slave, result);
+    _probes[i] = _probes[--_u8InFlight];
+  }
+
+  while (_u8InFlight < u8Window)
+  {
+    while (_u8Next <= _u8Last && (getBit(_u32Present, _u8Next) ||
+                                  (_u8State == ku8StateConfirm && !getBit(_u32Suspect, _u8Next))))
+    {
+      _u8Next++;
+    }
+    if (_u8Next > _u8Last)
+    {
+      break;
+    }
+
+    result = issue(_u8Next, ku8FnProbe, 0, 1, &_probes[_u8InFlight].u16Tid);
+    if (result == MM::ku8MBBusy)
+    {
+      break;
+    }
+    if (result != MM::ku8MBPending)
+    {
+      return result;
+    }
+    if (!_link)
+    {
+      _u8RecentSlave[_u8RecentHead] = _u8Next;
+      _u32RecentMs[_u8RecentHead] = millis();
+      _u8RecentHead = (_u8RecentHead + 1) % ku8Recent;
+    }
+    _probes[_u8InFlight++].slave = _u8Next++;
+  }
+
+  return (_u8InFlight || _u8Next <= _u8Last) ? MM::ku8MBPending : MM::ku8MBSuccess;
+}
+
+/**
+Record the outcome of a probe. Any answer from the addressed slave, an
+exception included, means it is there.
+*/
+void ModbusDiscovery::classify(uint8_t slave, uint8_t result)
+{
+  if (result == MM::ku8MBResponseTimedOut || result == MM::ku8MBNoConnection ||
+      result == ku8MBGatewayPathUnavailable || result == ku8MBGatewayTargetFailed)
+  {
+    return;
+  }
+  if (!_link && (result == MM::ku8MBInvalidSlaveID || result == MM::ku8MBInvalidFunction || result == MM::ku8MBInvalidCRC))
+  {
+    // someone answered, but not necessarily this slave
+    blameRecent();
+    return;
+  }
+  setBit(_u32Present, slave);
+}
+
+/**
+Make every address probed within ku16ConfirmMs a suspect for the confirm
+pass; a late answer to any of them may have garbled this one. During the
+confirm pass itself the suspects already passed are probed again, up to
+ku8ConfirmRewinds times.
+*/
+void ModbusDiscovery::blameRecent()
+{
+  uint32_t u32Now = millis();
+  uint8_t u8Back = _u8Next;
+
+  for (uint8_t i = 0; i < ku8Recent; i++)
+  {
+    if (_u8RecentSlave[i] && (uint32_t)(u32Now - _u32RecentMs[i]) <= ku16ConfirmMs)
+    {
+      setBit(_u32Suspect, _u8RecentSlave[i]);
+      if (_u8RecentSlave[i] < u8Back && !getBit(_u32Present, _u8RecentSlave[i]))
+      {
+        u8Back = _u8RecentSlave[i];
+      }
+    }
+  }
+  if (_u8State == ku8StateConfirm && u8Back < _u8Next && _u8Rewinds < ku8ConfirmRewinds)
+  {
+    _u8Next = u8Back;
+    _u8Rewinds++;
+  }
+}
+
+/**
+Turn the presence bits into the list of slaves to fingerprint. After
+verify() the cached list is kept minus the slaves that did not answer.
+*/
+void ModbusDiscovery::listFound()
+{
+  uint8_t u8Kept = 0;
+
+  if (_bVerify)
+  {
+    for (uint8_t i = 0; i < _u8Found; i++)
+    {
+      if (getBit(_u32Present, _found[i].slave))
+      {
+        _found[u8Kept++] = _found[i];
+      }
+    }
+    if (u8Kept != _u8Found)
+    {
+      _u8Result = ku8TopologyChanged;
+    }
+    _u8Found = u8Kept;
+    return;
+  }
+
+  _u8Found = 0;
+  for (uint16_t s = _u8First; s <= _u8Last && _u8Found < ku8MaxFound; s++)
+  {
+    if (getBit(_u32Present, s))
+    {
+      _found[_u8Found].slave = s;
+      _found[_u8Found].mType = 0;
+      _found[_u8Found].u8Score = 0;
+      _u8Found++;
+    }
+  }
+}
+
+/**
+One step of fingerprinting: take the read in flight, then score the
+current candidate from cached reads until another read has to be sent.
+*/
+uint8_t ModbusDiscovery::fingerprint()
+{
+  const MM::meterProfile *profile;
+  const MM::meterField *f;
+  const fpRead *read;
+  uint8_t result;
+
+  for (;;)
+  {
+    if (_u8Fp >= _u8Found)
+    {
+      return MM::ku8MBSuccess;
+    }
+    if (!_u8Cand || _u8Check >= ku8Checks)
+    {
+      if (_u8Cand)
+      {
+        finishCandidate();
+      }
+      if (!nextCandidate())
+      {
+        finishSlave();
+      }
+      continue;
+    }
+
+    profile = MM::findProfile(_u8Cand);
+    f = checkField(profile, kChecks[_u8Check]);
+    if (!f)
+    {
+      _u8Check++;
+      continue;
+    }
+
+    read = cachedRead(profile->u8Function, f->u16Address, regdecode_qty(f->u8Type));
+    if (!read && !_bReading)
+    {
+      _pending.u8Fn = profile->u8Function;
+      _pending.u16Address = f->u16Address;
+      _pending.u8Qty = regdecode_qty(f->u8Type);
+      result = issue(_found[_u8Fp].slave, _pending.u8Fn, _pending.u16Address, _pending.u8Qty, &_probes[0].u16Tid);
+      if (result == MM::ku8MBBusy)
+      {
+        return MM::ku8MBPending;
+      }
+      if (result != MM::ku8MBPending)
+      {
+        return result;
+      }
+      _probes[0].slave = _found[_u8Fp].slave;
+      _u8InFlight = 1;
+      _bReading = true;
+    }
+    if (!read)
+    {
+      result = collect(&_probes[0], _pending.u8Qty);
+      if (result == MM::ku8MBPending)
+      {
+        return result;
+      }
+      _bReading = false;
+      _u8InFlight = 0;
+      _pending.u8Result = result;
+      memcpy(_pending.u8Data, _u8Data, sizeof(_pending.u8Data));
+      if (_u8Cached < ku8ReadCache)
+      {
+        _cache[_u8Cached++] = _pending;
+      }
+      read = &_pending;
+    }
+
+    // a refused or implausible reading rules the candidate out
+    int8_t i8Verdict = -1;
+
+    if (read->u8Result == MM::ku8MBSuccess)
+    {
+      float fValue = regdecode_value_be(f->u8Type, read->u8Data) / f->fDivisor;
+
+      if ((f->u8Flags & MM::ku8FieldPfFold) && fValue < -1.00)
+        fValue = (-2.0) - fValue;
+      if ((f->u8Flags & MM::ku8FieldPfFold) && fValue > 1.00)
+        fValue = (2.0) - fValue;
+      i8Verdict = plausible(f->u8Field, fValue);
+    }
+
+    if (i8Verdict < 0)
+    {
+      _u8Score = 0;
+      _u8Check = ku8Checks;
+      continue;
+    }
+    if (i8Verdict)
+    {
+      _u8Score++;
+    }
+    else
+    {
+      _u8Zeros++;
+    }
+    _u8Check++;
+  }
+}
+
+/**
+Reset the candidate search for _found[_u8Fp].
+*/
+void ModbusDiscovery::prepareSlave()
+{
+  const MM::meterProfile *profile;
+
+  _u8Cached = 0;
+  _u8BestType = 0;
+  _u8BestScore = 0;
+  _u8BestZeros = 0;
+  _u8NextType = 1;
+  _u8Cand = 0;
+  _u8Hint = 0;
+  _u8HintScore = 0;
+  if (_u8Fp >= _u8Found || !_bVerify)
+  {
+    return;
+  }
+
+  profile = MM::findProfile(_found[_u8Fp].mType);
+  if (profile && profile->u8Function && !(profile->u8Flags & MM::ku8ProfileMtAddress))
+  {
+    _u8Hint = _u8Cand = _found[_u8Fp].mType;
+    _u8HintScore = _found[_u8Fp].u8Score;
+    _u8Check = 0;
+    _u8Score = 0;
+    _u8Zeros = 0;
+  }
+}
+
+/**
+Move on to the next built-in type that can be fingerprinted: fixed
+register addresses and a function code of its own.
+
+@return false when every type has been tried
+*/
+bool ModbusDiscovery::nextCandidate()
+{
+  const MM::meterProfile *profile;
+
+  while (_u8NextType <= ku8LastType)
+  {
+    uint8_t mType = _u8NextType++;
+
+    profile = MM::findProfile(mType);
+    if (mType == _u8Hint || !profile || !profile->u8Function || (profile->u8Flags & MM::ku8ProfileMtAddress))
+    {
+      continue;
+    }
+    _u8Cand = mType;
+    _u8Check = 0;
+    _u8Score = 0;
+    _u8Zeros = 0;
+    return true;
+  }
+  return false;
+}
+
+/**
+Keep the candidate if it beats the best so far: more informative
+readings, or as many with fewer registers that read 0. The first type
+wins a full tie.
+*/
+void ModbusDiscovery::finishCandidate()
+{
+  if (_u8Score && (_u8Score > _u8BestScore || (_u8Score == _u8BestScore && _u8Zeros < _u8BestZeros)))
+  {
+    _u8BestType = _u8Cand;
+    _u8BestScore = _u8Score;
+    _u8BestZeros = _u8Zeros;
+  }
+  if (_u8Cand == _u8Hint && _u8Score && _u8Score >= _u8HintScore)
+  {
+    // the cached type still fits as well as it did
+    _u8NextType = ku8LastType + 1;
+  }
+}
+
+void ModbusDiscovery::finishSlave()
+{
+  foundSlave *slave = &_found[_u8Fp];
+
+  if (_bVerify && slave->mType != _u8BestType)
+  {
+    _u8Result = ku8TopologyChanged;
+  }
+  slave->mType = _u8BestType;
+  slave->u8Score = _u8BestScore;
+  _u8Fp++;
+  prepareSlave();
+}
+
+const ModbusDiscovery::fpRead *ModbusDiscovery::cachedRead(uint8_t u8Fn, uint16_t u16Address, uint8_t u8Qty)
+{
+  for (uint8_t i = 0; i < _u8Cached; i++)
+  {
+    if (_cache[i].u8Fn == u8Fn && _cache[i].u16Address == u16Address && _cache[i].u8Qty == u8Qty)
+    {
+      return &_cache[i];
+    }
+  }
+  return 0;
+}
+
+/**
+Row of a profile that reads u8Field from the bus, or 0.
+*/
+const ModbusMeter::meterField *ModbusDiscovery::checkField(const ModbusMeter::meterProfile *profile, uint8_t u8Field)
+{
+  for (uint8_t k = 0; k < profile->u8Fields; k++)
+  {
+    const MM::meterField *f = &profile->fields[k];
+
+    if (f->u8Field == u8Field && regdecode_qty(f->u8Type) && !(f->u8Flags & MM::ku8FieldHarmonic))
+    {
+      return f;
+    }
+  }
+  return 0;
+}
+
+bool ModbusDiscovery::getBit(const uint32_t *bits, uint8_t slave)
+{
+  return bits[slave >> 5] & (1UL << (slave & 31));
+}
+
+void ModbusDiscovery::setBit(uint32_t *bits, uint8_t slave)
+{
+  bits[slave >> 5] |= 1UL << (slave & 31);
+}
+
+/**
+Judge a fingerprint reading.
+
+@return 1 if a meter of the candidate type would plausibly read it and it
+        says something (not 0), 0 if plausible but 0, -1 if no meter of
+        that type would read it
+*/
+int8_t ModbusDiscovery::plausible(uint8_t u8Field, float fValue)
+{
+  if (isnan(fValue) || isinf(fValue))
+  {
+    return -1;
+  }
+
+  switch (u8Field)
+  {
+  case MM::ku8FieldV0:
+    // every meter measures its own supply
+    return (fValue >= 50 && fValue <= 1000) ? 1 : -1;
+  case MM::ku8FieldFreq:
+    return (fValue >= 45 && fValue <= 65) ? 1 : (fValue == 0 ? 0 : -1);
+  case MM::ku8FieldPf:
+    return (fValue < -1 || fValue > 1) ? -1 : (fabs(fValue) >= 0.01);
+  case MM::ku8FieldI0:
+    return (fabs(fValue) > 100000) ? -1 : (fabs(fValue) >= 0.001);
+  }
+  // THD [%]
+  return (fValue < 0 || fValue > 100) ? -1 : (fValue >= 0.01);
+}
@@ -0,0 +1,168 @@
+#ifndef ModbusMeter_Discovery_h
+#define ModbusMeter_Discovery_h
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusMeter_ESP32.h"
+#include "ModbusMeter_TcpLink.h"
+
+/**
+Finds the meters on a bus and tells their type, so commissioning does not
+need every slave ID and mType typed in by hand.
+
+A scan makes three passes. The sweep sends every address in the range a
+one-register read with a short timeout; any well-formed answer, an
+exception included, means a slave is there. On RS-485 a probe nobody
+answered has kept the line silent for longer than t3.5, so the next probe
+goes out at once; through a Modbus TCP link up to its window of probes are
+outstanding at once and the gateway sends them back to back. A garbled
+answer, typically a slow slave replying into a later probe, makes every
+address probed within ku16ConfirmMs suspect, and the confirm pass probes
+those again with that timeout, blaming garbled answers the same way.
+
+Last, every slave found is fingerprinted: for each built-in type with
+fixed register addresses, its voltage, current, power factor, frequency
+and THD registers are read, and the type whose readings are plausible and
+the most informative wins. Multi-channel types are checked at channel 0.
+Types sharing a register map (DMG610 and DMG800) cannot be told apart and
+the first one is reported; a slave no type fits is reported with mType 0.
+
+With the default probe timeout, extras/bench/discovery_bench.cpp scans
+addresses 1..247 at 9600 baud in 14.4 s (379 frames) and finds 12 of its
+13 simulated slaves, three of them slower than the probe timeout; the one
+it misses answers only after the confirm timeout.
+
+The result packs into a small CRC-protected blob for NVS with pack(); on
+the next boot unpack() and verify() re-probe only the cached slaves, first
+trying each one's cached type, which takes the same bench 1.9 s.
+
+poll() does a bounded amount of work and returns, like
+ModbusMeter::pollMeterRead(); run() polls until done.
+*/
+class ModbusDiscovery
+{
+public:
+  ModbusDiscovery();
+
+  /**
+  A slave that answered.
+  */
+  typedef struct __foundSlave
+  {
+    uint8_t slave;
+    uint8_t mType;   ///< best matching type; 0 if none fits
+    uint8_t u8Score; ///< informative fingerprint readings of mType
+  } foundSlave;
+
+  bool begin(ModbusMeter &meter, uint8_t u8First = 1, uint8_t u8Last = 247);
+  bool begin(ModbusTcpLink &link, uint8_t u8First = 1, uint8_t u8Last = 247);
+  bool verify(ModbusMeter &meter);
+  bool verify(ModbusTcpLink &link);
+  void setProbeTimeout(uint16_t u16TimeoutMs);
+  uint8_t poll();
+  uint8_t run();
+  bool busy();
+
+  uint8_t found();
+  bool getFound(uint8_t u8Index, foundSlave *slave);
+  uint16_t pack(uint8_t *pu8Buf, uint16_t u16Size);
+  bool unpack(const uint8_t *pu8Buf, uint16_t u16Len);
+
+  static const uint8_t ku8MaxFound = 32;
+  static const uint16_t ku16CacheSize = 4 + 3 * ku8MaxFound; ///< largest pack() blob
+  static const uint16_t ku16DefaultProbeMs = 20;
+  static const uint16_t ku16ConfirmMs = 200; ///< timeout of the confirm pass and of fingerprint reads
+  static const uint8_t ku8TopologyChanged = 0xF0; ///< verify(): a cached slave is gone or answers as another type
+
+private:
+  static const uint8_t ku8StateIdle = 0;
+  static const uint8_t ku8StateSweep = 1;
+  static const uint8_t ku8StateConfirm = 2;
+  static const uint8_t ku8StateFingerprint = 3;
+
+  static const uint8_t ku8CacheVersion = 1;
+  static const uint8_t ku8Recent = 16;    ///< RS-485 probes remembered for blaming a garbled answer
+  static const uint8_t ku8ConfirmRewinds = 2; ///< times a confirm pass goes back for suspects it passed
+  static const uint8_t ku8ReadCache = 16; ///< fingerprint reads of one slave kept for other candidates
+  static const uint8_t ku8FnProbe = 0x03; ///< read holding registers
+  static const uint8_t ku8MBGatewayPathUnavailable = 0x0A;
+  static const uint8_t ku8MBGatewayTargetFailed = 0x0B;
+  static const uint8_t ku8LastType = 0xFE; ///< highest mType tried; 0xFF is the manual type
+
+  // one request in flight
+  typedef struct __probe
+  {
+    uint8_t slave;
+    uint16_t u16Tid; ///< Modbus TCP transaction ID
+  } probe;
+
+  // fingerprint register read, shared by every candidate reading the same registers
+  typedef struct __fpRead
+  {
+    uint8_t u8Fn;
+    uint16_t u16Address;
+    uint8_t u8Qty;
+    uint8_t u8Result;
+    uint8_t u8Data[8];
+  } fpRead;
+
+  ModbusMeter *_meter;
+  ModbusTcpLink *_link;
+  uint8_t _u8State;
+  uint8_t _u8Result;
+  uint8_t _u8First;
+  uint8_t _u8Last;
+  uint8_t _u8Next;      ///< next address to probe in this pass
+  uint8_t _u8Rewinds;   ///< confirm pass: times _u8Next went back
+  uint16_t _u16ProbeMs;
+  bool _bVerify;
+  uint32_t _u32Present[8]; ///< bit per slave address
+  uint32_t _u32Suspect[8];
+
+  probe _probes[ModbusTcpLink::ku8MaxInFlight];
+  uint8_t _u8InFlight;
+  uint8_t _u8RecentSlave[ku8Recent]; ///< ring of recent RS-485 probes
+  uint32_t _u32RecentMs[ku8Recent];
+  uint8_t _u8RecentHead;
+  uint8_t _u8Data[256];              ///< payload of the last answer taken
+
+  foundSlave _found[ku8MaxFound];
+  uint8_t _u8Found;
+
+  // fingerprint of _found[_u8Fp]
+  uint8_t _u8Fp;
+  uint8_t _u8Hint;      ///< verify(): cached type, tried first and kept if it scores as cached
+  uint8_t _u8HintScore;
+  uint8_t _u8NextType;  ///< next mType to try as a candidate
+  uint8_t _u8Cand;      ///< type being tried; 0 before the first
+  uint8_t _u8Check;     ///< index into the fingerprint fields
+  uint8_t _u8Score;
+  uint8_t _u8Zeros;
+  uint8_t _u8BestType;
+  uint8_t _u8BestScore;
+  uint8_t _u8BestZeros;
+  bool _bReading;       ///< _pending is in flight
+  fpRead _pending;
+  fpRead _cache[ku8ReadCache];
+  uint8_t _u8Cached;
+
+  void start(uint8_t u8State);
+  void finish(uint8_t result);
+  uint8_t issue(uint8_t slave, uint8_t u8Fn, uint16_t u16Address, uint8_t u8Qty, uint16_t *pu16Tid);
+  uint8_t collect(const probe *p, uint8_t u8Qty);
+  uint8_t sweep();
+  void classify(uint8_t slave, uint8_t result);
+  void blameRecent();
+  void listFound();
+  uint8_t fingerprint();
+  void prepareSlave();
+  bool nextCandidate();
+  void finishCandidate();
+  void finishSlave();
+  const fpRead *cachedRead(uint8_t u8Fn, uint16_t u16Address, uint8_t u8Qty);
+  static const ModbusMeter::meterField *checkField(const ModbusMeter::meterProfile *profile, uint8_t u8Field);
+  bool getBit(const uint32_t *bits, uint8_t slave);
+  void setBit(uint32_t *bits, uint8_t slave);
+  static int8_t plausible(uint8_t u8Field, float fValue);
+};
+
+#endif
@@ -1,1320 +1,2243 @@
 #include "ModbusMeter_ESP32.h"
+#include "ModbusMeter_TcpLink.h"
 #include <esp_task_wdt.h>
 
 ModbusMeter::ModbusMeter(void)
 {
+  _debug = 0;
+  _link = 0;
+  md = 0;
+  pd = 0;
+  _u8Meters = 0;
+  _u8PQMeters = 0;
+  _bOwnTables = false;
+  _u8DebugHead = 0;
+  _u8DebugTail = 0;
   _preTransmission = 0;
   _postTransmission = 0;
+  _u16FrameCost = ku16MBDefaultFrameCost;
+  for (uint8_t i = 0; i < ku8Harmonics; i++)
+  {
+    _u8HarmonicOrders[i] = 2 * i + 3;
+  }
+  _u8HarmonicCount = ku8Harmonics;
+  _bPartialReads = false;
+  _u64ReadMask = ku64AllFields;
+  _mdTrack = 0;
+  _pdTrack = 0;
+  _bOwnTrack = false;
+  _u32Generation = 0;
+  memset(_fDeadband, 0, sizeof(_fDeadband));
+  _u64DeadbandPct = 0;
+  _u8TxState = ku8TxIdle;
+  _u8TxResult = ku8MBSuccess;
+  _job.u8State = ku8JobIdle;
+  _job.u8Result = ku8MBSuccess;
+  _u32BusIdleUs = 0;
+  _u32TimeoutFloorUs = ku16MBTimeoutFloor * 1000UL;
+  _u32TimeoutCeilingUs = ku16MBTimeoutCeiling * 1000UL;
+  _u32ScanTimeoutUs = 0;
+  _u8BreakerTrip = ku8DefaultBreakerTrip;
+  _u16BreakerBackoffMs = ku16DefaultBreakerBackoffMs;
+  _u32BreakerMaxBackoffMs = ku32DefaultBreakerMaxBackoffMs;
+  _bGapTune = false;
+  _gapTuned = 0;
+  _u8Slaves = 0;
+  memset(_u8SlaveSlot, ku8NoSlot, sizeof(_u8SlaveSlot));
+  _u8TxStats = 0;
+  _u32StatsSeq = 0;
+  _u32SerialSwitches = 0;
+  _serialSwitch = 0;
+  setBaudRate(ku32MBDefaultBaud);
+}
+
+ModbusMeter::~ModbusMeter(void)
+{
+  freeTables();
 }
 
+/**
+Bind the bus. md[] and pd[] get the default capacity of ku8DefaultMeters
+and ku8DefaultPQMeters unless begin() was already called with a capacity.
+*/
 void ModbusMeter::begin(Stream &serial)
 {
   _serial = &serial;
+  _link = 0;
+  if (!md)
+  {
+    begin(serial, ku8DefaultMeters, ku8DefaultPQMeters);
+  }
 }
 
 void ModbusMeter::begin(Stream &serial, Stream &debug)
 {
-  _serial = &serial;
+  begin(serial);
   _debug = &debug;
   _debug->println("Init Modbus Meter");
 }
 
-void ModbusMeter::preTransmission(void (*preTransmission)())
+/**
+Bind the bus and size md[] and pd[] exactly.
+
+The tables are carved out of the arena if one is given, so several
+instances can share one preallocated block; otherwise they are taken from
+the heap once. Either table may have capacity 0.
+
+@param u8Meters number of energy meters, md[0..u8Meters-1]
+@param u8PQMeters number of PQ meters, pd[0..u8PQMeters-1]
+@param arena arena to allocate from; 0 = heap
+@return false if the memory could not be allocated; the instance then has
+        no tables
+*/
+bool ModbusMeter::begin(Stream &serial, uint8_t u8Meters, uint8_t u8PQMeters, mbArena *arena)
 {
-  _preTransmission = preTransmission;
+  _serial = &serial;
+  _link = 0;
+  return allocTables(u8Meters, u8PQMeters, arena);
 }
 
-void ModbusMeter::postTransmission(void (*postTransmission)())
+/**
+Use a Modbus TCP connection instead of a serial bus. The meter types and
+md[]/pd[] work as with RTU; the blocks of a meter read are requested all at
+once, up to the link's window, instead of one after the other. Several
+instances may share one link. RTU bus timing, the adaptive timeout, the
+circuit breaker and the transaction statistics do not apply; the link keeps
+its own timeout and counters.
+
+@return false if the tables could not be allocated
+*/
+bool ModbusMeter::begin(ModbusTcpLink &link, uint8_t u8Meters, uint8_t u8PQMeters, mbArena *arena)
 {
-  _postTransmission = postTransmission;
+  _serial = 0;
+  _link = &link;
+  return allocTables(u8Meters, u8PQMeters, arena);
 }
 
-uint16_t ModbusMeter::getResponseBuffer(uint8_t u8Index)
+bool ModbusMeter::allocTables(uint8_t u8Meters, uint8_t u8PQMeters, mbArena *arena)
 {
-  if (u8Index < ku8MaxBufferSize)
+  freeTables();
+
+  if (arena)
   {
-    return _u16ResponseBuffer[u8Index];
+    md = u8Meters ? (meterData *)arena_alloc(arena, u8Meters * sizeof(meterData), alignof(meterData)) : 0;
+    pd = u8PQMeters ? (pqData *)arena_alloc(arena, u8PQMeters * sizeof(pqData), alignof(pqData)) : 0;
   }
   else
   {
-    return 0xFFFF;
+    md = u8Meters ? (meterData *)calloc(u8Meters, sizeof(meterData)) : 0;
+    pd = u8PQMeters ? (pqData *)calloc(u8PQMeters, sizeof(pqData)) : 0;
+    _bOwnTables = true;
+  }
+
+  if ((u8Meters && !md) || (u8PQMeters && !pd))
+  {
+    freeTables();
+    return false;
   }
+  _u8Meters = u8Meters;
+  _u8PQMeters = u8PQMeters;
+  return true;
 }
 
-uint8_t ModbusMeter::masterTransaction(uint8_t slave, uint16_t startAddress, uint16_t readQty, uint8_t fnRead)
+/**
+Capacity of md[].
+*/
+uint8_t ModbusMeter::meterCapacity()
 {
-  uint16_t u16CRC;
-  uint8_t u8ModbusADU[256];
-  uint8_t u8ModbusADUSize = 0;
-  uint8_t i;
-
-  uint32_t u32StartTime;
-  uint8_t u8BytesLeft = 8;
-  uint8_t u8MBStatus = ku8MBSuccess;
-
-  uint8_t u8MBFunction = fnRead;
-  //uint8_t u8MBFunction = ku8MBReadHoldingRegisters;
+  return _u8Meters;
+}
 
-  u8ModbusADU[u8ModbusADUSize++] = slave;
-  // MODBUS function = readHoldingRegister
-  u8ModbusADU[u8ModbusADUSize++] = u8MBFunction;
-  // MODBUS Address
-  u8ModbusADU[u8ModbusADUSize++] = highByte(startAddress);
-  u8ModbusADU[u8ModbusADUSize++] = lowByte(startAddress);
-  // MODBUS Data Size
-  u8ModbusADU[u8ModbusADUSize++] = highByte(readQty);
-  u8ModbusADU[u8ModbusADUSize++] = lowByte(readQty);
+/**
+Capacity of pd[].
+*/
+uint8_t ModbusMeter::pqMeterCapacity()
+{
+  return _u8PQMeters;
+}
 
-  // calculate CRC
-  u16CRC = 0xFFFF;
-  for (i = 0; i < (u8ModbusADUSize); i++)
+void ModbusMeter::freeTables()
+{
+  if (_bOwnTrack)
   {
-    u16CRC = crc16_update(u16CRC, u8ModbusADU[i]);
+    free(_mdTrack);
+    free(_pdTrack);
   }
-  u8ModbusADU[u8ModbusADUSize++] = lowByte(u16CRC);
-  u8ModbusADU[u8ModbusADUSize++] = highByte(u16CRC);
-  u8ModbusADU[u8ModbusADUSize] = 0;
+  _mdTrack = 0;
+  _pdTrack = 0;
+  _bOwnTrack = false;
 
-  // flush receive buffer before transmitting request
-  while (_serial->read() != -1)
-    ; //////////////////////////////////////////////
-  // while(_serial->available())
-  // {
-  //   _serial->read();
-  // }
-
-  // transmit request
-  if (_preTransmission)
+  if (_bOwnTables)
   {
-    _preTransmission();
+    free(md);
+    free(pd);
   }
-  uint8_t *data = (uint8_t *)"test";
-  for (i = 0; i < u8ModbusADUSize; i++)
+  md = 0;
+  pd = 0;
+  _u8Meters = 0;
+  _u8PQMeters = 0;
+  _bOwnTables = false;
+}
+
+/**
+Append bytes to the deferred debug log; bytes that do not fit are dropped.
+*/
+void ModbusMeter::queueDebugLog(const uint8_t *buf, uint8_t u8Len)
+{
+  while (u8Len-- && (uint8_t)(_u8DebugHead - _u8DebugTail) < ku8DebugLogSize)
   {
-    _serial->write(u8ModbusADU[i]);
-    // uart_write_bytes(UART_NUM_2, (const char*)&u8ModbusADU[i], 1);
-    if (_debug)
-    {
-      _debug->write(u8ModbusADU[i]);
-    }
+    _u8DebugLog[_u8DebugHead++ & (ku8DebugLogSize - 1)] = *buf++;
   }
+}
 
-  u8ModbusADUSize = 0;
-  _serial->flush(); // flush transmit buffer ///////////////////////////////
+/**
+Write the deferred debug log to the debug Stream.
 
-  if (_postTransmission)
+Called while a transaction waits for its response, so mirroring requests
+does not delay the bus turnaround; call it directly to empty the log at
+other times.
+*/
+void ModbusMeter::drainDebugLog()
+{
+  while (_debug && _u8DebugTail != _u8DebugHead)
   {
-    delay(10);
-    _postTransmission();
-  }
+    uint8_t u8Pos = _u8DebugTail & (ku8DebugLogSize - 1);
+    uint8_t u8Len = _u8DebugHead - _u8DebugTail;
 
-  // loop until we run out of time or bytes, or an error occurs
-  u32StartTime = millis();
-  while (u8BytesLeft && !u8MBStatus)
-  {
-    if (_serial->available())
+    // contiguous run up to the end of the ring
+    if (u8Len > ku8DebugLogSize - u8Pos)
     {
-      u8ModbusADU[u8ModbusADUSize++] = _serial->read();
-      // if(uart_read_bytes(UART_NUM_2, &u8ModbusADU[u8ModbusADUSize++], 1, 1000))
-      // {
-      u8BytesLeft--;
-      // }
-      //_debug->printf("Char %c \r\n", u8ModbusADU[u8ModbusADUSize-1]);
+      u8Len = ku8DebugLogSize - u8Pos;
     }
+    _debug->write(_u8DebugLog + u8Pos, u8Len);
+    _u8DebugTail += u8Len;
+  }
+}
 
-    // evaluate slave ID, function code once enough bytes have been read
-    if (u8ModbusADUSize == 5)
-    {
-      // verify response is for correct Modbus slave
-      if (u8ModbusADU[0] != slave)
-      {
-        u8MBStatus = ku8MBInvalidSlaveID;
-        break;
-      }
+void ModbusMeter::preTransmission(void (*preTransmission)())
+{
+  _preTransmission = preTransmission;
+}
 
-      // verify response is for correct Modbus function code (mask exception bit 7)
-      if ((u8ModbusADU[1] & 0x7F) != u8MBFunction)
-      {
-        u8MBStatus = ku8MBInvalidFunction;
-        break;
-      }
+void ModbusMeter::postTransmission(void (*postTransmission)())
+{
+  _postTransmission = postTransmission;
+}
 
-      // check whether Modbus exception occurred; return Modbus Exception Code
-      if (bitRead(u8ModbusADU[1], 7))
-      {
-        u8MBStatus = u8ModbusADU[2];
-        break;
-      }
+/**
+Set the overhead of one request frame used by the block planner.
 
-      // evaluate returned Modbus function code
-      switch (u8ModbusADU[1])
-      {
-      case ku8MBReadCoils:
-      case ku8MBReadDiscreteInputs:
-      case ku8MBReadInputRegisters:
-      case ku8MBReadHoldingRegisters:
-      case ku8MBReadWriteMultipleRegisters:
-        u8BytesLeft = u8ModbusADU[2];
-        break;
+Register gaps cheaper than this many bytes are read and discarded rather
+than paying for a second request. 0 merges only adjacent registers.
 
-      case ku8MBWriteSingleCoil:
-      case ku8MBWriteMultipleCoils:
-      case ku8MBWriteSingleRegister:
-      case ku8MBWriteMultipleRegisters:
-        u8BytesLeft = 3;
-        break;
+@param u16Bytes frame overhead [bytes]
+*/
+void ModbusMeter::setFrameCost(uint16_t u16Bytes)
+{
+  _u16FrameCost = u16Bytes;
+}
 
-      case ku8MBMaskWriteRegister:
-        u8BytesLeft = 5;
-        break;
-      }
-    }
+/**
+Keep reading the remaining blocks of a meter when one of them fails.
 
-    if ((millis() - u32StartTime) > ku16MBResponseTimeout)
-    {
-      u8MBStatus = ku8MBResponseTimedOut;
-    }
-  }
-  // verify response is large enough to inspect further
-  if (!u8MBStatus && u8ModbusADUSize >= 5)
-  {
-    // calculate CRC
-    u16CRC = 0xFFFF;
-    for (i = 0; i < (u8ModbusADUSize - 2); i++)
-    {
-      u16CRC = crc16_update(u16CRC, u8ModbusADU[i]);
-    }
+Off, a read stops at the first failed transaction and leaves md[]/pd[]
+untouched. On, every block is tried, the fields that arrived are written
+and flagged in u64Valid, and the read returns ku8MBPartialRead if any are
+missing (or the last error if none arrived). A read still stops early once
+the slave's circuit breaker opens.
+*/
+void ModbusMeter::setPartialReads(bool bEnable)
+{
+  _bPartialReads = bEnable;
+}
 
-    // verify CRC
-    if (!u8MBStatus && (lowByte(u16CRC) != u8ModbusADU[u8ModbusADUSize - 2] ||
-                        highByte(u16CRC) != u8ModbusADU[u8ModbusADUSize - 1]))
-    {
-      u8MBStatus = ku8MBInvalidCRC;
-    }
-  }
+/**
+Restrict meter reads to the fields with their bit set, ku64AllFields by
+default.
 
-  // disassemble ADU into words
-  if (!u8MBStatus)
-  {
-    // evaluate returned Modbus function code
-    switch (u8ModbusADU[1])
-    {
-    case ku8MBReadCoils:
-    case ku8MBReadDiscreteInputs:
-      // load bytes into word; response bytes are ordered L, H, L, H, ...
-      for (i = 0; i < (u8ModbusADU[2] >> 1); i++)
-      {
-        if (i < ku8MaxBufferSize)
-        {
-          _u16ResponseBuffer[i] = word(u8ModbusADU[2 * i + 4], u8ModbusADU[2 * i + 3]);
-        }
+Fields outside the mask are neither requested nor written and keep their
+u64Valid bit, so a retry of only what a partial read missed is
 
-        //_u8ResponseBufferLength = i;
-      }
+  node.setReadMask(~md[i].u64Valid);
+  node.readMeterData(i, ...);
+  node.setReadMask(ModbusMeter::ku64AllFields);
 
-      // in the event of an odd number of bytes, load last byte into zero-padded word
-      if (u8ModbusADU[2] % 2)
-      {
-        if (i < ku8MaxBufferSize)
-        {
-          _u16ResponseBuffer[i] = word(0, u8ModbusADU[2 * i + 3]);
-        }
+Note that mdt then belongs to the retry.
+*/
+void ModbusMeter::setReadMask(uint64_t u64Fields)
+{
+  _u64ReadMask = u64Fields;
+}
 
-        //_u8ResponseBufferLength = i + 1;
-      }
-      break;
+/**
+Track which fields of md[]/pd[] moved, so an uplink can send only those.
+
+Call after begin(); begin() drops the tracking tables along with md[] and
+pd[]. Every meter read then bumps the generation (see getGeneration()) and
+stamps the fields that crossed their deadband with it. A field is also
+stamped when it first becomes valid or when a partial read loses it. The
+tables take 8 bytes per field: 80 per md[] slot and 328 per pd[] slot.
+
+  uint32_t u32Sent = 0;
+  ...
+  uint32_t u32Now = node.getGeneration();
+  uint8_t n = node.getChanges(i, false, u32Sent, fields, values, 10);
+  // send n (field, value) pairs
+  u32Sent = u32Now;
+
+@param arena allocate from this arena instead of the heap
+@return false if the tables did not fit
+*/
+bool ModbusMeter::setChangeTracking(mbArena *arena)
+{
+  fieldTrack *mdTrack, *pdTrack;
+  uint32_t u32MdSize = _u8Meters * ku8MeterFields;
+  uint32_t u32PdSize = _u8PQMeters * ku8PQFields;
 
-    case ku8MBReadInputRegisters:
-    case ku8MBReadHoldingRegisters:
-    case ku8MBReadWriteMultipleRegisters:
-      // load bytes into word; response bytes are ordered H, L, H, L, ...
-      for (i = 0; i < (u8ModbusADU[2] >> 1); i++)
-      {
-        if (i < ku8MaxBufferSize)
-        {
-          _u16ResponseBuffer[i] = word(u8ModbusADU[2 * i + 3], u8ModbusADU[2 * i + 4]);
-        }
+  if (_mdTrack || _pdTrack)
+  {
+    return true;
+  }
 
-        //_u8ResponseBufferLength = i;
-      }
-      break;
+  if (arena)
+  {
+    mdTrack = u32MdSize ? (fieldTrack *)arena_alloc(arena, u32MdSize * sizeof(fieldTrack), alignof(fieldTrack)) : 0;
+    pdTrack = u32PdSize ? (fieldTrack *)arena_alloc(arena, u32PdSize * sizeof(fieldTrack), alignof(fieldTrack)) : 0;
+  }
+  else
+  {
+    mdTrack = u32MdSize ? (fieldTrack *)calloc(u32MdSize, sizeof(fieldTrack)) : 0;
+    pdTrack = u32PdSize ? (fieldTrack *)calloc(u32PdSize, sizeof(fieldTrack)) : 0;
+  }
+
+  if ((u32MdSize && !mdTrack) || (u32PdSize && !pdTrack))
+  {
+    if (!arena)
+    {
+      free(mdTrack);
+      free(pdTrack);
     }
+    return false;
   }
-  return u8MBStatus;
+  _mdTrack = mdTrack;
+  _pdTrack = pdTrack;
+  _bOwnTrack = !arena;
+  return true;
 }
 
-uint8_t ModbusMeter::readMeterData(uint8_t index, uint8_t slave, uint8_t slaveIndex, uint8_t mType, time_t mdt, float *adj, uint16_t *mt, uint8_t *dt)
+/**
+Set how far a field must move from the value last reported before it
+counts as changed again. The default of 0 reports every change.
+
+@param u8Field one of ku8Field*
+@param fBand absolute band in the field's unit, or percent of the value
+       last reported if bPercent is set
+@return false if the field is unknown
+*/
+bool ModbusMeter::setDeadband(uint8_t u8Field, float fBand, bool bPercent)
 {
-  uint8_t result = 0x00;
-  // Select Meter Type
-  switch (mType)
+  if (u8Field >= ku8PQFields)
   {
-  case dts353: // 3 Phase Meter
-    result = masterTransaction(slave, 0x000e, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[7];
-    md[index].v1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[8];
-    md[index].v2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[9];
+    return false;
+  }
 
-    result |= masterTransaction(slave, 0x0016, 8, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[4];
-    md[index].i1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[5];
-    md[index].i2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[6];
-    md[index].watt = wordToFloat(getResponseBuffer(6), getResponseBuffer(7)) * adj[0];
+  _fDeadband[u8Field] = fBand;
+  if (bPercent)
+    _u64DeadbandPct |= 1ULL << u8Field;
+  else
+    _u64DeadbandPct &= ~(1ULL << u8Field);
+  return true;
+}
 
-    result |= masterTransaction(slave, 0x0034, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].pf = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[2];
+/**
+Generation of the latest meter read. Pass the value read before the last
+upload to getChanges() to get what moved since.
+*/
+uint32_t ModbusMeter::getGeneration()
+{
+  return _u32Generation;
+}
 
-    result |= masterTransaction(slave, 0x00100, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[1];
+/**
+Continue the generation count from a given value, e.g. the u32Sent an
+uplink kept across a restart; a fresh count would make every new change
+look older than it. Generations compare modulo 2^32, so a u32Since up to
+2^31 reads behind still works after the count wraps.
+*/
+void ModbusMeter::setGeneration(uint32_t u32Generation)
+{
+  _u32Generation = u32Generation;
+}
 
-    result |= masterTransaction(slave, 0x00118, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].varh = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[3];
+/**
+Fields of md[index] (or pd[index] if bPQ) that changed after generation
+u32Since, one bit per ku8Field*; 0 if change tracking is off.
+*/
+uint64_t ModbusMeter::getChangeMask(uint8_t index, bool bPQ, uint32_t u32Since)
+{
+  const fieldTrack *track = trackFor(index, bPQ);
+  uint8_t u8Fields = bPQ ? ku8PQFields : ku8MeterFields;
+  uint64_t u64Mask = 0;
 
-    md[index].mdt = mdt;
+  if (!track)
+  {
+    return 0;
+  }
 
-    break;
+  for (uint8_t f = 0; f < u8Fields; f++)
+  {
+    if (track[f].u32Gen && (int32_t)(track[f].u32Gen - u32Since) > 0)
+    {
+      u64Mask |= 1ULL << f;
+    }
+  }
+  return u64Mask;
+}
 
-  case eastron:
-    result = masterTransaction(slave, 0x0000 + (2000 * slaveIndex), 12, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].v0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[7];
-    md[index].v1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[8];
-    md[index].v2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[9];
-    md[index].i0 = wordToFloat(getResponseBuffer(6), getResponseBuffer(7)) * adj[4];
-    md[index].i1 = wordToFloat(getResponseBuffer(8), getResponseBuffer(9)) * adj[5];
-    md[index].i2 = wordToFloat(getResponseBuffer(10), getResponseBuffer(11)) * adj[6];
-
-    result |= masterTransaction(slave, 0x0034 + (2000 * slaveIndex), 2, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].watt = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[0];
+/**
+Copy the fields that changed after generation u32Since as (field, value)
+pairs; see getChangeMask().
 
-    result |= masterTransaction(slave, 0x003E + (2000 * slaveIndex), 2, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].pf = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[2];
+@param pu8Fields receives the ku8Field* of each change
+@param pfValues receives the current value of each change
+@return number of pairs written, at most u8Max
+*/
+uint8_t ModbusMeter::getChanges(uint8_t index, bool bPQ, uint32_t u32Since, uint8_t *pu8Fields, float *pfValues, uint8_t u8Max)
+{
+  uint64_t u64Mask = getChangeMask(index, bPQ, u32Since);
+  uint8_t n = 0;
 
-    result |= masterTransaction(slave, 0x0156 + (2000 * slaveIndex), 4, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[1];
-    md[index].varh = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[3];
+  for (uint8_t f = 0; u64Mask && n < u8Max; f++, u64Mask >>= 1)
+  {
+    if (u64Mask & 1)
+    {
+      pu8Fields[n] = f;
+      pfValues[n] = *fieldPtr(index, bPQ ? ku8ProfilePQ : 0, f);
+      n++;
+    }
+  }
+  return n;
+}
 
-    md[index].mdt = mdt;
+/**
+Tracking entries of md[index] or pd[index]; 0 if tracking is off or the
+index is out of range.
+*/
+ModbusMeter::fieldTrack *ModbusMeter::trackFor(uint8_t index, bool bPQ)
+{
+  if (bPQ)
+  {
+    return (_pdTrack && index < _u8PQMeters) ? _pdTrack + index * ku8PQFields : 0;
+  }
+  return (_mdTrack && index < _u8Meters) ? _mdTrack + index * ku8MeterFields : 0;
+}
 
-    break;
+/**
+Stamp the fields of the read just decoded that crossed their deadband.
 
-  case iem3255:
-    result |= masterTransaction(slave, 2999, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[4];
-    md[index].i1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[5];
-    md[index].i2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[6];
+@param u64Before u64Valid of the slot before the read
+@param u64Got fields the read delivered
+*/
+void ModbusMeter::trackChanges(uint8_t index, bool bPQ, uint64_t u64Before, uint64_t u64Got)
+{
+  fieldTrack *track = trackFor(index, bPQ);
+  uint8_t u8Fields = bPQ ? ku8PQFields : ku8MeterFields;
 
-    delay(10);
+  if (!track)
+  {
+    return;
+  }
 
-    result = masterTransaction(slave, 3027, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[7];
-    md[index].v1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[8];
-    md[index].v2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[9];
+  // 0 marks a field never stamped
+  if (!++_u32Generation)
+  {
+    _u32Generation = 1;
+  }
+  for (uint8_t f = 0; f < u8Fields; f++)
+  {
+    uint64_t u64Bit = 1ULL << f;
+    float fValue, fBand;
 
-    delay(10);
+    if (!(_job.u64Mask & u64Bit))
+      continue;
 
-    result |= masterTransaction(slave, 3059, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].watt = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[0];
+    if (!(u64Got & u64Bit))
+    {
+      // lost by a partial read; u64Valid tells the consumer
+      if (u64Before & u64Bit)
+        track[f].u32Gen = _u32Generation;
+      continue;
+    }
 
-    delay(10);
+    fValue = *fieldPtr(index, bPQ ? ku8ProfilePQ : 0, f);
+    fBand = (_u64DeadbandPct & u64Bit) ? fabsf(track[f].fRef) * _fDeadband[f] / 100 : _fDeadband[f];
+    if (!(u64Before & u64Bit) || fabsf(fValue - track[f].fRef) > fBand || isnan(fValue) != isnan(track[f].fRef))
+    {
+      track[f].fRef = fValue;
+      track[f].u32Gen = _u32Generation;
+    }
+  }
+}
 
-    result |= masterTransaction(slave, 3083, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].pf = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[2];
-    if (isnan(md[index].pf))
-      md[index].pf = 0;
-    if (md[index].pf < -1.00)
-      md[index].pf = (-2.0) - md[index].pf;
-    if (md[index].pf > 1.00)
-      md[index].pf = (2.0) - md[index].pf;
-
-    delay(10);
-
-    result |= masterTransaction(slave, 3203, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = (((int64_t)getResponseBuffer(0) << 48) | ((int64_t)getResponseBuffer(1) << 32) | ((int64_t)getResponseBuffer(2) << 16) | ((int64_t)getResponseBuffer(3))) * adj[1];
+/**
+Choose the harmonic orders read into chr[], chs[] and cht[].
 
-    delay(10);
+Slot i of each array receives order orders[i]; slots from u8Count on read
+as 0. The default is the odd orders 3, 5, ... 15. Meters keep their
+harmonics in one table per phase, so the block planner fetches all
+selected orders of a phase in one frame when they lie within 125
+registers, and in a few frames otherwise.
 
-    result |= masterTransaction(slave, 3219, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].varh = (((int64_t)getResponseBuffer(0) << 48) | ((int64_t)getResponseBuffer(1) << 32) | ((int64_t)getResponseBuffer(2) << 16) | ((int64_t)getResponseBuffer(3))) * adj[3];
+Orders run from 1 to ku8MaxHarmonicOrder, the last entry every harmonic
+table has room for; a higher order would read the next phase's table. A
+rejected call leaves the selection unchanged.
 
-    md[index].mdt = mdt;
+@param orders harmonic orders, e.g. {3, 5, 7}
+@param u8Count number of orders, at most ku8Harmonics
+@return false if u8Count is too large or an order is out of range
+*/
+bool ModbusMeter::setHarmonicOrders(const uint8_t *orders, uint8_t u8Count)
+{
+  if (u8Count > ku8Harmonics)
+  {
+    return false;
+  }
+  for (uint8_t i = 0; i < u8Count; i++)
+  {
+    if (orders[i] < 1 || orders[i] > ku8MaxHarmonicOrder)
+      return false;
+  }
+  memcpy(_u8HarmonicOrders, orders, u8Count);
+  _u8HarmonicCount = u8Count;
+  return true;
+}
 
-    break;
+/**
+Set the bounds of the adaptive response timeout.
 
-  case heyuan3: // 3-Phase
-    result |= masterTransaction(slave, mt[0], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].watt = (getResponseBuffer(0) / 1000.00) * adj[0];
+Every slave's timeout follows its measured response latency, RFC 6298
+style: smoothed latency plus four times its mean deviation, plus the wire
+time of the expected response at the current baud rate, clamped to these
+bounds. Slaves that have not answered yet get ku16MBResponseTimeout.
+Equal bounds give a fixed timeout.
 
-    delay(5);
+@param u16FloorMs shortest timeout [milliseconds]
+@param u16CeilingMs longest timeout [milliseconds]
+*/
+void ModbusMeter::setResponseTimeout(uint16_t u16FloorMs, uint16_t u16CeilingMs)
+{
+  _u32TimeoutFloorUs = u16FloorMs * 1000UL;
+  _u32TimeoutCeilingUs = (u16CeilingMs > u16FloorMs ? u16CeilingMs : u16FloorMs) * 1000UL;
+}
 
-    result |= masterTransaction(slave, mt[1], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].wattHour = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00) * adj[1];
+/**
+Probe a bus for slaves that may not exist; see ModbusDiscovery.
 
-    delay(5);
+While the timeout is nonzero, every transaction waits that long for the
+first response byte instead of the adaptive timeout, and leaves no trace
+in the per-slave state (latency, health, gap tuning) or the transaction
+statistics, so sweeping 247 addresses does not use up their rows. A
+request that timed out without a byte on the line counts as silent time
+since it was sent, so the next probe can follow at once. Meter reads
+should not run meanwhile.
 
-    result |= masterTransaction(slave, mt[2], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].pf = (getResponseBuffer(0) / 1000.00) * adj[2];
+@param u16TimeoutMs response timeout [milliseconds]; 0 ends scan mode
+*/
+void ModbusMeter::setScanMode(uint16_t u16TimeoutMs)
+{
+  _u32ScanTimeoutUs = u16TimeoutMs * 1000UL;
+}
 
-    delay(5);
+/**
+Response timeout the next read of u16ReadQty registers from this slave
+would get [microseconds].
+*/
+uint32_t ModbusMeter::getResponseTimeout(uint8_t slave, uint16_t u16ReadQty)
+{
+  slaveState *state = (slave < sizeof(_u8SlaveSlot) && _u8SlaveSlot[slave] != ku8NoSlot) ? &_slaves[_u8SlaveSlot[slave]] : 0;
 
-    result |= masterTransaction(slave, mt[3], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].varh = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00) * adj[3];
+  return responseTimeoutUs(state, 5 + 2 * u16ReadQty);
+}
 
-    delay(5);
+/**
+Configure the dead-slave circuit breaker.
+
+A slave that times out is suspect; after u8TripFailures consecutive
+timeouts it is open. Meter reads of an open slave return ku8MBSlaveOpen at
+once without touching the bus, except that every backoff interval one read
+is preceded by a single-register probe. The interval doubles with every
+failed probe up to u32MaxBackoffMs. Any answer, an exception included,
+makes the slave healthy again.
+
+@param u8TripFailures consecutive timeouts that open the breaker; 0 never opens
+@param u16BackoffMs first probe interval [milliseconds]
+@param u32MaxBackoffMs longest probe interval [milliseconds]
+*/
+void ModbusMeter::setBreaker(uint8_t u8TripFailures, uint16_t u16BackoffMs, uint32_t u32MaxBackoffMs)
+{
+  _u8BreakerTrip = u8TripFailures;
+  _u16BreakerBackoffMs = u16BackoffMs;
+  _u32BreakerMaxBackoffMs = u32MaxBackoffMs;
+}
 
-    result |= masterTransaction(slave, mt[4], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].i0 = (getResponseBuffer(0) / 100.00) * adj[4];
+/**
+Health of a slave: ku8SlaveHealthy, ku8SlaveSuspect or ku8SlaveOpen.
+Slaves never addressed are reported healthy.
+*/
+uint8_t ModbusMeter::getSlaveHealth(uint8_t slave)
+{
+  if (slave >= sizeof(_u8SlaveSlot) || _u8SlaveSlot[slave] == ku8NoSlot)
+  {
+    return ku8SlaveHealthy;
+  }
+  return _slaves[_u8SlaveSlot[slave]].u8Health;
+}
 
-    delay(5);
+/**
+millis() of the last answer from a slave, to tell live readings from stale
+ones; 0 if it never answered.
+*/
+uint32_t ModbusMeter::getSlaveLastSeen(uint8_t slave)
+{
+  if (slave >= sizeof(_u8SlaveSlot) || _u8SlaveSlot[slave] == ku8NoSlot)
+  {
+    return 0;
+  }
+  return _slaves[_u8SlaveSlot[slave]].u32LastSeenMs;
+}
 
-    result |= masterTransaction(slave, mt[5], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].i1 = (getResponseBuffer(0) / 100.00) * adj[5];
+/**
+Set the serial configuration of the bus, from which the inter-frame
+timing is derived. Slaves without a profile of their own (see
+setSlaveSerial()) are addressed in it.
 
-    delay(5);
+The silent interval between two frames is t3.5, 3.5 character times of 11
+bits; above 19200 baud the fixed 1750 us recommended by the Modbus serial
+line specification is used.
 
-    result |= masterTransaction(slave, mt[6], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].i2 = (getResponseBuffer(0) / 100.00) * adj[6];
+@param u32Baud baud rate the Stream was opened with
+@param u8Format character format it was opened with, ku8Serial8N1 etc.
+*/
+void ModbusMeter::setBaudRate(uint32_t u32Baud, uint8_t u8Format)
+{
+  _u32Baud = u32Baud;
+  _u8Format = u8Format;
+  _u32LineBaud = u32Baud;
+  _u8LineFormat = u8Format;
+  _u32CharUs = charUs(u32Baud);
+  _u16T35Us = t35Us(u32Baud);
+}
 
-    delay(5);
+/**
+Set the function that reconfigures the UART for slaves with a serial
+profile, e.g. one calling HardwareSerial::updateBaudRate() and
+uart_set_parity(). It is called between two transactions, with the bus
+quiet, only when the next slave needs another configuration than the one
+the UART is in.
 
-    result = masterTransaction(slave, mt[7], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].v0 = (getResponseBuffer(0) / 100.00) * adj[7];
+@param apply returns false if the configuration could not be set
+*/
+void ModbusMeter::setSerialSwitch(bool (*apply)(uint32_t u32Baud, uint8_t u8Format))
+{
+  _serialSwitch = apply;
+}
 
-    delay(5);
+/**
+Give a slave its own baud rate and character format, for buses that mix
+meters at e.g. 9600 8N1 and 19200 8E1. Requests to the slave switch the
+UART through the function set with setSerialSwitch(); timing (t3.5, wire
+time in the response timeout) follows the rate in use. To keep switching
+rare, poll the slaves of one configuration one after another, as
+ModbusBusManager does.
+
+@param u32Baud baud rate; 0 returns the slave to the bus configuration
+@param u8Format ku8Serial8N1, ku8Serial8E1, ku8Serial8O1 or ku8Serial8N2
+@return false if the format is unknown or ku8MaxSlaves slaves already
+        have state
+*/
+bool ModbusMeter::setSlaveSerial(uint8_t slave, uint32_t u32Baud, uint8_t u8Format)
+{
+  slaveState *state;
 
-    result = masterTransaction(slave, mt[8], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].v1 = (getResponseBuffer(0) / 100.00) * adj[8];
+  if (u8Format > ku8Serial8N2 || !(state = slaveFor(slave)))
+  {
+    return false;
+  }
+  state->u32Baud = u32Baud;
+  state->u8Format = u8Format;
+  return true;
+}
 
-    delay(5);
+/**
+Serial configuration a slave is addressed in: its profile, or the bus
+configuration if it has none.
 
-    result = masterTransaction(slave, mt[9], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].v2 = (getResponseBuffer(0) / 100.00) * adj[9];
+@return true if the slave has a profile of its own
+*/
+bool ModbusMeter::getSlaveSerial(uint8_t slave, uint32_t *pu32Baud, uint8_t *pu8Format)
+{
+  slaveState *state = (slave < sizeof(_u8SlaveSlot) && _u8SlaveSlot[slave] != ku8NoSlot) ? &_slaves[_u8SlaveSlot[slave]] : 0;
+  bool bOwn = state && state->u32Baud;
 
-    md[index].mdt = mdt;
+  *pu32Baud = bOwn ? state->u32Baud : _u32Baud;
+  *pu8Format = bOwn ? state->u8Format : _u8Format;
+  return bOwn;
+}
 
-    break;
+// tried by detectSlaveSerial(), the most common first
+static const uint32_t kDetectBauds[] = {9600, 19200, 38400, 57600, 115200, 4800, 2400};
+
+/**
+Find the serial configuration of a slave by reading one register at every
+common baud rate and format until it answers; the slave keeps the
+configuration found as its profile. Blocking, like readMeterData().
+
+Each attempt waits ku16DetectTimeoutMs and, as in scan mode, leaves no
+latency, health or statistics behind. An exception counts as an answer.
+Slaves at 8N2 usually answer at 8N1 already and are reported so.
+
+@param fn read function code, ku8MBReadHoldingRegisters or ku8MBReadInputRegisters
+@param u16Address a register the slave has
+@param pu32Baud, pu8Format receive the configuration found; may be 0
+@return ku8MBSuccess; ku8MBResponseTimedOut if no configuration got an
+        answer (the previous profile is kept); ku8MBSerialConfig without
+        a switch function, on Modbus TCP, if the UART could not be
+        switched or ku8MaxSlaves slaves already have state
+*/
+uint8_t ModbusMeter::detectSlaveSerial(uint8_t slave, uint8_t fn, uint16_t u16Address, uint32_t *pu32Baud, uint8_t *pu8Format)
+{
+  slaveState *state = slaveFor(slave);
+  uint32_t u32ScanUs = _u32ScanTimeoutUs;
+  uint32_t u32OldBaud;
+  uint8_t u8OldFormat;
+  uint8_t result = ku8MBResponseTimedOut;
 
-  case heyuan1: // 1-Phase
-    result |= masterTransaction(slave, mt[0], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].watt = (getResponseBuffer(0) / 1000.00) * adj[0];
+  if (!_serialSwitch || _link || !state)
+  {
+    return ku8MBSerialConfig;
+  }
+  u32OldBaud = state->u32Baud;
+  u8OldFormat = state->u8Format;
 
-    delay(5);
+  _u32ScanTimeoutUs = ku16DetectTimeoutMs * 1000UL;
+  for (uint8_t b = 0; b < sizeof(kDetectBauds) / sizeof(kDetectBauds[0]) && result == ku8MBResponseTimedOut; b++)
+  {
+    for (uint8_t f = ku8Serial8N1; f <= ku8Serial8N2; f++)
+    {
+      state->u32Baud = kDetectBauds[b];
+      state->u8Format = f;
+      result = masterTransaction(slave, u16Address, 1, fn);
+      if (result < ku8MBInvalidSlaveID || result == ku8MBSerialConfig)
+      {
+        break;
+      }
+      result = ku8MBResponseTimedOut;
+    }
+  }
+  _u32ScanTimeoutUs = u32ScanUs;
 
-    result |= masterTransaction(slave, mt[1], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].wattHour = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00) * adj[1];
+  if (result >= ku8MBInvalidSlaveID)
+  {
+    state->u32Baud = u32OldBaud;
+    state->u8Format = u8OldFormat;
+    return result;
+  }
+  if (pu32Baud)
+  {
+    *pu32Baud = state->u32Baud;
+  }
+  if (pu8Format)
+  {
+    *pu8Format = state->u8Format;
+  }
+  if (state->u32Baud == _u32Baud && state->u8Format == _u8Format)
+  {
+    // the bus configuration; no profile needed
+    state->u32Baud = 0;
+  }
+  return ku8MBSuccess;
+}
 
-    delay(5);
-
-    result |= masterTransaction(slave, mt[2], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].pf = (getResponseBuffer(0) / 1000.00) * adj[2];
-
-    delay(5);
-
-    result |= masterTransaction(slave, mt[3], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].varh = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00) * adj[3];
-
-    delay(5);
-
-    result |= masterTransaction(slave, mt[4], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].i0 = (getResponseBuffer(0) / 100.00) * adj[4];
-    md[index].i1 = 0;
-    md[index].i2 = 0;
-
-    delay(5);
-
-    result = masterTransaction(slave, mt[7], 1, mt[10]);
-    if (result)
-      return result;
-    md[index].v0 = (getResponseBuffer(0) / 100.00) * adj[7];
-    md[index].v1 = 0;
-    md[index].v2 = 0;
-
-    md[index].mdt = mdt;
-
-    break;
-
-  case circutor: // 3-Phase
-    result |= masterTransaction(slave, 0x1e, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].watt = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[0];
-
-    delay(5);
+/**
+Number of times the UART has been reconfigured for a serial profile.
+*/
+uint32_t ModbusMeter::getSerialSwitches()
+{
+  return _u32SerialSwitches;
+}
 
-    result |= masterTransaction(slave, 0x3c, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[1];
+/**
+One 11-bit character at a baud rate [microseconds].
+*/
+uint32_t ModbusMeter::charUs(uint32_t u32Baud)
+{
+  return (11UL * 1000000UL + u32Baud - 1) / u32Baud;
+}
 
-    delay(5);
+/**
+Modbus RTU silent interval t3.5 at a baud rate [microseconds].
+*/
+uint16_t ModbusMeter::t35Us(uint32_t u32Baud)
+{
+  return (u32Baud > 19200) ? 1750 : (uint16_t)((charUs(u32Baud) * 7 + 1) / 2);
+}
 
-    result |= masterTransaction(slave, 0x26, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].pf = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00) * adj[2];
+/**
+Put the UART into the serial configuration of a slave before a request.
+*/
+uint8_t ModbusMeter::selectSerial(uint8_t slave)
+{
+  uint32_t u32Baud;
+  uint8_t u8Format;
 
-    delay(5);
+  getSlaveSerial(slave, &u32Baud, &u8Format);
+  if (u32Baud == _u32LineBaud && u8Format == _u8LineFormat)
+  {
+    return ku8MBSuccess;
+  }
+  if (!_serialSwitch || !_serialSwitch(u32Baud, u8Format))
+  {
+    return ku8MBSerialConfig;
+  }
+  _u32LineBaud = u32Baud;
+  _u8LineFormat = u8Format;
+  _u32CharUs = charUs(u32Baud);
+  _u16T35Us = t35Us(u32Baud);
+  _u32SerialSwitches++;
+  return ku8MBSuccess;
+}
 
-    result |= masterTransaction(slave, 0x3c, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].varh = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[3];
+/**
+Set the minimum silent interval a slave needs before each request.
 
-    delay(5);
+The bus is kept quiet for the larger of t3.5 and this value. Use it for
+slaves that answer late or miss requests that follow too closely, and to
+restore values found by auto-tuning.
 
-    result |= masterTransaction(slave, 0x02, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i0 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[4];
+@param u16GapUs minimum silent interval [microseconds]; 0 = t3.5 only
+*/
+void ModbusMeter::setSlaveMinGap(uint8_t slave, uint16_t u16GapUs)
+{
+  slaveState *state = slaveFor(slave);
 
-    delay(5);
+  if (state)
+  {
+    state->u16MinGapUs = u16GapUs;
+    state->u16TuneFloorUs = 0;
+    state->u8TuneRun = 0;
+    state->u8FloorRuns = 0;
+  }
+}
 
-    result |= masterTransaction(slave, 0x0c, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i1 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[5];
+/**
+Minimum silent interval of a slave [microseconds]; 0 = t3.5 only.
+*/
+uint16_t ModbusMeter::getSlaveMinGap(uint8_t slave)
+{
+  slaveState *state = slaveFor(slave);
 
-    delay(5);
+  return state ? state->u16MinGapUs : 0;
+}
 
-    result |= masterTransaction(slave, 0x16, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i2 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[6];
+/**
+Let every slave's minimum silent interval adapt to what it tolerates.
+
+After ku8GapTuneRun good transactions the gap is shortened by 1/8; a
+corrupt response (bad CRC, wrong slave or function, wrong length) right
+after a good one widens it by half and keeps later attempts above the
+failing value. Timeouts are taken as lost frames and leave the gap alone.
+The floor drops by 1/8 after ku8GapFloorRuns good runs held up by it, so
+one unlucky frame does not pin the gap for good. The callback is invoked on
+every change so the application can persist the value and hand it back
+through setSlaveMinGap() after a restart.
+
+@param bEnable true to tune
+@param tuned called with (slave, gap [microseconds]) on every change; may be 0
+*/
+void ModbusMeter::setGapAutoTune(bool bEnable, void (*tuned)(uint8_t slave, uint16_t u16GapUs))
+{
+  _bGapTune = bEnable;
+  _gapTuned = tuned;
+}
 
-    delay(5);
+/**
+Per-slave state, created on first use.
 
-    result = masterTransaction(slave, 0x00, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v0 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 10.00) * adj[7];
+@return state, or 0 for an invalid address or when ku8MaxSlaves slaves are
+        already tracked
+*/
+ModbusMeter::slaveState *ModbusMeter::slaveFor(uint8_t slave)
+{
+  slaveState *state;
 
-    delay(5);
+  if (slave >= sizeof(_u8SlaveSlot))
+  {
+    return 0;
+  }
+  if (_u8SlaveSlot[slave] != ku8NoSlot)
+  {
+    return &_slaves[_u8SlaveSlot[slave]];
+  }
+  if (_u8Slaves == ku8MaxSlaves)
+  {
+    return 0;
+  }
 
-    result = masterTransaction(slave, 0x0a, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v1 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 10.00) * adj[8];
+  state = &_slaves[_u8Slaves];
+  memset(state, 0, sizeof(*state));
+  state->u8Slave = slave;
+  _u8SlaveSlot[slave] = _u8Slaves++;
+  return state;
+}
 
-    delay(5);
+/**
+Silent interval required before a request to this slave [microseconds].
+*/
+uint32_t ModbusMeter::silentIntervalUs(uint8_t slave)
+{
+  slaveState *state = (slave < sizeof(_u8SlaveSlot) && _u8SlaveSlot[slave] != ku8NoSlot) ? &_slaves[_u8SlaveSlot[slave]] : 0;
+  uint32_t u32Gap = _u16T35Us;
+  uint32_t u32Baud = (state && state->u32Baud) ? state->u32Baud : _u32Baud;
 
-    result = masterTransaction(slave, 0x14, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v2 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 10.00) * adj[9];
+  if (u32Baud != _u32LineBaud && t35Us(u32Baud) > u32Gap)
+  {
+    // the UART is switched first; slaves at either rate must see the gap
+    u32Gap = t35Us(u32Baud);
+  }
+  if (state && state->u16MinGapUs > u32Gap)
+  {
+    return state->u16MinGapUs;
+  }
+  return u32Gap;
+}
 
-    md[index].mdt = mdt;
+/**
+True once the bus has been quiet long enough to address this slave; a
+transaction started with beginTransaction() should wait for it.
+*/
+bool ModbusMeter::busQuiet(uint8_t slave)
+{
+  return (uint32_t)(micros() - _u32BusIdleUs) >= silentIntervalUs(slave);
+}
 
-    break;
+/**
+Auto-tune step after a transaction with this slave completed.
+*/
+void ModbusMeter::tuneGap(uint8_t slave, uint8_t result)
+{
+  slaveState *state;
+  uint32_t u32Gap;
+  uint16_t u16Old;
 
-  case abbm2m: // 3-Phase
-    result |= masterTransaction(slave, 0x102e, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].watt = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[0];
+  if (!_bGapTune || !(state = slaveFor(slave)))
+  {
+    return;
+  }
 
-    delay(5);
+  u32Gap = silentIntervalUs(slave);
+  u16Old = state->u16MinGapUs;
 
-    result |= masterTransaction(slave, 0x103e, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100000.00) * adj[1];
+  if (result < ku8MBInvalidSlaveID)
+  {
+    // a well-formed answer, possibly an exception: the gap was long enough
+    if (state->u8TuneRun < ku8GapTuneRun)
+    {
+      state->u8TuneRun++;
+    }
+    if (state->u8TuneRun == ku8GapTuneRun && state->u16MinGapUs > _u16T35Us)
+    {
+      uint32_t u32Shorter = u32Gap - u32Gap / 8;
 
-    delay(5);
+      if (u32Shorter > state->u16TuneFloorUs)
+      {
+        state->u16MinGapUs = (u32Shorter > _u16T35Us) ? u32Shorter : 0;
+        state->u8FloorRuns = 0;
+      }
+      else if (++state->u8FloorRuns == ku8GapFloorRuns)
+      {
+        // a long good run at the floor: the failure that set it may have been
+        // noise, or the slave has changed; let the gap be tried lower again
+        state->u16TuneFloorUs -= state->u16TuneFloorUs / 8;
+        state->u8FloorRuns = 0;
+      }
+      state->u8TuneRun = 1;
+    }
+  }
+  else if (state->u8TuneRun && (result == ku8MBInvalidSlaveID || result == ku8MBInvalidFunction ||
+                                result == ku8MBInvalidCRC || result == ku8MBInvalidLength))
+  {
+    // a garbled answer right after a good transaction: the gap is too short.
+    // A timeout is a lost frame, not a framing problem, and says nothing.
+    state->u16TuneFloorUs = u32Gap;
+    u32Gap += u32Gap / 2;
+    state->u16MinGapUs = (u32Gap < ku16MaxGapUs) ? u32Gap : ku16MaxGapUs;
+    state->u8TuneRun = 0;
+    state->u8FloorRuns = 0;
+  }
 
-    result |= masterTransaction(slave, 0x1016, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].pf = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[2];
+  if (state->u16MinGapUs != u16Old && _gapTuned)
+  {
+    _gapTuned(slave, state->u16MinGapUs);
+  }
+}
 
-    delay(5);
+/**
+Timeout for a response of u16ResponseBytes from a slave, counted from the
+end of the request.
+*/
+uint32_t ModbusMeter::responseTimeoutUs(slaveState *state, uint16_t u16ResponseBytes)
+{
+  uint32_t u32Timeout;
 
-    result |= masterTransaction(slave, 0x1040, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].varh = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100000.00) * adj[3];
+  if (!state || !state->bRtt)
+  {
+    u32Timeout = ku16MBResponseTimeout * 1000UL;
+  }
+  else
+  {
+    u32Timeout = state->u32SrttUs + 4 * state->u32RttvarUs + (u16ResponseBytes + 1) * _u32CharUs;
+  }
 
-    delay(5);
+  if (u32Timeout < _u32TimeoutFloorUs)
+  {
+    return _u32TimeoutFloorUs;
+  }
+  return (u32Timeout > _u32TimeoutCeilingUs) ? _u32TimeoutCeilingUs : u32Timeout;
+}
 
-    result |= masterTransaction(slave, 0x1010, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i0 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[4];
+/**
+Feed the latency of the transaction that just completed into the slave's
+estimate.
 
-    delay(5);
+Only well-formed answers are sampled. A timeout doubles the deviation, so
+a slave that has become slower gets a longer timeout on the next request
+until fresh samples arrive.
+*/
+void ModbusMeter::sampleRtt(uint8_t result)
+{
+  slaveState *state = slaveFor(_u8TxSlave);
+  uint32_t u32Wire, u32Latency, u32Err;
 
-    result |= masterTransaction(slave, 0x1012, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i1 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[5];
+  if (!state)
+  {
+    return;
+  }
 
-    delay(5);
+  if (result == ku8MBResponseTimedOut)
+  {
+    if (state->bRtt)
+    {
+      state->u32RttvarUs = (state->u32RttvarUs < _u32TimeoutCeilingUs / 2) ? 2 * state->u32RttvarUs + _u32CharUs : _u32TimeoutCeilingUs;
+    }
+    return;
+  }
+  if (result >= ku8MBInvalidSlaveID)
+  {
+    return;
+  }
 
-    result |= masterTransaction(slave, 0x1014, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i2 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[6];
+  // latency: end of request to end of response, less the response's own wire time
+  u32Wire = _u8ModbusADUSize * _u32CharUs;
+  u32Latency = _u32RxLastUs - _u32TxDoneUs;
+  u32Latency = (u32Latency > u32Wire) ? u32Latency - u32Wire : 0;
 
-    delay(5);
+  if (!state->bRtt)
+  {
+    state->u32SrttUs = u32Latency;
+    state->u32RttvarUs = u32Latency / 2;
+    state->bRtt = true;
+    return;
+  }
 
-    result = masterTransaction(slave, 0x1002, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v0 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1.00) * adj[7];
+  u32Err = (u32Latency > state->u32SrttUs) ? u32Latency - state->u32SrttUs : state->u32SrttUs - u32Latency;
+  state->u32RttvarUs = state->u32RttvarUs - state->u32RttvarUs / 4 + u32Err / 4;
+  state->u32SrttUs = state->u32SrttUs - state->u32SrttUs / 8 + u32Latency / 8;
+}
 
-    delay(5);
+/**
+Circuit breaker step after a transaction with the current slave.
 
-    result = masterTransaction(slave, 0x1004, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v1 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1.00) * adj[8];
+Only timeouts count against a slave; a corrupt or misaddressed frame still
+shows something is alive on the line.
+*/
+void ModbusMeter::updateHealth(uint8_t result)
+{
+  slaveState *state = slaveFor(_u8TxSlave);
 
-    delay(5);
+  if (!state)
+  {
+    return;
+  }
 
-    result = masterTransaction(slave, 0x1006, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v2 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1.00) * adj[9];
+  if (result != ku8MBResponseTimedOut)
+  {
+    if (result < ku8MBInvalidSlaveID)
+    {
+      state->u8Health = ku8SlaveHealthy;
+      state->u8Timeouts = 0;
+      state->u32BackoffMs = 0;
+      state->u32LastSeenMs = millis();
+    }
+    return;
+  }
 
-    md[index].mdt = mdt;
+  if (state->u8Timeouts < 0xFF)
+  {
+    state->u8Timeouts++;
+  }
 
-    break;
+  if (state->u8Health == ku8SlaveOpen)
+  {
+    // failed probe: wait twice as long for the next one
+    state->u32BackoffMs = (state->u32BackoffMs < _u32BreakerMaxBackoffMs / 2) ? 2 * state->u32BackoffMs : _u32BreakerMaxBackoffMs;
+    state->u32ProbeAtMs = millis() + state->u32BackoffMs;
+  }
+  else if (_u8BreakerTrip && state->u8Timeouts >= _u8BreakerTrip)
+  {
+    state->u8Health = ku8SlaveOpen;
+    state->u32BackoffMs = _u16BreakerBackoffMs;
+    state->u32ProbeAtMs = millis() + state->u32BackoffMs;
+  }
+  else
+  {
+    state->u8Health = ku8SlaveSuspect;
+  }
+}
 
-  case integra1630: // 3 Phase Meter
-    result = masterTransaction(slave, 0x0000, 6, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].v0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[7];
-    md[index].v1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[8];
-    md[index].v2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[9];
+/**
+Payload of the last response, without copying; empty unless the last
+transaction succeeded.
+*/
+ModbusMeter::responseSpan ModbusMeter::getResponseSpan()
+{
+  responseSpan span;
 
-    result |= masterTransaction(slave, 0x0006, 6, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].i0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[4];
-    md[index].i1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[5];
-    md[index].i2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[6];
+  span.pu8Data = _u8ModbusADU + 3;
+  span.u8Words = (_u8TxState == ku8TxIdle) ? _u8ResponseWords : 0;
+  return span;
+}
 
-    result |= masterTransaction(slave, 0x0034, 2, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].watt = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[0];
+/**
+Register u8Index of the last response, or 0xFFFF past its end. Coil and
+discrete input bits are packed L, H per word.
+*/
+uint16_t ModbusMeter::getResponseBuffer(uint8_t u8Index)
+{
+  responseSpan span = getResponseSpan();
+  const uint8_t *p = span.pu8Data + 2 * u8Index;
 
-    result |= masterTransaction(slave, 0x0048, 2, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[1];
+  if (u8Index >= span.u8Words)
+  {
+    return 0xFFFF;
+  }
+  if (_u8TxFunction == ku8MBReadCoils || _u8TxFunction == ku8MBReadDiscreteInputs)
+  {
+    // an odd byte count leaves the last word zero-padded
+    return word((2 * u8Index + 1 < _u8ModbusADU[2]) ? p[1] : 0, p[0]);
+  }
+  return word(p[0], p[1]);
+}
 
-    result |= masterTransaction(slave, 0x004c, 2, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].varh = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[3];
+/**
+Start a read transaction without waiting for the response.
 
-    result |= masterTransaction(slave, 0x00fe, 2, ku8MBReadInputRegisters);
-    if (result)
-      return result;
-    md[index].pf = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[2];
+The request is built and transmitted; the response is collected by
+pollTransaction(). Only one transaction can be in flight per instance.
 
-    md[index].mdt = mdt;
+@return ku8MBPending once the request is sent, ku8MBBusy if another
+        transaction is still in flight
+*/
+uint8_t ModbusMeter::beginTransaction(uint8_t slave, uint16_t startAddress, uint16_t readQty, uint8_t fnRead)
+{
+  uint16_t u16CRC;
+  uint8_t u8ModbusADUSize = 0;
+  int n;
 
-    break;
+  if (_u8TxState != ku8TxIdle)
+  {
+    return ku8MBBusy;
+  }
 
-  case generic3: // 3-Phase
-    result |= masterTransaction(slave, mt[0], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].watt = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[0];
+  _u8TxSlave = slave;
+  _u8TxFunction = fnRead;
+  _u16TxQty = readQty;
+  _u8ResponseWords = 0;
 
-    result |= masterTransaction(slave, mt[1], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].wattHour = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[1];
+  if (_link)
+  {
+    uint8_t result = _link->request(slave, fnRead, startAddress, readQty, &_u16TxTid);
 
-    result |= masterTransaction(slave, mt[2], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].pf = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[2];
+    if (result == ku8MBPending)
+    {
+      _u8TxState = ku8TxTcp;
+    }
+    return result;
+  }
 
-    result |= masterTransaction(slave, mt[3], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].varh = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[3];
+  if (selectSerial(slave) != ku8MBSuccess)
+  {
+    return ku8MBSerialConfig;
+  }
 
-    result |= masterTransaction(slave, mt[4], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].i0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[4];
+  _u8ModbusADU[u8ModbusADUSize++] = slave;
+  // MODBUS function = readHoldingRegister
+  _u8ModbusADU[u8ModbusADUSize++] = fnRead;
+  // MODBUS Address
+  _u8ModbusADU[u8ModbusADUSize++] = highByte(startAddress);
+  _u8ModbusADU[u8ModbusADUSize++] = lowByte(startAddress);
+  // MODBUS Data Size
+  _u8ModbusADU[u8ModbusADUSize++] = highByte(readQty);
+  _u8ModbusADU[u8ModbusADUSize++] = lowByte(readQty);
 
-    result |= masterTransaction(slave, mt[5], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].i1 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[5];
+  // calculate CRC
+  u16CRC = crc16_block(0xFFFF, _u8ModbusADU, u8ModbusADUSize);
+  _u8ModbusADU[u8ModbusADUSize++] = lowByte(u16CRC);
+  _u8ModbusADU[u8ModbusADUSize++] = highByte(u16CRC);
+  _u8ModbusADU[u8ModbusADUSize] = 0;
 
-    result |= masterTransaction(slave, mt[6], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].i2 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[6];
+  // flush receive buffer before transmitting request
+  while ((n = _serial->available()) > 0)
+  {
+    if (!_serial->readBytes(_u8ModbusADU + u8ModbusADUSize, (n < 64) ? n : 64))
+    {
+      break;
+    }
+  }
 
-    result = masterTransaction(slave, mt[7], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].v0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[7];
+  // transmit request
+  _u32TxBeginUs = micros();
+  if (_preTransmission)
+  {
+    _preTransmission();
+  }
+  _serial->write(_u8ModbusADU, u8ModbusADUSize);
+  _serial->flush(); // flush transmit buffer
+  _u32TxDoneUs = micros();
 
-    result = masterTransaction(slave, mt[8], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].v1 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[8];
+  // the debug mirror is written out while waiting for the response
+  if (_debug)
+  {
+    queueDebugLog(_u8ModbusADU, u8ModbusADUSize);
+  }
 
-    result = masterTransaction(slave, mt[9], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].v2 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[9];
+  _u8ModbusADUSize = 0;
+  _u8BytesLeft = 8;
+  _u16RxCRC = 0xFFFF;
+  _u32TxTimeoutUs = _u32ScanTimeoutUs ? _u32ScanTimeoutUs : responseTimeoutUs(slaveFor(slave), (fnRead <= ku8MBReadInputRegisters) ? 5 + 2 * readQty : 8);
+  _u8TxState = _postTransmission ? ku8TxTurnaround : ku8TxReceiving;
 
-    md[index].mdt = mdt;
+  return ku8MBPending;
+}
 
-    break;
+/**
+Advance the transaction started by beginTransaction().
 
-  case generic1: // 1-Phase
-    result |= masterTransaction(slave, mt[0], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].watt = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[0];
+Consumes whatever bytes have arrived and returns immediately.
 
-    result |= masterTransaction(slave, mt[1], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].wattHour = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[1];
+@return ku8MBPending while the response is incomplete; afterwards the
+        result of the transaction (0 on success, exception or ku8MB* error)
+*/
+uint8_t ModbusMeter::pollTransaction()
+{
+  uint8_t u8MBStatus = ku8MBSuccess;
+  int n;
 
-    result |= masterTransaction(slave, mt[2], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].pf = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[2];
+  if (_u8TxState == ku8TxIdle)
+  {
+    return _u8TxResult;
+  }
 
-    result |= masterTransaction(slave, mt[3], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].varh = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[3];
+  if (_u8TxState == ku8TxTcp)
+  {
+    _link->poll();
+    u8MBStatus = _link->take(_u16TxTid, _u8ModbusADU + 3, &_u8ResponseWords);
+    if (u8MBStatus == ku8MBPending)
+    {
+      return ku8MBPending;
+    }
+    if (!u8MBStatus && _u8TxFunction != ku8MBReadCoils && _u8TxFunction != ku8MBReadDiscreteInputs &&
+        _u8ResponseWords != _u16TxQty)
+    {
+      u8MBStatus = ku8MBInvalidLength;
+    }
+    if (u8MBStatus)
+    {
+      _u8ResponseWords = 0;
+    }
+    _u8ModbusADU[1] = _u8TxFunction;
+    _u8ModbusADU[2] = 2 * _u8ResponseWords;
+    _u8TxState = ku8TxIdle;
+    _u8TxResult = u8MBStatus;
+    return u8MBStatus;
+  }
 
-    result |= masterTransaction(slave, mt[4], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].i0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[4];
-    md[index].i1 = 0;
-    md[index].i2 = 0;
+  if (_u8TxState == ku8TxTurnaround)
+  {
+    // give the transceiver one character time to finish the last stop bit
+    if ((uint32_t)(micros() - _u32TxDoneUs) < _u32CharUs)
+    {
+      return ku8MBPending;
+    }
+    _postTransmission();
+    _u8TxState = ku8TxReceiving;
+  }
 
-    result = masterTransaction(slave, mt[7], 2, mt[10]);
-    if (result)
-      return result;
-    md[index].v0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[7];
-    md[index].v1 = 0;
-    md[index].v2 = 0;
+  // take what has arrived in bulk, stopping at the 5-byte header so it can
+  // be checked; the response CRC is accumulated over every chunk and ends at
+  // 0 for a valid frame
+  while (_u8BytesLeft && !u8MBStatus && (n = _serial->available()) > 0)
+  {
+    uint8_t u8Chunk = _u8BytesLeft;
 
-    md[index].mdt = mdt;
+    if (_u8ModbusADUSize < 5 && u8Chunk > 5 - _u8ModbusADUSize)
+    {
+      u8Chunk = 5 - _u8ModbusADUSize;
+    }
+    if (n < u8Chunk)
+    {
+      u8Chunk = n;
+    }
+    if (!_u8ModbusADUSize)
+    {
+      _u32TxFirstByteUs = micros();
+    }
 
-    break;
+    u8Chunk = _serial->readBytes(_u8ModbusADU + _u8ModbusADUSize, u8Chunk);
+    if (!u8Chunk)
+    {
+      break;
+    }
+    _u32RxLastUs = micros();
+    _u16RxCRC = crc16_block(_u16RxCRC, _u8ModbusADU + _u8ModbusADUSize, u8Chunk);
+    _u8ModbusADUSize += u8Chunk;
+    _u8BytesLeft -= u8Chunk;
 
-  case pm800: // 3 Phase Meter
-    result |= masterTransaction(slave, 1099, 3, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i0 = getResponseBuffer(0) * adj[4];
-    md[index].i1 = getResponseBuffer(1) * adj[5];
-    md[index].i2 = getResponseBuffer(2) * adj[6];
+    // evaluate slave ID, function code once enough bytes have been read
+    if (_u8ModbusADUSize == 5)
+    {
+      // verify response is for correct Modbus slave
+      if (_u8ModbusADU[0] != _u8TxSlave)
+      {
+        u8MBStatus = ku8MBInvalidSlaveID;
+        break;
+      }
 
-    delay(5);
+      // verify response is for correct Modbus function code (mask exception bit 7)
+      if ((_u8ModbusADU[1] & 0x7F) != _u8TxFunction)
+      {
+        u8MBStatus = ku8MBInvalidFunction;
+        break;
+      }
 
-    result = masterTransaction(slave, 1123, 3, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v0 = getResponseBuffer(0) * adj[7];
-    md[index].v1 = getResponseBuffer(1) * adj[8];
-    md[index].v2 = getResponseBuffer(2) * adj[9];
+      // check whether Modbus exception occurred; return Modbus Exception Code
+      if (bitRead(_u8ModbusADU[1], 7))
+      {
+        u8MBStatus = _u8ModbusADU[2];
+        break;
+      }
 
-    delay(5);
+      // evaluate returned Modbus function code
+      switch (_u8ModbusADU[1])
+      {
+      case ku8MBReadCoils:
+      case ku8MBReadDiscreteInputs:
+      case ku8MBReadInputRegisters:
+      case ku8MBReadHoldingRegisters:
+      case ku8MBReadWriteMultipleRegisters:
+        _u8BytesLeft = _u8ModbusADU[2];
+        break;
 
-    result |= masterTransaction(slave, 1142, 1, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].watt = getResponseBuffer(0) * adj[0];
+      case ku8MBWriteSingleCoil:
+      case ku8MBWriteMultipleCoils:
+      case ku8MBWriteSingleRegister:
+      case ku8MBWriteMultipleRegisters:
+        _u8BytesLeft = 3;
+        break;
 
-    delay(5);
+      case ku8MBMaskWriteRegister:
+        _u8BytesLeft = 5;
+        break;
+      }
+    }
+  }
 
-    result |= masterTransaction(slave, 1715, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = (((int64_t)getResponseBuffer(0)) + ((int64_t)getResponseBuffer(1) * 10000) + ((int64_t)getResponseBuffer(2) * 10000 * 10000) + ((int64_t)getResponseBuffer(3) * 10000 * 10000 * 10000)) * adj[1];
+  if (_u8BytesLeft && !u8MBStatus)
+  {
+    if (_debug && !_serial->available())
+    {
+      drainDebugLog();
+    }
+    // once the response has started, the rest is due within its own wire
+    // time plus a few characters (UARTs may hand bytes over in FIFO-sized
+    // bursts); a frame that stalls is given up then instead of at the
+    // full timeout
+    if (_u8ModbusADUSize ? (uint32_t)(micros() - _u32RxLastUs) <= (_u8BytesLeft + ku8InterByteChars) * _u32CharUs + 1000
+                         : (uint32_t)(micros() - _u32TxDoneUs) <= _u32TxTimeoutUs)
+    {
+      return ku8MBPending;
+    }
+    u8MBStatus = ku8MBResponseTimedOut;
+  }
 
-    delay(5);
+  // verify response is large enough to inspect further
+  if (!u8MBStatus && _u8ModbusADUSize >= 5)
+  {
+    // verify CRC; running CRC over data and CRC bytes is 0 for a good frame
+    if (_u16RxCRC != 0)
+    {
+      u8MBStatus = ku8MBInvalidCRC;
+    }
+  }
 
-    result |= masterTransaction(slave, 1719, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].varh = (((int64_t)getResponseBuffer(0)) + ((int64_t)getResponseBuffer(1) * 10000) + ((int64_t)getResponseBuffer(2) * 10000 * 10000) + ((int64_t)getResponseBuffer(3) * 10000 * 10000 * 10000)) * adj[3];
+  // check the payload length once; getResponseSpan() then hands the frame
+  // out as it is
+  if (!u8MBStatus)
+  {
+    switch (_u8ModbusADU[1])
+    {
+    case ku8MBReadCoils:
+    case ku8MBReadDiscreteInputs:
+      _u8ResponseWords = (_u8ModbusADU[2] + 1) >> 1;
+      break;
 
-    delay(5);
+    case ku8MBReadInputRegisters:
+    case ku8MBReadHoldingRegisters:
+    case ku8MBReadWriteMultipleRegisters:
+      if (_u8ModbusADU[2] != 2 * _u16TxQty)
+      {
+        u8MBStatus = ku8MBInvalidLength;
+        break;
+      }
+      _u8ResponseWords = _u8ModbusADU[2] >> 1;
+      break;
+    }
+  }
 
-    result |= masterTransaction(slave, 1166, 1, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].pf = (getResponseBuffer(0) / 1000.00) * adj[2];
+  _u8TxState = ku8TxIdle;
+  _u8TxResult = u8MBStatus;
+  if (_u32ScanTimeoutUs)
+  {
+    // a request nobody answered has left the line quiet since it was sent
+    _u32BusIdleUs = (u8MBStatus == ku8MBResponseTimedOut && !_u8ModbusADUSize) ? _u32TxDoneUs : micros();
+    return u8MBStatus;
+  }
+  _u32BusIdleUs = micros();
+  sampleRtt(u8MBStatus);
+  updateHealth(u8MBStatus);
+  recordTx(u8MBStatus);
+  tuneGap(_u8TxSlave, u8MBStatus);
+  return u8MBStatus;
+}
 
-    delay(5);
+/**
+Blocking transaction: waits for the silent interval, then beginTransaction()
+and pollTransaction() until done.
 
-    md[index].mdt = mdt;
+The calling task sleeps between polls instead of spinning.
+*/
+uint8_t ModbusMeter::masterTransaction(uint8_t slave, uint16_t startAddress, uint16_t readQty, uint8_t fnRead)
+{
+  uint8_t result;
 
-    break;
+  while (!busQuiet(slave))
+  {
+    delay(1);
+  }
 
-    /////////
-    ///////// pq
-  case pm2230: // PQ
-    result |= masterTransaction(slave, 2999, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].i0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[4];
-    pd[index].i1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[5];
-    pd[index].i2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[6];
+  result = beginTransaction(slave, startAddress, readQty, fnRead);
 
-    delay(10);
+  while (result == ku8MBPending)
+  {
+    delay(1);
+    result = pollTransaction();
+  }
+  return result;
+}
 
-    result = masterTransaction(slave, 3027, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].v0 = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[7];
-    pd[index].v1 = wordToFloat(getResponseBuffer(2), getResponseBuffer(3)) * adj[8];
-    pd[index].v2 = wordToFloat(getResponseBuffer(4), getResponseBuffer(5)) * adj[9];
+/**
+Copy the statistics of every (slave, function code) pair seen so far.
 
-    delay(10);
+The copy is consistent even while another task is running transactions on
+this instance; the call spins only if a transaction completes during it.
 
-    result |= masterTransaction(slave, 3059, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].watt = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[0];
+@param stats receives the rows
+@param u8Max capacity of stats
+@return number of rows copied
+*/
+uint8_t ModbusMeter::getTxStats(txStats *stats, uint8_t u8Max)
+{
+  uint32_t u32Seq;
+  uint8_t u8Rows;
 
-    delay(10);
+  do
+  {
+    while ((u32Seq = _u32StatsSeq) & 1)
+      ;
+    __sync_synchronize();
+    u8Rows = (_u8TxStats < u8Max) ? _u8TxStats : u8Max;
+    memcpy(stats, _txStats, u8Rows * sizeof(txStats));
+    __sync_synchronize();
+  } while (_u32StatsSeq != u32Seq);
+
+  return u8Rows;
+}
 
-    result |= masterTransaction(slave, 3083, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].pf = wordToFloat(getResponseBuffer(0), getResponseBuffer(1)) * adj[2];
-    if (isnan(pd[index].pf))
-      pd[index].pf = 0;
-    if (pd[index].pf < -1.00)
-      pd[index].pf = (-2.0) - pd[index].pf;
-    if (pd[index].pf > 1.00)
-      pd[index].pf = (2.0) - pd[index].pf;
-
-    delay(10);
-
-    result |= masterTransaction(slave, 3203, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].wattHour = (((int64_t)getResponseBuffer(0) << 48) | ((int64_t)getResponseBuffer(1) << 32) | ((int64_t)getResponseBuffer(2) << 16) | ((int64_t)getResponseBuffer(3))) * adj[1];
+/**
+Copy the statistics of one slave and function code.
 
-    delay(10);
+@return false if no transaction with this pair has been recorded
+*/
+bool ModbusMeter::getTxStats(uint8_t slave, uint8_t fn, txStats *stats)
+{
+  uint32_t u32Seq;
+  bool bFound;
+  uint8_t i;
 
-    result |= masterTransaction(slave, 3219, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].varh = (((int64_t)getResponseBuffer(0) << 48) | ((int64_t)getResponseBuffer(1) << 32) | ((int64_t)getResponseBuffer(2) << 16) | ((int64_t)getResponseBuffer(3))) * adj[3];
+  do
+  {
+    while ((u32Seq = _u32StatsSeq) & 1)
+      ;
+    __sync_synchronize();
+    bFound = false;
+    for (i = 0; i < _u8TxStats; i++)
+    {
+      if (_txStats[i].u8Slave == slave && _txStats[i].u8Function == fn)
+      {
+        *stats = _txStats[i];
+        bFound = true;
+        break;
+      }
+    }
+    __sync_synchronize();
+  } while (_u32StatsSeq != u32Seq);
 
-    delay(10);
+  return bFound;
+}
 
-    // THDV
-    result |= masterTransaction(slave, 21329, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].thdvr = wordToFloat(getResponseBuffer(0), getResponseBuffer(1));
-    pd[index].thdvs = wordToFloat(getResponseBuffer(2), getResponseBuffer(3));
-    pd[index].thdvt = wordToFloat(getResponseBuffer(4), getResponseBuffer(5));
+void ModbusMeter::resetTxStats()
+{
+  _u32StatsSeq++;
+  __sync_synchronize();
+  _u8TxStats = 0;
+  __sync_synchronize();
+  _u32StatsSeq++;
+}
 
-    delay(10);
+/**
+Lower bound of a latency histogram bucket [microseconds].
 
-    // THDI
-    result |= masterTransaction(slave, 21299, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].thdir = wordToFloat(getResponseBuffer(0), getResponseBuffer(1));
-    pd[index].thdis = wordToFloat(getResponseBuffer(2), getResponseBuffer(3));
-    pd[index].thdit = wordToFloat(getResponseBuffer(4), getResponseBuffer(5));
+Bucket 0 holds everything below 1024 us; every further bucket doubles, so
+bucket b starts at 2^(9+b) us and the last one collects all from about one
+second up.
+*/
+uint32_t ModbusMeter::statBucketUs(uint8_t u8Bucket)
+{
+  return u8Bucket ? (1UL << (9 + u8Bucket)) : 0;
+}
 
-    delay(10);
+uint8_t ModbusMeter::statBucket(uint32_t u32Us)
+{
+  uint8_t u8Bucket = 0;
 
-    // VUNB
-    result |= masterTransaction(slave, 3045, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].vunbr = wordToFloat(getResponseBuffer(0), getResponseBuffer(1));
-    pd[index].vunbs = wordToFloat(getResponseBuffer(2), getResponseBuffer(3));
-    pd[index].vunbt = wordToFloat(getResponseBuffer(4), getResponseBuffer(5));
+  u32Us >>= 10;
+  while (u32Us && u8Bucket < ku8StatBuckets - 1)
+  {
+    u32Us >>= 1;
+    u8Bucket++;
+  }
+  return u8Bucket;
+}
 
-    delay(10);
+/**
+Statistics row of a slave and function code, created on first use.
 
-    // CHR
-    for (uint8_t i = 0; i < 7; i++)
-    {
-      result |= masterTransaction(slave, 22887 + (i * 12), 2, ku8MBReadHoldingRegisters);
-      if (result)
-        return result;
-      pd[index].chr[i] = wordToFloat(getResponseBuffer(0), getResponseBuffer(1));
-      delay(15);
-    }
+@return row, or 0 when ku8MaxTxStats pairs are already tracked
+*/
+ModbusMeter::txStats *ModbusMeter::statsFor(uint8_t slave, uint8_t fn)
+{
+  txStats *stats;
+  uint8_t i;
 
-    // CHS
-    for (uint8_t i = 0; i < 7; i++)
+  for (i = 0; i < _u8TxStats; i++)
+  {
+    if (_txStats[i].u8Slave == slave && _txStats[i].u8Function == fn)
     {
-      result |= masterTransaction(slave, 23275 + (i * 12), 2, ku8MBReadHoldingRegisters);
-      if (result)
-        return result;
-      pd[index].chs[i] = wordToFloat(getResponseBuffer(0), getResponseBuffer(1));
-      delay(15);
+      return &_txStats[i];
     }
+  }
+  if (_u8TxStats == ku8MaxTxStats)
+  {
+    return 0;
+  }
 
-    // CHT
-    for (uint8_t i = 0; i < 7; i++)
-    {
-      result |= masterTransaction(slave, 23663 + (i * 12), 2, ku8MBReadHoldingRegisters);
-      if (result)
-        return result;
-      pd[index].cht[i] = wordToFloat(getResponseBuffer(0), getResponseBuffer(1));
-      delay(15);
-    }
+  stats = &_txStats[_u8TxStats];
+  memset(stats, 0, sizeof(*stats));
+  stats->u8Slave = slave;
+  stats->u8Function = fn;
+  _u8TxStats++;
+  return stats;
+}
 
-    result |= masterTransaction(slave, 3109, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].freq = wordToFloat(getResponseBuffer(0), getResponseBuffer(1));
+/**
+Account the transaction that just completed.
+*/
+void ModbusMeter::recordTx(uint8_t result)
+{
+  uint32_t u32Now = micros();
+  uint32_t u32Rtt = u32Now - _u32TxBeginUs;
+  txStats *stats;
 
-    pd[index].mdt = mdt;
+  _u32StatsSeq++;
+  __sync_synchronize();
 
-    break;
+  if ((stats = statsFor(_u8TxSlave, _u8TxFunction)) != 0)
+  {
+    stats->u32Transactions++;
+    stats->u32BytesSent += 8;
+    stats->u32BytesReceived += _u8ModbusADUSize;
+    stats->u64BusyUs += u32Rtt;
 
-  case dmg610: // PQ
-    result |= masterTransaction(slave, 0x0008 - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].i0 = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 10000.00 * adj[4];
-    pd[index].i1 = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 10000.00 * adj[5];
-    pd[index].i2 = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 10000.00 * adj[6];
+    if (_u8ModbusADUSize)
+    {
+      stats->u32TtfbHist[statBucket(_u32TxFirstByteUs - _u32TxDoneUs)]++;
+    }
 
-    delay(10);
+    switch (result)
+    {
+    case ku8MBResponseTimedOut:
+      stats->u32Timeouts++;
+      break;
 
-    result = masterTransaction(slave, 0x0002 - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].v0 = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00 * adj[7];
-    pd[index].v1 = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 100.00 * adj[8];
-    pd[index].v2 = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 100.00 * adj[9];
+    case ku8MBInvalidCRC:
+      stats->u32CrcErrors++;
+      break;
 
-    delay(10);
+    case ku8MBInvalidSlaveID:
+      stats->u32WrongSlave++;
+      break;
 
-    result |= masterTransaction(slave, 0x003a - 1, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].watt = ((int32_t)u16Tou32(getResponseBuffer(1), getResponseBuffer(0))) / 100.00 * adj[0];
+    case ku8MBInvalidFunction:
+      stats->u32WrongFunction++;
+      break;
 
-    delay(10);
+    case ku8MBSuccess:
+      break;
 
-    result |= masterTransaction(slave, 0x0040 - 1, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].pf = ((int32_t)u16Tou32(getResponseBuffer(1), getResponseBuffer(0))) / 10000.00 * adj[2];
+    default:
+      stats->u32Exceptions[(result <= ku8MBSlaveDeviceFailure) ? result : 0]++;
+      break;
+    }
 
-    delay(10);
+    if (result != ku8MBResponseTimedOut)
+    {
+      stats->u32RttHist[statBucket(u32Rtt)]++;
+      if (u32Rtt > stats->u32RttMaxUs)
+      {
+        stats->u32RttMaxUs = u32Rtt;
+      }
+    }
+  }
 
-    result |= masterTransaction(slave, 0x1b20 - 1, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].wattHour = (((uint64_t)getResponseBuffer(0) << 48) | ((uint64_t)getResponseBuffer(1) << 32) | ((uint64_t)getResponseBuffer(2) << 16) | ((uint64_t)getResponseBuffer(3))) / 100.00 * adj[1];
+  __sync_synchronize();
+  _u32StatsSeq++;
+}
 
-    delay(10);
+/**
+Find the built-in profile of a meter type.
 
-    result |= masterTransaction(slave, 0x1b28 - 1, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].varh = (((uint64_t)getResponseBuffer(0) << 48) | ((uint64_t)getResponseBuffer(1) << 32) | ((uint64_t)getResponseBuffer(2) << 16) | ((uint64_t)getResponseBuffer(3))) / 100.00 * adj[3];
+@return profile, or 0 if mType has none
+*/
+const ModbusMeter::meterProfile *ModbusMeter::findProfile(uint8_t mType)
+{
+  for (uint8_t i = 0; i < ku8Profiles; i++)
+  {
+    if (kProfiles[i].u8MeterType == mType)
+    {
+      return &kProfiles[i];
+    }
+  }
+  return 0;
+}
 
-    delay(10);
+/**
+True if mType stores its readings in pd[] rather than md[].
+*/
+bool ModbusMeter::isPQType(uint8_t mType)
+{
+  const meterProfile *profile = findProfile(mType);
 
-    // THDV
-    result |= masterTransaction(slave, 0x0054 - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].thdvr = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00;
-    pd[index].thdvs = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 100.00;
-    pd[index].thdvt = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 100.00;
+  return profile && (profile->u8Flags & ku8ProfilePQ);
+}
 
-    delay(10);
+/**
+Address of a float field of md[index] or pd[index].
 
-    // THDI
-    result |= masterTransaction(slave, 0x005a - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].thdir = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00;
-    pd[index].thdis = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 100.00;
-    pd[index].thdit = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 100.00;
+meterData and pqData are a time stamp followed by floats only, in the order
+of the ku8Field* constants.
+*/
+float *ModbusMeter::fieldPtr(uint8_t index, uint8_t u8ProfileFlags, uint8_t u8Field)
+{
+  static_assert(offsetof(meterData, v2) - offsetof(meterData, watt) == (ku8MeterFields - 1) * sizeof(float), "meterData must be packed floats");
+  static_assert(offsetof(pqData, freq) - offsetof(pqData, watt) == (ku8PQFields - 1) * sizeof(float), "pqData must be packed floats");
 
-    delay(10);
+  if (u8ProfileFlags & ku8ProfilePQ)
+  {
+    return &pd[index].watt + u8Field;
+  }
+  return &md[index].watt + u8Field;
+}
 
-    // VUNB
-    // result |= masterTransaction(slave, 3045, 6, ku8MBReadHoldingRegisters);
-    // if (result)
-    //   return result;
-    pd[index].vunbr = 0;
-    pd[index].vunbs = 0;
-    pd[index].vunbt = 0;
+/**
+Start reading one meter without blocking.
+
+Takes the same arguments as readMeterData(); adj[] and mt[] are copied, so
+they need not outlive the call. The read is advanced by pollMeterRead().
+Register spans are coalesced into block reads (see util/blockplan.h); each
+span is decoded straight from the frame it arrived in, however spans were
+merged. A merged block the slave rejects with an illegal data address
+exception is retried span by span. md[index]/pd[index] is only written once
+every read succeeded, unless setPartialReads() is on.
+
+@param callback called with (index, result, context) when the read completes; may be 0
+@return ku8MBPending if the read was started, ku8MBBusy if another read is
+        in progress, ku8MBSuccess if mType has nothing to read
+*/
+uint8_t ModbusMeter::beginMeterRead(uint8_t index, uint8_t slave, uint8_t slaveIndex, uint8_t mType, time_t mdt, float *adj, uint16_t *mt, uint8_t *dt, meterReadCallback callback, void *context)
+{
+  readJob &j = _job;
+  const meterProfile *profile;
+  uint16_t u16Offset;
+  uint8_t k;
 
-    delay(10);
+  if (j.u8State != ku8JobIdle)
+  {
+    return ku8MBBusy;
+  }
 
-    // CHR
-    for (uint8_t i = 0; i < 7; i++)
+  profile = findProfile(mType);
+  if (mType == manual)
+  {
+    // register k of mt[] holds field k, encoded as dt[k]
+    for (k = 0; k < ku8MeterFields; k++)
     {
-      // result |= masterTransaction(slave, 0x31c0 + (i * 2) - 1, 2, ku8MBReadHoldingRegisters);
-      // if (result)
-      //   return result;
-      pd[index].chr[i] = 0;
-      delay(15);
+      j.manualFields[k].u16Address = mt[k];
+      j.manualFields[k].u8Type = dt[k];
+      j.manualFields[k].u8Field = k;
+      j.manualFields[k].fDivisor = 1;
+      j.manualFields[k].u8Flags = 0;
     }
+    j.manualProfile.u8MeterType = manual;
+    j.manualProfile.u8Function = 0;
+    j.manualProfile.u8Flags = 0;
+    j.manualProfile.u16SlaveStride = 0;
+    j.manualProfile.u8HarmonicRegs = 0;
+    j.manualProfile.fields = j.manualFields;
+    j.manualProfile.u8Fields = ku8MeterFields;
+    profile = &j.manualProfile;
+  }
 
-    // CHS
-    for (uint8_t i = 0; i < 7; i++)
+  if (!profile)
+  {
+    if (callback)
     {
-      // result |= masterTransaction(slave, 0x3202 + (i * 2) - 1, 2, ku8MBReadHoldingRegisters);
-      // if (result)
-      //   return result;
-      pd[index].chs[i] = 0;
-      delay(15);
+      callback(index, ku8MBSuccess, context);
     }
+    return ku8MBSuccess;
+  }
 
-    // CHT
-    for (uint8_t i = 0; i < 7; i++)
+  if (index >= ((profile->u8Flags & ku8ProfilePQ) ? _u8PQMeters : _u8Meters))
+  {
+    if (callback)
     {
-      // result |= masterTransaction(slave, 0x3242 + (i * 2) - 1, 2, ku8MBReadHoldingRegisters);
-      // if (result)
-      //   return result;
-      pd[index].cht[i] = 0;
-      delay(15);
+      callback(index, ku8MBInvalidIndex, context);
     }
+    return ku8MBInvalidIndex;
+  }
 
-    // FREQ
-    result |= masterTransaction(slave, 0x0032 - 1, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].freq = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00;
-
-    pd[index].mdt = mdt;
+  j.bProbe = false;
+  if (getSlaveHealth(slave) == ku8SlaveOpen)
+  {
+    slaveState *state = slaveFor(slave);
 
-    break;
+    if ((int32_t)(millis() - state->u32ProbeAtMs) < 0)
+    {
+      if (callback)
+      {
+        callback(index, ku8MBSlaveOpen, context);
+      }
+      return ku8MBSlaveOpen;
+    }
+    j.bProbe = true;
+  }
 
-  case dmg800: // PQ
-    result |= masterTransaction(slave, 0x0008 - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].i0 = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 10000.00 * adj[4];
-    pd[index].i1 = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 10000.00 * adj[5];
-    pd[index].i2 = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 10000.00 * adj[6];
+  j.profile = profile;
+  j.index = index;
+  j.slave = slave;
+  j.mdt = mdt;
+  j.callback = callback;
+  j.context = context;
+  memcpy(j.adj, adj, sizeof(j.adj));
+  if (mt)
+  {
+    memcpy(j.mt, mt, sizeof(j.mt));
+  }
+  else
+  {
+    memset(j.mt, 0, sizeof(j.mt));
+  }
+  j.fn = profile->u8Function ? profile->u8Function : j.mt[10];
+  j.u64Mask = _u64ReadMask;
+  j.u64SpanOk = 0;
+  j.u8Error = ku8MBSuccess;
+
+  u16Offset = profile->u16SlaveStride * slaveIndex;
+  j.u8Spans = 0;
+  for (k = 0; k < profile->u8Fields; k++)
+  {
+    const meterField *f = &profile->fields[k];
+    uint8_t u8Qty = regdecode_qty(fieldType(f));
+    uint16_t u16Address = (profile->u8Flags & ku8ProfileMtAddress) ? j.mt[f->u8Field] : f->u16Address;
 
-    delay(10);
+    if (!u8Qty || !(j.u64Mask & (1ULL << f->u8Field)))
+      continue;
+    if (j.u8Spans == ku8MaxPlanFields)
+      return finishMeterRead(ku8MBIllegalDataValue);
 
-    result = masterTransaction(slave, 0x0002 - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].v0 = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00 * adj[7];
-    pd[index].v1 = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 100.00 * adj[8];
-    pd[index].v2 = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 100.00 * adj[9];
+    if (f->u8Flags & ku8FieldHarmonic)
+    {
+      u16Address += _u8HarmonicOrders[(f->u8Field - ku8FieldChr) % ku8Harmonics] * profile->u8HarmonicRegs;
+    }
 
-    delay(10);
+    j.u8SpanField[j.u8Spans] = k;
+    j.spans[j.u8Spans].u16Address = u16Address + u16Offset;
+    j.spans[j.u8Spans].u8Qty = u8Qty;
+    j.u8Spans++;
+  }
 
-    result |= masterTransaction(slave, 0x003a - 1, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].watt = ((int32_t)u16Tou32(getResponseBuffer(1), getResponseBuffer(0))) / 100.00 * adj[0];
+  j.u8Blocks = blockplan_build(j.spans, j.u8Spans, j.blocks, j.u8SpanBlock, ku8MBMaxReadQty, _u16FrameCost);
+  j.u8Block = 0;
+  j.u8Fallback = ku8NoSpan;
+  j.u8State = _link ? ku8JobTcp : ku8JobGap;
+  for (k = 0; k < j.u8Blocks; k++)
+  {
+    j.u8Work[k] = k;
+  }
+  j.u8Works = j.u8Blocks;
+  j.u8WorkSent = 0;
 
-    delay(10);
+  if (!j.u8Blocks)
+  {
+    decodeMeterRead();
+    return finishMeterRead(ku8MBSuccess);
+  }
 
-    result |= masterTransaction(slave, 0x0040 - 1, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].pf = ((int32_t)u16Tou32(getResponseBuffer(1), getResponseBuffer(0))) / 10000.00 * adj[2];
+  return pollMeterRead();
+}
 
-    delay(10);
+/**
+Advance the read started by beginMeterRead().
 
-    result |= masterTransaction(slave, 0x1b20 - 1, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].wattHour = (((uint64_t)getResponseBuffer(0) << 48) | ((uint64_t)getResponseBuffer(1) << 32) | ((uint64_t)getResponseBuffer(2) << 16) | ((uint64_t)getResponseBuffer(3))) / 100.00 * adj[1];
+Returns immediately; call it from the polling loop or task until it stops
+returning ku8MBPending.
 
-    delay(10);
+@return ku8MBPending while frames are in flight; afterwards the result of
+        the read (0 on success, exception or ku8MB* error)
+*/
+uint8_t ModbusMeter::pollMeterRead()
+{
+  readJob &j = _job;
+  uint8_t result;
+  uint8_t k;
 
-    result |= masterTransaction(slave, 0x1b28 - 1, 4, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].varh = (((uint64_t)getResponseBuffer(0) << 48) | ((uint64_t)getResponseBuffer(1) << 32) | ((uint64_t)getResponseBuffer(2) << 16) | ((uint64_t)getResponseBuffer(3))) / 100.00 * adj[3];
+  switch (j.u8State)
+  {
+  case ku8JobIdle:
+    return j.u8Result;
 
-    delay(10);
+  case ku8JobGap:
+    if (!busQuiet(j.slave))
+    {
+      return ku8MBPending;
+    }
+    return startMeterFrame();
 
-    // THDV
-    result |= masterTransaction(slave, 0x0054 - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].thdvr = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00;
-    pd[index].thdvs = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 100.00;
-    pd[index].thdvt = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 100.00;
+  case ku8JobTcp:
+    return pollTcpRead();
+  }
 
-    delay(10);
+  result = pollTransaction();
+  if (result == ku8MBPending)
+  {
+    return ku8MBPending;
+  }
 
-    // THDI
-    result |= masterTransaction(slave, 0x005a - 1, 6, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].thdir = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100.00;
-    pd[index].thdis = u16Tou32(getResponseBuffer(3), getResponseBuffer(2)) / 100.00;
-    pd[index].thdit = u16Tou32(getResponseBuffer(5), getResponseBuffer(4)) / 100.00;
+  if (j.bProbe)
+  {
+    // an open slave answered its probe, exception or not: read it in full
+    j.bProbe = false;
+    if (result >= ku8MBInvalidSlaveID)
+    {
+      return finishMeterRead(result);
+    }
+    j.u8State = ku8JobGap;
+    return ku8MBPending;
+  }
 
-    delay(10);
+  if (j.u8Fallback == ku8NoSpan)
+  {
+    if (result == ku8MBIllegalDataAddress && _u16FrameCost && spansInBlock(j.u8Block) > 1)
+    {
+      // slave refuses the gap registers; fall back to one request per span
+      j.u8Fallback = nextSpanInBlock(0);
+    }
+    else
+    {
+      if (result && !_bPartialReads)
+        return finishMeterRead(result);
+      if (result)
+        j.u8Error = result;
 
-    // VUNB
-    // result |= masterTransaction(slave, 3045, 6, ku8MBReadHoldingRegisters);
-    // if (result)
-    //   return result;
-    pd[index].vunbr = 0;
-    pd[index].vunbs = 0;
-    pd[index].vunbt = 0;
+      // pollTransaction() checked the register count; every span of the
+      // block lies inside the frame
+      for (k = 0; k < j.u8Spans && !result; k++)
+      {
+        if (j.u8SpanBlock[k] != j.u8Block)
+          continue;
 
-    delay(10);
+        stageSpan(k, getResponseSpan().pu8Data + 2 * (j.spans[k].u16Address - j.blocks[j.u8Block].u16Address));
+      }
+      j.u8Block++;
+    }
+  }
+  else
+  {
+    if (result && !_bPartialReads)
+      return finishMeterRead(result);
 
-    // CHR
-    for (uint8_t i = 0; i < 7; i++)
+    if (result)
     {
-      result |= masterTransaction(slave, 0x0c02 + (i * 2) - 1, 2, ku8MBReadHoldingRegisters);
-      if (result)
-        return result;
-      pd[index].chr[i] = 0;
-      delay(15);
+      j.u8Error = result;
     }
-
-    // CHS
-    for (uint8_t i = 0; i < 7; i++)
+    else
     {
-      result |= masterTransaction(slave, 0x0c42 + (i * 2) - 1, 2, ku8MBReadHoldingRegisters);
-      if (result)
-        return result;
-      pd[index].chs[i] = 0;
-      delay(15);
+      stageSpan(j.u8Fallback, getResponseSpan().pu8Data);
     }
-
-    // CHT
-    for (uint8_t i = 0; i < 7; i++)
+    j.u8Fallback = nextSpanInBlock(j.u8Fallback + 1);
+    if (j.u8Fallback == ku8NoSpan)
     {
-      result |= masterTransaction(slave, 0x0c82 + (i * 2) - 1, 2, ku8MBReadHoldingRegisters);
-      if (result)
-        return result;
-      pd[index].cht[i] = 0;
-      delay(15);
+      j.u8Block++;
     }
+  }
 
-    // FREQ
-    result |= masterTransaction(slave, 0x0032 - 1, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    pd[index].freq = u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00;
+  if (j.u8Block == j.u8Blocks || (j.u8Error && getSlaveHealth(j.slave) == ku8SlaveOpen))
+  {
+    if (!j.u64SpanOk && j.u8Error)
+      return finishMeterRead(j.u8Error);
+    decodeMeterRead();
+    return finishMeterRead(j.u8Error ? ku8MBPartialRead : ku8MBSuccess);
+  }
 
-    pd[index].mdt = mdt;
+  j.u8State = ku8JobGap;
+  return ku8MBPending;
+}
 
-    break;
-    /////////
-    /////////
+/**
+Meter read over the TCP link: every block is requested at once, as far as
+the link's window allows, and the answers are taken in whatever order they
+arrive. A block refused with an illegal data address exception is replaced
+by one request per span, as on RTU.
+*/
+uint8_t ModbusMeter::pollTcpRead()
+{
+  readJob &j = _job;
+  uint8_t result;
+  uint8_t u8Words;
+  uint8_t i, k;
 
-    /////////////////////////////////////////////////////////////////////////////////////////////////////////////
-  case manual: // Manual
+  static_assert(ku8MaxPlanFields <= ku8WorkIndex + 1, "u8Work index field too narrow");
 
-    uint8_t num = 0;
-    float value = 0;
+  _link->poll();
 
-    for (uint8_t k = 0; k < 10; k++)
+  for (i = 0; i < j.u8WorkSent; i++)
+  {
+    uint8_t u8Item = j.u8Work[i];
+
+    if (u8Item & ku8WorkDone)
+      continue;
+    result = _link->take(j.u16WorkTid[i], _u8ModbusADU + 3, &u8Words);
+    if (result == ku8MBPending)
+      continue;
+    j.u8Work[i] |= ku8WorkDone;
+    if (!result && u8Words != ((u8Item & ku8WorkSpan) ? j.spans[u8Item & ku8WorkIndex] : j.blocks[u8Item]).u8Qty)
+      result = ku8MBInvalidLength;
+
+    if (!(u8Item & ku8WorkSpan) && result == ku8MBIllegalDataAddress && _u16FrameCost && spansInBlock(u8Item) > 1)
     {
-
-      switch (dt[k])
+      // slave refuses the gap registers; request the block's spans on their own
+      for (k = 0; k < j.u8Spans; k++)
       {
-      case 1:
-        result |= masterTransaction(slave, mt[k], 2, mt[10]);
-        if (result)
-          return result;
-        value = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)));
-        break;
+        if (j.u8SpanBlock[k] == u8Item)
+          j.u8Work[j.u8Works++] = ku8WorkSpan | k;
       }
-
-      switch (k)
+      continue;
+    }
+    if (result)
+    {
+      if (!_bPartialReads)
       {
-      case 0:
-        md[index].watt = value * adj[0];
-        break;
-      case 1:
-        md[index].watt = value * adj[1];
-        break;
+        cancelTcpRead();
+        return finishMeterRead(result);
       }
+      j.u8Error = result;
+      continue;
     }
 
-    result |= masterTransaction(slave, 0x102e, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].watt = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[0];
+    if (u8Item & ku8WorkSpan)
+    {
+      stageSpan(u8Item & ku8WorkIndex, _u8ModbusADU + 3);
+      continue;
+    }
+    for (k = 0; k < j.u8Spans; k++)
+    {
+      if (j.u8SpanBlock[k] == u8Item)
+        stageSpan(k, _u8ModbusADU + 3 + 2 * (j.spans[k].u16Address - j.blocks[u8Item].u16Address));
+    }
+  }
 
-    delay(5);
+  while (j.u8WorkSent < j.u8Works)
+  {
+    uint8_t u8Item = j.u8Work[j.u8WorkSent];
+    const mbRegSpan *span = (u8Item & ku8WorkSpan) ? &j.spans[u8Item & ku8WorkIndex] : &j.blocks[u8Item];
 
-    result |= masterTransaction(slave, 0x103e, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].wattHour = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100000.00) * adj[1];
+    result = _link->request(j.slave, j.fn, span->u16Address, span->u8Qty, &j.u16WorkTid[j.u8WorkSent]);
+    if (result == ku8MBBusy)
+      break;
+    if (result != ku8MBPending)
+    {
+      cancelTcpRead();
+      return finishMeterRead(result);
+    }
+    j.u8WorkSent++;
+  }
 
-    delay(5);
+  for (i = 0; i < j.u8Works; i++)
+  {
+    if (!(j.u8Work[i] & ku8WorkDone))
+      return ku8MBPending;
+  }
 
-    result |= masterTransaction(slave, 0x1016, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].pf = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[2];
+  if (!j.u64SpanOk && j.u8Error)
+    return finishMeterRead(j.u8Error);
+  decodeMeterRead();
+  return finishMeterRead(j.u8Error ? ku8MBPartialRead : ku8MBSuccess);
+}
 
-    delay(5);
+/**
+Drop the requests of an abandoned TCP read so they free the link's window.
+*/
+void ModbusMeter::cancelTcpRead()
+{
+  for (uint8_t i = 0; i < _job.u8WorkSent; i++)
+  {
+    if (!(_job.u8Work[i] & ku8WorkDone))
+      _link->cancel(_job.u16WorkTid[i]);
+  }
+}
 
-    result |= masterTransaction(slave, 0x1040, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].varh = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 100000.00) * adj[3];
+/**
+True while a read started by beginMeterRead() has not completed.
+*/
+bool ModbusMeter::meterReadBusy()
+{
+  return _job.u8State != ku8JobIdle;
+}
 
-    delay(5);
+/**
+First span at or after u8From that belongs to the current block.
+*/
+uint8_t ModbusMeter::nextSpanInBlock(uint8_t u8From)
+{
+  for (uint8_t k = u8From; k < _job.u8Spans; k++)
+  {
+    if (_job.u8SpanBlock[k] == _job.u8Block)
+    {
+      return k;
+    }
+  }
+  return ku8NoSpan;
+}
 
-    result |= masterTransaction(slave, 0x1010, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i0 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[4];
+/**
+Number of spans read by a block; a block of one span has no gap registers
+to refuse, so a refusal is not worth retrying span by span.
+*/
+uint8_t ModbusMeter::spansInBlock(uint8_t u8Block)
+{
+  uint8_t u8Count = 0;
 
-    delay(5);
+  for (uint8_t k = 0; k < _job.u8Spans; k++)
+  {
+    if (_job.u8SpanBlock[k] == u8Block)
+    {
+      u8Count++;
+    }
+  }
+  return u8Count;
+}
 
-    result |= masterTransaction(slave, 0x1012, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i1 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[5];
+/**
+Transmit the request for the current block, or for the current span when
+the block is being read span by span.
+*/
+uint8_t ModbusMeter::startMeterFrame()
+{
+  readJob &j = _job;
+  const mbRegSpan *span = (j.u8Fallback == ku8NoSpan) ? &j.blocks[j.u8Block] : &j.spans[j.u8Fallback];
+  uint8_t result = beginTransaction(j.slave, span->u16Address, j.bProbe ? 1 : span->u8Qty, j.fn);
 
-    delay(5);
+  if (result != ku8MBPending)
+  {
+    return finishMeterRead(result);
+  }
+  j.u8State = ku8JobFrame;
+  return ku8MBPending;
+}
 
-    result |= masterTransaction(slave, 0x1014, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].i2 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1000.00) * adj[6];
+/**
+Decode one span straight from the response payload and keep the value
+until the read completes.
+*/
+void ModbusMeter::stageSpan(uint8_t u8Span, const uint8_t *pu8Data)
+{
+  const meterField *f = &_job.profile->fields[_job.u8SpanField[u8Span]];
 
-    delay(5);
+  _job.fStaged[u8Span] = fieldValue(f, regdecode_value_be(fieldType(f), pu8Data));
+  _job.u64SpanOk |= 1ULL << u8Span;
+}
 
-    result = masterTransaction(slave, 0x1002, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v0 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1.00) * adj[7];
+/**
+Scale a raw field value by its divisor and adj[], and fold the power
+factor if the field asks for it.
+*/
+float ModbusMeter::fieldValue(const meterField *f, double raw)
+{
+  double value = raw / f->fDivisor;
+  float fValue;
 
-    delay(5);
+  if (f->u8Field < ku8MeterFields)
+  {
+    value *= _job.adj[f->u8Field];
+  }
+  fValue = value;
 
-    result = masterTransaction(slave, 0x1004, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v1 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1.00) * adj[8];
+  if (f->u8Flags & ku8FieldPfFold)
+  {
+    if (isnan(fValue))
+      fValue = 0;
+    if (fValue < -1.00)
+      fValue = (-2.0) - fValue;
+    if (fValue > 1.00)
+      fValue = (2.0) - fValue;
+  }
+  return fValue;
+}
 
-    delay(5);
+/**
+Write the staged values into md[index]/pd[index].
 
-    result = masterTransaction(slave, 0x1006, 2, ku8MBReadHoldingRegisters);
-    if (result)
-      return result;
-    md[index].v2 = (u16Tou32(getResponseBuffer(1), getResponseBuffer(0)) / 1.00) * adj[9];
+Only fields in the read mask whose span arrived are written; their
+u64Valid bits are set, those of missing fields cleared, the rest kept.
+*/
+void ModbusMeter::decodeMeterRead()
+{
+  readJob &j = _job;
+  const meterProfile *profile = j.profile;
+  uint64_t u64Valid = 0;
+  uint8_t u8Span = 0;
 
-    md[index].mdt = mdt;
+  static_assert(ku8MaxPlanFields <= 64, "u64SpanOk holds one bit per span");
 
-    break;
-    ////////////////////////////////////////////////////////////////////////////////////////////////////////
-  }
+  for (uint8_t k = 0; k < profile->u8Fields; k++)
+  {
+    const meterField *f = &profile->fields[k];
+    float fValue;
 
-  return result;
-}
+    if (!(j.u64Mask & (1ULL << f->u8Field)))
+      continue;
 
-float ModbusMeter::wordToFloat(uint16_t h, uint16_t l)
-{
-  typedef union {
-    float number;
-    uint16_t wd[2];
-  } FLOATUNION_t;
+    if (regdecode_qty(fieldType(f)))
+    {
+      if (!(j.u64SpanOk & (1ULL << u8Span)))
+      {
+        u8Span++;
+        continue;
+      }
+      fValue = j.fStaged[u8Span++];
+    }
+    else
+    {
+      fValue = fieldValue(f, 0);
+    }
 
-  FLOATUNION_t myFloat;
+    *fieldPtr(j.index, profile->u8Flags, f->u8Field) = fValue;
+    u64Valid |= 1ULL << f->u8Field;
+  }
 
-  myFloat.wd[0] = l;
-  myFloat.wd[1] = h;
+  if (profile->u8Flags & ku8ProfilePQ)
+  {
+    trackChanges(j.index, true, pd[j.index].u64Valid, u64Valid);
+    pd[j.index].mdt = j.mdt;
+    pd[j.index].u64Valid = (pd[j.index].u64Valid & ~j.u64Mask) | u64Valid;
+  }
+  else
+  {
+    trackChanges(j.index, false, md[j.index].u64Valid, u64Valid);
+    md[j.index].mdt = j.mdt;
+    md[j.index].u64Valid = (md[j.index].u64Valid & ~j.u64Mask) | u64Valid;
+  }
+}
 
-  return myFloat.number;
+/**
+Data type a field is read with; 0 for harmonic slots beyond the selected
+orders.
+*/
+uint8_t ModbusMeter::fieldType(const meterField *f)
+{
+  if ((f->u8Flags & ku8FieldHarmonic) && (f->u8Field - ku8FieldChr) % ku8Harmonics >= _u8HarmonicCount)
+  {
+    return 0;
+  }
+  return f->u8Type;
 }
 
-uint32_t ModbusMeter::u16Tou32(uint16_t h, uint16_t l)
+/**
+Complete the current read and report its result.
+*/
+uint8_t ModbusMeter::finishMeterRead(uint8_t result)
 {
-  typedef union {
-    uint32_t number;
-    uint16_t wd[2];
-  } FLOATUNION_t;
+  _job.u8State = ku8JobIdle;
+  _job.u8Result = result;
+  if (_job.callback)
+  {
+    _job.callback(_job.index, result, _job.context);
+  }
+  return result;
+}
 
-  FLOATUNION_t myU32;
+/**
+Read one meter and wait for the result.
 
-  myU32.wd[0] = h;
-  myU32.wd[1] = l;
+Blocking form of beginMeterRead()/pollMeterRead(); the calling task sleeps
+between polls.
+*/
+uint8_t ModbusMeter::readMeterData(uint8_t index, uint8_t slave, uint8_t slaveIndex, uint8_t mType, time_t mdt, float *adj, uint16_t *mt, uint8_t *dt)
+{
+  uint8_t result = beginMeterRead(index, slave, slaveIndex, mType, mdt, adj, mt, dt);
 
-  return myU32.number;
-}
\ No newline at end of file
+  while (result == ku8MBPending)
+  {
+    delay(1);
+    result = pollMeterRead();
+  }
+  return result;
+}
@@ -14,16 +14,29 @@
 // functions to manipulate words
 #include "util/word.h"
 
+// functions to coalesce register reads into blocks
+#include "util/blockplan.h"
+
+// functions to decode register data types
+#include "util/regdecode.h"
+
+// allocator for the meter tables
+#include "util/arena.h"
+
 #include <driver/uart.h>
 
+class ModbusTcpLink;
+
 class ModbusMeter
 {
 public:
   ModbusMeter();
+  ~ModbusMeter();
 
   typedef struct __meterData
   {
     time_t mdt;
+    uint64_t u64Valid; ///< bit u8Field set for every field holding a decoded value; see setPartialReads()
     float watt;
     float wattHour;
     float pf;
@@ -36,11 +49,12 @@ public:
     float v2;
   } meterData;
 
-  meterData md[10];
+  meterData *md; ///< energy meter readings by index; see begin() for the capacity
 
   typedef struct __pqData
   {
     time_t mdt;
+    uint64_t u64Valid; ///< bit u8Field set for every field holding a decoded value; see setPartialReads()
     float watt;
     float wattHour;
     float pf;
@@ -70,17 +84,170 @@ public:
 
   } pqData;
 
-  pqData pd[5];
+  pqData *pd; ///< PQ meter readings by index; see begin() for the capacity
+
+  /**
+  One value of a meter profile: where it lives on the slave, how it is
+  encoded and which float of meterData/pqData receives it.
+  */
+  typedef struct __meterField
+  {
+    uint16_t u16Address; ///< register address (ignored for profiles flagged ku8ProfileMtAddress)
+    uint8_t u8Type;      ///< data type code, see the dt[] table below; 0 writes 0 without reading
+    uint8_t u8Field;     ///< target, one of ku8Field*
+    float fDivisor;      ///< raw value is divided by this before adj[] is applied
+    uint8_t u8Flags;     ///< ku8FieldPfFold, ku8FieldHarmonic
+  } meterField;
+
+  /**
+  Register map of one meter type, read by beginMeterRead()/pollMeterRead().
+  */
+  typedef struct __meterProfile
+  {
+    uint8_t u8MeterType;     ///< mType this profile implements
+    uint8_t u8Function;      ///< read function code; 0 takes it from mt[10]
+    uint8_t u8Flags;         ///< ku8ProfilePQ, ku8ProfileMtAddress
+    uint16_t u16SlaveStride; ///< address offset per slaveIndex (multi-channel meters)
+    uint8_t u8HarmonicRegs;  ///< registers per order in the tables of ku8FieldHarmonic fields
+    const meterField *fields;
+    uint8_t u8Fields;
+  } meterProfile;
+
+  // meterField::u8Field; 0..9 match the adj[] and mt[] index
+  static const uint8_t ku8FieldWatt = 0;
+  static const uint8_t ku8FieldWattHour = 1;
+  static const uint8_t ku8FieldPf = 2;
+  static const uint8_t ku8FieldVarh = 3;
+  static const uint8_t ku8FieldI0 = 4;
+  static const uint8_t ku8FieldI1 = 5;
+  static const uint8_t ku8FieldI2 = 6;
+  static const uint8_t ku8FieldV0 = 7;
+  static const uint8_t ku8FieldV1 = 8;
+  static const uint8_t ku8FieldV2 = 9;
+  static const uint8_t ku8FieldThdvr = 10;
+  static const uint8_t ku8FieldThdvs = 11;
+  static const uint8_t ku8FieldThdvt = 12;
+  static const uint8_t ku8FieldThdir = 13;
+  static const uint8_t ku8FieldThdis = 14;
+  static const uint8_t ku8FieldThdit = 15;
+  static const uint8_t ku8FieldVunbr = 16;
+  static const uint8_t ku8FieldVunbs = 17;
+  static const uint8_t ku8FieldVunbt = 18;
+  static const uint8_t ku8FieldChr = 19; ///< chr[0]; chr[i] is ku8FieldChr + i
+  static const uint8_t ku8FieldChs = 26; ///< chs[0]
+  static const uint8_t ku8FieldCht = 33; ///< cht[0]
+  static const uint8_t ku8FieldFreq = 40;
+  static const uint8_t ku8MeterFields = 10; ///< number of float fields in meterData
+  static const uint8_t ku8PQFields = 41;    ///< number of float fields in pqData
+  static const uint8_t ku8Harmonics = 7;    ///< harmonic slots per phase, chr[]/chs[]/cht[]
+  static const uint8_t ku8MaxHarmonicOrder = 63; ///< highest order every profile's harmonic tables hold
+
+  // meterField::u8Flags
+  static const uint8_t ku8FieldPfFold = 0x01;   ///< fold power factor reported as 2 - |pf| back into -1..1
+  static const uint8_t ku8FieldHarmonic = 0x02; ///< u16Address is order 0 of a harmonic table; the slot reads the order set by setHarmonicOrders()
+
+  // meterProfile::u8Flags
+  static const uint8_t ku8ProfilePQ = 0x01;        ///< fields go to pd[] instead of md[]
+  static const uint8_t ku8ProfileMtAddress = 0x02; ///< field addresses come from mt[u8Field]
+
+  static const meterProfile *findProfile(uint8_t mType);
 
   void begin(Stream &serial);
   void begin(Stream &serial, Stream &debug);
+  bool begin(Stream &serial, uint8_t u8Meters, uint8_t u8PQMeters, mbArena *arena = 0);
+  bool begin(ModbusTcpLink &link, uint8_t u8Meters = ku8DefaultMeters, uint8_t u8PQMeters = ku8DefaultPQMeters, mbArena *arena = 0);
+  uint8_t meterCapacity();
+  uint8_t pqMeterCapacity();
   void preTransmission(void (*)());
   void postTransmission(void (*)());
+  void setFrameCost(uint16_t);
+  void setBaudRate(uint32_t u32Baud, uint8_t u8Format = ku8Serial8N1);
+  void setSerialSwitch(bool (*apply)(uint32_t u32Baud, uint8_t u8Format));
+  bool setSlaveSerial(uint8_t slave, uint32_t u32Baud, uint8_t u8Format = ku8Serial8N1);
+  bool getSlaveSerial(uint8_t slave, uint32_t *pu32Baud, uint8_t *pu8Format);
+  uint8_t detectSlaveSerial(uint8_t slave, uint8_t fn, uint16_t u16Address, uint32_t *pu32Baud = 0, uint8_t *pu8Format = 0);
+  uint32_t getSerialSwitches();
+  void setSlaveMinGap(uint8_t slave, uint16_t u16GapUs);
+  uint16_t getSlaveMinGap(uint8_t slave);
+  void setGapAutoTune(bool bEnable, void (*tuned)(uint8_t slave, uint16_t u16GapUs) = 0);
+  bool setHarmonicOrders(const uint8_t *orders, uint8_t u8Count);
+  void setPartialReads(bool bEnable);
+  void setReadMask(uint64_t u64Fields);
+  bool setChangeTracking(mbArena *arena = 0);
+  bool setDeadband(uint8_t u8Field, float fBand, bool bPercent = false);
+  uint32_t getGeneration();
+  void setGeneration(uint32_t u32Generation);
+  uint64_t getChangeMask(uint8_t index, bool bPQ, uint32_t u32Since);
+  uint8_t getChanges(uint8_t index, bool bPQ, uint32_t u32Since, uint8_t *pu8Fields, float *pfValues, uint8_t u8Max);
+  void setResponseTimeout(uint16_t u16FloorMs, uint16_t u16CeilingMs);
+  void setBreaker(uint8_t u8TripFailures, uint16_t u16BackoffMs, uint32_t u32MaxBackoffMs);
+  uint8_t getSlaveHealth(uint8_t slave);
+  uint32_t getSlaveLastSeen(uint8_t slave);
+  uint32_t getResponseTimeout(uint8_t slave, uint16_t u16ReadQty);
+  void drainDebugLog();
 
   /*_____READ HOLDING REGISTER_____*/
   uint8_t readMeterData(uint8_t, uint8_t, uint8_t, uint8_t, time_t, float *, uint16_t *, uint8_t *);
 
+  /*_____ASYNCHRONOUS READ_____*/
+  // called when a read started by beginMeterRead() completes
+  typedef void (*meterReadCallback)(uint8_t index, uint8_t result, void *context);
+
+  uint8_t beginMeterRead(uint8_t, uint8_t, uint8_t, uint8_t, time_t, float *, uint16_t *, uint8_t *, meterReadCallback callback = 0, void *context = 0);
+  uint8_t pollMeterRead();
+  bool meterReadBusy();
+  static bool isPQType(uint8_t mType);
+
+  uint8_t beginTransaction(uint8_t slave, uint16_t startAddress, uint16_t readQty, uint8_t fnRead);
+  uint8_t pollTransaction();
+  bool busQuiet(uint8_t slave);
+  void setScanMode(uint16_t u16TimeoutMs);
+
+  /*_____TRANSACTION STATISTICS_____*/
+  static const uint8_t ku8StatBuckets = 12; ///< latency histogram buckets; see statBucketUs()
+
+  /**
+  Counters of one (slave, function code) pair, updated at the end of every
+  transaction; see getTxStats().
+  */
+  typedef struct __txStats
+  {
+    uint8_t u8Slave;
+    uint8_t u8Function;
+    uint32_t u32Transactions;
+    uint32_t u32Timeouts;                 ///< ku8MBResponseTimedOut
+    uint32_t u32CrcErrors;                ///< ku8MBInvalidCRC
+    uint32_t u32WrongSlave;               ///< ku8MBInvalidSlaveID
+    uint32_t u32WrongFunction;            ///< ku8MBInvalidFunction
+    uint32_t u32Exceptions[5];            ///< exception codes 1..4 at their index; [0] counts any other code
+    uint32_t u32BytesSent;
+    uint32_t u32BytesReceived;
+    uint64_t u64BusyUs;                   ///< total round-trip time, timeouts included
+    uint32_t u32RttMaxUs;                 ///< longest answered round trip
+    uint32_t u32RttHist[ku8StatBuckets];  ///< answered round trips, start of request to end of response
+    uint32_t u32TtfbHist[ku8StatBuckets]; ///< end of request to first response byte
+  } txStats;
+
+  uint8_t getTxStats(txStats *stats, uint8_t u8Max);
+  bool getTxStats(uint8_t slave, uint8_t fn, txStats *stats);
+  void resetTxStats();
+  static uint32_t statBucketUs(uint8_t u8Bucket);
+
   /*_____READ DATA FROM BUFFER_____*/
+  /**
+  Read-only view of the payload of the last response, straight from the
+  received frame. For register reads, register i is the big-endian byte
+  pair pu8Data[2i], pu8Data[2i + 1]; see regdecode_value_be(). u8Words was
+  checked against the request once, when the frame completed. Valid until
+  the next transaction starts.
+  */
+  typedef struct __responseSpan
+  {
+    const uint8_t *pu8Data;
+    uint8_t u8Words;
+  } responseSpan;
+
+  responseSpan getResponseSpan();
   uint16_t getResponseBuffer(uint8_t);
 
   static const uint8_t ku8MBIllegalFunction = 0x01;
@@ -92,12 +259,46 @@ public:
   static const uint8_t ku8MBInvalidFunction = 0xE1;
   static const uint8_t ku8MBResponseTimedOut = 0xE2;
   static const uint8_t ku8MBInvalidCRC = 0xE3;
+  static const uint8_t ku8MBBusy = 0xE4;    ///< a transaction or meter read is already in flight
+  static const uint8_t ku8MBPending = 0xE5; ///< not complete yet; poll again
+  static const uint8_t ku8MBInvalidIndex = 0xE6; ///< index is beyond the md[]/pd[] capacity given to begin()
+  static const uint8_t ku8MBSlaveOpen = 0xE7;    ///< slave is considered dead and was not addressed; see getSlaveHealth()
+  static const uint8_t ku8MBPartialRead = 0xE8;  ///< some blocks failed; the fields that arrived are flagged in u64Valid
+  static const uint8_t ku8MBNoConnection = 0xE9; ///< Modbus TCP connection could not be opened or was lost
+  static const uint8_t ku8MBInvalidLength = 0xEA; ///< response does not carry the registers requested
+  static const uint8_t ku8MBSerialConfig = 0xEB;  ///< the UART could not be switched to the slave's serial profile; see setSlaveSerial()
+
+  static const uint64_t ku64AllFields = ~0ULL; ///< setReadMask() default
+
+  // getSlaveHealth()
+  static const uint8_t ku8SlaveHealthy = 0; ///< last transaction was answered
+  static const uint8_t ku8SlaveSuspect = 1; ///< recent timeouts, still polled normally
+  static const uint8_t ku8SlaveOpen = 2;    ///< skipped except for backed-off probes
+
+  // character formats; see setSlaveSerial()
+  static const uint8_t ku8Serial8N1 = 0;
+  static const uint8_t ku8Serial8E1 = 1;
+  static const uint8_t ku8Serial8O1 = 2;
+  static const uint8_t ku8Serial8N2 = 3;
+
+  static const uint8_t ku8DefaultMeters = 10;  ///< md[] capacity of begin(Stream &)
+  static const uint8_t ku8DefaultPQMeters = 5; ///< pd[] capacity of begin(Stream &)
 
 private:
   Stream *_serial;
   Stream *_debug;
-  static const uint8_t ku8MaxBufferSize = 128;   ///< size of response/transmit buffers
-  uint16_t _u16ResponseBuffer[ku8MaxBufferSize]; ///< buffer to store Modbus slave response; read via GetResponseBuffer()
+  ModbusTcpLink *_link; ///< transactions go over Modbus TCP instead of _serial
+  uint8_t _u8Meters;   ///< md[] capacity
+  uint8_t _u8PQMeters; ///< pd[] capacity
+  bool _bOwnTables;    ///< md/pd came from the heap and are freed here
+  bool allocTables(uint8_t u8Meters, uint8_t u8PQMeters, mbArena *arena);
+  void freeTables();
+  static const uint8_t ku8DebugLogSize = 64; ///< deferred debug log; power of two
+  uint8_t _u8DebugLog[ku8DebugLogSize];
+  uint8_t _u8DebugHead; ///< free-running write index
+  uint8_t _u8DebugTail; ///< free-running read index
+  void queueDebugLog(const uint8_t *buf, uint8_t u8Len);
+  uint8_t _u8ResponseWords; ///< registers in the payload of the last good response; see getResponseSpan()
   //uint8_t _u8ResponseBufferLength;
 
   // preTransmission callback function; gets called before writing a Modbus message
@@ -105,9 +306,79 @@ private:
   // postTransmission callback function; gets called after a Modbus message has been sent
   void (*_postTransmission)();
 
+  uint16_t _u16FrameCost; ///< cost of one extra request frame [bytes]; see util/blockplan.h
+  uint8_t _u8HarmonicOrders[ku8Harmonics]; ///< order read into slot i of chr[]/chs[]/cht[]
+  uint8_t _u8HarmonicCount;                ///< slots in use; the rest read as 0
+  bool _bPartialReads;                     ///< keep going past failed blocks; see setPartialReads()
+  uint64_t _u64ReadMask;                   ///< fields read by a meter read; see setReadMask()
+
+  // change tracking; see setChangeTracking()
+  typedef struct __fieldTrack
+  {
+    float fRef;       ///< value last reported as changed
+    uint32_t u32Gen;  ///< generation of that change; 0 = never
+  } fieldTrack;
+
+  fieldTrack *_mdTrack; ///< ku8MeterFields per md[] slot
+  fieldTrack *_pdTrack; ///< ku8PQFields per pd[] slot
+  bool _bOwnTrack;
+  uint32_t _u32Generation;            ///< meter reads decoded since change tracking was enabled
+  float _fDeadband[ku8PQFields];      ///< per field; see setDeadband()
+  uint64_t _u64DeadbandPct;           ///< fields whose deadband is a percentage
+  fieldTrack *trackFor(uint8_t index, bool bPQ);
+  void trackChanges(uint8_t index, bool bPQ, uint64_t u64Before, uint64_t u64Got);
+
+  // transaction in flight; see beginTransaction()/pollTransaction()
+  uint8_t _u8ModbusADU[256];
+  uint8_t _u8ModbusADUSize;
+  uint8_t _u8BytesLeft;
+  uint16_t _u16RxCRC;
+  uint32_t _u32TxTimeoutUs; ///< response timeout of this request, from _u32TxDoneUs
+  uint32_t _u32RxLastUs;    ///< micros() when the last response byte was seen
+  uint8_t _u8TxSlave;
+  uint8_t _u8TxFunction;
+  uint16_t _u16TxQty;
+  uint8_t _u8TxState;
+  uint8_t _u8TxResult;
+  uint32_t _u32TxDoneUs; ///< micros() when the request left the UART
+  uint32_t _u32TxBeginUs;     ///< micros() when the request started
+  uint32_t _u32TxFirstByteUs; ///< micros() when the first response byte was seen
+  uint16_t _u16TxTid;         ///< transaction ID of a request on _link
+
+  // inter-frame timing; see setBaudRate()/setSlaveMinGap()
+  uint32_t _u32CharUs;   ///< one 11-bit character at the configured baud rate
+  uint16_t _u16T35Us;    ///< Modbus RTU silent interval t3.5
+  uint32_t _u32BusIdleUs; ///< micros() when the bus last went quiet
+  uint32_t _u32Baud;      ///< serial configuration of slaves without a profile; see setBaudRate()
+  uint8_t _u8Format;
+  uint32_t _u32LineBaud;  ///< serial configuration the UART is in
+  uint8_t _u8LineFormat;
+  uint32_t _u32SerialSwitches;
+  bool (*_serialSwitch)(uint32_t u32Baud, uint8_t u8Format);
+  uint32_t _u32TimeoutFloorUs;
+  uint32_t _u32TimeoutCeilingUs;
+  uint32_t _u32ScanTimeoutUs;    ///< fixed response timeout while scanning; 0 = adaptive; see setScanMode()
+  uint8_t _u8BreakerTrip;        ///< consecutive timeouts that open the breaker
+  uint16_t _u16BreakerBackoffMs; ///< first probe interval of an open slave
+  uint32_t _u32BreakerMaxBackoffMs;
+  bool _bGapTune;
+  void (*_gapTuned)(uint8_t slave, uint16_t u16GapUs);
+
   uint8_t masterTransaction(uint8_t slave, uint16_t startAddress, uint16_t readQty, uint8_t fnRead);
-  float wordToFloat(uint16_t h, uint16_t l);
-  uint32_t u16Tou32(uint16_t h, uint16_t l);
+  uint8_t nextSpanInBlock(uint8_t u8From);
+  uint8_t spansInBlock(uint8_t u8Block);
+  uint8_t startMeterFrame();
+  void stageSpan(uint8_t u8Span, const uint8_t *pu8Data);
+  float fieldValue(const meterField *f, double raw);
+  void decodeMeterRead();
+  uint8_t finishMeterRead(uint8_t result);
+  uint8_t pollTcpRead();
+  void cancelTcpRead();
+  float *fieldPtr(uint8_t index, uint8_t u8ProfileFlags, uint8_t u8Field);
+  uint8_t fieldType(const meterField *f);
+
+  static const meterProfile kProfiles[]; ///< built-in meter types; see ModbusMeter_Profiles.cpp
+  static const uint8_t ku8Profiles;
 
   // Modbus function codes for bit access
   static const uint8_t ku8MBReadCoils = 0x01;          ///< Modbus function 0x01 Read Coils
@@ -186,8 +457,127 @@ private:
       28: 64 Bit Double Little-endian Byte Swap  
     */
 
+  static const uint8_t ku8MBMaxReadQty = 125;       ///< largest register count of a single 0x03/0x04 read
+  static const uint8_t ku8MaxPlanFields = 48;       ///< most registers spans one meter read can plan
+  static const uint16_t ku16MBDefaultFrameCost = 32; ///< request + response header + silent intervals + turnaround at 9600 baud [bytes]
+
   // Modbus timeout [milliseconds]
-  static const uint16_t ku16MBResponseTimeout = 500; ///< Modbus timeout [milliseconds]
+  static const uint16_t ku16MBResponseTimeout = 500;  ///< timeout of a slave without RTT samples [milliseconds]
+  static const uint16_t ku16MBTimeoutFloor = 20;      ///< default lower bound of the adaptive timeout [milliseconds]
+  static const uint16_t ku16MBTimeoutCeiling = 2000;  ///< default upper bound of the adaptive timeout [milliseconds]
+  static const uint8_t ku8InterByteChars = 8;         ///< slack on the remaining wire time of a started response [character times]
+  static const uint32_t ku32MBDefaultBaud = 9600;
+  static const uint16_t ku16DetectTimeoutMs = 200;  ///< response timeout of each detectSlaveSerial() attempt [milliseconds]
+  static const uint8_t ku8MaxSlaves = 32;            ///< slaves with per-device state
+  static const uint8_t ku8NoSlot = 0xFF;
+  static const uint8_t ku8GapTuneRun = 32;           ///< good transactions before auto-tune tries a shorter gap
+  static const uint8_t ku8GapFloorRuns = 8;          ///< runs held up by the floor before the floor is lowered by 1/8
+  static const uint16_t ku16MaxGapUs = 50000;        ///< auto-tune never widens the gap beyond this [microseconds]
+  static const uint8_t ku8DefaultBreakerTrip = 3;
+  static const uint16_t ku16DefaultBreakerBackoffMs = 1000;
+  static const uint32_t ku32DefaultBreakerMaxBackoffMs = 60000;
+
+  // transaction states
+  static const uint8_t ku8TxIdle = 0;
+  static const uint8_t ku8TxTurnaround = 1; ///< request sent, waiting to release the bus
+  static const uint8_t ku8TxReceiving = 2;
+  static const uint8_t ku8TxTcp = 3;        ///< request queued on _link
+
+  // meter read states
+  static const uint8_t ku8JobIdle = 0;
+  static const uint8_t ku8JobFrame = 1; ///< block request in flight
+  static const uint8_t ku8JobGap = 2;   ///< waiting for the bus to be quiet before the next request
+  static const uint8_t ku8JobTcp = 3;   ///< requests pipelined on _link
+
+  // readJob::u8Work; a block index, or a span index with ku8WorkSpan
+  static const uint8_t ku8WorkSpan = 0x80;  ///< item is a span of a block the slave refused
+  static const uint8_t ku8WorkDone = 0x40;  ///< answer taken
+  static const uint8_t ku8WorkIndex = 0x3F;
+
+  static const uint8_t ku8NoSpan = 0xFF;
+
+  // meter read in progress; see beginMeterRead()/pollMeterRead()
+  typedef struct __readJob
+  {
+    uint8_t u8State;
+    uint8_t u8Result;
+    const meterProfile *profile;
+    meterProfile manualProfile;               ///< profile built from mt[]/dt[] for the manual type
+    meterField manualFields[ku8MeterFields];
+    uint8_t index;
+    uint8_t slave;
+    uint8_t fn;
+    time_t mdt;
+    float adj[ku8MeterFields];
+    uint16_t mt[ku8MeterFields + 1];
+    mbRegSpan spans[ku8MaxPlanFields];        ///< registers of every field that is read
+    uint8_t u8SpanField[ku8MaxPlanFields];    ///< profile field each span belongs to
+    float fStaged[ku8MaxPlanFields];          ///< value of each span, decoded as its frame arrived
+    uint8_t u8SpanBlock[ku8MaxPlanFields];    ///< block each span is read in
+    uint8_t u8Spans;
+    mbRegSpan blocks[ku8MaxPlanFields];
+    uint8_t u8Blocks;
+    uint8_t u8Block;                          ///< block being read
+    uint8_t u8Fallback;                       ///< span being read on its own, or ku8NoSpan
+    bool bProbe;                              ///< single-register probe of an open slave in flight
+    uint64_t u64SpanOk;                       ///< bit k set once span k has arrived
+    uint64_t u64Mask;                         ///< fields this read decodes
+    uint8_t u8Error;                          ///< last failure of a partial read
+    uint8_t u8Work[2 * ku8MaxPlanFields];     ///< Modbus TCP requests of this read, in sending order
+    uint16_t u16WorkTid[2 * ku8MaxPlanFields];
+    uint8_t u8Works;
+    uint8_t u8WorkSent;                       ///< u8Work[] handed to the link so far
+    meterReadCallback callback;
+    void *context;
+  } readJob;
+
+  readJob _job;
+
+  // per-slave state, looked up through _u8SlaveSlot[slave]
+  typedef struct __slaveState
+  {
+    uint8_t u8Slave;
+    uint16_t u16MinGapUs;    ///< per-device minimum silent interval; 0 = t3.5 only
+    uint16_t u16TuneFloorUs; ///< largest gap that has failed; auto-tune stays above it
+    uint8_t u8TuneRun;       ///< consecutive good transactions at the current gap
+    uint8_t u8FloorRuns;     ///< good runs in a row that the floor kept from shortening the gap
+    bool bRtt;               ///< u32SrttUs/u32RttvarUs hold at least one sample
+    uint32_t u32SrttUs;      ///< smoothed response latency, wire time excluded
+    uint32_t u32RttvarUs;    ///< smoothed mean deviation of the latency
+    uint8_t u8Health;        ///< ku8SlaveHealthy, ku8SlaveSuspect, ku8SlaveOpen
+    uint8_t u8Timeouts;      ///< consecutive timeouts
+    uint32_t u32BackoffMs;   ///< current probe interval while open
+    uint32_t u32ProbeAtMs;   ///< millis() when the next probe is due
+    uint32_t u32LastSeenMs;  ///< millis() of the last answer
+    uint32_t u32Baud;        ///< serial profile; 0 = the bus configuration
+    uint8_t u8Format;
+  } slaveState;
+
+  slaveState _slaves[ku8MaxSlaves];
+  uint8_t _u8Slaves;
+  uint8_t _u8SlaveSlot[248];
+
+  slaveState *slaveFor(uint8_t slave);
+  uint32_t silentIntervalUs(uint8_t slave);
+  uint8_t selectSerial(uint8_t slave);
+  static uint32_t charUs(uint32_t u32Baud);
+  static uint16_t t35Us(uint32_t u32Baud);
+  void tuneGap(uint8_t slave, uint8_t result);
+  uint32_t responseTimeoutUs(slaveState *state, uint16_t u16ResponseBytes);
+  void sampleRtt(uint8_t result);
+  void updateHealth(uint8_t result);
+
+  // transaction statistics, one row per (slave, function code) pair; rows
+  // are updated between two increments of _u32StatsSeq so getTxStats() can
+  // take a consistent copy from another task without a lock
+  static const uint8_t ku8MaxTxStats = 32;
+  txStats _txStats[ku8MaxTxStats];
+  uint8_t _u8TxStats;
+  volatile uint32_t _u32StatsSeq;
+
+  txStats *statsFor(uint8_t slave, uint8_t fn);
+  static uint8_t statBucket(uint32_t u32Us);
+  void recordTx(uint8_t result);
 };
 
 #endif
\ No newline at end of file
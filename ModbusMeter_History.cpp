@@ -0,0 +1,457 @@
+#include "ModbusMeter_History.h"
+
+// control byte encoding of the changed fields, shared with the uplink codec
+#include "util/snapcodec.h"
+
+MeterHistory::MeterHistory(void)
+{
+  _buf = 0;
+  _u16ChunkSize = 0;
+  _u16Chunks = 0;
+  _u8Fields = 0;
+#if defined(ESP32)
+  _lock = xSemaphoreCreateMutex();
+#endif
+  clear();
+}
+
+MeterHistory::~MeterHistory(void)
+{
+#if defined(ESP32)
+  vSemaphoreDelete(_lock);
+#endif
+}
+
+/**
+Attach the storage and set the number of fields per sample.
+
+@param buf storage; it is used from the first 8-byte aligned address
+@param u32Bytes size of buf
+@param u8Fields floats per sample: ModbusMeter::ku8MeterFields for
+       meterData, ModbusMeter::ku8PQFields for pqData
+@return false if buf is too small for two chunks
+*/
+bool MeterHistory::begin(uint8_t *buf, uint32_t u32Bytes, uint8_t u8Fields)
+{
+  uint32_t u32Skew = (8 - ((uintptr_t)buf & 7)) & 7;
+  uint32_t u32Chunk = (sizeof(chunkHeader) + (uint32_t)u8Fields * 4 * ku8AnchorRatio + 7) & ~7UL;
+  uint32_t u32Chunks;
+
+  if (!u8Fields || u8Fields > ModbusMeter::ku8PQFields || u32Bytes < u32Skew)
+  {
+    return false;
+  }
+  u32Chunks = (u32Bytes - u32Skew) / u32Chunk;
+  if (u32Chunks < 2)
+  {
+    return false;
+  }
+
+  lock();
+  _buf = buf + u32Skew;
+  _u16ChunkSize = (uint16_t)u32Chunk;
+  _u16Chunks = (u32Chunks < 0xFFFF) ? (uint16_t)u32Chunks : 0xFFFF;
+  _u8Fields = u8Fields;
+  unlock();
+
+  clear();
+  return true;
+}
+
+/**
+Drop every sample.
+*/
+void MeterHistory::clear()
+{
+  lock();
+  _u16First = 0;
+  _u16Used = 0;
+  _u32Samples = 0;
+  _u32Overwritten = 0;
+  _i64Last = 0;
+  unlock();
+}
+
+/**
+Append a sample.
+
+@param mdt timestamp; must be later than the previous sample
+@param values _u8Fields floats
+@param u64Valid bit k clear records field k as absent, NaN
+@return false if the history is not set up or mdt is not later than the
+        newest sample
+*/
+bool MeterHistory::append(time_t mdt, const float *values, uint64_t u64Valid)
+{
+  uint32_t u32Values[ModbusMeter::ku8PQFields];
+  uint8_t u8Bitmap = (_u8Fields + 7) / 8;
+  chunkHeader *head;
+  uint8_t *p;
+  uint64_t u64Delta;
+  uint8_t k;
+
+  memcpy(u32Values, values, _u8Fields * sizeof(uint32_t));
+  for (k = 0; k < _u8Fields; k++)
+  {
+    if (!(u64Valid & (1ULL << k)))
+      u32Values[k] = 0x7FC00000UL; // quiet NaN
+  }
+
+  lock();
+
+  if (!_buf || (_u32Samples && (int64_t)mdt <= _i64Last))
+  {
+    unlock();
+    return false;
+  }
+
+  head = _u16Used ? chunk(_u16Used - 1) : 0;
+  if (!head || head->u16Used + maxRecord() > _u16ChunkSize)
+  {
+    startChunk(mdt, u32Values);
+  }
+  else
+  {
+    p = (uint8_t *)head + head->u16Used;
+
+    // timestamp: unsigned LEB128 delta to the previous sample
+    u64Delta = (uint64_t)((int64_t)mdt - _i64Last);
+    while (u64Delta >= 0x80)
+    {
+      *p++ = (uint8_t)(u64Delta | 0x80);
+      u64Delta >>= 7;
+    }
+    *p++ = (uint8_t)u64Delta;
+
+    // bitmap of changed fields, then one record per changed field
+    uint8_t *bitmap = p;
+    memset(bitmap, 0, u8Bitmap);
+    p += u8Bitmap;
+
+    for (k = 0; k < _u8Fields; k++)
+    {
+      uint32_t x = u32Values[k] ^ _u32Last[k];
+
+      if (!x)
+      {
+        continue;
+      }
+      bitmap[k >> 3] |= 1 << (k & 7);
+      // maxRecord() leaves room for every field
+      p += snapcodec_put_xor(p, 5, x);
+    }
+
+    head->u16Used = (uint16_t)(p - (uint8_t *)head);
+    head->u16Count++;
+  }
+
+  memcpy(_u32Last, u32Values, sizeof(_u32Last[0]) * _u8Fields);
+  _i64Last = mdt;
+  _u32Samples++;
+
+  unlock();
+  return true;
+}
+
+/**
+Append a meterData reading; the history must have at most
+ModbusMeter::ku8MeterFields fields.
+*/
+bool MeterHistory::append(const ModbusMeter::meterData &data)
+{
+  if (_u8Fields > ModbusMeter::ku8MeterFields)
+  {
+    return false;
+  }
+  return append(data.mdt, &data.watt, data.u64Valid);
+}
+
+/**
+Append a pqData reading; a history with fewer fields keeps the leading
+ones, e.g. just the meterData part.
+*/
+bool MeterHistory::append(const ModbusMeter::pqData &data)
+{
+  return append(data.mdt, &data.watt, data.u64Valid);
+}
+
+/**
+Read the samples with tFrom <= mdt <= tTo, oldest first.
+
+To drain the history without gaps, pass the mdt of the last sample already
+delivered plus one as tFrom and repeat until fewer than u16Max samples are
+returned.
+
+@param times receives the timestamps
+@param values receives _u8Fields floats per sample
+@param u16Max capacity of times, in samples
+@return number of samples read
+*/
+uint16_t MeterHistory::read(time_t tFrom, time_t tTo, time_t *times, float *values, uint16_t u16Max)
+{
+  return readStrided(tFrom, tTo, (uint8_t *)times, sizeof(*times), (uint8_t *)values, _u8Fields * sizeof(*values), _u8Fields, u16Max);
+}
+
+uint16_t MeterHistory::read(time_t tFrom, time_t tTo, ModbusMeter::meterData *data, uint16_t u16Max)
+{
+  uint8_t u8Fields = (_u8Fields < ModbusMeter::ku8MeterFields) ? _u8Fields : ModbusMeter::ku8MeterFields;
+
+  return readStrided(tFrom, tTo, (uint8_t *)&data->mdt, sizeof(*data), (uint8_t *)&data->watt, sizeof(*data), u8Fields, u16Max);
+}
+
+uint16_t MeterHistory::read(time_t tFrom, time_t tTo, ModbusMeter::pqData *data, uint16_t u16Max)
+{
+  return readStrided(tFrom, tTo, (uint8_t *)&data->mdt, sizeof(*data), (uint8_t *)&data->watt, sizeof(*data), _u8Fields, u16Max);
+}
+
+/**
+Samples currently stored.
+*/
+uint32_t MeterHistory::samples()
+{
+  uint32_t n;
+
+  lock();
+  n = _u32Samples;
+  unlock();
+  return n;
+}
+
+/**
+Samples lost because the buffer wrapped before they were read.
+*/
+uint32_t MeterHistory::overwritten()
+{
+  uint32_t n;
+
+  lock();
+  n = _u32Overwritten;
+  unlock();
+  return n;
+}
+
+/**
+Timestamp of the oldest sample; 0 if empty.
+*/
+time_t MeterHistory::oldest()
+{
+  time_t t;
+
+  lock();
+  t = _u16Used ? (time_t)chunk(0)->i64Start : 0;
+  unlock();
+  return t;
+}
+
+/**
+Timestamp of the newest sample; 0 if empty.
+*/
+time_t MeterHistory::newest()
+{
+  time_t t;
+
+  // a 64-bit read tears on the ESP32 while the poll task appends
+  lock();
+  t = _u32Samples ? (time_t)_i64Last : 0;
+  unlock();
+  return t;
+}
+
+void MeterHistory::lock()
+{
+#if defined(ESP32)
+  xSemaphoreTake(_lock, portMAX_DELAY);
+#else
+  _lock.lock();
+#endif
+}
+
+void MeterHistory::unlock()
+{
+#if defined(ESP32)
+  xSemaphoreGive(_lock);
+#else
+  _lock.unlock();
+#endif
+}
+
+/**
+Chunk by position in time order; 0 is the oldest.
+*/
+MeterHistory::chunkHeader *MeterHistory::chunk(uint16_t u16Index)
+{
+  uint32_t u32Slot = (uint32_t)_u16First + u16Index;
+
+  if (u32Slot >= _u16Chunks)
+  {
+    u32Slot -= _u16Chunks;
+  }
+  return (chunkHeader *)(_buf + u32Slot * _u16ChunkSize);
+}
+
+/**
+Largest encoded sample: 10-byte timestamp delta, bitmap, and a control
+byte plus four bytes per field.
+*/
+uint16_t MeterHistory::maxRecord()
+{
+  return 10 + (_u8Fields + 7) / 8 + 5 * _u8Fields;
+}
+
+/**
+Open a new chunk with the sample as its anchor, overwriting the oldest
+chunk when the ring is full.
+*/
+void MeterHistory::startChunk(int64_t i64Time, const uint32_t *u32Values)
+{
+  chunkHeader *head;
+
+  if (_u16Used == _u16Chunks)
+  {
+    head = chunk(0);
+    _u32Samples -= head->u16Count;
+    _u32Overwritten += head->u16Count;
+    _u16First = (_u16First + 1 == _u16Chunks) ? 0 : _u16First + 1;
+    _u16Used--;
+  }
+
+  head = chunk(_u16Used++);
+  head->i64Start = i64Time;
+  head->u16Count = 1;
+  head->u16Used = sizeof(chunkHeader) + _u8Fields * sizeof(uint32_t);
+  memcpy(head + 1, u32Values, _u8Fields * sizeof(uint32_t));
+}
+
+/**
+Position a cursor on the anchor of a chunk.
+*/
+void MeterHistory::openCursor(chunkCursor *cursor, uint16_t u16Index)
+{
+  chunkHeader *head = chunk(u16Index);
+
+  memcpy(cursor->u32Values, head + 1, _u8Fields * sizeof(uint32_t));
+  cursor->p = (const uint8_t *)(head + 1) + _u8Fields * sizeof(uint32_t);
+  cursor->end = (const uint8_t *)head + head->u16Used;
+  cursor->u16Left = head->u16Count - 1;
+  cursor->i64Time = head->i64Start;
+}
+
+/**
+Advance a cursor to the next sample of its chunk; u16Left must be non-zero.
+
+@return false if the sample runs past the end of the chunk
+*/
+bool MeterHistory::nextSample(chunkCursor *cursor)
+{
+  const uint8_t *p = cursor->p;
+  const uint8_t *bitmap;
+  uint64_t u64Delta = 0;
+  uint8_t u8Shift = 0;
+  uint8_t k;
+
+  do
+  {
+    u64Delta |= (uint64_t)(*p & 0x7F) << u8Shift;
+    u8Shift += 7;
+  } while (*p++ & 0x80);
+  cursor->i64Time += (int64_t)u64Delta;
+
+  bitmap = p;
+  p += (_u8Fields + 7) / 8;
+  if (p > cursor->end)
+  {
+    return false;
+  }
+
+  for (k = 0; k < _u8Fields; k++)
+  {
+    uint32_t x;
+    uint8_t n;
+
+    if (!(bitmap[k >> 3] & (1 << (k & 7))))
+    {
+      continue;
+    }
+    if (!(n = snapcodec_get_xor(p, (uint16_t)(cursor->end - p), &x)))
+    {
+      return false;
+    }
+    p += n;
+    cursor->u32Values[k] ^= x;
+  }
+
+  cursor->p = p;
+  cursor->u16Left--;
+  return true;
+}
+
+/**
+Range read into arrays of records.
+
+@param times where the first timestamp goes
+@param timeStride distance between timestamps [bytes]
+@param values where the first sample's fields go
+@param valueStride distance between samples' fields [bytes]
+*/
+uint16_t MeterHistory::readStrided(time_t tFrom, time_t tTo, uint8_t *times, size_t timeStride, uint8_t *values, size_t valueStride, uint8_t u8Fields, uint16_t u16Max)
+{
+  chunkCursor cursor;
+  uint16_t u16Lo, u16Hi, i;
+  uint16_t n = 0;
+
+  lock();
+
+  if (!_u16Used || !u16Max)
+  {
+    unlock();
+    return 0;
+  }
+
+  // last chunk starting at or before tFrom; chunk 0 if tFrom is older
+  u16Lo = 0;
+  u16Hi = _u16Used - 1;
+  while (u16Lo < u16Hi)
+  {
+    uint16_t u16Mid = u16Lo + (u16Hi - u16Lo + 1) / 2;
+
+    if (chunk(u16Mid)->i64Start <= (int64_t)tFrom)
+    {
+      u16Lo = u16Mid;
+    }
+    else
+    {
+      u16Hi = u16Mid - 1;
+    }
+  }
+
+  for (i = u16Lo; i < _u16Used && n < u16Max; i++)
+  {
+    openCursor(&cursor, i);
+    for (;;)
+    {
+      if (cursor.i64Time > (int64_t)tTo)
+      {
+        unlock();
+        return n;
+      }
+      if (cursor.i64Time >= (int64_t)tFrom)
+      {
+        time_t t = (time_t)cursor.i64Time;
+
+        memcpy(times + n * timeStride, &t, sizeof(t));
+        memcpy(values + n * valueStride, cursor.u32Values, u8Fields * sizeof(uint32_t));
+        if (++n == u16Max)
+        {
+          break;
+        }
+      }
+      if (!cursor.u16Left || !nextSample(&cursor))
+      {
+        break;
+      }
+    }
+  }
+
+  unlock();
+  return n;
+}
@@ -0,0 +1,112 @@
+#ifndef ModbusMeter_History_h
+#define ModbusMeter_History_h
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+#if defined(ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#else
+#include <mutex>
+#endif
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusMeter_ESP32.h"
+
+/**
+Fixed-memory history of one meter's readings.
+
+Samples are timestamped by their mdt and appended in time order into a ring
+of equally sized chunks carved out of a caller-supplied buffer. Each chunk
+starts with an anchor, the full timestamp and every field in raw form;
+the samples after it store the timestamp as a varint delta and only the
+fields that changed, each as the XOR against its previous value with the
+leading and trailing zero bytes removed. When the buffer is full the oldest
+chunk is overwritten.
+
+Space depends on how much the readings move. With the noisy trace of
+extras/bench/history_bench.cpp, where power and currents change every
+sample, a meterData sample takes 32-35 bytes instead of 48 and a pqData
+sample 75-78 instead of 172: a 32 KB buffer holds about 1000 meterData
+samples, and thousands need 64 KB or more. Fields that do not change cost
+nothing after the bitmap.
+
+A field missing from a reading, its u64Valid bit clear after a partial
+read, is recorded as absent and reads back as NaN.
+
+Chunks are in time order, so a range query binary searches the anchors and
+decodes from the chunk that holds the start of the range. Appending and
+reading are locked against each other, so a polling task can record while
+an uplink task catches up after a network outage by reading everything
+after the last sample it delivered.
+*/
+class MeterHistory
+{
+public:
+  MeterHistory();
+  ~MeterHistory();
+
+  bool begin(uint8_t *buf, uint32_t u32Bytes, uint8_t u8Fields);
+  void clear();
+
+  bool append(time_t mdt, const float *values, uint64_t u64Valid = ModbusMeter::ku64AllFields);
+  bool append(const ModbusMeter::meterData &data);
+  bool append(const ModbusMeter::pqData &data);
+
+  uint16_t read(time_t tFrom, time_t tTo, time_t *times, float *values, uint16_t u16Max);
+  uint16_t read(time_t tFrom, time_t tTo, ModbusMeter::meterData *data, uint16_t u16Max);
+  uint16_t read(time_t tFrom, time_t tTo, ModbusMeter::pqData *data, uint16_t u16Max);
+
+  uint32_t samples();
+  uint32_t overwritten();
+  time_t oldest();
+  time_t newest();
+
+  static const uint8_t ku8AnchorRatio = 8; ///< chunk size in raw samples; larger chunks compress better, smaller ones lose less when the oldest is overwritten
+
+private:
+  typedef struct __chunkHeader
+  {
+    int64_t i64Start; ///< timestamp of the anchor sample
+    uint16_t u16Count; ///< samples in the chunk, anchor included
+    uint16_t u16Used;  ///< bytes used, header included
+  } chunkHeader;
+
+  // decoding position inside one chunk
+  typedef struct __chunkCursor
+  {
+    const uint8_t *p;
+    const uint8_t *end; ///< first byte after the chunk's samples
+    uint16_t u16Left;
+    int64_t i64Time;
+    uint32_t u32Values[ModbusMeter::ku8PQFields];
+  } chunkCursor;
+
+  uint8_t *_buf;
+  uint16_t _u16ChunkSize;
+  uint16_t _u16Chunks;
+  uint8_t _u8Fields;
+
+  uint16_t _u16First; ///< chunk holding the oldest samples
+  uint16_t _u16Used;  ///< chunks in use
+  uint32_t _u32Samples;
+  uint32_t _u32Overwritten;
+  int64_t _i64Last;
+  uint32_t _u32Last[ModbusMeter::ku8PQFields]; ///< previous sample, raw bits
+
+#if defined(ESP32)
+  SemaphoreHandle_t _lock;
+#else
+  std::mutex _lock;
+#endif
+
+  void lock();
+  void unlock();
+  chunkHeader *chunk(uint16_t u16Index);
+  uint16_t maxRecord();
+  void startChunk(int64_t i64Time, const uint32_t *u32Values);
+  void openCursor(chunkCursor *cursor, uint16_t u16Index);
+  bool nextSample(chunkCursor *cursor);
+  uint16_t readStrided(time_t tFrom, time_t tTo, uint8_t *times, size_t timeStride, uint8_t *values, size_t valueStride, uint8_t u8Fields, uint16_t u16Max);
+};
+
+#endif
@@ -0,0 +1,273 @@
+#include "ModbusMeter_ESP32.h"
+
+/*
+  Register maps of the built-in meter types.
+
+  Every row reads one value: register address, data type (see the dt[] table
+  in ModbusMeter_ESP32.h), target field and divisor. Rows do not need to be
+  in address order; beginMeterRead() plans the block reads and
+  pollMeterRead() decodes them.
+*/
+
+typedef ModbusMeter MM;
+
+static constexpr MM::meterField dts353Fields[] = {
+    {0x000e, 21, MM::ku8FieldV0, 1, 0},
+    {0x0010, 21, MM::ku8FieldV1, 1, 0},
+    {0x0012, 21, MM::ku8FieldV2, 1, 0},
+    {0x0016, 21, MM::ku8FieldI0, 1, 0},
+    {0x0018, 21, MM::ku8FieldI1, 1, 0},
+    {0x001a, 21, MM::ku8FieldI2, 1, 0},
+    {0x001c, 21, MM::ku8FieldWatt, 1, 0},
+    {0x0034, 21, MM::ku8FieldPf, 1, 0},
+    {0x0100, 21, MM::ku8FieldWattHour, 1, 0},
+    {0x0118, 21, MM::ku8FieldVarh, 1, 0},
+};
+
+// one channel every 2000 registers, selected by slaveIndex
+static constexpr MM::meterField eastronFields[] = {
+    {0x0000, 21, MM::ku8FieldV0, 1, 0},
+    {0x0002, 21, MM::ku8FieldV1, 1, 0},
+    {0x0004, 21, MM::ku8FieldV2, 1, 0},
+    {0x0006, 21, MM::ku8FieldI0, 1, 0},
+    {0x0008, 21, MM::ku8FieldI1, 1, 0},
+    {0x000a, 21, MM::ku8FieldI2, 1, 0},
+    {0x0034, 21, MM::ku8FieldWatt, 1, 0},
+    {0x003e, 21, MM::ku8FieldPf, 1, 0},
+    {0x0156, 21, MM::ku8FieldWattHour, 1, 0},
+    {0x0158, 21, MM::ku8FieldVarh, 1, 0},
+};
+
+static constexpr MM::meterField iem3255Fields[] = {
+    {2999, 21, MM::ku8FieldI0, 1, 0},
+    {3001, 21, MM::ku8FieldI1, 1, 0},
+    {3003, 21, MM::ku8FieldI2, 1, 0},
+    {3027, 21, MM::ku8FieldV0, 1, 0},
+    {3029, 21, MM::ku8FieldV1, 1, 0},
+    {3031, 21, MM::ku8FieldV2, 1, 0},
+    {3059, 21, MM::ku8FieldWatt, 1, 0},
+    {3083, 21, MM::ku8FieldPf, 1, MM::ku8FieldPfFold},
+    {3203, 13, MM::ku8FieldWattHour, 1, 0},
+    {3219, 13, MM::ku8FieldVarh, 1, 0},
+};
+
+// addresses come from mt[]
+static constexpr MM::meterField heyuan3Fields[] = {
+    {0, 2, MM::ku8FieldWatt, 1000, 0},
+    {0, 9, MM::ku8FieldWattHour, 100, 0},
+    {0, 2, MM::ku8FieldPf, 1000, 0},
+    {0, 9, MM::ku8FieldVarh, 100, 0},
+    {0, 2, MM::ku8FieldI0, 100, 0},
+    {0, 2, MM::ku8FieldI1, 100, 0},
+    {0, 2, MM::ku8FieldI2, 100, 0},
+    {0, 2, MM::ku8FieldV0, 100, 0},
+    {0, 2, MM::ku8FieldV1, 100, 0},
+    {0, 2, MM::ku8FieldV2, 100, 0},
+};
+
+static constexpr MM::meterField heyuan1Fields[] = {
+    {0, 2, MM::ku8FieldWatt, 1000, 0},
+    {0, 9, MM::ku8FieldWattHour, 100, 0},
+    {0, 2, MM::ku8FieldPf, 1000, 0},
+    {0, 9, MM::ku8FieldVarh, 100, 0},
+    {0, 2, MM::ku8FieldI0, 100, 0},
+    {0, 0, MM::ku8FieldI1, 1, 0},
+    {0, 0, MM::ku8FieldI2, 1, 0},
+    {0, 2, MM::ku8FieldV0, 100, 0},
+    {0, 0, MM::ku8FieldV1, 1, 0},
+    {0, 0, MM::ku8FieldV2, 1, 0},
+};
+
+static constexpr MM::meterField circutorFields[] = {
+    {0x1e, 9, MM::ku8FieldWatt, 1000, 0},
+    {0x3c, 9, MM::ku8FieldWattHour, 1000, 0},
+    {0x26, 9, MM::ku8FieldPf, 100, 0},
+    {0x3c, 9, MM::ku8FieldVarh, 1000, 0},
+    {0x02, 9, MM::ku8FieldI0, 1000, 0},
+    {0x0c, 9, MM::ku8FieldI1, 1000, 0},
+    {0x16, 9, MM::ku8FieldI2, 1000, 0},
+    {0x00, 9, MM::ku8FieldV0, 10, 0},
+    {0x0a, 9, MM::ku8FieldV1, 10, 0},
+    {0x14, 9, MM::ku8FieldV2, 10, 0},
+};
+
+static constexpr MM::meterField abbm2mFields[] = {
+    {0x102e, 9, MM::ku8FieldWatt, 1000, 0},
+    {0x103e, 9, MM::ku8FieldWattHour, 100000, 0},
+    {0x1016, 9, MM::ku8FieldPf, 1000, 0},
+    {0x1040, 9, MM::ku8FieldVarh, 100000, 0},
+    {0x1010, 9, MM::ku8FieldI0, 1000, 0},
+    {0x1012, 9, MM::ku8FieldI1, 1000, 0},
+    {0x1014, 9, MM::ku8FieldI2, 1000, 0},
+    {0x1002, 9, MM::ku8FieldV0, 1, 0},
+    {0x1004, 9, MM::ku8FieldV1, 1, 0},
+    {0x1006, 9, MM::ku8FieldV2, 1, 0},
+};
+
+static constexpr MM::meterField integra1630Fields[] = {
+    {0x0000, 21, MM::ku8FieldV0, 1, 0},
+    {0x0002, 21, MM::ku8FieldV1, 1, 0},
+    {0x0004, 21, MM::ku8FieldV2, 1, 0},
+    {0x0006, 21, MM::ku8FieldI0, 1, 0},
+    {0x0008, 21, MM::ku8FieldI1, 1, 0},
+    {0x000a, 21, MM::ku8FieldI2, 1, 0},
+    {0x0034, 21, MM::ku8FieldWatt, 1, 0},
+    {0x0048, 21, MM::ku8FieldWattHour, 1, 0},
+    {0x004c, 21, MM::ku8FieldVarh, 1, 0},
+    {0x00fe, 21, MM::ku8FieldPf, 1, 0},
+};
+
+// addresses come from mt[]
+static constexpr MM::meterField generic3Fields[] = {
+    {0, 21, MM::ku8FieldWatt, 1, 0},
+    {0, 21, MM::ku8FieldWattHour, 1, 0},
+    {0, 21, MM::ku8FieldPf, 1, 0},
+    {0, 21, MM::ku8FieldVarh, 1, 0},
+    {0, 21, MM::ku8FieldI0, 1, 0},
+    {0, 21, MM::ku8FieldI1, 1, 0},
+    {0, 21, MM::ku8FieldI2, 1, 0},
+    {0, 21, MM::ku8FieldV0, 1, 0},
+    {0, 21, MM::ku8FieldV1, 1, 0},
+    {0, 21, MM::ku8FieldV2, 1, 0},
+};
+
+static constexpr MM::meterField generic1Fields[] = {
+    {0, 21, MM::ku8FieldWatt, 1, 0},
+    {0, 21, MM::ku8FieldWattHour, 1, 0},
+    {0, 21, MM::ku8FieldPf, 1, 0},
+    {0, 21, MM::ku8FieldVarh, 1, 0},
+    {0, 21, MM::ku8FieldI0, 1, 0},
+    {0, 0, MM::ku8FieldI1, 1, 0},
+    {0, 0, MM::ku8FieldI2, 1, 0},
+    {0, 21, MM::ku8FieldV0, 1, 0},
+    {0, 0, MM::ku8FieldV1, 1, 0},
+    {0, 0, MM::ku8FieldV2, 1, 0},
+};
+
+static constexpr MM::meterField pm800Fields[] = {
+    {1099, 2, MM::ku8FieldI0, 1, 0},
+    {1100, 2, MM::ku8FieldI1, 1, 0},
+    {1101, 2, MM::ku8FieldI2, 1, 0},
+    {1123, 2, MM::ku8FieldV0, 1, 0},
+    {1124, 2, MM::ku8FieldV1, 1, 0},
+    {1125, 2, MM::ku8FieldV2, 1, 0},
+    {1142, 2, MM::ku8FieldWatt, 1, 0},
+    {1715, REGDECODE_MOD10K, MM::ku8FieldWattHour, 1, 0},
+    {1719, REGDECODE_MOD10K, MM::ku8FieldVarh, 1, 0},
+    {1166, 2, MM::ku8FieldPf, 1000, 0},
+};
+
+static constexpr MM::meterField pm2230Fields[] = {
+    {2999, 21, MM::ku8FieldI0, 1, 0},
+    {3001, 21, MM::ku8FieldI1, 1, 0},
+    {3003, 21, MM::ku8FieldI2, 1, 0},
+    {3027, 21, MM::ku8FieldV0, 1, 0},
+    {3029, 21, MM::ku8FieldV1, 1, 0},
+    {3031, 21, MM::ku8FieldV2, 1, 0},
+    {3059, 21, MM::ku8FieldWatt, 1, 0},
+    {3083, 21, MM::ku8FieldPf, 1, MM::ku8FieldPfFold},
+    {3203, 13, MM::ku8FieldWattHour, 1, 0},
+    {3219, 13, MM::ku8FieldVarh, 1, 0},
+    {21329, 21, MM::ku8FieldThdvr, 1, 0},
+    {21331, 21, MM::ku8FieldThdvs, 1, 0},
+    {21333, 21, MM::ku8FieldThdvt, 1, 0},
+    {21299, 21, MM::ku8FieldThdir, 1, 0},
+    {21301, 21, MM::ku8FieldThdis, 1, 0},
+    {21303, 21, MM::ku8FieldThdit, 1, 0},
+    {3045, 21, MM::ku8FieldVunbr, 1, 0},
+    {3047, 21, MM::ku8FieldVunbs, 1, 0},
+    {3049, 21, MM::ku8FieldVunbt, 1, 0},
+    // per-phase harmonic tables, one 6-register entry per order starting at
+    // order 0; the rows read the orders chosen by setHarmonicOrders()
+    {22869, 21, MM::ku8FieldChr + 0, 1, MM::ku8FieldHarmonic},
+    {22869, 21, MM::ku8FieldChr + 1, 1, MM::ku8FieldHarmonic},
+    {22869, 21, MM::ku8FieldChr + 2, 1, MM::ku8FieldHarmonic},
+    {22869, 21, MM::ku8FieldChr + 3, 1, MM::ku8FieldHarmonic},
+    {22869, 21, MM::ku8FieldChr + 4, 1, MM::ku8FieldHarmonic},
+    {22869, 21, MM::ku8FieldChr + 5, 1, MM::ku8FieldHarmonic},
+    {22869, 21, MM::ku8FieldChr + 6, 1, MM::ku8FieldHarmonic},
+    {23257, 21, MM::ku8FieldChs + 0, 1, MM::ku8FieldHarmonic},
+    {23257, 21, MM::ku8FieldChs + 1, 1, MM::ku8FieldHarmonic},
+    {23257, 21, MM::ku8FieldChs + 2, 1, MM::ku8FieldHarmonic},
+    {23257, 21, MM::ku8FieldChs + 3, 1, MM::ku8FieldHarmonic},
+    {23257, 21, MM::ku8FieldChs + 4, 1, MM::ku8FieldHarmonic},
+    {23257, 21, MM::ku8FieldChs + 5, 1, MM::ku8FieldHarmonic},
+    {23257, 21, MM::ku8FieldChs + 6, 1, MM::ku8FieldHarmonic},
+    {23645, 21, MM::ku8FieldCht + 0, 1, MM::ku8FieldHarmonic},
+    {23645, 21, MM::ku8FieldCht + 1, 1, MM::ku8FieldHarmonic},
+    {23645, 21, MM::ku8FieldCht + 2, 1, MM::ku8FieldHarmonic},
+    {23645, 21, MM::ku8FieldCht + 3, 1, MM::ku8FieldHarmonic},
+    {23645, 21, MM::ku8FieldCht + 4, 1, MM::ku8FieldHarmonic},
+    {23645, 21, MM::ku8FieldCht + 5, 1, MM::ku8FieldHarmonic},
+    {23645, 21, MM::ku8FieldCht + 6, 1, MM::ku8FieldHarmonic},
+    {3109, 21, MM::ku8FieldFreq, 1, 0},
+};
+
+// DMG610 and DMG800 share the measurement map; harmonics and unbalance are
+// not read yet and are reported as 0
+static constexpr MM::meterField dmgFields[] = {
+    {0x0008 - 1, 9, MM::ku8FieldI0, 10000, 0},
+    {0x000a - 1, 9, MM::ku8FieldI1, 10000, 0},
+    {0x000c - 1, 9, MM::ku8FieldI2, 10000, 0},
+    {0x0002 - 1, 9, MM::ku8FieldV0, 100, 0},
+    {0x0004 - 1, 9, MM::ku8FieldV1, 100, 0},
+    {0x0006 - 1, 9, MM::ku8FieldV2, 100, 0},
+    {0x003a - 1, 5, MM::ku8FieldWatt, 100, 0},
+    {0x0040 - 1, 5, MM::ku8FieldPf, 10000, 0},
+    {0x1b20 - 1, 17, MM::ku8FieldWattHour, 100, 0},
+    {0x1b28 - 1, 17, MM::ku8FieldVarh, 100, 0},
+    {0x0054 - 1, 9, MM::ku8FieldThdvr, 100, 0},
+    {0x0056 - 1, 9, MM::ku8FieldThdvs, 100, 0},
+    {0x0058 - 1, 9, MM::ku8FieldThdvt, 100, 0},
+    {0x005a - 1, 9, MM::ku8FieldThdir, 100, 0},
+    {0x005c - 1, 9, MM::ku8FieldThdis, 100, 0},
+    {0x005e - 1, 9, MM::ku8FieldThdit, 100, 0},
+    {0, 0, MM::ku8FieldVunbr, 1, 0},
+    {0, 0, MM::ku8FieldVunbs, 1, 0},
+    {0, 0, MM::ku8FieldVunbt, 1, 0},
+    {0, 0, MM::ku8FieldChr + 0, 1, 0},
+    {0, 0, MM::ku8FieldChr + 1, 1, 0},
+    {0, 0, MM::ku8FieldChr + 2, 1, 0},
+    {0, 0, MM::ku8FieldChr + 3, 1, 0},
+    {0, 0, MM::ku8FieldChr + 4, 1, 0},
+    {0, 0, MM::ku8FieldChr + 5, 1, 0},
+    {0, 0, MM::ku8FieldChr + 6, 1, 0},
+    {0, 0, MM::ku8FieldChs + 0, 1, 0},
+    {0, 0, MM::ku8FieldChs + 1, 1, 0},
+    {0, 0, MM::ku8FieldChs + 2, 1, 0},
+    {0, 0, MM::ku8FieldChs + 3, 1, 0},
+    {0, 0, MM::ku8FieldChs + 4, 1, 0},
+    {0, 0, MM::ku8FieldChs + 5, 1, 0},
+    {0, 0, MM::ku8FieldChs + 6, 1, 0},
+    {0, 0, MM::ku8FieldCht + 0, 1, 0},
+    {0, 0, MM::ku8FieldCht + 1, 1, 0},
+    {0, 0, MM::ku8FieldCht + 2, 1, 0},
+    {0, 0, MM::ku8FieldCht + 3, 1, 0},
+    {0, 0, MM::ku8FieldCht + 4, 1, 0},
+    {0, 0, MM::ku8FieldCht + 5, 1, 0},
+    {0, 0, MM::ku8FieldCht + 6, 1, 0},
+    {0x0032 - 1, 9, MM::ku8FieldFreq, 1000, 0},
+};
+
+#define PROFILE_FIELDS(a) a, (uint8_t)(sizeof(a) / sizeof(a[0]))
+
+const ModbusMeter::meterProfile ModbusMeter::kProfiles[] = {
+    {dts353, ku8MBReadHoldingRegisters, 0, 0, 0, PROFILE_FIELDS(dts353Fields)},
+    {eastron, ku8MBReadInputRegisters, 0, 2000, 0, PROFILE_FIELDS(eastronFields)},
+    {iem3255, ku8MBReadHoldingRegisters, 0, 0, 0, PROFILE_FIELDS(iem3255Fields)},
+    {heyuan3, 0, ku8ProfileMtAddress, 0, 0, PROFILE_FIELDS(heyuan3Fields)},
+    {heyuan1, 0, ku8ProfileMtAddress, 0, 0, PROFILE_FIELDS(heyuan1Fields)},
+    {circutor, ku8MBReadHoldingRegisters, 0, 0, 0, PROFILE_FIELDS(circutorFields)},
+    {abbm2m, ku8MBReadHoldingRegisters, 0, 0, 0, PROFILE_FIELDS(abbm2mFields)},
+    {integra1630, ku8MBReadInputRegisters, 0, 0, 0, PROFILE_FIELDS(integra1630Fields)},
+    {generic3, 0, ku8ProfileMtAddress, 0, 0, PROFILE_FIELDS(generic3Fields)},
+    {generic1, 0, ku8ProfileMtAddress, 0, 0, PROFILE_FIELDS(generic1Fields)},
+    {pm800, ku8MBReadHoldingRegisters, 0, 0, 0, PROFILE_FIELDS(pm800Fields)},
+    {pm2230, ku8MBReadHoldingRegisters, ku8ProfilePQ, 0, 6, PROFILE_FIELDS(pm2230Fields)},
+    {dmg610, ku8MBReadHoldingRegisters, ku8ProfilePQ, 0, 0, PROFILE_FIELDS(dmgFields)},
+    {dmg800, ku8MBReadHoldingRegisters, ku8ProfilePQ, 0, 0, PROFILE_FIELDS(dmgFields)},
+};
+
+const uint8_t ModbusMeter::ku8Profiles = sizeof(kProfiles) / sizeof(kProfiles[0]);
+
+#undef PROFILE_FIELDS
@@ -0,0 +1,391 @@
+#include "ModbusMeter_Stats.h"
+
+MeterStats::MeterStats(void)
+{
+  _acc = 0;
+  _last = 0;
+  _rows = 0;
+  _u8Rows = 0;
+  _u8Fields = 0;
+  _bOwnData = false;
+  _u32WindowSec = ku32DefaultWindowSec;
+  _u16SubSec = ku16DefaultDemandSec;
+  _u8SubIntervals = 1;
+}
+
+MeterStats::~MeterStats(void)
+{
+  freeData();
+}
+
+/**
+Allocate the state of every meter.
+
+@param u8Meters number of rows
+@param u8Fields fields with statistics: ModbusMeter::ku8MeterFields for
+       energy meters, ModbusMeter::ku8PQFields to cover the PQ fields too;
+       demand needs at least ModbusMeter::ku8FieldWattHour + 1
+@param arena arena to allocate from; 0 = heap
+@return false if the memory could not be allocated
+*/
+bool MeterStats::begin(uint8_t u8Meters, uint8_t u8Fields, mbArena *arena)
+{
+  uint32_t u32Acc = (uint32_t)u8Meters * u8Fields;
+
+  freeData();
+  if (!u8Meters || !u8Fields || u8Fields > ModbusMeter::ku8PQFields)
+  {
+    return false;
+  }
+
+  if (arena)
+  {
+    _acc = (fieldAcc *)arena_alloc(arena, u32Acc * sizeof(fieldAcc), alignof(fieldAcc));
+    _last = (fieldAcc *)arena_alloc(arena, u32Acc * sizeof(fieldAcc), alignof(fieldAcc));
+    _rows = (rowState *)arena_alloc(arena, u8Meters * sizeof(rowState), alignof(rowState));
+  }
+  else
+  {
+    _acc = (fieldAcc *)calloc(u32Acc, sizeof(fieldAcc));
+    _last = (fieldAcc *)calloc(u32Acc, sizeof(fieldAcc));
+    _rows = (rowState *)calloc(u8Meters, sizeof(rowState));
+    _bOwnData = true;
+  }
+
+  if (!_acc || !_last || !_rows)
+  {
+    freeData();
+    return false;
+  }
+  _u8Rows = u8Meters;
+  _u8Fields = u8Fields;
+  for (uint8_t r = 0; r < u8Meters; r++)
+  {
+    clear(r);
+  }
+  return true;
+}
+
+/**
+Set the length of the statistics window, ku32DefaultWindowSec by default.
+Every row starts over.
+
+@return false if the length is 0
+*/
+bool MeterStats::setWindow(uint32_t u32WindowSec)
+{
+  if (!u32WindowSec)
+  {
+    return false;
+  }
+  _u32WindowSec = u32WindowSec;
+  for (uint8_t r = 0; r < _u8Rows; r++)
+  {
+    clear(r);
+  }
+  return true;
+}
+
+/**
+Set the demand interval, ku16DefaultDemandSec in one block by default.
+Every row starts over.
+
+@param u16IntervalSec length of the demand window
+@param u8SubIntervals steps the window slides in; 1 gives block demand
+@return false if the interval does not split into whole seconds or there
+        are too many sub-intervals
+*/
+bool MeterStats::setDemand(uint16_t u16IntervalSec, uint8_t u8SubIntervals)
+{
+  if (!u8SubIntervals || u8SubIntervals > ku8MaxSubIntervals || !u16IntervalSec || u16IntervalSec % u8SubIntervals)
+  {
+    return false;
+  }
+  _u16SubSec = u16IntervalSec / u8SubIntervals;
+  _u8SubIntervals = u8SubIntervals;
+  for (uint8_t r = 0; r < _u8Rows; r++)
+  {
+    clear(r);
+  }
+  return true;
+}
+
+/**
+Add an energy meter reading.
+
+@return false if the row is unknown or mdt lies before the current window
+*/
+bool MeterStats::add(uint8_t u8Row, const ModbusMeter::meterData &data)
+{
+  return addRow(u8Row, data.mdt, &data.watt, ModbusMeter::ku8MeterFields, data.u64Valid);
+}
+
+/**
+Add a PQ meter reading; fields beyond the configured ones are ignored.
+*/
+bool MeterStats::add(uint8_t u8Row, const ModbusMeter::pqData &data)
+{
+  return addRow(u8Row, data.mdt, &data.watt, ModbusMeter::ku8PQFields, data.u64Valid);
+}
+
+/**
+Forget everything about a row, peak demand included.
+*/
+void MeterStats::clear(uint8_t u8Row)
+{
+  if (u8Row >= _u8Rows)
+  {
+    return;
+  }
+  memset(_acc + u8Row * _u8Fields, 0, _u8Fields * sizeof(fieldAcc));
+  memset(_last + u8Row * _u8Fields, 0, _u8Fields * sizeof(fieldAcc));
+  memset(&_rows[u8Row], 0, sizeof(rowState));
+  _rows[u8Row].i64Window = -1;
+  _rows[u8Row].i64LastWindow = -1;
+}
+
+/**
+Start a new peak demand, e.g. at the start of a billing period.
+*/
+void MeterStats::resetPeak(uint8_t u8Row)
+{
+  if (u8Row < _u8Rows)
+  {
+    _rows[u8Row].fPeak = 0;
+    _rows[u8Row].tPeak = 0;
+  }
+}
+
+/**
+Minimum, maximum and mean of a field.
+
+@param bCompleted the last completed window instead of the running one
+@return false if the row or field is unknown
+*/
+bool MeterStats::getStats(uint8_t u8Row, uint8_t u8Field, bool bCompleted, fieldStats *stats)
+{
+  const fieldAcc *acc;
+  int64_t i64Window;
+
+  if (u8Row >= _u8Rows || u8Field >= _u8Fields)
+  {
+    return false;
+  }
+
+  acc = (bCompleted ? _last : _acc) + u8Row * _u8Fields + u8Field;
+  i64Window = bCompleted ? _rows[u8Row].i64LastWindow : _rows[u8Row].i64Window;
+  memset(stats, 0, sizeof(*stats));
+  if (i64Window >= 0)
+  {
+    stats->tStart = (time_t)(i64Window * _u32WindowSec);
+  }
+  if (acc->u32Count)
+  {
+    stats->fMin = acc->fMin;
+    stats->fMax = acc->fMax;
+    stats->fAvg = (float)(acc->dSum / acc->u32Count);
+    stats->u32Count = acc->u32Count;
+  }
+  return true;
+}
+
+/**
+Demand of a meter as of the last completed sub-interval.
+
+@return false if the row is unknown
+*/
+bool MeterStats::getDemand(uint8_t u8Row, demandInfo *demand)
+{
+  const rowState *row;
+
+  if (u8Row >= _u8Rows)
+  {
+    return false;
+  }
+
+  row = &_rows[u8Row];
+  demand->fDemand = row->fDemand;
+  demand->fEnergy = row->fEnergy;
+  demand->tEnd = row->tEnd;
+  demand->fPeak = row->fPeak;
+  demand->tPeak = row->tPeak;
+  demand->fPartialEnergy = (float)row->dSubEnergy;
+  return true;
+}
+
+void MeterStats::freeData()
+{
+  if (_bOwnData)
+  {
+    free(_acc);
+    free(_last);
+    free(_rows);
+  }
+  _acc = 0;
+  _last = 0;
+  _rows = 0;
+  _u8Rows = 0;
+  _u8Fields = 0;
+  _bOwnData = false;
+}
+
+bool MeterStats::addRow(uint8_t u8Row, time_t mdt, const float *values, uint8_t u8Fields, uint64_t u64Valid)
+{
+  rowState *row;
+  fieldAcc *acc;
+  int64_t i64Window;
+  uint8_t k;
+
+  if (u8Row >= _u8Rows)
+  {
+    return false;
+  }
+
+  row = &_rows[u8Row];
+  acc = _acc + u8Row * _u8Fields;
+  i64Window = (int64_t)mdt / _u32WindowSec;
+  if (i64Window < row->i64Window)
+  {
+    return false;
+  }
+
+  if (i64Window != row->i64Window)
+  {
+    // rollover: the running window becomes the completed one
+    if (row->i64Window >= 0)
+    {
+      memcpy(_last + u8Row * _u8Fields, acc, _u8Fields * sizeof(fieldAcc));
+      row->i64LastWindow = row->i64Window;
+    }
+    memset(acc, 0, _u8Fields * sizeof(fieldAcc));
+    row->i64Window = i64Window;
+  }
+
+  if (u8Fields > _u8Fields)
+  {
+    u8Fields = _u8Fields;
+  }
+  for (k = 0; k < u8Fields; k++, acc++)
+  {
+    float f = values[k];
+
+    if (!(u64Valid & (1ULL << k)) || isnan(f))
+      continue;
+
+    if (!acc->u32Count || f < acc->fMin)
+      acc->fMin = f;
+    if (!acc->u32Count || f > acc->fMax)
+      acc->fMax = f;
+    acc->dSum += f;
+    acc->u32Count++;
+  }
+
+  if (u8Fields > ModbusMeter::ku8FieldWattHour && (u64Valid & (1ULL << ModbusMeter::ku8FieldWattHour)) &&
+      !isnan(values[ModbusMeter::ku8FieldWattHour]))
+  {
+    addEnergy(row, mdt, values[ModbusMeter::ku8FieldWattHour]);
+  }
+  return true;
+}
+
+/**
+Spread the energy since the previous reading over the sub-intervals it
+spans, closing each one that ends before mdt.
+
+After a long gap the sub-intervals inside it all get the same share, so
+once a window's worth of them has been closed the rest are skipped up to
+the last window before mdt; a reading closes at most 2 * u8SubIntervals + 1
+sub-intervals.
+*/
+void MeterStats::addEnergy(rowState *row, time_t mdt, double dWh)
+{
+  double dEnergy;
+  int64_t i64From;
+  uint8_t u8Closed = 0;
+
+  if (!row->bEnergy)
+  {
+    row->i64SubStart = (int64_t)mdt - (int64_t)mdt % _u16SubSec;
+    row->bPartialSub = (row->i64SubStart != (int64_t)mdt);
+    row->bEnergy = true;
+    row->dLastWh = dWh;
+    row->tLastWh = mdt;
+    return;
+  }
+  if (mdt <= row->tLastWh)
+  {
+    return;
+  }
+
+  dEnergy = (dWh >= row->dLastWh) ? dWh - row->dLastWh : 0;
+  i64From = row->tLastWh;
+  while ((int64_t)mdt >= row->i64SubStart + _u16SubSec)
+  {
+    int64_t i64End = row->i64SubStart + _u16SubSec;
+    int64_t i64Skip = ((int64_t)mdt - row->i64SubStart) / _u16SubSec - _u8SubIntervals;
+    double dShare;
+
+    if (u8Closed >= _u8SubIntervals && i64Skip > 0)
+    {
+      i64End = row->i64SubStart + i64Skip * _u16SubSec;
+      dEnergy -= dEnergy * (i64End - i64From) / ((int64_t)mdt - i64From);
+      i64From = i64End;
+      row->i64SubStart = i64End;
+      continue;
+    }
+
+    dShare = dEnergy * (i64End - i64From) / ((int64_t)mdt - i64From);
+    row->dSubEnergy += dShare;
+    dEnergy -= dShare;
+    i64From = i64End;
+    closeSub(row);
+    u8Closed++;
+  }
+  row->dSubEnergy += dEnergy;
+  row->dLastWh = dWh;
+  row->tLastWh = mdt;
+}
+
+/**
+End the running sub-interval and update the demand over the window that
+ends with it.
+*/
+void MeterStats::closeSub(rowState *row)
+{
+  double dWindow = 0;
+
+  if (row->bPartialSub)
+  {
+    // metering started inside this sub-interval; its energy is incomplete
+    row->bPartialSub = false;
+    row->i64SubStart += _u16SubSec;
+    row->dSubEnergy = 0;
+    return;
+  }
+
+  row->fSub[row->u8SubHead] = (float)row->dSubEnergy;
+  row->u8SubHead = (row->u8SubHead + 1 == _u8SubIntervals) ? 0 : row->u8SubHead + 1;
+  if (row->u8SubFilled < _u8SubIntervals)
+  {
+    row->u8SubFilled++;
+  }
+  row->i64SubStart += _u16SubSec;
+  row->dSubEnergy = 0;
+
+  if (row->u8SubFilled < _u8SubIntervals)
+  {
+    return;
+  }
+  for (uint8_t s = 0; s < _u8SubIntervals; s++)
+  {
+    dWindow += row->fSub[s];
+  }
+  row->fEnergy = (float)dWindow;
+  row->fDemand = (float)(dWindow * 3600 / ((uint32_t)_u16SubSec * _u8SubIntervals));
+  row->tEnd = (time_t)row->i64SubStart;
+  if (row->fDemand > row->fPeak)
+  {
+    row->fPeak = row->fDemand;
+    row->tPeak = row->tEnd;
+  }
+}
@@ -0,0 +1,122 @@
+#ifndef ModbusMeter_Stats_h
+#define ModbusMeter_Stats_h
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusMeter_ESP32.h"
+
+/**
+Running statistics and demand of many meters, updated one reading at a
+time.
+
+Feed every reading with add() right after it lands in md[]/pd[]. Each field
+keeps its minimum, maximum and mean over the current statistics window; the
+windows are aligned to multiples of their length in mdt (a 900 s window
+rolls over at :00, :15, :30 and :45), and the figures of the last completed
+window stay available after rollover. Demand is derived from wattHour
+deltas: the energy between two readings is spread over the demand
+sub-intervals it spans in proportion to time, and when a sub-interval ends
+the demand over the last u8SubIntervals of them is computed, a block
+demand with one sub-interval or a sliding one with several. Demand is in
+wattHour units per hour, e.g. kW for a meter reporting kWh.
+
+add() takes constant time per reading: a reading closes at most
+2 * u8SubIntervals + 1 demand sub-intervals, however long the gap before
+it. All memory is allocated by begin().
+Fields missing from u64Valid are skipped; a falling wattHour (meter reset)
+counts as no energy and restarts the deltas.
+*/
+class MeterStats
+{
+public:
+  MeterStats();
+  ~MeterStats();
+
+  /**
+  Statistics of one field over one window.
+  */
+  typedef struct __fieldStats
+  {
+    float fMin;
+    float fMax;
+    float fAvg;
+    uint32_t u32Count; ///< readings in the window; the figures are 0 without any
+    time_t tStart;     ///< start of the window
+  } fieldStats;
+
+  /**
+  Demand of one meter.
+  */
+  typedef struct __demandInfo
+  {
+    float fDemand;         ///< demand over the window ending at tEnd; 0 until the first full window
+    float fEnergy;         ///< energy in that window [wattHour units]
+    time_t tEnd;           ///< end of the last completed sub-interval
+    float fPeak;           ///< largest demand since begin() or resetPeak()
+    time_t tPeak;          ///< end of the window of fPeak
+    float fPartialEnergy;  ///< energy in the running sub-interval so far
+  } demandInfo;
+
+  bool begin(uint8_t u8Meters, uint8_t u8Fields, mbArena *arena = 0);
+  bool setWindow(uint32_t u32WindowSec);
+  bool setDemand(uint16_t u16IntervalSec, uint8_t u8SubIntervals = 1);
+
+  bool add(uint8_t u8Row, const ModbusMeter::meterData &data);
+  bool add(uint8_t u8Row, const ModbusMeter::pqData &data);
+  void clear(uint8_t u8Row);
+  void resetPeak(uint8_t u8Row);
+
+  bool getStats(uint8_t u8Row, uint8_t u8Field, bool bCompleted, fieldStats *stats);
+  bool getDemand(uint8_t u8Row, demandInfo *demand);
+
+  static const uint8_t ku8MaxSubIntervals = 15;
+  static const uint32_t ku32DefaultWindowSec = 900;
+  static const uint16_t ku16DefaultDemandSec = 900;
+
+private:
+  // running figures of one field in the current window
+  typedef struct __fieldAcc
+  {
+    float fMin;
+    float fMax;
+    double dSum;
+    uint32_t u32Count;
+  } fieldAcc;
+
+  // per-meter window and demand state
+  typedef struct __rowState
+  {
+    int64_t i64Window;       ///< current statistics window, mdt / window length; -1 before the first reading
+    int64_t i64LastWindow;   ///< window of _last; -1 if none completed
+    bool bEnergy;            ///< dLastWh/tLastWh hold a reading
+    double dLastWh;
+    time_t tLastWh;
+    int64_t i64SubStart;     ///< start of the running sub-interval
+    bool bPartialSub;        ///< the running sub-interval began before the first reading
+    double dSubEnergy;       ///< energy of the running sub-interval
+    float fSub[ku8MaxSubIntervals]; ///< energy of the last completed sub-intervals, ring
+    uint8_t u8SubHead;       ///< next ring slot to fill
+    uint8_t u8SubFilled;     ///< completed sub-intervals in the ring
+    float fDemand;
+    float fEnergy;
+    time_t tEnd;
+    float fPeak;
+    time_t tPeak;
+  } rowState;
+
+  fieldAcc *_acc;  ///< u8Fields per row, current window
+  fieldAcc *_last; ///< u8Fields per row, last completed window
+  rowState *_rows;
+  uint8_t _u8Rows;
+  uint8_t _u8Fields;
+  bool _bOwnData;
+  uint32_t _u32WindowSec;
+  uint16_t _u16SubSec; ///< length of a demand sub-interval
+  uint8_t _u8SubIntervals;
+
+  void freeData();
+  bool addRow(uint8_t u8Row, time_t mdt, const float *values, uint8_t u8Fields, uint64_t u64Valid);
+  void addEnergy(rowState *row, time_t mdt, double dWh);
+  void closeSub(rowState *row);
+};
+
+#endif
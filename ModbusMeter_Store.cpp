@@ -0,0 +1,232 @@
+#include "ModbusMeter_Store.h"
+
+MeterStore::MeterStore(void)
+{
+  _data = 0;
+  _mdt = 0;
+  _u16Stride = 0;
+  _u8Rows = 0;
+  _u8Fields = 0;
+  _bOwnData = false;
+}
+
+MeterStore::~MeterStore(void)
+{
+  freeData();
+}
+
+/**
+Allocate the columns.
+
+@param u8Meters number of rows
+@param u8Fields columns: ModbusMeter::ku8MeterFields for energy meters,
+       ModbusMeter::ku8PQFields to keep the PQ fields as well
+@param arena arena to allocate from; 0 = heap
+@return false if the memory could not be allocated
+*/
+bool MeterStore::begin(uint8_t u8Meters, uint8_t u8Fields, mbArena *arena)
+{
+  uint16_t u16Stride = (u8Meters + AGGREGATE_LANES - 1) / AGGREGATE_LANES * AGGREGATE_LANES;
+  uint32_t u32Data = (uint32_t)u16Stride * u8Fields * sizeof(float);
+
+  freeData();
+  if (!u8Meters || !u8Fields || u8Fields > ModbusMeter::ku8PQFields)
+  {
+    return false;
+  }
+
+  if (arena)
+  {
+    // 32-byte alignment lets every column start on a vector boundary
+    _data = (float *)arena_alloc(arena, u32Data, 32);
+    _mdt = (time_t *)arena_alloc(arena, u8Meters * sizeof(time_t), alignof(time_t));
+  }
+  else
+  {
+    _data = (float *)calloc(1, u32Data);
+    _mdt = (time_t *)calloc(u8Meters, sizeof(time_t));
+    _bOwnData = true;
+  }
+
+  if (!_data || !_mdt)
+  {
+    freeData();
+    return false;
+  }
+  _u16Stride = u16Stride;
+  _u8Rows = u8Meters;
+  _u8Fields = u8Fields;
+  return true;
+}
+
+/**
+Store an energy meter reading; PQ columns of the row are left as they are.
+
+Only fields flagged in u64Valid are written: after a partial read the
+missing ones keep the row's previous value, so the totals stay finite.
+*/
+void MeterStore::set(uint8_t u8Row, const ModbusMeter::meterData &data)
+{
+  setRow(u8Row, data.mdt, &data.watt, ModbusMeter::ku8MeterFields, data.u64Valid);
+}
+
+/**
+Store a PQ meter reading; fields beyond the store's columns are dropped,
+and fields not flagged in u64Valid keep their previous value.
+*/
+void MeterStore::set(uint8_t u8Row, const ModbusMeter::pqData &data)
+{
+  setRow(u8Row, data.mdt, &data.watt, ModbusMeter::ku8PQFields, data.u64Valid);
+}
+
+/**
+Zero a row, e.g. for a meter that stopped answering, so it drops out of
+the totals and the min/max.
+*/
+void MeterStore::clear(uint8_t u8Row)
+{
+  uint8_t k;
+
+  if (u8Row >= _u8Rows)
+  {
+    return;
+  }
+  for (k = 0; k < _u8Fields; k++)
+  {
+    _data[k * _u16Stride + u8Row] = 0;
+  }
+  _mdt[u8Row] = 0;
+}
+
+/**
+Column of a field, rows() values long; 0 if the store has no such column.
+*/
+const float *MeterStore::column(uint8_t u8Field) const
+{
+  return (u8Field < _u8Fields) ? _data + u8Field * _u16Stride : 0;
+}
+
+time_t MeterStore::timestamp(uint8_t u8Row) const
+{
+  return (u8Row < _u8Rows) ? _mdt[u8Row] : 0;
+}
+
+uint8_t MeterStore::rows() const
+{
+  return _u8Rows;
+}
+
+uint8_t MeterStore::fields() const
+{
+  return _u8Fields;
+}
+
+/**
+Sum of one field over every row.
+*/
+float MeterStore::sum(uint8_t u8Field) const
+{
+  return (u8Field < _u8Fields) ? aggregate_sum(column(u8Field), _u8Rows) : 0;
+}
+
+/**
+Smallest and largest non-zero value of one field.
+
+@return false if the field has no non-zero value
+*/
+bool MeterStore::minMax(uint8_t u8Field, float *pfMin, float *pfMax) const
+{
+  return (u8Field < _u8Fields) ? aggregate_minmax(column(u8Field), _u8Rows, pfMin, pfMax) : false;
+}
+
+/**
+Site power factor: the meters' power factors weighted by |watt|.
+*/
+float MeterStore::weightedPf() const
+{
+  float fWeights;
+  float fDot;
+
+  if (_u8Fields <= ModbusMeter::ku8FieldPf)
+  {
+    return 0;
+  }
+  fDot = aggregate_dot_abs(column(ModbusMeter::ku8FieldPf), column(ModbusMeter::ku8FieldWatt), _u8Rows, &fWeights);
+  return (fWeights > 0) ? fDot / fWeights : 0;
+}
+
+/**
+Compute the feeder totals in one pass over the needed columns.
+*/
+void MeterStore::totals(siteTotals *totals) const
+{
+  float fMin, fMax;
+  uint8_t p;
+
+  memset(totals, 0, sizeof(*totals));
+  if (_u8Fields < ModbusMeter::ku8MeterFields)
+  {
+    return;
+  }
+
+  totals->watt = sum(ModbusMeter::ku8FieldWatt);
+  totals->wattHour = sum(ModbusMeter::ku8FieldWattHour);
+  totals->varh = sum(ModbusMeter::ku8FieldVarh);
+  totals->pf = weightedPf();
+  totals->vMin = 3.4e38f;
+
+  for (p = 0; p < 3; p++)
+  {
+    totals->i[p] = sum(ModbusMeter::ku8FieldI0 + p);
+    if (minMax(ModbusMeter::ku8FieldI0 + p, &fMin, &fMax) && fMax > totals->iMax)
+    {
+      totals->iMax = fMax;
+    }
+    if (minMax(ModbusMeter::ku8FieldV0 + p, &fMin, &fMax))
+    {
+      totals->vMin = (fMin < totals->vMin) ? fMin : totals->vMin;
+      totals->vMax = (fMax > totals->vMax) ? fMax : totals->vMax;
+    }
+  }
+  if (totals->vMin > totals->vMax)
+  {
+    totals->vMin = 0;
+  }
+}
+
+void MeterStore::freeData()
+{
+  if (_bOwnData)
+  {
+    free(_data);
+    free(_mdt);
+  }
+  _data = 0;
+  _mdt = 0;
+  _u16Stride = 0;
+  _u8Rows = 0;
+  _u8Fields = 0;
+  _bOwnData = false;
+}
+
+void MeterStore::setRow(uint8_t u8Row, time_t mdt, const float *values, uint8_t u8Fields, uint64_t u64Valid)
+{
+  uint8_t k;
+
+  if (u8Row >= _u8Rows)
+  {
+    return;
+  }
+  if (u8Fields > _u8Fields)
+  {
+    u8Fields = _u8Fields;
+  }
+  for (k = 0; k < u8Fields; k++)
+  {
+    if (u64Valid & (1ULL << k))
+    {
+      _data[k * _u16Stride + u8Row] = values[k];
+    }
+  }
+  _mdt[u8Row] = mdt;
+}
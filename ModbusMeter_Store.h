@@ -0,0 +1,68 @@
+#ifndef ModbusMeter_Store_h
+#define ModbusMeter_Store_h
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusMeter_ESP32.h"
+
+// reductions over float columns
+#include "util/aggregate.h"
+
+/**
+Readings of many meters kept as one contiguous float column per field.
+
+Columns are indexed by the ModbusMeter::ku8Field* constants and hold one
+value per meter row, so a site total or a maximum walks a single array
+instead of striding through meterData/pqData. Rows are filled from the
+readings after every poll; aggregation then costs the same per meter no
+matter how many fields a record has.
+*/
+class MeterStore
+{
+public:
+  MeterStore();
+  ~MeterStore();
+
+  /**
+  Feeder totals over every row.
+  */
+  typedef struct __siteTotals
+  {
+    float watt;     ///< sum of active power
+    float wattHour; ///< sum of active energy
+    float varh;     ///< sum of reactive energy
+    float i[3];     ///< per-phase current sums
+    float pf;       ///< power factor weighted by |watt|; 0 without load
+    float iMax;     ///< largest phase current of any meter
+    float vMin;     ///< lowest phase voltage of any meter, unused phases excluded
+    float vMax;     ///< highest phase voltage of any meter
+  } siteTotals;
+
+  bool begin(uint8_t u8Meters, uint8_t u8Fields, mbArena *arena = 0);
+
+  void set(uint8_t u8Row, const ModbusMeter::meterData &data);
+  void set(uint8_t u8Row, const ModbusMeter::pqData &data);
+  void clear(uint8_t u8Row);
+
+  const float *column(uint8_t u8Field) const;
+  time_t timestamp(uint8_t u8Row) const;
+  uint8_t rows() const;
+  uint8_t fields() const;
+
+  float sum(uint8_t u8Field) const;
+  bool minMax(uint8_t u8Field, float *pfMin, float *pfMax) const;
+  float weightedPf() const;
+  void totals(siteTotals *totals) const;
+
+private:
+  float *_data;     ///< u8Fields columns of _u16Stride floats
+  time_t *_mdt;
+  uint16_t _u16Stride; ///< rows rounded up to AGGREGATE_LANES; padding stays 0
+  uint8_t _u8Rows;
+  uint8_t _u8Fields;
+  bool _bOwnData;
+
+  void freeData();
+  void setRow(uint8_t u8Row, time_t mdt, const float *values, uint8_t u8Fields, uint64_t u64Valid);
+};
+
+#endif
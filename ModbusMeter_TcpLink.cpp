@@ -0,0 +1,518 @@
+#include "ModbusMeter_TcpLink.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+ModbusTcpLink::ModbusTcpLink(void)
+{
+  memset(&_addr, 0, sizeof(_addr));
+  _fd = -1;
+  _bConnecting = false;
+  _u32ConnectMs = 0;
+  _u8Window = ku8MaxInFlight;
+  _u16TimeoutMs = ku16DefaultTimeoutMs;
+  _u16NextTid = 0;
+  memset(_slots, 0, sizeof(_slots));
+  _u8Used = 0;
+  _u8InFlight = 0;
+  _u16TxLen = 0;
+  _u16RxLen = 0;
+  _u32BusySinceUs = 0;
+  resetStats();
+}
+
+ModbusTcpLink::~ModbusTcpLink(void)
+{
+  close();
+}
+
+/**
+Set the gateway address. The connection is opened by the first request.
+
+@param host IPv4 address in dotted notation
+*/
+void ModbusTcpLink::begin(const char *host, uint16_t u16Port)
+{
+  close();
+  memset(&_addr, 0, sizeof(_addr));
+  _addr.sin_family = AF_INET;
+  _addr.sin_port = htons(u16Port);
+  inet_pton(AF_INET, host, &_addr.sin_addr);
+}
+
+/**
+Limit the number of requests outstanding at once, 1..ku8MaxInFlight.
+Gateways that serialise onto RS-485 gain nothing beyond one request per
+slave line; native TCP meters usually accept several.
+*/
+void ModbusTcpLink::setWindow(uint8_t u8Window)
+{
+  _u8Window = (u8Window < 1) ? 1 : (u8Window > ku8MaxInFlight) ? ku8MaxInFlight : u8Window;
+}
+
+/**
+Time a request may stay unanswered, and a connection attempt may take
+[milliseconds].
+*/
+void ModbusTcpLink::setTimeout(uint16_t u16TimeoutMs)
+{
+  _u16TimeoutMs = u16TimeoutMs;
+}
+
+/**
+Drop the connection; outstanding requests complete with ku8MBNoConnection.
+*/
+void ModbusTcpLink::close()
+{
+  fail(ModbusMeter::ku8MBNoConnection);
+}
+
+bool ModbusTcpLink::connected()
+{
+  return _fd >= 0 && !_bConnecting;
+}
+
+/**
+Queue a read request.
+
+@param tid receives the transaction ID to pass to take()
+@return ku8MBPending if queued, ku8MBBusy if the window is full or the
+        socket has not taken earlier requests yet, ku8MBNoConnection if no
+        socket could be created
+*/
+uint8_t ModbusTcpLink::request(uint8_t unit, uint8_t fn, uint16_t u16Address, uint16_t u16Qty, uint16_t *tid)
+{
+  tcpSlot *slot = 0;
+  uint8_t *p;
+  uint8_t i;
+
+  if (_u8Used >= _u8Window || (size_t)_u16TxLen + ku8RequestLen > sizeof(_u8TxBuf))
+  {
+    return ModbusMeter::ku8MBBusy;
+  }
+  if (!open())
+  {
+    return ModbusMeter::ku8MBNoConnection;
+  }
+
+  for (i = 0; i < ku8MaxInFlight && !slot; i++)
+  {
+    if (_slots[i].u8State == ku8SlotFree)
+      slot = &_slots[i];
+  }
+
+  // IDs only have to be unique among requests still known to the link
+  do
+  {
+    _u16NextTid++;
+  } while (slotFor(_u16NextTid, false));
+
+  slot->u8State = ku8SlotSent;
+  slot->u8Result = ModbusMeter::ku8MBPending;
+  slot->u8Unit = unit;
+  slot->u8Fn = fn;
+  slot->u8Words = 0;
+  slot->u16Tid = _u16NextTid;
+  slot->u32SentMs = millis();
+  *tid = slot->u16Tid;
+
+  p = _u8TxBuf + _u16TxLen;
+  p[0] = highByte(slot->u16Tid);
+  p[1] = lowByte(slot->u16Tid);
+  p[2] = 0; // protocol 0 = Modbus
+  p[3] = 0;
+  p[4] = 0; // length of unit + PDU
+  p[5] = 6;
+  p[6] = unit;
+  p[7] = fn;
+  p[8] = highByte(u16Address);
+  p[9] = lowByte(u16Address);
+  p[10] = highByte(u16Qty);
+  p[11] = lowByte(u16Qty);
+  _u16TxLen += ku8RequestLen;
+
+  if (!_u8InFlight)
+  {
+    _u32BusySinceUs = micros();
+  }
+  _u8Used++;
+  _u8InFlight++;
+  _stats.u32Requests++;
+  if (_u8InFlight > _stats.u8MaxInFlight)
+  {
+    _stats.u8MaxInFlight = _u8InFlight;
+  }
+
+  if (!_bConnecting)
+  {
+    flushTx();
+  }
+  return ModbusMeter::ku8MBPending;
+}
+
+/**
+Complete a pending connect, send queued requests, take in answers and
+expire requests older than the timeout. Never blocks.
+*/
+void ModbusTcpLink::poll()
+{
+  uint8_t i;
+
+  if (_fd < 0)
+  {
+    return;
+  }
+
+  if (_bConnecting)
+  {
+    fd_set wr;
+    struct timeval tv = {0, 0};
+
+    FD_ZERO(&wr);
+    FD_SET(_fd, &wr);
+    if (select(_fd + 1, 0, &wr, 0, &tv) > 0)
+    {
+      int err = 0;
+      socklen_t len = sizeof(err);
+
+      getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err)
+      {
+        fail(ModbusMeter::ku8MBNoConnection);
+        return;
+      }
+      _bConnecting = false;
+    }
+    else if ((uint32_t)(millis() - _u32ConnectMs) >= _u16TimeoutMs)
+    {
+      fail(ModbusMeter::ku8MBNoConnection);
+      return;
+    }
+    else
+    {
+      return;
+    }
+  }
+
+  flushTx();
+  receive();
+
+  for (i = 0; i < ku8MaxInFlight; i++)
+  {
+    if (_slots[i].u8State == ku8SlotSent && (uint32_t)(millis() - _slots[i].u32SentMs) >= _u16TimeoutMs)
+    {
+      _stats.u32Timeouts++;
+      unqueue(_slots[i].u16Tid);
+      complete(&_slots[i], ModbusMeter::ku8MBResponseTimedOut);
+    }
+  }
+}
+
+/**
+Collect a finished request.
+
+@param pu8Data receives the registers read as they came on the wire,
+       big-endian, 2 * *pu8Words bytes; room for 125 registers
+@param pu8Words receives the number of registers
+@return ku8MBPending while unanswered; afterwards 0, the exception code or
+        a ku8MB* error. An unknown ID reports ku8MBResponseTimedOut.
+*/
+uint8_t ModbusTcpLink::take(uint16_t tid, uint8_t *pu8Data, uint8_t *pu8Words)
+{
+  tcpSlot *slot = slotFor(tid, false);
+  uint8_t result;
+
+  if (!slot)
+  {
+    return ModbusMeter::ku8MBResponseTimedOut;
+  }
+  if (slot->u8State == ku8SlotSent)
+  {
+    return ModbusMeter::ku8MBPending;
+  }
+
+  result = slot->u8Result;
+  *pu8Words = slot->u8Words;
+  memcpy(pu8Data, slot->u8Data, 2 * slot->u8Words);
+  release(slot);
+  return result;
+}
+
+/**
+Forget a request; its answer, if it still comes, is discarded.
+*/
+void ModbusTcpLink::cancel(uint16_t tid)
+{
+  tcpSlot *slot = slotFor(tid, false);
+
+  if (slot)
+  {
+    if (slot->u8State == ku8SlotSent)
+    {
+      unqueue(tid);
+      complete(slot, ModbusMeter::ku8MBResponseTimedOut);
+    }
+    release(slot);
+  }
+}
+
+/**
+Requests queued, on the wire or answered but not yet taken.
+*/
+uint8_t ModbusTcpLink::inFlight()
+{
+  return _u8Used;
+}
+
+void ModbusTcpLink::getStats(tcpStats *stats)
+{
+  *stats = _stats;
+  if (_u8InFlight)
+  {
+    stats->u64BusyUs += (uint32_t)(micros() - _u32BusySinceUs);
+  }
+}
+
+void ModbusTcpLink::resetStats()
+{
+  memset(&_stats, 0, sizeof(_stats));
+  _u32BusySinceUs = micros();
+}
+
+/**
+Answers per second while the connection had work outstanding; the rate a
+polling loop that keeps the window full can expect.
+*/
+uint32_t ModbusTcpLink::getThroughput()
+{
+  tcpStats stats;
+
+  getStats(&stats);
+  return stats.u64BusyUs ? (uint32_t)(stats.u32Responses * 1000000ULL / stats.u64BusyUs) : 0;
+}
+
+/**
+Start a non-blocking connect unless a socket is already open.
+*/
+bool ModbusTcpLink::open()
+{
+  int flags;
+  int one = 1;
+
+  if (_fd >= 0)
+  {
+    return true;
+  }
+
+  _fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (_fd < 0)
+  {
+    return false;
+  }
+  flags = fcntl(_fd, F_GETFL, 0);
+  fcntl(_fd, F_SETFL, flags | O_NONBLOCK);
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(_fd, (struct sockaddr *)&_addr, sizeof(_addr)) < 0 && errno != EINPROGRESS)
+  {
+    ::close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  _bConnecting = true;
+  _u32ConnectMs = millis();
+  _u16TxLen = 0;
+  _u16RxLen = 0;
+  _stats.u32Connects++;
+  return true;
+}
+
+/**
+Close the socket and complete every outstanding request with result.
+*/
+void ModbusTcpLink::fail(uint8_t result)
+{
+  uint8_t i;
+
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _bConnecting = false;
+  _u16TxLen = 0;
+  _u16RxLen = 0;
+
+  for (i = 0; i < ku8MaxInFlight; i++)
+  {
+    if (_slots[i].u8State == ku8SlotSent)
+    {
+      _stats.u32Timeouts++;
+      complete(&_slots[i], result);
+    }
+  }
+}
+
+/**
+Hand queued requests to the socket, as much as it takes.
+*/
+void ModbusTcpLink::flushTx()
+{
+  ssize_t n;
+
+  if (!_u16TxLen || _fd < 0)
+  {
+    return;
+  }
+
+  n = send(_fd, _u8TxBuf, _u16TxLen, MSG_NOSIGNAL);
+  if (n < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      fail(ModbusMeter::ku8MBNoConnection);
+    }
+    return;
+  }
+
+  _stats.u32BytesSent += n;
+  _u16TxLen -= n;
+  memmove(_u8TxBuf, _u8TxBuf + n, _u16TxLen);
+}
+
+/**
+Take a request out of the send queue if none of it has gone out yet; a
+request the socket has taken in part must be completed, or the gateway
+loses track of the frames after it.
+
+The queue holds whole requests, except that the first may have been sent
+in part: whole requests start _u16TxLen % ku8RequestLen bytes in.
+*/
+void ModbusTcpLink::unqueue(uint16_t tid)
+{
+  uint16_t u16Pos;
+
+  for (u16Pos = _u16TxLen % ku8RequestLen; u16Pos < _u16TxLen; u16Pos += ku8RequestLen)
+  {
+    if (word(_u8TxBuf[u16Pos], _u8TxBuf[u16Pos + 1]) == tid)
+    {
+      _u16TxLen -= ku8RequestLen;
+      memmove(_u8TxBuf + u16Pos, _u8TxBuf + u16Pos + ku8RequestLen, _u16TxLen - u16Pos);
+      return;
+    }
+  }
+}
+
+/**
+Read what the socket has and dispatch every complete answer by its
+transaction ID.
+*/
+void ModbusTcpLink::receive()
+{
+  uint16_t u16Pos = 0;
+  bool bClosed = false;
+  ssize_t n;
+
+  while (_fd >= 0 && _u16RxLen < sizeof(_u8RxBuf))
+  {
+    n = recv(_fd, _u8RxBuf + _u16RxLen, sizeof(_u8RxBuf) - _u16RxLen, 0);
+    if (n > 0)
+    {
+      _stats.u32BytesReceived += n;
+      _u16RxLen += n;
+      continue;
+    }
+    // closed by the gateway: answers already received are still used
+    bClosed = (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+    break;
+  }
+
+  while (_u16RxLen - u16Pos >= ku8MBAPHeader)
+  {
+    const uint8_t *frame = _u8RxBuf + u16Pos;
+    uint16_t u16Len = word(frame[4], frame[5]); // unit + PDU
+    const uint8_t *pdu = frame + ku8MBAPHeader;
+    tcpSlot *slot;
+
+    if (word(frame[2], frame[3]) != 0 || u16Len < 3 || u16Len > ku16MaxADU - 6)
+    {
+      // not Modbus or out of step; nothing after this can be trusted
+      fail(ModbusMeter::ku8MBNoConnection);
+      return;
+    }
+    if (_u16RxLen - u16Pos < 6 + u16Len)
+    {
+      break;
+    }
+    u16Pos += 6 + u16Len;
+
+    slot = slotFor(word(frame[0], frame[1]), true);
+    if (!slot)
+    {
+      _stats.u32Unmatched++;
+      continue;
+    }
+
+    _stats.u32Responses++;
+    if (frame[6] != slot->u8Unit)
+    {
+      complete(slot, ModbusMeter::ku8MBInvalidSlaveID);
+    }
+    else if (pdu[0] == (slot->u8Fn | 0x80))
+    {
+      _stats.u32Exceptions++;
+      complete(slot, pdu[1]);
+    }
+    else if (pdu[0] != slot->u8Fn || pdu[1] > u16Len - 3 || pdu[1] > 2 * ku8MaxReadQty)
+    {
+      complete(slot, ModbusMeter::ku8MBInvalidFunction);
+    }
+    else
+    {
+      slot->u8Words = pdu[1] >> 1;
+      memcpy(slot->u8Data, pdu + 2, 2 * slot->u8Words);
+      complete(slot, ModbusMeter::ku8MBSuccess);
+    }
+  }
+
+  _u16RxLen -= u16Pos;
+  memmove(_u8RxBuf, _u8RxBuf + u16Pos, _u16RxLen);
+
+  if (bClosed)
+  {
+    fail(ModbusMeter::ku8MBNoConnection);
+  }
+}
+
+/**
+Mark a sent request finished; it stays in its slot until take().
+*/
+void ModbusTcpLink::complete(tcpSlot *slot, uint8_t result)
+{
+  slot->u8State = ku8SlotDone;
+  slot->u8Result = result;
+  if (!--_u8InFlight)
+  {
+    _stats.u64BusyUs += (uint32_t)(micros() - _u32BusySinceUs);
+  }
+}
+
+void ModbusTcpLink::release(tcpSlot *slot)
+{
+  slot->u8State = ku8SlotFree;
+  _u8Used--;
+}
+
+ModbusTcpLink::tcpSlot *ModbusTcpLink::slotFor(uint16_t tid, bool bSentOnly)
+{
+  for (uint8_t i = 0; i < ku8MaxInFlight; i++)
+  {
+    if (_slots[i].u16Tid == tid && (bSentOnly ? _slots[i].u8State == ku8SlotSent : _slots[i].u8State != ku8SlotFree))
+    {
+      return &_slots[i];
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef ModbusMeter_TcpLink_h
+#define ModbusMeter_TcpLink_h
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+#include <errno.h>
+#if defined(ESP32)
+#include <lwip/sockets.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusMeter_ESP32.h"
+
+/**
+One Modbus TCP connection with several requests in flight.
+
+Each request carries its own MBAP transaction ID, so up to the window size
+can be outstanding at once and answers are matched by ID in whatever order
+they come back. The connection is opened on the first request, kept open
+across requests and reopened after an error. Every ModbusMeter bound to the
+link with begin(ModbusTcpLink &) shares the connection; they must be polled
+from the same task, the link does no locking.
+
+Non-blocking throughout: request() queues, poll() moves bytes and expires
+requests, take() collects a finished request.
+*/
+class ModbusTcpLink
+{
+public:
+  ModbusTcpLink();
+  ~ModbusTcpLink();
+
+  /**
+  Counters of the connection since construction or resetStats().
+  */
+  typedef struct __tcpStats
+  {
+    uint32_t u32Connects;      ///< connections opened
+    uint32_t u32Requests;
+    uint32_t u32Responses;     ///< answers matched to a request, exceptions included
+    uint32_t u32Exceptions;
+    uint32_t u32Timeouts;      ///< requests expired or lost with the connection
+    uint32_t u32Unmatched;     ///< answers with an unknown or cancelled transaction ID
+    uint32_t u32BytesSent;
+    uint32_t u32BytesReceived;
+    uint8_t u8MaxInFlight;     ///< most requests outstanding at once
+    uint64_t u64BusyUs;        ///< time with at least one request outstanding
+  } tcpStats;
+
+  void begin(const char *host, uint16_t u16Port = 502);
+  void setWindow(uint8_t u8Window);
+  void setTimeout(uint16_t u16TimeoutMs);
+  void close();
+  bool connected();
+
+  uint8_t request(uint8_t unit, uint8_t fn, uint16_t u16Address, uint16_t u16Qty, uint16_t *tid);
+  void poll();
+  uint8_t take(uint16_t tid, uint8_t *pu8Data, uint8_t *pu8Words);
+  void cancel(uint16_t tid);
+  uint8_t inFlight();
+
+  void getStats(tcpStats *stats);
+  void resetStats();
+  uint32_t getThroughput();
+
+  static const uint8_t ku8MaxInFlight = 8;          ///< largest window
+  static const uint16_t ku16DefaultTimeoutMs = 1000;
+
+private:
+  static const uint8_t ku8SlotFree = 0;
+  static const uint8_t ku8SlotSent = 1; ///< queued or on the wire, awaiting the answer
+  static const uint8_t ku8SlotDone = 2; ///< answered or failed, awaiting take()
+
+  static const uint8_t ku8MBAPHeader = 7;          ///< transaction, protocol, length, unit
+  static const uint16_t ku16MaxADU = 260;          ///< MBAP header + largest PDU
+  static const uint8_t ku8MaxReadQty = 125;
+  static const uint8_t ku8RequestLen = 12;         ///< MBAP header + read request PDU
+
+  // one outstanding request
+  typedef struct __tcpSlot
+  {
+    uint8_t u8State;
+    uint8_t u8Result;
+    uint8_t u8Unit;
+    uint8_t u8Fn;
+    uint8_t u8Words;
+    uint16_t u16Tid;
+    uint32_t u32SentMs;
+    uint8_t u8Data[2 * ku8MaxReadQty]; ///< answer payload, big-endian
+  } tcpSlot;
+
+  struct sockaddr_in _addr;
+  int _fd;
+  bool _bConnecting;
+  uint32_t _u32ConnectMs;
+  uint8_t _u8Window;
+  uint16_t _u16TimeoutMs;
+  uint16_t _u16NextTid;
+
+  tcpSlot _slots[ku8MaxInFlight];
+  uint8_t _u8Used;     ///< slots not free
+  uint8_t _u8InFlight; ///< slots awaiting their answer
+
+  uint8_t _u8TxBuf[ku8MaxInFlight * ku8RequestLen]; ///< requests the socket has not accepted yet
+  uint16_t _u16TxLen;
+  uint8_t _u8RxBuf[2 * ku16MaxADU];
+  uint16_t _u16RxLen;
+
+  tcpStats _stats;
+  uint32_t _u32BusySinceUs;
+
+  bool open();
+  void fail(uint8_t result);
+  void flushTx();
+  void unqueue(uint16_t tid);
+  void receive();
+  void complete(tcpSlot *slot, uint8_t result);
+  void release(tcpSlot *slot);
+  tcpSlot *slotFor(uint16_t tid, bool bSentOnly);
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+  aggregate_bench.cpp - site totals from pqData records versus MeterStore
+
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -march=native -std=gnu++11 -Iextras/host -I. -o aggregate_bench \
+        ModbusMeter_Store.cpp extras/bench/aggregate_bench.cpp && ./aggregate_bench
+
+  Both sides compute the same feeder totals (power, energy, per-phase
+  current, weighted power factor, current maximum, voltage range) for a
+  panel of meters; the record loop is the straightforward code an
+  application writes against pd[].
+
+  GCC 12 vectorizes the min/max lanes of util/aggregate.h at -O2 but unrolls
+  them into scalar code at -O3; compare both when changing the kernels.
+*/
+
+#include <chrono>
+
+#include "ModbusMeter_Store.h"
+
+volatile float fSink;
+
+static void totalsFromRecords(const ModbusMeter::pqData *pd, uint16_t n, MeterStore::siteTotals *t)
+{
+  float fWeights = 0;
+  float fDot = 0;
+
+  memset(t, 0, sizeof(*t));
+  t->vMin = 3.4e38f;
+  for (uint16_t m = 0; m < n; m++)
+  {
+    const ModbusMeter::pqData *r = &pd[m];
+    const float *i = &r->i0;
+    const float *v = &r->v0;
+    float a = (r->watt < 0) ? -r->watt : r->watt;
+
+    t->watt += r->watt;
+    t->wattHour += r->wattHour;
+    t->varh += r->varh;
+    fDot += r->pf * a;
+    fWeights += a;
+    for (uint8_t p = 0; p < 3; p++)
+    {
+      t->i[p] += i[p];
+      if (i[p] > t->iMax)
+        t->iMax = i[p];
+      if (v[p] != 0 && v[p] < t->vMin)
+        t->vMin = v[p];
+      if (v[p] > t->vMax)
+        t->vMax = v[p];
+    }
+  }
+  t->pf = (fWeights > 0) ? fDot / fWeights : 0;
+}
+
+int main()
+{
+  static const uint8_t kSizes[] = {8, 32, 128, 255};
+  static ModbusMeter::pqData pd[255];
+
+  for (uint16_t m = 0; m < 255; m++)
+  {
+    memset(&pd[m], 0, sizeof(pd[m]));
+    pd[m].watt = 1000 + m * 3.5f;
+    pd[m].wattHour = 50000 + m;
+    pd[m].pf = 0.9f + (m % 10) / 100.0f;
+    pd[m].varh = 100 + m;
+    pd[m].i0 = 4 + (m % 7) * 0.5f;
+    pd[m].i1 = 4 + (m % 5) * 0.5f;
+    pd[m].i2 = 4 + (m % 3) * 0.5f;
+    pd[m].v0 = 228 + (m % 9);
+    pd[m].v1 = 229 + (m % 4);
+    pd[m].v2 = 230 - (m % 6);
+    pd[m].u64Valid = ModbusMeter::ku64AllFields;
+  }
+
+  printf("%7s %12s %12s\n", "meters", "records ns", "store ns");
+  for (uint8_t s = 0; s < sizeof(kSizes); s++)
+  {
+    uint8_t n = kSizes[s];
+    MeterStore store;
+    MeterStore::siteTotals a, b;
+    const uint32_t ku32Loops = 200000;
+
+    store.begin(n, ModbusMeter::ku8PQFields);
+    for (uint8_t m = 0; m < n; m++)
+      store.set(m, pd[m]);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint32_t k = 0; k < ku32Loops; k++)
+    {
+      totalsFromRecords(pd, n, &a);
+      fSink = a.watt;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (uint32_t k = 0; k < ku32Loops; k++)
+    {
+      store.totals(&b);
+      fSink = b.watt;
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    if (a.iMax != b.iMax || a.vMin != b.vMin || a.vMax != b.vMax || fabsf(a.watt - b.watt) > 1e-3f * fabsf(a.watt))
+      printf("mismatch at %u meters\n", n);
+
+    printf("%7u %12.1f %12.1f\n", n,
+           std::chrono::duration<double, std::nano>(t1 - t0).count() / ku32Loops,
+           std::chrono::duration<double, std::nano>(t2 - t1).count() / ku32Loops);
+  }
+  return 0;
+}
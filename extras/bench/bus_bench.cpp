@@ -0,0 +1,259 @@
+/*
+  bus_bench.cpp - ModbusBusManager polling simulated RS-485 buses
+
+  The same meters are polled by the bus manager from one bus and split
+  over two, each bus a SimSlaveFarm of its own with one worker thread.
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -I. -o bus_bench \
+        ModbusMeter_ESP32.cpp ModbusMeter_Profiles.cpp ModbusMeter_BusManager.cpp \
+        ModbusMeter_TcpLink.cpp \
+        extras/host/HostArduino.cpp extras/host/SimSlaveFarm.cpp \
+        extras/bench/bus_bench.cpp -lpthread && ./bus_bench
+
+  Time is real, as the workers run concurrently: cycles/s depend on the
+  baud rate and slave latency, not on the host. While the workers run the
+  shared table is read continuously; every row must be a complete record.
+  After stop() every row is checked against a direct read of its meter.
+
+  The rate group run puts the energy, THD, unbalance and harmonic fields
+  of six PQ meters into a group read every ku8GroupCycles cycles. The
+  first cycle reads everything; after that every cycle must carry the
+  same share of slow reads, 6 / ku8GroupCycles meters' worth, give or
+  take one meter.
+*/
+
+#include <math.h>
+#include <time.h>
+
+#include "ModbusMeter_BusManager.h"
+#include "extras/host/SimSlaveFarm.h"
+
+static const uint32_t ku32Baud = 38400;
+static const uint32_t ku32RunMs = 3000;
+static const uint8_t ku8Meters = 8;
+
+static const uint32_t ku32GroupBaud = 115200;
+static const uint8_t ku8GroupMeters = 6;
+static const uint8_t ku8GroupCycles = 3;   ///< period of the slow group, in cycles
+static const uint32_t ku32CycleMs = 900;   ///< room for a full read of every meter
+static const uint8_t ku8GroupRun = 10;     ///< cycles observed
+
+typedef struct
+{
+  const char *name;
+  uint8_t u8Buses;
+} benchCase;
+
+static const benchCase kCases[] = {
+    {"1 bus x 8", 1},
+    {"2 buses x 4", 2},
+};
+
+// energy and PQ meters in pairs, so each bus gets both kinds
+static uint8_t typeOf(uint8_t u8Meter)
+{
+  return (u8Meter & 2) ? 0x81 : 0x02;
+}
+
+// a record is complete when every field its type reads is valid
+static bool complete(const ModbusBusManager::meterRecord &r, uint8_t mType)
+{
+  uint8_t u8Fields = ModbusMeter::isPQType(mType) ? ModbusMeter::ku8PQFields : ModbusMeter::ku8MeterFields;
+
+  return r.data.mdt != 0 && (r.data.u64Valid & ((1ULL << u8Fields) - 1)) == ((1ULL << u8Fields) - 1);
+}
+
+static bool check(ModbusMeter &node, const ModbusBusManager::meterRecord &r, uint8_t slave, uint8_t mType, float *adj)
+{
+  bool bPQ = ModbusMeter::isPQType(mType);
+  uint8_t u8Fields = bPQ ? ModbusMeter::ku8PQFields : ModbusMeter::ku8MeterFields;
+  const float *pfDirect;
+
+  if (node.readMeterData(0, slave, 0, mType, time(NULL), adj, 0, 0) != ModbusMeter::ku8MBSuccess)
+  {
+    printf("MISMATCH: slave %u does not answer a direct read\n", slave);
+    return false;
+  }
+  pfDirect = bPQ ? &node.pd[0].watt : &node.md[0].watt;
+  for (uint8_t f = 0; f < u8Fields; f++)
+  {
+    float a = (&r.data.watt)[f];
+
+    if (memcmp(&a, &pfDirect[f], sizeof(a)) != 0)
+    {
+      printf("MISMATCH: slave %u field %u: %.7g published, %.7g read\n", slave, f, a, pfDirect[f]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool runBuses(float *adj)
+{
+  double dBase = 0;
+  uint8_t k;
+
+  printf("%-14s %8s %8s %8s %9s\n", "case", "reads/s", "speedup", "cycles", "snapshots");
+  for (const benchCase *c = kCases; c < kCases + sizeof(kCases) / sizeof(kCases[0]); c++)
+  {
+    SimSlaveFarm *farms[2];
+    ModbusMeter nodes[2];
+    ModbusBusManager manager;
+    ModbusBusManager::meterRecord rec[ku8Meters];
+    uint32_t u32Snapshots = 0;
+    uint32_t u32Reads = 0;
+    uint32_t u32Cycles = 0;
+    uint32_t u32Start;
+    uint8_t b;
+
+    for (b = 0; b < c->u8Buses; b++)
+    {
+      farms[b] = new SimSlaveFarm(ku32Baud);
+      nodes[b].begin(*farms[b]);
+      nodes[b].setBaudRate(ku32Baud);
+      manager.addBus(nodes[b]);
+    }
+    for (k = 0; k < ku8Meters; k++)
+    {
+      b = k % c->u8Buses;
+      farms[b]->addSlave(k + 1, typeOf(k));
+      farms[b]->setLatency(k + 1, 2000);
+      manager.addMeter(b, k + 1, 0, typeOf(k), adj, 0, 0);
+    }
+
+    u32Start = millis();
+    manager.start(0);
+    while (millis() - u32Start < ku32RunMs)
+    {
+      manager.getRecords(rec, ku8Meters);
+      for (k = 0; k < ku8Meters; k++)
+      {
+        if (rec[k].u32Updates && !complete(rec[k], typeOf(k)))
+        {
+          printf("MISMATCH: %s row %u torn or incomplete\n", c->name, k);
+          manager.stop();
+          return false;
+        }
+      }
+      u32Snapshots++;
+      delay(1);
+    }
+    manager.stop();
+
+    manager.getRecords(rec, ku8Meters);
+    for (k = 0; k < ku8Meters; k++)
+    {
+      if (rec[k].u8Result != ModbusMeter::ku8MBSuccess || !check(nodes[k % c->u8Buses], rec[k], k + 1, typeOf(k), adj))
+      {
+        printf("MISMATCH: %s row %u result %02x\n", c->name, k, rec[k].u8Result);
+        return false;
+      }
+      u32Reads += rec[k].u32Updates;
+    }
+    for (b = 0; b < c->u8Buses; b++)
+    {
+      u32Cycles += manager.getCycles(b);
+      delete farms[b];
+    }
+
+    if (!dBase)
+      dBase = u32Reads * 1000.0 / ku32RunMs;
+    printf("%-14s %8.1f %8.2f %8u %9u\n", c->name, u32Reads * 1000.0 / ku32RunMs,
+           u32Reads * 1000.0 / ku32RunMs / dBase, u32Cycles, u32Snapshots);
+  }
+  return true;
+}
+
+// frames of one read of a meter, with the given fields
+static uint32_t framesOf(SimSlaveFarm &farm, ModbusMeter &node, uint64_t u64Mask, float *adj)
+{
+  farm.resetStats();
+  node.setReadMask(u64Mask);
+  node.readMeterData(0, 1, 0, 0x81, time(NULL), adj, 0, 0);
+  node.setReadMask(ModbusMeter::ku64AllFields);
+  return farm.frames();
+}
+
+static bool runGroups(float *adj)
+{
+  SimSlaveFarm farm(ku32GroupBaud);
+  ModbusMeter node;
+  ModbusBusManager manager;
+  uint32_t u32Frames[ku8GroupRun];
+  uint32_t u32Full, u32Fast, u32Expect, u32Min = 0xFFFFFFFFUL, u32Max = 0, u32Sum = 0;
+  uint64_t u64Fast = 0;
+  uint8_t u8Seen = 0;
+  uint8_t f, k;
+
+  node.begin(farm);
+  node.setBaudRate(ku32GroupBaud);
+  manager.addBus(node);
+  for (k = 1; k <= ku8GroupMeters; k++)
+  {
+    farm.addSlave(k, 0x81);
+    farm.setLatency(k, 2000);
+    manager.addMeter(0, k, 0, 0x81, adj, 0, 0);
+  }
+
+  manager.setRateGroup(1, ku8GroupCycles * ku32CycleMs);
+  for (f = 0; f < ModbusMeter::ku8PQFields; f++)
+  {
+    if (f == ModbusMeter::ku8FieldWattHour || f == ModbusMeter::ku8FieldVarh ||
+        (f >= ModbusMeter::ku8FieldThdvr && f < ModbusMeter::ku8FieldFreq))
+      manager.setFieldGroup(f, 1);
+    else
+      u64Fast |= 1ULL << f;
+  }
+  u32Full = framesOf(farm, node, ModbusMeter::ku64AllFields, adj);
+  u32Fast = framesOf(farm, node, u64Fast, adj);
+  u32Expect = ku8GroupMeters * u32Fast + ku8GroupMeters / ku8GroupCycles * (u32Full - u32Fast);
+
+  // the worker sleeps between cycles, so the counters are still there
+  farm.resetStats();
+  manager.start(ku32CycleMs);
+  while (u8Seen < ku8GroupRun)
+  {
+    if (manager.getCycles(0) > u8Seen)
+    {
+      u32Frames[u8Seen++] = farm.frames();
+      farm.resetStats();
+    }
+    delay(1);
+  }
+  manager.stop();
+
+  for (k = 0; k < ku8GroupRun; k++)
+  {
+    uint32_t n = u32Frames[k];
+
+    if (!k ? n != ku8GroupMeters * u32Full : n + (u32Full - u32Fast) < u32Expect || n > u32Expect + (u32Full - u32Fast))
+    {
+      printf("MISMATCH: rate groups, cycle %u: %u frames, expected %u\n", k, n, !k ? ku8GroupMeters * u32Full : u32Expect);
+      return false;
+    }
+    if (k)
+    {
+      u32Min = (n < u32Min) ? n : u32Min;
+      u32Max = (n > u32Max) ? n : u32Max;
+      u32Sum += n;
+    }
+  }
+
+  printf("%u pm2230, slow group every %u cycles: frames/cycle %u all fields, %u first, %u..%u after (mean %.1f)\n",
+         ku8GroupMeters, ku8GroupCycles, ku8GroupMeters * u32Full, u32Frames[0], u32Min, u32Max, (double)u32Sum / (ku8GroupRun - 1));
+  return true;
+}
+
+int main()
+{
+  float adj[ModbusMeter::ku8MeterFields];
+
+  for (uint8_t k = 0; k < ModbusMeter::ku8MeterFields; k++)
+  {
+    adj[k] = 1;
+  }
+  if (!runBuses(adj) || !runGroups(adj))
+    return 1;
+  return 0;
+}
@@ -0,0 +1,82 @@
+/*
+  crc16_bench.cpp - host-side microbenchmark of the util/crc16.h variants
+
+  Build and run on the development machine (not part of the Arduino build):
+
+    g++ -O2 -o crc16_bench extras/bench/crc16_bench.cpp && ./crc16_bench
+
+  Every variant is run over an 8-byte request frame and a 255-byte frame;
+  results are checked against the bitwise reference before timing.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+
+#include "../../util/crc16.h"
+
+static uint16_t crcBitwise(const uint8_t *buf, uint16_t len)
+{
+  uint16_t crc = 0xFFFF;
+  while (len--)
+    crc = crc16_update_bitwise(crc, *buf++);
+  return crc;
+}
+
+static uint16_t crcTable(const uint8_t *buf, uint16_t len)
+{
+  uint16_t crc = 0xFFFF;
+  while (len--)
+    crc = crc16_update_table(crc, *buf++);
+  return crc;
+}
+
+static uint16_t crcSlice4(const uint8_t *buf, uint16_t len)
+{
+  return crc16_block_slice4(0xFFFF, buf, len);
+}
+
+static void run(const char *name, uint16_t (*fn)(const uint8_t *, uint16_t), const uint8_t *buf, uint16_t len)
+{
+  const uint32_t u32Iterations = 20000000UL / len;
+  volatile uint16_t sink = 0;
+
+  if (fn(buf, len) != crcBitwise(buf, len))
+  {
+    printf("%-8s %3u bytes  MISMATCH\n", name, len);
+    return;
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < u32Iterations; i++)
+  {
+    sink = sink ^ fn(buf, len);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+
+  double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / u32Iterations;
+  printf("%-8s %3u bytes  %8.1f ns/frame  %6.2f ns/byte\n", name, len, ns, ns / len);
+}
+
+int main()
+{
+  uint8_t u8Request[8] = {0x01, 0x03, 0x0B, 0xB7, 0x00, 0x06, 0x00, 0x00};
+  uint8_t u8Frame[255];
+  uint16_t i;
+
+  for (i = 0; i < sizeof(u8Frame); i++)
+  {
+    u8Frame[i] = (uint8_t)(i * 37 + 11);
+  }
+
+  const uint16_t sizes[] = {8, 255};
+  for (i = 0; i < 2; i++)
+  {
+    const uint8_t *buf = (sizes[i] == 8) ? u8Request : u8Frame;
+    run("bitwise", crcBitwise, buf, sizes[i]);
+    run("table", crcTable, buf, sizes[i]);
+    run("slice4", crcSlice4, buf, sizes[i]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,185 @@
+/*
+  discovery_bench.cpp - ModbusDiscovery scanning a simulated RS-485 bus
+
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -I. -o discovery_bench \
+        ModbusMeter_ESP32.cpp ModbusMeter_Profiles.cpp ModbusMeter_TcpLink.cpp \
+        ModbusMeter_Discovery.cpp \
+        extras/host/HostArduino.cpp extras/host/SimSlaveFarm.cpp \
+        extras/bench/discovery_bench.cpp -lpthread && ./discovery_bench
+
+  The clock is virtual, so scan times follow the baud rate and the slave
+  latencies. The farm mixes meter types, a strict slave, and slaves slower
+  than the probe timeout whose late answers garble later probes: one is
+  found by the confirm pass, one is even slower than the confirm timeout
+  and garbles a probe of the confirm pass itself. Every slave but that one
+  must be found with the type it simulates, and no address without a slave
+  may be reported. The list then goes through pack() and unpack(), a
+  damaged blob must be refused, and verify() must confirm the cached list
+  and then report a slave gone and another one replaced.
+*/
+
+#include "ModbusMeter_Discovery.h"
+#include "extras/host/SimSlaveFarm.h"
+
+static const uint32_t ku32Baud = 9600;
+
+typedef struct
+{
+  uint8_t slave;
+  uint8_t mType;
+  uint32_t u32LatencyUs; ///< 0 keeps the default
+  bool bStrict;
+  bool bFound;           ///< expected in the scan result
+} simMeter;
+
+static const simMeter kFarm[] = {
+    {3, 0x01, 0, false, true},
+    {17, 0x02, 0, false, true},
+    {42, 0x03, 0, false, true},
+    {100, 0x81, 0, false, true},
+    {120, 0x02, 300000, false, false}, // answers after the confirm timeout
+    {122, 0x01, 60000, false, true},   // its late answer makes 120 a suspect
+    {150, 0x82, 0, false, true},
+    {200, 0x0b, 0, false, true},
+    {201, 0x06, 0, false, true},
+    {210, 0x08, 0, false, true},
+    {220, 0x07, 0, false, true},
+    {230, 0x02, 45000, false, true},
+    {240, 0x03, 0, true, true},
+};
+static const uint8_t ku8Farm = sizeof(kFarm) / sizeof(kFarm[0]);
+
+static uint8_t expectedType(uint8_t slave)
+{
+  for (uint8_t i = 0; i < ku8Farm; i++)
+  {
+    if (kFarm[i].slave == slave && kFarm[i].bFound)
+      return kFarm[i].mType;
+  }
+  return 0;
+}
+
+static bool checkFound(const char *what, ModbusDiscovery &d, uint8_t u8Expected)
+{
+  ModbusDiscovery::foundSlave f;
+
+  if (d.found() != u8Expected)
+  {
+    printf("MISMATCH: %s: %u slaves found, expected %u\n", what, d.found(), u8Expected);
+  }
+  for (uint8_t i = 0; i < d.found(); i++)
+  {
+    d.getFound(i, &f);
+    if (!expectedType(f.slave) || f.mType != expectedType(f.slave))
+    {
+      printf("MISMATCH: %s: slave %u reported as type %02x, expected %02x\n", what, f.slave, f.mType, expectedType(f.slave));
+      return false;
+    }
+  }
+  return d.found() == u8Expected;
+}
+
+static bool sameList(ModbusDiscovery &a, ModbusDiscovery &b)
+{
+  ModbusDiscovery::foundSlave fa, fb;
+
+  if (a.found() != b.found())
+    return false;
+  for (uint8_t i = 0; i < a.found(); i++)
+  {
+    a.getFound(i, &fa);
+    b.getFound(i, &fb);
+    if (fa.slave != fb.slave || fa.mType != fb.mType || fa.u8Score != fb.u8Score)
+      return false;
+  }
+  return true;
+}
+
+int main()
+{
+  SimSlaveFarm sim(ku32Baud);
+  ModbusMeter meter;
+  ModbusDiscovery scan, cached, damaged;
+  ModbusDiscovery::foundSlave f;
+  uint8_t buf[ModbusDiscovery::ku16CacheSize];
+  uint8_t u8Expected = 0;
+  uint64_t u64Start;
+  uint16_t u16Len;
+  uint8_t result;
+
+  hostUseVirtualClock(true);
+  for (uint8_t i = 0; i < ku8Farm; i++)
+  {
+    sim.addSlave(kFarm[i].slave, kFarm[i].mType);
+    if (kFarm[i].u32LatencyUs)
+      sim.setLatency(kFarm[i].slave, kFarm[i].u32LatencyUs);
+    sim.setStrict(kFarm[i].slave, kFarm[i].bStrict);
+    u8Expected += kFarm[i].bFound;
+  }
+  meter.begin(sim);
+  meter.setBaudRate(ku32Baud);
+
+  // full scan
+  u64Start = hostMicros64();
+  scan.begin(meter);
+  result = scan.run();
+  if (result != ModbusMeter::ku8MBSuccess)
+  {
+    printf("MISMATCH: scan ended with %02x\n", result);
+    return 1;
+  }
+  if (!checkFound("scan", scan, u8Expected))
+    return 1;
+  printf("scan 1..247 at %u baud: %u of %u slaves, all types identified, %.2f s, %u frames\n", ku32Baud, scan.found(),
+         ku8Farm, (hostMicros64() - u64Start) / 1e6, sim.frames());
+
+  // cache round trip
+  u16Len = scan.pack(buf, sizeof(buf));
+  if (!u16Len || scan.pack(buf, u16Len - 1) || !cached.unpack(buf, u16Len) || !sameList(scan, cached))
+  {
+    printf("MISMATCH: pack()/unpack() of %u bytes\n", u16Len);
+    return 1;
+  }
+  buf[3] ^= 0x01;
+  if (damaged.unpack(buf, u16Len) || damaged.unpack(buf, u16Len - 3) || damaged.found())
+  {
+    printf("MISMATCH: damaged blob accepted\n");
+    return 1;
+  }
+  buf[3] ^= 0x01;
+
+  // unchanged bus
+  sim.resetStats();
+  u64Start = hostMicros64();
+  cached.verify(meter);
+  result = cached.run();
+  if (result != ModbusMeter::ku8MBSuccess || !sameList(scan, cached))
+  {
+    printf("MISMATCH: verify of an unchanged bus ended with %02x, %u slaves\n", result, cached.found());
+    return 1;
+  }
+  printf("verify, unchanged: %u slaves, %.2f s, %u frames\n", cached.found(), (hostMicros64() - u64Start) / 1e6, sim.frames());
+
+  // slave 17 gone, slave 42 replaced by a PQ meter
+  sim.setFaults(17, 100, 0, 0);
+  sim.addSlave(42, 0x82);
+  result = cached.verify(meter) ? cached.run() : 0;
+  if (result != ModbusDiscovery::ku8TopologyChanged || cached.found() != u8Expected - 1)
+  {
+    printf("MISMATCH: verify of a changed bus ended with %02x, %u slaves\n", result, cached.found());
+    return 1;
+  }
+  for (uint8_t i = 0; i < cached.found(); i++)
+  {
+    cached.getFound(i, &f);
+    if (f.slave == 17 || f.mType != (f.slave == 42 ? 0x82 : expectedType(f.slave)))
+    {
+      printf("MISMATCH: verify of a changed bus reported slave %u as type %02x\n", f.slave, f.mType);
+      return 1;
+    }
+  }
+  printf("verify, changed: slave 17 gone, slave 42 now type 82, topology change reported\n");
+  return 0;
+}
@@ -0,0 +1,275 @@
+/*
+  history_bench.cpp - MeterHistory round trip past the ring's capacity
+
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -I. -o history_bench \
+        ModbusMeter_History.cpp extras/host/HostArduino.cpp \
+        extras/bench/history_bench.cpp -lpthread && ./history_bench
+
+  A day of meterData and pqData readings at an irregular period is appended
+  to histories far too small to hold it, so the oldest chunks are
+  overwritten many times over. Afterwards the bench checks that the
+  surviving samples are exactly the newest ones, bit for bit, through a
+  full read, through random range queries (ranges starting before the
+  oldest sample, between samples, on chunk anchors and past the newest
+  included), and through paged draining with a small buffer. Out-of-order
+  samples must be refused, and a field missing from a partial read must
+  read back as NaN.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "ModbusMeter_History.h"
+
+static const uint32_t ku32Samples = 86400 / 5;
+static const uint32_t ku32Queries = 2000;
+static const uint16_t ku16Page = 37; ///< deliberately not a divisor of anything
+
+typedef struct
+{
+  const char *name;
+  uint8_t u8Fields;
+  uint32_t u32Bytes; ///< history buffer
+} benchCase;
+
+static const benchCase kCases[] = {
+    {"meterData 4k", ModbusMeter::ku8MeterFields, 4096},
+    {"meterData 32k", ModbusMeter::ku8MeterFields, 32768},
+    {"pqData 16k", ModbusMeter::ku8PQFields, 16384},
+    {"pqData 128k", ModbusMeter::ku8PQFields, 131072},
+};
+
+typedef struct
+{
+  time_t t;
+  float f[ModbusMeter::ku8PQFields];
+} sample;
+
+static uint32_t u32Rand = 0x2545F491;
+
+static uint32_t rnd()
+{
+  u32Rand ^= u32Rand << 13;
+  u32Rand ^= u32Rand >> 17;
+  u32Rand ^= u32Rand << 5;
+  return u32Rand;
+}
+
+// energy climbs, power and currents wander, the rest changes now and then
+static void makeTrace(std::vector<sample> &trace)
+{
+  sample s;
+  time_t t = 1700000000;
+  uint8_t k;
+
+  for (k = 0; k < ModbusMeter::ku8PQFields; k++)
+  {
+    s.f[k] = 100.0f + k;
+  }
+  for (uint32_t i = 0; i < ku32Samples; i++)
+  {
+    t += 4 + rnd() % 3 + ((i % 500 == 499) ? 3600 : 0); // the odd outage
+    s.t = t;
+    s.f[ModbusMeter::ku8FieldWatt] = 1500.0f + (int32_t)(rnd() % 200) / 10.0f;
+    s.f[ModbusMeter::ku8FieldWattHour] += s.f[ModbusMeter::ku8FieldWatt] * 5 / 3600.0f;
+    for (k = ModbusMeter::ku8FieldI0; k <= ModbusMeter::ku8FieldI2; k++)
+    {
+      s.f[k] = 6.5f + (int32_t)(rnd() % 100) / 100.0f;
+    }
+    for (k = ModbusMeter::ku8FieldV0; k < ModbusMeter::ku8PQFields; k++)
+    {
+      if (rnd() % 4 == 0)
+        s.f[k] = 200.0f + (int32_t)(rnd() % 500) / 10.0f;
+    }
+    trace.push_back(s);
+  }
+}
+
+static bool same(const sample &a, time_t t, const float *f, uint8_t u8Fields)
+{
+  return a.t == t && memcmp(a.f, f, u8Fields * sizeof(float)) == 0;
+}
+
+// samples of trace[u32First..] in [tFrom, tTo], as the history should return them
+static uint32_t expected(const std::vector<sample> &trace, uint32_t u32First, time_t tFrom, time_t tTo, uint32_t *pu32Start)
+{
+  uint32_t i = u32First;
+  uint32_t n = 0;
+
+  while (i < trace.size() && trace[i].t < tFrom)
+    i++;
+  *pu32Start = i;
+  while (i + n < trace.size() && trace[i + n].t <= tTo)
+    n++;
+  return n;
+}
+
+static bool runCase(const benchCase *c, const std::vector<sample> &trace)
+{
+  std::vector<uint8_t> buf(c->u32Bytes);
+  std::vector<time_t> times(ku32Samples);
+  std::vector<float> values((size_t)ku32Samples * c->u8Fields);
+  std::vector<ModbusMeter::pqData> pq(ku16Page);
+  MeterHistory history;
+  uint32_t u32First, u32Held, i;
+  double dAppendNs, dReadNs;
+  uint16_t n;
+
+  if (!history.begin(&buf[0], c->u32Bytes, c->u8Fields))
+  {
+    printf("MISMATCH: %s: begin() refused the buffer\n", c->name);
+    return false;
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (i = 0; i < ku32Samples; i++)
+  {
+    if (!history.append(trace[i].t, trace[i].f))
+    {
+      printf("MISMATCH: %s: sample %u refused\n", c->name, i);
+      return false;
+    }
+  }
+  dAppendNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / ku32Samples;
+
+  if (history.append(trace[ku32Samples - 1].t, trace[0].f) || history.append(trace[0].t, trace[0].f))
+  {
+    printf("MISMATCH: %s: out-of-order sample accepted\n", c->name);
+    return false;
+  }
+
+  u32Held = history.samples();
+  u32First = ku32Samples - u32Held;
+  if (!u32Held || history.overwritten() != u32First || history.oldest() != trace[u32First].t ||
+      history.newest() != trace[ku32Samples - 1].t)
+  {
+    printf("MISMATCH: %s: %u held, %u overwritten, oldest %ld\n", c->name, u32Held, history.overwritten(), (long)history.oldest());
+    return false;
+  }
+
+  // everything
+  t0 = std::chrono::steady_clock::now();
+  n = history.read(0, trace[ku32Samples - 1].t + 1000, &times[0], &values[0], 0xFFFF);
+  dReadNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / (n ? n : 1);
+  if (n != u32Held)
+  {
+    printf("MISMATCH: %s: full read gave %u of %u\n", c->name, n, u32Held);
+    return false;
+  }
+  for (i = 0; i < n; i++)
+  {
+    if (!same(trace[u32First + i], times[i], &values[(size_t)i * c->u8Fields], c->u8Fields))
+    {
+      printf("MISMATCH: %s: full read, sample %u\n", c->name, i);
+      return false;
+    }
+  }
+
+  // random ranges, from before the oldest sample to past the newest
+  for (uint32_t q = 0; q < ku32Queries; q++)
+  {
+    time_t tSpan = trace[ku32Samples - 1].t - trace[u32First].t;
+    time_t tFrom = trace[u32First].t - 100 + (time_t)(rnd() % (tSpan + 200));
+    time_t tTo = tFrom + (time_t)(rnd() % 4000);
+    uint32_t u32Start;
+    uint32_t u32Want;
+
+    if (q % 3 == 0)
+      tFrom = trace[u32First + rnd() % u32Held].t; // exactly on a sample
+    u32Want = expected(trace, u32First, tFrom, tTo, &u32Start);
+    n = history.read(tFrom, tTo, &times[0], &values[0], 0xFFFF);
+    if (n != u32Want)
+    {
+      printf("MISMATCH: %s: range %ld..%ld gave %u of %u\n", c->name, (long)tFrom, (long)tTo, n, u32Want);
+      return false;
+    }
+    for (i = 0; i < n; i++)
+    {
+      if (!same(trace[u32Start + i], times[i], &values[(size_t)i * c->u8Fields], c->u8Fields))
+      {
+        printf("MISMATCH: %s: range %ld..%ld, sample %u\n", c->name, (long)tFrom, (long)tTo, i);
+        return false;
+      }
+    }
+  }
+
+  // drain page by page as an uplink would, into pqData records
+  i = u32First;
+  time_t tNext = 0;
+  do
+  {
+    n = history.read(tNext, trace[ku32Samples - 1].t, &pq[0], ku16Page);
+    for (uint16_t r = 0; r < n; r++, i++)
+    {
+      if (i >= ku32Samples || !same(trace[i], pq[r].mdt, &pq[r].watt, c->u8Fields))
+      {
+        printf("MISMATCH: %s: drain, sample %u\n", c->name, i);
+        return false;
+      }
+    }
+    if (n)
+      tNext = pq[n - 1].mdt + 1;
+  } while (n == ku16Page);
+  if (i != ku32Samples)
+  {
+    printf("MISMATCH: %s: drain ended at %u of %u\n", c->name, i, ku32Samples);
+    return false;
+  }
+
+  printf("%-14s %8u %8u %7.1f %7.1f %9.0f %9.0f\n", c->name, u32Held, history.overwritten(),
+         (double)c->u32Bytes / u32Held, (double)u32Held * (sizeof(time_t) + c->u8Fields * sizeof(float)) / c->u32Bytes,
+         dAppendNs, dReadNs);
+  return true;
+}
+
+// a reading with u64Valid bits clear, between two complete ones
+static bool runPartial()
+{
+  uint8_t buf[1024];
+  MeterHistory history;
+  ModbusMeter::meterData md[3];
+  uint16_t n;
+
+  memset(md, 0, sizeof(md));
+  for (uint8_t s = 0; s < 3; s++)
+  {
+    md[s].mdt = 1000 + s;
+    md[s].u64Valid = ModbusMeter::ku64AllFields;
+    for (float *f = &md[s].watt; f < &md[s].watt + ModbusMeter::ku8MeterFields; f++)
+      *f = 230.0f + s;
+  }
+  md[1].u64Valid &= ~((1ULL << ModbusMeter::ku8FieldWatt) | (1ULL << ModbusMeter::ku8FieldPf));
+
+  history.begin(buf, sizeof(buf), ModbusMeter::ku8MeterFields);
+  for (uint8_t s = 0; s < 3; s++)
+    history.append(md[s]);
+  memset(md, 0, sizeof(md));
+  n = history.read(0, 2000, md, 3);
+  if (n != 3 || !isnan(md[1].watt) || !isnan(md[1].pf) || md[1].wattHour != 231.0f || md[2].watt != 232.0f)
+  {
+    printf("MISMATCH: partial read: %u samples, watt %g, pf %g\n", n, md[1].watt, md[1].pf);
+    return false;
+  }
+  printf("partial read: missing fields read back as NaN\n");
+  return true;
+}
+
+int main()
+{
+  std::vector<sample> trace;
+
+  makeTrace(trace);
+  printf("%u samples appended to each history\n", ku32Samples);
+  printf("%-14s %8s %8s %7s %7s %9s %9s\n", "case", "held", "lost", "B/smp", "ratio", "append ns", "read ns");
+  for (const benchCase *c = kCases; c < kCases + sizeof(kCases) / sizeof(kCases[0]); c++)
+  {
+    if (!runCase(c, trace))
+      return 1;
+  }
+  return runPartial() ? 0 : 1;
+}
@@ -0,0 +1,235 @@
+/*
+  serial_bench.cpp - per-slave serial profiles on one simulated RS-485 bus
+
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -I. -o serial_bench \
+        ModbusMeter_ESP32.cpp ModbusMeter_Profiles.cpp ModbusMeter_BusManager.cpp \
+        ModbusMeter_TcpLink.cpp \
+        extras/host/HostArduino.cpp extras/host/SimSlaveFarm.cpp \
+        extras/bench/serial_bench.cpp -lpthread && ./serial_bench
+
+  Eight meters listen in three configurations (9600 8N1, 19200 8E1,
+  38400 8N1), interleaved in the table. The switch callback given to
+  setSerialSwitch() reconfigures the farm with SimSlaveFarm::setLine(), as
+  an application would call Serial2.updateBaudRate(); a slave hears only
+  requests sent in its own configuration.
+
+  On the virtual clock detectSlaveSerial() must find every profile and
+  report an absent slave, then ku8Cycles cycles are read in table order
+  and in the order ModbusBusManager uses (grouped by profile, every other
+  cycle reversed), next to the same meters all at 9600 8N1. The grouped
+  order must stay within profiles - 1 switches per cycle plus one to reach
+  the first group. Last, the bus manager itself polls the meters on the
+  real clock, as its worker runs on a thread, within the same bound with
+  one more cycle for the one stop() interrupts.
+*/
+
+#include <time.h>
+
+#include "ModbusMeter_BusManager.h"
+#include "extras/host/SimSlaveFarm.h"
+
+static const uint8_t ku8Cycles = 10;
+static const uint32_t ku32RunMs = 3000;
+static const uint8_t ku8Profiles = 3;
+static const uint8_t ku8FnInput = 0x04; ///< read input registers, which the eastron profile uses
+
+typedef struct
+{
+  uint8_t slave;
+  uint32_t u32Baud;
+  uint8_t u8Format;
+} slaveSerial;
+
+static const slaveSerial kSlaves[] = {
+    {1, 9600, ModbusMeter::ku8Serial8N1},
+    {10, 19200, ModbusMeter::ku8Serial8E1},
+    {2, 9600, ModbusMeter::ku8Serial8N1},
+    {20, 38400, ModbusMeter::ku8Serial8N1},
+    {11, 19200, ModbusMeter::ku8Serial8E1},
+    {3, 9600, ModbusMeter::ku8Serial8N1},
+    {21, 38400, ModbusMeter::ku8Serial8N1},
+    {12, 19200, ModbusMeter::ku8Serial8E1},
+};
+static const uint8_t ku8Slaves = sizeof(kSlaves) / sizeof(kSlaves[0]);
+
+static SimSlaveFarm *farm;
+
+static bool applySerial(uint32_t u32Baud, uint8_t u8Format)
+{
+  farm->setLine(u32Baud, u8Format);
+  return true;
+}
+
+static void addSlaves(SimSlaveFarm &sim, bool bOwnSerial)
+{
+  for (uint8_t i = 0; i < ku8Slaves; i++)
+  {
+    sim.addSlave(kSlaves[i].slave, 0x02);
+    sim.setLatency(kSlaves[i].slave, 2000);
+    if (bOwnSerial)
+      sim.setSerial(kSlaves[i].slave, kSlaves[i].u32Baud, kSlaves[i].u8Format);
+  }
+}
+
+// ku8Cycles cycles over kSlaves in the given order, reversed every other cycle if bAlternate
+static bool runCycles(const char *name, ModbusMeter &meter, const uint8_t *order, bool bAlternate, float *adj, uint32_t *pu32Switches)
+{
+  uint32_t u32Switches = meter.getSerialSwitches();
+  uint64_t u64Start = hostMicros64();
+
+  for (uint8_t c = 0; c < ku8Cycles; c++)
+  {
+    for (uint8_t i = 0; i < ku8Slaves; i++)
+    {
+      const slaveSerial *s = &kSlaves[order[(bAlternate && (c & 1)) ? ku8Slaves - 1 - i : i]];
+
+      if (meter.readMeterData(0, s->slave, 0, 0x02, time(NULL), adj, 0, 0) != ModbusMeter::ku8MBSuccess)
+      {
+        printf("MISMATCH: %s: slave %u does not answer\n", name, s->slave);
+        return false;
+      }
+    }
+  }
+  *pu32Switches = meter.getSerialSwitches() - u32Switches;
+  printf("%-14s %10.1f %10.1f\n", name, (double)*pu32Switches / ku8Cycles, (hostMicros64() - u64Start) / 1e3 / ku8Cycles);
+  return true;
+}
+
+static bool runDirect(float *adj)
+{
+  SimSlaveFarm sim(9600), same(9600);
+  ModbusMeter meter, reference;
+  uint8_t table[ku8Slaves], grouped[ku8Slaves];
+  uint32_t u32Key[ku8Slaves];
+  uint32_t u32Table, u32Grouped;
+  uint64_t u64Start;
+  uint8_t i, k;
+
+  farm = &sim;
+  addSlaves(sim, true);
+  meter.begin(sim);
+  meter.setBaudRate(9600);
+  meter.setSerialSwitch(applySerial);
+
+  // autodetect; every slave keeps the profile found
+  u64Start = hostMicros64();
+  for (i = 0; i < ku8Slaves; i++)
+  {
+    uint32_t u32Baud = 0;
+    uint8_t u8Format = 0xFF;
+    uint8_t result = meter.detectSlaveSerial(kSlaves[i].slave, ku8FnInput, 0, &u32Baud, &u8Format);
+
+    if (result != ModbusMeter::ku8MBSuccess || u32Baud != kSlaves[i].u32Baud || u8Format != kSlaves[i].u8Format)
+    {
+      printf("MISMATCH: detect slave %u: %02x, %lu/%u instead of %lu/%u\n", kSlaves[i].slave, result, (unsigned long)u32Baud,
+             u8Format, (unsigned long)kSlaves[i].u32Baud, kSlaves[i].u8Format);
+      return false;
+    }
+  }
+  printf("detectSlaveSerial: %u of %u profiles found, %.2f s\n", ku8Slaves, ku8Slaves, (hostMicros64() - u64Start) / 1e6);
+  if (meter.detectSlaveSerial(99, ku8FnInput, 0) != ModbusMeter::ku8MBResponseTimedOut)
+  {
+    printf("MISMATCH: detect of an absent slave did not time out\n");
+    return false;
+  }
+
+  // table order, and the manager's order: stable by baud rate and format
+  for (k = 0; k < ku8Slaves; k++)
+  {
+    table[k] = k;
+    u32Key[k] = ((kSlaves[k].u32Baud / 100) << 2) | kSlaves[k].u8Format;
+    for (i = k; i > 0 && u32Key[grouped[i - 1]] > u32Key[k]; i--)
+    {
+      grouped[i] = grouped[i - 1];
+    }
+    grouped[i] = k;
+  }
+
+  printf("%-14s %10s %10s\n", "order", "switches/c", "ms/cycle");
+  if (!runCycles("table", meter, table, false, adj, &u32Table) || !runCycles("grouped", meter, grouped, true, adj, &u32Grouped))
+    return false;
+  if (u32Grouped > (uint32_t)(ku8Profiles - 1) * ku8Cycles + 1 || u32Grouped >= u32Table)
+  {
+    printf("MISMATCH: %u switches in table order, %u grouped\n", u32Table, u32Grouped);
+    return false;
+  }
+
+  addSlaves(same, false);
+  reference.begin(same);
+  reference.setBaudRate(9600);
+  u64Start = hostMicros64();
+  for (uint8_t c = 0; c < ku8Cycles; c++)
+  {
+    for (i = 0; i < ku8Slaves; i++)
+    {
+      reference.readMeterData(0, kSlaves[i].slave, 0, 0x02, time(NULL), adj, 0, 0);
+    }
+  }
+  printf("%-14s %10s %10.1f\n", "all at 9600", "-", (hostMicros64() - u64Start) / 1e3 / ku8Cycles);
+  return true;
+}
+
+static bool runManager(float *adj)
+{
+  SimSlaveFarm sim(9600);
+  ModbusMeter meter;
+  ModbusBusManager manager;
+  ModbusBusManager::meterRecord rec[ku8Slaves];
+  uint32_t u32Cycles;
+  uint8_t u8Bus, i;
+
+  farm = &sim;
+  addSlaves(sim, true);
+  meter.begin(sim);
+  meter.setBaudRate(9600);
+  meter.setSerialSwitch(applySerial);
+  u8Bus = manager.addBus(meter);
+  for (i = 0; i < ku8Slaves; i++)
+  {
+    meter.setSlaveSerial(kSlaves[i].slave, kSlaves[i].u32Baud, kSlaves[i].u8Format);
+    manager.addMeter(u8Bus, kSlaves[i].slave, 0, 0x02, adj, 0, 0);
+  }
+
+  manager.start(0);
+  delay(ku32RunMs);
+  manager.stop();
+
+  u32Cycles = manager.getCycles(u8Bus);
+  manager.getRecords(rec, ku8Slaves);
+  for (i = 0; i < ku8Slaves; i++)
+  {
+    if (rec[i].u8Result != ModbusMeter::ku8MBSuccess || !rec[i].u32Updates)
+    {
+      printf("MISMATCH: manager, slave %u: result %02x, %u reads\n", kSlaves[i].slave, rec[i].u8Result, rec[i].u32Updates);
+      return false;
+    }
+  }
+  if (!u32Cycles || meter.getSerialSwitches() > (ku8Profiles - 1) * (u32Cycles + 1))
+  {
+    printf("MISMATCH: manager: %u switches in %u cycles\n", meter.getSerialSwitches(), u32Cycles);
+    return false;
+  }
+  printf("bus manager: %u cycles, %.2f switches/cycle, %.0f ms/cycle\n", u32Cycles,
+         (double)meter.getSerialSwitches() / u32Cycles, (double)ku32RunMs / u32Cycles);
+  return true;
+}
+
+int main()
+{
+  float adj[ModbusMeter::ku8MeterFields];
+
+  for (uint8_t k = 0; k < ModbusMeter::ku8MeterFields; k++)
+  {
+    adj[k] = 1;
+  }
+
+  hostUseVirtualClock(true);
+  if (!runDirect(adj))
+    return 1;
+  hostUseVirtualClock(false);
+  if (!runManager(adj))
+    return 1;
+  return 0;
+}
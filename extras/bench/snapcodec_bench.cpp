@@ -0,0 +1,346 @@
+/*
+  snapcodec_bench.cpp - util/snapcodec.h against plain JSON
+
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -I. -o snapcodec_bench \
+        extras/bench/snapcodec_bench.cpp && ./snapcodec_bench
+
+  An hour of pqData readings of one meter at a 1 s period (with the odd
+  late poll) under a steady load is sent in batches of at most ku16Batch
+  bytes, three ways: a JSON array of objects keyed by field name, as an
+  integrator would write it with printf("%.7g"); the binary format with
+  every field XOR coded (exact); and the binary format with each field
+  fixed-point at the resolution the meter reports it with. The binary
+  batches are decoded and checked against the input before timing, and
+  every truncation of a batch must decode to a prefix of it. JSON
+  decoding uses strtod() on each value, the least a consumer has to do.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+#include "ModbusMeter_ESP32.h"
+#include "util/snapcodec.h"
+
+static const uint16_t ku16Samples = 3600;
+static const uint16_t ku16Batch = 1400; ///< one TCP segment on Ethernet
+static const uint8_t ku8Fields = ModbusMeter::ku8PQFields;
+
+static const char *const kNames[ku8Fields] = {
+    "watt", "wattHour", "pf", "varh", "i0", "i1", "i2", "v0", "v1", "v2",
+    "thdvr", "thdvs", "thdvt", "thdir", "thdis", "thdit", "vunbr", "vunbs", "vunbt",
+    "chr0", "chr1", "chr2", "chr3", "chr4", "chr5", "chr6",
+    "chs0", "chs1", "chs2", "chs3", "chs4", "chs5", "chs6",
+    "cht0", "cht1", "cht2", "cht3", "cht4", "cht5", "cht6",
+    "freq"};
+
+// decimals the meter reports each field with
+static uint8_t decimalsOf(uint8_t u8Field)
+{
+  switch (u8Field)
+  {
+  case ModbusMeter::ku8FieldPf:
+  case ModbusMeter::ku8FieldI0:
+  case ModbusMeter::ku8FieldI1:
+  case ModbusMeter::ku8FieldI2:
+    return 3;
+  case ModbusMeter::ku8FieldVunbr:
+  case ModbusMeter::ku8FieldVunbs:
+  case ModbusMeter::ku8FieldVunbt:
+  case ModbusMeter::ku8FieldFreq:
+    return 2;
+  }
+  return 1;
+}
+
+static uint32_t u32Rand = 0x2545F491;
+
+static float noise(float fAmplitude)
+{
+  u32Rand ^= u32Rand << 13;
+  u32Rand ^= u32Rand >> 17;
+  u32Rand ^= u32Rand << 5;
+  return fAmplitude * ((int32_t)(u32Rand % 2001) - 1000) / 1000.0f;
+}
+
+static float quantize(float f, uint8_t u8Decimals)
+{
+  double d = snapcodec_scale(u8Decimals);
+
+  return (float)(lrint(f * d) / d);
+}
+
+// steady load: power wanders, energy climbs, the rest jitters in its last digit
+static void makeTrace(std::vector<ModbusMeter::pqData> &trace)
+{
+  ModbusMeter::pqData r;
+  double dWh = 123456.7;
+  double dVarh = 2345.6;
+  float fWatt = 1520.5f;
+  time_t t = 1700000000;
+  uint8_t k;
+
+  for (uint16_t s = 0; s < ku16Samples; s++)
+  {
+    float *f = &r.watt;
+
+    fWatt += noise(3);
+    dWh += fWatt / 3600.0;
+    dVarh += fWatt * 0.33 / 3600.0;
+    t += (s % 97 == 96) ? 2 : 1;
+
+    r.mdt = t;
+    r.u64Valid = (1ULL << ku8Fields) - 1;
+    f[ModbusMeter::ku8FieldWatt] = fWatt;
+    f[ModbusMeter::ku8FieldWattHour] = (float)dWh;
+    f[ModbusMeter::ku8FieldPf] = 0.95f + noise(0.002f);
+    f[ModbusMeter::ku8FieldVarh] = (float)dVarh;
+    for (k = 0; k < 3; k++)
+    {
+      f[ModbusMeter::ku8FieldI0 + k] = fWatt / 3 / 230 / 0.95f + noise(0.01f);
+      f[ModbusMeter::ku8FieldV0 + k] = 230.1f - 0.3f * k + noise(0.2f);
+    }
+    // THD, unbalance and harmonics move every few seconds only
+    for (k = ModbusMeter::ku8FieldThdvr; k < ModbusMeter::ku8FieldFreq; k++)
+    {
+      if (s == 0 || (u32Rand + k) % 8 == 0)
+        f[k] = ((k < ModbusMeter::ku8FieldThdir) ? 2.1f : (k < ModbusMeter::ku8FieldVunbr) ? 8.5f : (k < ModbusMeter::ku8FieldChr) ? 0.4f : 1.0f) + noise(0.15f);
+    }
+    f[ModbusMeter::ku8FieldFreq] = 50.0f + noise(0.03f);
+
+    for (k = 0; k < ku8Fields; k++)
+    {
+      f[k] = quantize(f[k], decimalsOf(k));
+    }
+    trace.push_back(r);
+  }
+}
+
+static uint32_t encodeJson(const std::vector<ModbusMeter::pqData> &trace, std::vector<std::vector<char> > &batches)
+{
+  char rec[1024];
+  std::vector<char> batch;
+  uint32_t u32Bytes = 0;
+
+  batches.clear();
+  for (size_t s = 0; s < trace.size(); s++)
+  {
+    const float *f = &trace[s].watt;
+    int n = snprintf(rec, sizeof(rec), "{\"t\":%ld", (long)trace[s].mdt);
+
+    for (uint8_t k = 0; k < ku8Fields; k++)
+    {
+      if (trace[s].u64Valid & (1ULL << k))
+        n += snprintf(rec + n, sizeof(rec) - n, ",\"%s\":%.7g", kNames[k], f[k]);
+    }
+    rec[n++] = '}';
+
+    if (!batch.empty() && batch.size() + n + 1 > ku16Batch)
+    {
+      batch.push_back(']');
+      u32Bytes += batch.size();
+      batches.push_back(batch);
+      batch.clear();
+    }
+    batch.push_back(batch.empty() ? '[' : ',');
+    batch.insert(batch.end(), rec, rec + n);
+  }
+  batch.push_back(']');
+  u32Bytes += batch.size();
+  batches.push_back(batch);
+  return u32Bytes;
+}
+
+static double decodeJson(const std::vector<std::vector<char> > &batches)
+{
+  double dSum = 0;
+
+  for (size_t b = 0; b < batches.size(); b++)
+  {
+    std::vector<char> text(batches[b]);
+    size_t n = text.size();
+
+    text.push_back(0); // strtod() stops at the terminator
+    char *p = &text[0];
+    char *end = p + n;
+
+    while (p < end)
+    {
+      p = (char *)memchr(p, ':', end - p);
+      if (!p)
+        break;
+      dSum += strtod(p + 1, &p);
+    }
+  }
+  return dSum;
+}
+
+static uint32_t encodeBinary(const std::vector<ModbusMeter::pqData> &trace, const uint8_t *modes, std::vector<std::vector<uint8_t> > &batches)
+{
+  uint8_t buf[ku16Batch];
+  snapCodec enc;
+  uint32_t u32Bytes = 0;
+
+  batches.clear();
+  snapcodec_begin(&enc, buf, sizeof(buf), ku8Fields, modes);
+  for (size_t s = 0; s < trace.size(); s++)
+  {
+    if (!snapcodec_put(&enc, trace[s].mdt, &trace[s].watt, trace[s].u64Valid))
+    {
+      batches.push_back(std::vector<uint8_t>(buf, buf + enc.u16Used));
+      u32Bytes += enc.u16Used;
+      snapcodec_begin(&enc, buf, sizeof(buf), ku8Fields, modes);
+      snapcodec_put(&enc, trace[s].mdt, &trace[s].watt, trace[s].u64Valid);
+    }
+  }
+  batches.push_back(std::vector<uint8_t>(buf, buf + enc.u16Used));
+  return u32Bytes + enc.u16Used;
+}
+
+static double decodeBinary(const std::vector<std::vector<uint8_t> > &batches, std::vector<ModbusMeter::pqData> *out)
+{
+  ModbusMeter::pqData r;
+  snapCodec dec;
+  double dSum = 0;
+  int64_t i64Time;
+
+  for (size_t b = 0; b < batches.size(); b++)
+  {
+    snapcodec_open(&dec, &batches[b][0], batches[b].size());
+    while (snapcodec_next(&dec, &i64Time, &r.watt, &r.u64Valid))
+    {
+      r.mdt = (time_t)i64Time;
+      dSum += r.watt;
+      if (out)
+        out->push_back(r);
+    }
+  }
+  return dSum;
+}
+
+static bool check(const std::vector<ModbusMeter::pqData> &trace, const std::vector<ModbusMeter::pqData> &got, const uint8_t *modes)
+{
+  if (got.size() != trace.size())
+  {
+    printf("MISMATCH: %u of %u records\n", (unsigned)got.size(), (unsigned)trace.size());
+    return false;
+  }
+  for (size_t s = 0; s < trace.size(); s++)
+  {
+    if (got[s].mdt != trace[s].mdt || got[s].u64Valid != trace[s].u64Valid)
+    {
+      printf("MISMATCH at record %u: time or presence\n", (unsigned)s);
+      return false;
+    }
+    for (uint8_t k = 0; k < ku8Fields; k++)
+    {
+      float a = (&trace[s].watt)[k];
+      float b = (&got[s].watt)[k];
+
+      if (modes ? fabs(a - b) > 0.5 / snapcodec_scale(modes[k]) * (1 + 1e-6 * fabs(a)) : memcmp(&a, &b, sizeof(a)) != 0)
+      {
+        printf("MISMATCH at record %u field %s: %.9g != %.9g\n", (unsigned)s, kNames[k], a, b);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// every prefix of a batch must decode to a prefix of its records, never read past the end
+static bool checkTruncated(const std::vector<uint8_t> &batch, const std::vector<ModbusMeter::pqData> &whole)
+{
+  ModbusMeter::pqData r;
+  snapCodec dec;
+  int64_t i64Time;
+
+  for (size_t n = 1; n < batch.size(); n++)
+  {
+    std::vector<uint8_t> cut(batch.begin(), batch.begin() + n);
+    size_t s = 0;
+
+    if (!snapcodec_open(&dec, &cut[0], n))
+      continue;
+    while (snapcodec_next(&dec, &i64Time, &r.watt, &r.u64Valid))
+    {
+      if (s >= whole.size() || i64Time != whole[s].mdt || memcmp(&r.watt, &whole[s].watt, ku8Fields * sizeof(float)) != 0)
+      {
+        printf("MISMATCH: batch cut at %u bytes, record %u\n", (unsigned)n, (unsigned)s);
+        return false;
+      }
+      s++;
+    }
+    if (s == whole.size())
+    {
+      printf("MISMATCH: batch cut at %u bytes decodes whole\n", (unsigned)n);
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename F>
+static double nsPerRecord(F f)
+{
+  const int kRuns = 20;
+  auto t0 = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < kRuns; i++)
+    f();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / kRuns / ku16Samples;
+}
+
+int main()
+{
+  std::vector<ModbusMeter::pqData> trace;
+  std::vector<std::vector<char> > json;
+  std::vector<std::vector<uint8_t> > xorBatches, fixedBatches;
+  std::vector<ModbusMeter::pqData> got;
+  uint8_t fixed[ku8Fields];
+  uint32_t u32Json, u32Xor, u32Fixed;
+  volatile double dSink = 0;
+
+  for (uint8_t k = 0; k < ku8Fields; k++)
+  {
+    fixed[k] = decimalsOf(k);
+  }
+  makeTrace(trace);
+
+  u32Json = encodeJson(trace, json);
+  u32Xor = encodeBinary(trace, 0, xorBatches);
+  u32Fixed = encodeBinary(trace, fixed, fixedBatches);
+
+  decodeBinary(xorBatches, &got);
+  if (!check(trace, got, 0))
+    return 1;
+  got.clear();
+  decodeBinary(fixedBatches, &got);
+  if (!check(trace, got, fixed))
+    return 1;
+  for (int f = 0; f < 2; f++)
+  {
+    const std::vector<std::vector<uint8_t> > first(1, (f ? fixedBatches : xorBatches)[0]);
+
+    got.clear();
+    decodeBinary(first, &got);
+    if (!checkTruncated(first[0], got))
+      return 1;
+  }
+
+  printf("%u pqData records, %u-byte batches\n", ku16Samples, ku16Batch);
+  printf("%-8s %8s %8s %7s %10s %10s\n", "format", "bytes", "B/rec", "ratio", "enc ns/rec", "dec ns/rec");
+  printf("%-8s %8u %8.1f %7.1f %10.0f %10.0f\n", "json", u32Json, (double)u32Json / ku16Samples, 1.0,
+         nsPerRecord([&]() { encodeJson(trace, json); }),
+         nsPerRecord([&]() { dSink = dSink + decodeJson(json); }));
+  printf("%-8s %8u %8.1f %7.1f %10.0f %10.0f\n", "xor", u32Xor, (double)u32Xor / ku16Samples, (double)u32Json / u32Xor,
+         nsPerRecord([&]() { encodeBinary(trace, 0, xorBatches); }),
+         nsPerRecord([&]() { dSink = dSink + decodeBinary(xorBatches, 0); }));
+  printf("%-8s %8u %8.1f %7.1f %10.0f %10.0f\n", "fixed", u32Fixed, (double)u32Fixed / ku16Samples, (double)u32Json / u32Fixed,
+         nsPerRecord([&]() { encodeBinary(trace, fixed, fixedBatches); }),
+         nsPerRecord([&]() { dSink = dSink + decodeBinary(fixedBatches, 0); }));
+  return 0;
+}
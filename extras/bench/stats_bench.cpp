@@ -0,0 +1,333 @@
+/*
+  stats_bench.cpp - MeterStats windows and demand against figures worked out by hand
+
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -I. -o stats_bench \
+        ModbusMeter_Stats.cpp extras/bench/stats_bench.cpp && ./stats_bench
+
+  Every case feeds a short script of readings and compares the results
+  with values computed by hand from the script: minimum, maximum and mean
+  of a statistics window and of the completed one after rollover; block
+  demand with the partial first sub-interval dropped, peak and resetPeak();
+  sliding demand over three sub-intervals; a reading after a 30 day gap,
+  which skips most of the sub-intervals in between; and a meter reset,
+  whose falling wattHour must count as no energy. The state lives in an
+  arena, as on the device. The last line times add() for a panel of PQ
+  meters.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+
+#include "ModbusMeter_Stats.h"
+
+static const time_t kT0 = 1800000; ///< on a 900 s boundary
+static const uint64_t ku64All = (1ULL << ModbusMeter::ku8MeterFields) - 1;
+
+static const uint8_t ku8TimedRows = 32;
+static const uint32_t ku32TimedReadings = 100000;
+
+// constant power up to an offset from kT0
+typedef struct
+{
+  uint32_t u32Until;
+  float fWatt;
+} powerStep;
+
+// demand expected after the reading at kT0 + u32At; offsets of 0 stand for time 0
+typedef struct
+{
+  uint32_t u32At;
+  float fDemand;
+  float fEnergy;
+  uint32_t u32End;
+  float fPeak;
+  uint32_t u32PeakAt;
+  bool bResetPeak; ///< call resetPeak() after the check
+} demandCheck;
+
+static const powerStep kBlockPower[] = {{1800, 1000}, {2700, 2000}, {4500, 500}};
+
+// metering starts 100 s into [kT0, kT0 + 900), which is dropped
+static const demandCheck kBlockChecks[] = {
+    {890, 0, 0, 0, 0, 0, false},
+    {900, 0, 0, 0, 0, 0, false},
+    {1800, 1000, 250, 1800, 1000, 1800, false},
+    {2700, 2000, 500, 2700, 2000, 2700, false},
+    {3600, 500, 125, 3600, 2000, 2700, true},
+    {4500, 500, 125, 4500, 500, 4500, false},
+};
+
+// sub-intervals of 100, 200, 50 and 300 Wh
+static const powerStep kSlidingPower[] = {{300, 1200}, {600, 2400}, {900, 600}, {1200, 3600}};
+
+static const demandCheck kSlidingChecks[] = {
+    {300, 0, 0, 0, 0, 0, false},
+    {600, 0, 0, 0, 0, 0, false},
+    {900, 1400, 350, 900, 1400, 900, false},
+    {1200, 2200, 550, 1200, 2200, 1200, false},
+};
+
+static bool near(float a, double b)
+{
+  return fabs(a - b) <= 1e-4 * fabs(b) + 1e-3;
+}
+
+static double energyAt(const powerStep *steps, uint8_t u8Steps, uint32_t u32At)
+{
+  double dWh = 0;
+  uint32_t u32From = 0;
+
+  for (uint8_t s = 0; s < u8Steps && u32From < u32At; s++)
+  {
+    uint32_t u32To = (steps[s].u32Until < u32At) ? steps[s].u32Until : u32At;
+
+    dWh += (double)steps[s].fWatt * (u32To - u32From) / 3600;
+    u32From = steps[s].u32Until;
+  }
+  return dWh;
+}
+
+static void feed(MeterStats &stats, uint8_t u8Row, time_t t, float fWatt, float fWh, uint64_t u64Valid = ku64All)
+{
+  ModbusMeter::meterData d;
+
+  memset(&d, 0, sizeof(d));
+  d.mdt = t;
+  d.u64Valid = u64Valid;
+  d.watt = fWatt;
+  d.wattHour = fWh;
+  stats.add(u8Row, d);
+}
+
+static bool sameStats(const char *what, const MeterStats::fieldStats &s, float fMin, float fMax, float fAvg, uint32_t u32Count, time_t tStart)
+{
+  if (s.u32Count != u32Count || s.tStart != tStart || !near(s.fMin, fMin) || !near(s.fMax, fMax) || !near(s.fAvg, fAvg))
+  {
+    printf("MISMATCH: %s: %u readings from %ld, min %g max %g avg %g; expected %u from %ld, %g %g %g\n", what, s.u32Count,
+           (long)s.tStart, s.fMin, s.fMax, s.fAvg, u32Count, (long)tStart, fMin, fMax, fAvg);
+    return false;
+  }
+  return true;
+}
+
+static bool sameDemand(const char *what, MeterStats &stats, uint8_t u8Row, const demandCheck &c)
+{
+  MeterStats::demandInfo d;
+  time_t tEnd = c.u32End ? kT0 + c.u32End : 0;
+  time_t tPeak = c.u32PeakAt ? kT0 + c.u32PeakAt : 0;
+
+  stats.getDemand(u8Row, &d);
+  if (!near(d.fDemand, c.fDemand) || !near(d.fEnergy, c.fEnergy) || d.tEnd != tEnd || !near(d.fPeak, c.fPeak) || d.tPeak != tPeak)
+  {
+    printf("MISMATCH: %s at +%u: demand %g (%g Wh) to %ld, peak %g at %ld; expected %g (%g Wh) to %ld, peak %g at %ld\n", what,
+           c.u32At, d.fDemand, d.fEnergy, (long)d.tEnd, d.fPeak, (long)d.tPeak, c.fDemand, c.fEnergy, (long)tEnd, c.fPeak, (long)tPeak);
+    return false;
+  }
+  return true;
+}
+
+static bool checkWindows(MeterStats &stats)
+{
+  MeterStats::fieldStats s;
+  ModbusMeter::meterData d;
+  const uint8_t ku8I0 = ModbusMeter::ku8FieldI0;
+
+  stats.setWindow(60);
+  memset(&d, 0, sizeof(d));
+
+  // watt 10, 30, 20; i0 5, then left out, then NaN
+  d.mdt = kT0;
+  d.u64Valid = ku64All;
+  d.watt = 10;
+  d.i0 = 5;
+  stats.add(0, d);
+  d.mdt = kT0 + 10;
+  d.u64Valid = ku64All & ~(1ULL << ku8I0);
+  d.watt = 30;
+  d.i0 = 1000;
+  stats.add(0, d);
+  d.mdt = kT0 + 20;
+  d.u64Valid = ku64All;
+  d.watt = 20;
+  d.i0 = NAN;
+  stats.add(0, d);
+
+  stats.getStats(0, ModbusMeter::ku8FieldWatt, false, &s);
+  if (!sameStats("running window, watt", s, 10, 30, 20, 3, kT0))
+    return false;
+  stats.getStats(0, ku8I0, false, &s);
+  if (!sameStats("running window, i0", s, 5, 5, 5, 1, kT0))
+    return false;
+  stats.getStats(0, ModbusMeter::ku8FieldWatt, true, &s);
+  if (!sameStats("no completed window yet", s, 0, 0, 0, 0, 0))
+    return false;
+
+  // rollover at kT0 + 60
+  feed(stats, 0, kT0 + 65, 40, 0);
+  stats.getStats(0, ModbusMeter::ku8FieldWatt, true, &s);
+  if (!sameStats("completed window, watt", s, 10, 30, 20, 3, kT0))
+    return false;
+  stats.getStats(0, ku8I0, true, &s);
+  if (!sameStats("completed window, i0", s, 5, 5, 5, 1, kT0))
+    return false;
+  stats.getStats(0, ModbusMeter::ku8FieldWatt, false, &s);
+  if (!sameStats("window after rollover", s, 40, 40, 40, 1, kT0 + 60))
+    return false;
+
+  d.mdt = kT0 + 50;
+  if (stats.add(0, d))
+  {
+    printf("MISMATCH: reading before the running window accepted\n");
+    return false;
+  }
+
+  // several empty windows later the completed one is still the last with readings
+  feed(stats, 0, kT0 + 300, 50, 0);
+  stats.getStats(0, ModbusMeter::ku8FieldWatt, true, &s);
+  if (!sameStats("completed window after a gap", s, 40, 40, 40, 1, kT0 + 60))
+    return false;
+
+  printf("windows: min/max/avg, missing and NaN fields, rollover ok\n");
+  return true;
+}
+
+// readings every u32Step s from kT0 + u32First to the last check
+static bool runProfile(MeterStats &stats, const char *name, uint16_t u16Interval, uint8_t u8Subs, uint32_t u32First,
+                       uint32_t u32Step, const powerStep *steps, uint8_t u8Steps, const demandCheck *checks, uint8_t u8Checks)
+{
+  uint8_t c = 0;
+
+  stats.setDemand(u16Interval, u8Subs);
+  for (uint32_t u32At = u32First; c < u8Checks; u32At += u32Step)
+  {
+    feed(stats, 0, kT0 + u32At, 0, (float)energyAt(steps, u8Steps, u32At));
+    if (u32At == checks[c].u32At)
+    {
+      if (!sameDemand(name, stats, 0, checks[c]))
+        return false;
+      if (checks[c].bResetPeak)
+        stats.resetPeak(0);
+      c++;
+    }
+  }
+  printf("%s ok\n", name);
+  return true;
+}
+
+static bool checkGap(MeterStats &stats)
+{
+  const uint32_t ku32Gap = 30 * 86400 + 150;
+  const demandCheck kBefore = {900, 3600, 900, 900, 3600, 900, false};
+  const demandCheck kAfter = {900 + ku32Gap, 7200, 1800, 900 + 30 * 86400, 7200, 1800, false};
+  const demandCheck kNext = {900 + ku32Gap + 150, 7200, 1800, 900 + 30 * 86400 + 300, 7200, 1800, false};
+  MeterStats::demandInfo d;
+  uint32_t u32At;
+
+  // 1 Wh/s for three sub-intervals of 300 s
+  stats.setDemand(900, 3);
+  for (u32At = 0; u32At <= 900; u32At += 10)
+  {
+    feed(stats, 0, kT0 + u32At, 0, (float)u32At);
+  }
+  if (!sameDemand("gap, before", stats, 0, kBefore))
+    return false;
+
+  // 2 Wh/s through the gap: 600 Wh per sub-interval, 300 Wh into the running
+  // one; the peak is reached by the first three, at +1800
+  feed(stats, 0, kT0 + kAfter.u32At, 0, (float)(900 + 2 * ku32Gap));
+  if (!sameDemand("gap, after", stats, 0, kAfter))
+    return false;
+  stats.getDemand(0, &d);
+  if (!near(d.fPartialEnergy, 300))
+  {
+    printf("MISMATCH: gap: %g Wh in the running sub-interval, expected 300\n", d.fPartialEnergy);
+    return false;
+  }
+
+  // the running sub-interval closes where it should, with its share of the gap
+  feed(stats, 0, kT0 + kNext.u32At, 0, (float)(900 + 2 * (ku32Gap + 150)));
+  if (!sameDemand("gap, next", stats, 0, kNext))
+    return false;
+
+  printf("sliding demand across a 30 day gap ok\n");
+  return true;
+}
+
+static bool checkReset(MeterStats &stats)
+{
+  const demandCheck kAfter = {900, 3560, 890, 900, 3560, 900, false};
+  uint32_t u32At;
+
+  // 1 Wh/s from 5000 Wh; the meter restarts from 10 Wh at +400; wattHour
+  // is left out at +600 and NaN at +610; 390 + 500 Wh in the block
+  stats.setDemand(900, 1);
+  for (u32At = 0; u32At <= 900; u32At += 10)
+  {
+    float fWh = (u32At < 400) ? 5000.0f + u32At : 10.0f + (u32At - 400);
+
+    if (u32At == 600)
+      feed(stats, 0, kT0 + u32At, 0, 99999, ku64All & ~(1ULL << ModbusMeter::ku8FieldWattHour));
+    else
+      feed(stats, 0, kT0 + u32At, 0, (u32At == 610) ? NAN : fWh);
+  }
+  if (!sameDemand("reset", stats, 0, kAfter))
+    return false;
+
+  printf("counter reset and missing energy readings ok\n");
+  return true;
+}
+
+static void timeAdd()
+{
+  MeterStats stats;
+  ModbusMeter::pqData d;
+  volatile float fSink;
+
+  memset(&d, 0, sizeof(d));
+  d.u64Valid = ModbusMeter::ku64AllFields;
+  stats.begin(ku8TimedRows, ModbusMeter::ku8PQFields);
+  stats.setDemand(900, 3);
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < ku32TimedReadings; i++)
+  {
+    d.mdt = kT0 + i / ku8TimedRows;
+    d.watt = 1000.0f + i % 97;
+    d.wattHour = (float)(i / ku8TimedRows);
+    d.freq = 50.0f + (i % 7) * 0.01f;
+    stats.add(i % ku8TimedRows, d);
+  }
+  double dNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / ku32TimedReadings;
+  MeterStats::demandInfo demand;
+  stats.getDemand(0, &demand);
+  fSink = demand.fDemand;
+  (void)fSink;
+
+  printf("add(): %.0f ns per pqData reading, %u meters\n", dNs, ku8TimedRows);
+}
+
+int main()
+{
+  static uint8_t buf[4096];
+  mbArena arena;
+  MeterStats stats;
+
+  arena_init(&arena, buf, sizeof(buf));
+  if (!stats.begin(1, ModbusMeter::ku8MeterFields, &arena))
+  {
+    printf("MISMATCH: begin() refused the arena\n");
+    return 1;
+  }
+
+  if (!checkWindows(stats) ||
+      !runProfile(stats, "block demand", 900, 1, 100, 10, kBlockPower, 3, kBlockChecks, sizeof(kBlockChecks) / sizeof(kBlockChecks[0])) ||
+      !runProfile(stats, "sliding demand", 900, 3, 0, 10, kSlidingPower, 4, kSlidingChecks, sizeof(kSlidingChecks) / sizeof(kSlidingChecks[0])) ||
+      !checkGap(stats) || !checkReset(stats))
+    return 1;
+
+  timeAdd();
+  return 0;
+}
@@ -0,0 +1,117 @@
+/*
+  tcp_bench.cpp - Modbus TCP polling against a loopback gateway
+
+  Reads meters through ModbusTcpLink from a SimGateway on 127.0.0.1, with
+  the link's window at 1 (one request at a time, as on RTU) and at its
+  maximum, and with one or several meters in flight on the same connection.
+  Build and run on the development machine from the repository root:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -I. -o tcp_bench \
+        ModbusMeter_ESP32.cpp ModbusMeter_Profiles.cpp ModbusMeter_TcpLink.cpp \
+        extras/host/HostArduino.cpp extras/host/SimSlaveFarm.cpp \
+        extras/host/SimGateway.cpp extras/bench/tcp_bench.cpp -lpthread && ./tcp_bench
+
+  Time is real: every simulated slave answers 2 ms after a request arrives.
+*/
+
+#include <time.h>
+
+#include "ModbusMeter_ESP32.h"
+#include "ModbusMeter_TcpLink.h"
+#include "extras/host/SimGateway.h"
+
+static const uint16_t ku16Reads = 100;
+static const uint8_t ku8Meters = 4;
+
+typedef struct
+{
+  const char *name;
+  uint8_t mType;
+  bool bSerial;    ///< gateway answers one request at a time
+  uint8_t u8Window;
+  uint8_t u8Meters; ///< meters read concurrently on the connection
+} benchCase;
+
+static const benchCase kCases[] = {
+    {"eastron w1", 0x02, false, 1, 1},
+    {"eastron w8", 0x02, false, 8, 1},
+    {"pm2230 w1", 0x81, false, 1, 1},
+    {"pm2230 w8", 0x81, false, 8, 1},
+    {"pm2230 w8 x4", 0x81, false, 8, ku8Meters},
+    {"pm2230 serial w8", 0x81, true, 8, 1},
+};
+
+int main()
+{
+  float adj[ModbusMeter::ku8MeterFields];
+  uint8_t k;
+
+  for (k = 0; k < ModbusMeter::ku8MeterFields; k++)
+  {
+    adj[k] = 1;
+  }
+
+  printf("%-18s %6s %9s %8s %9s %8s %6s\n", "case", "ok", "ms/read", "reads/s", "answers/s", "inflight", "conns");
+  for (k = 0; k < sizeof(kCases) / sizeof(kCases[0]); k++)
+  {
+    const benchCase *c = &kCases[k];
+    SimSlaveFarm farm(9600);
+    SimGateway gateway(farm);
+    ModbusTcpLink link;
+    ModbusMeter nodes[ku8Meters];
+    ModbusTcpLink::tcpStats stats;
+    uint16_t u16Ok = 0;
+    uint16_t u16Started = 0;
+    uint16_t u16Done = 0;
+    uint64_t u64Start;
+    uint16_t u16Port;
+    uint8_t m;
+
+    for (m = 0; m < c->u8Meters; m++)
+    {
+      farm.addSlave(m + 1, c->mType);
+      farm.setLatency(m + 1, 2000);
+      nodes[m].begin(link, 1, 1);
+    }
+    u16Port = gateway.start(c->bSerial);
+    link.begin("127.0.0.1", u16Port);
+    link.setWindow(c->u8Window);
+
+    u64Start = hostMicros64();
+    while (u16Done < ku16Reads)
+    {
+      for (m = 0; m < c->u8Meters; m++)
+      {
+        uint8_t result;
+
+        if (!nodes[m].meterReadBusy())
+        {
+          if (u16Started == ku16Reads)
+            continue;
+          u16Started++;
+          result = nodes[m].beginMeterRead(0, m + 1, 0, c->mType, time(NULL), adj, 0, 0);
+        }
+        else
+        {
+          result = nodes[m].pollMeterRead();
+        }
+        if (result != ModbusMeter::ku8MBPending)
+        {
+          u16Done++;
+          if (result == ModbusMeter::ku8MBSuccess)
+            u16Ok++;
+        }
+      }
+      delayMicroseconds(50);
+    }
+
+    link.getStats(&stats);
+    printf("%-18s %6u %9.2f %8.1f %9u %8u %6u\n", c->name, u16Ok,
+           (hostMicros64() - u64Start) / 1000.0 / ku16Reads * c->u8Meters,
+           ku16Reads * 1e6 / (hostMicros64() - u64Start),
+           link.getThroughput(), stats.u8MaxInFlight, stats.u32Connects);
+    link.close();
+    gateway.stop();
+  }
+  return 0;
+}
@@ -0,0 +1,85 @@
+/*
+  Arduino.h - minimal Arduino core for building the library on a host
+
+  Provides just what ModbusMeter uses: fixed-width types, the byte/word
+  macros, Print/Stream and the timing functions. The clock is either the
+  real monotonic clock or a virtual one that only advances through delay()
+  and hostAdvanceMicros(); see HostArduino.cpp.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+
+static inline uint16_t word(uint8_t h, uint8_t l)
+{
+  return (uint16_t)((h << 8) | l);
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+// host extensions
+void hostUseVirtualClock(bool bEnable);
+void hostAdvanceMicros(uint64_t us);
+uint64_t hostMicros64();
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--)
+    {
+      n += write(*buffer++);
+    }
+    return n;
+  }
+  size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+  size_t print(const char *str) { return write(str); }
+  size_t println(const char *str) { return write(str) + write("\r\n"); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  virtual size_t readBytes(uint8_t *buffer, size_t length)
+  {
+    size_t n = 0;
+    while (n < length)
+    {
+      int c = read();
+      if (c < 0)
+        break;
+      buffer[n++] = (uint8_t)c;
+    }
+    return n;
+  }
+};
+
+#endif
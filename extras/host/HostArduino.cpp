@@ -0,0 +1,88 @@
+/*
+  HostArduino.cpp - timing and Print support for the host build
+
+  With the virtual clock enabled, time stands still until delay(),
+  delayMicroseconds() or hostAdvanceMicros() move it forward. Benchmarks use
+  it to measure bus time independently of host speed; it is not meant to be
+  shared between threads.
+*/
+
+#include "Arduino.h"
+
+#include <stdarg.h>
+#include <chrono>
+#include <thread>
+
+static bool bVirtual = false;
+static uint64_t u64VirtualUs = 0;
+static const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+void hostUseVirtualClock(bool bEnable)
+{
+  u64VirtualUs = hostMicros64();
+  bVirtual = bEnable;
+}
+
+uint64_t hostMicros64()
+{
+  if (bVirtual)
+  {
+    return u64VirtualUs;
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+}
+
+void hostAdvanceMicros(uint64_t us)
+{
+  if (bVirtual)
+  {
+    u64VirtualUs += us;
+  }
+  else
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(hostMicros64() / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)hostMicros64();
+}
+
+void delay(unsigned long ms)
+{
+  hostAdvanceMicros((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  hostAdvanceMicros(us);
+}
+
+void yield()
+{
+  if (!bVirtual)
+  {
+    std::this_thread::yield();
+  }
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char buf[256];
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+
+  if (n < 0)
+    return 0;
+  return write((const uint8_t *)buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
@@ -0,0 +1,210 @@
+/*
+  SimGateway.cpp - simulated Modbus TCP gateway on the loopback interface
+*/
+
+#include "SimGateway.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+SimGateway::SimGateway(SimSlaveFarm &farm) : _farm(farm)
+{
+  _listen = -1;
+  _bSerial = false;
+  _bRun = false;
+  _u64SerialFreeUs = 0;
+  _u32Connections = 0;
+}
+
+SimGateway::~SimGateway()
+{
+  stop();
+}
+
+/**
+Listen on an ephemeral loopback port and start answering.
+
+@param bSerial answer one request at a time instead of concurrently
+@return the port, or 0 on failure
+*/
+uint16_t SimGateway::start(bool bSerial)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int one = 1;
+
+  _listen = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listen < 0)
+  {
+    return 0;
+  }
+  setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind(_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(_listen, 4) < 0 ||
+      getsockname(_listen, (struct sockaddr *)&addr, &len) < 0)
+  {
+    close(_listen);
+    _listen = -1;
+    return 0;
+  }
+
+  _bSerial = bSerial;
+  _bRun = true;
+  _thread = std::thread(&SimGateway::run, this);
+  return ntohs(addr.sin_port);
+}
+
+void SimGateway::stop()
+{
+  if (!_bRun)
+  {
+    return;
+  }
+  _bRun = false;
+  _thread.join();
+  for (size_t i = 0; i < _clients.size(); i++)
+  {
+    close(_clients[i].fd);
+  }
+  _clients.clear();
+  _pending.clear();
+  close(_listen);
+  _listen = -1;
+}
+
+void SimGateway::run()
+{
+  while (_bRun)
+  {
+    std::vector<struct pollfd> fds;
+    struct pollfd p;
+    uint64_t u64Now = hostMicros64();
+    size_t i;
+
+    // send what is due, oldest first
+    for (i = 0; i < _pending.size();)
+    {
+      if (_pending[i].u64DueUs <= u64Now)
+      {
+        send(_pending[i].fd, &_pending[i].adu[0], _pending[i].adu.size(), MSG_NOSIGNAL);
+        _pending.erase(_pending.begin() + i);
+      }
+      else
+      {
+        i++;
+      }
+    }
+
+    p.fd = _listen;
+    p.events = POLLIN;
+    fds.push_back(p);
+    for (i = 0; i < _clients.size(); i++)
+    {
+      p.fd = _clients[i].fd;
+      fds.push_back(p);
+    }
+
+    // sub-millisecond latencies are rounded up; good enough for a gateway
+    if (poll(&fds[0], fds.size(), _pending.empty() ? 5 : 0) <= 0)
+    {
+      if (!_pending.empty())
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      int fd = accept(_listen, 0, 0);
+
+      if (fd >= 0)
+      {
+        client c;
+        int one = 1;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c.fd = fd;
+        _clients.push_back(c);
+        _u32Connections++;
+      }
+    }
+
+    for (i = 1; i < fds.size(); i++)
+    {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        handle(_clients[i - 1]);
+      }
+    }
+
+    for (i = 0; i < _clients.size();)
+    {
+      if (_clients[i].fd < 0)
+        _clients.erase(_clients.begin() + i);
+      else
+        i++;
+    }
+  }
+}
+
+/**
+Read what a client sent and schedule the answers of complete requests.
+*/
+void SimGateway::handle(client &c)
+{
+  uint8_t buf[512];
+  ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+  size_t pos = 0;
+
+  if (n <= 0)
+  {
+    close(c.fd);
+    c.fd = -1;
+    return;
+  }
+  c.rx.insert(c.rx.end(), buf, buf + n);
+
+  while (c.rx.size() - pos >= 7)
+  {
+    const uint8_t *frame = &c.rx[pos];
+    uint16_t u16Len = word(frame[4], frame[5]);
+    std::vector<uint8_t> pdu;
+    uint32_t u32LatencyUs = 0;
+
+    if (c.rx.size() - pos < 6u + u16Len)
+    {
+      break;
+    }
+    pos += 6 + u16Len;
+
+    if (!_farm.answer(frame[6], frame + 7, (uint8_t)(u16Len - 1), pdu, &u32LatencyUs))
+    {
+      continue;
+    }
+
+    pendingAnswer a;
+    uint64_t u64Start = hostMicros64();
+
+    if (_bSerial)
+    {
+      u64Start = (_u64SerialFreeUs > u64Start) ? _u64SerialFreeUs : u64Start;
+      _u64SerialFreeUs = u64Start + u32LatencyUs;
+    }
+    a.fd = c.fd;
+    a.u64DueUs = u64Start + u32LatencyUs;
+    a.adu.assign(frame, frame + 4);
+    a.adu.push_back(highByte(pdu.size() + 1));
+    a.adu.push_back(lowByte(pdu.size() + 1));
+    a.adu.push_back(frame[6]);
+    a.adu.insert(a.adu.end(), pdu.begin(), pdu.end());
+    _pending.push_back(a);
+  }
+  c.rx.erase(c.rx.begin(), c.rx.begin() + pos);
+}
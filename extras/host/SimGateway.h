@@ -0,0 +1,58 @@
+/*
+  SimGateway.h - simulated Modbus TCP gateway on the loopback interface
+
+  Listens on 127.0.0.1 and answers MBAP requests from the register images
+  of a SimSlaveFarm, each after the addressed slave's latency in real time.
+  A pipelined gateway works on every request as it arrives, like a meter
+  with a native TCP port; a serial one answers strictly one after another,
+  like a gateway in front of a single RS-485 line.
+*/
+
+#ifndef SimGateway_h
+#define SimGateway_h
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "SimSlaveFarm.h"
+
+class SimGateway
+{
+public:
+  explicit SimGateway(SimSlaveFarm &farm);
+  ~SimGateway();
+
+  uint16_t start(bool bSerial);
+  void stop();
+  uint32_t connections() const { return _u32Connections; }
+
+private:
+  typedef struct
+  {
+    int fd;
+    uint64_t u64DueUs;
+    std::vector<uint8_t> adu;
+  } pendingAnswer;
+
+  typedef struct
+  {
+    int fd;
+    std::vector<uint8_t> rx;
+  } client;
+
+  SimSlaveFarm &_farm;
+  int _listen;
+  bool _bSerial;
+  std::atomic<bool> _bRun;
+  std::thread _thread;
+  std::vector<client> _clients;
+  std::vector<pendingAnswer> _pending;
+  uint64_t _u64SerialFreeUs; ///< serial mode: when the line is free again
+  uint32_t _u32Connections;
+
+  void run();
+  void handle(client &c);
+};
+
+#endif
@@ -0,0 +1,481 @@
+/*
+  SimSlaveFarm.cpp - simulated Modbus RTU slaves behind a Stream
+*/
+
+#include "SimSlaveFarm.h"
+
+/**
+Encode a value into registers, the inverse of regdecode_value().
+*/
+static void encodeValue(uint8_t u8Type, double value, uint16_t *w)
+{
+  uint8_t u8Qty = regdecode_qty(u8Type);
+  uint8_t u8Variant = 0;
+  uint64_t u64 = 0;
+  uint8_t i;
+
+  if (u8Type >= 1 && u8Type <= 4)
+  {
+    w[0] = (u8Type == 1) ? (uint16_t)(int16_t)lround(value) : (uint16_t)lround(value);
+    return;
+  }
+  if (u8Type == REGDECODE_MOD10K)
+  {
+    uint64_t u64Value = (uint64_t)llround(value);
+    for (i = 0; i < 4; i++)
+    {
+      w[i] = (uint16_t)(u64Value % 10000);
+      u64Value /= 10000;
+    }
+    return;
+  }
+
+  if (u8Type >= 5 && u8Type <= 8)
+  {
+    u8Variant = u8Type - 5;
+    u64 = (uint32_t)(int32_t)llround(value);
+  }
+  else if (u8Type >= 9 && u8Type <= 12)
+  {
+    u8Variant = u8Type - 9;
+    u64 = (uint32_t)llround(value);
+  }
+  else if (u8Type >= 13 && u8Type <= 16)
+  {
+    u8Variant = u8Type - 13;
+    u64 = (uint64_t)llround(value);
+  }
+  else if (u8Type >= 17 && u8Type <= 20)
+  {
+    u8Variant = u8Type - 17;
+    u64 = (uint64_t)llround(value);
+  }
+  else if (u8Type >= 21 && u8Type <= 24)
+  {
+    float f = (float)value;
+    uint32_t u32;
+    memcpy(&u32, &f, sizeof(u32));
+    u8Variant = u8Type - 21;
+    u64 = u32;
+  }
+  else if (u8Type >= 25 && u8Type <= 28)
+  {
+    u8Variant = u8Type - 25;
+    memcpy(&u64, &value, sizeof(u64));
+  }
+  else
+  {
+    return;
+  }
+
+  // canonical AB CD ... order, then the variant's word order and byte order
+  for (i = 0; i < u8Qty; i++)
+  {
+    uint16_t r = (uint16_t)(u64 >> (16 * (u8Qty - 1 - i)));
+    uint8_t u8Pos = (u8Variant & 1) ? (u8Qty - 1 - i) : i;
+    w[u8Pos] = (u8Variant & 2) ? regdecode_swap(r) : r;
+  }
+}
+
+SimSlaveFarm::SimSlaveFarm(uint32_t u32Baud)
+{
+  _u32CharUs = (11UL * 1000000UL + u32Baud - 1) / u32Baud;
+  _u32Baud = u32Baud;
+  _u8Format = ModbusMeter::ku8Serial8N1;
+  _rxPos = 0;
+  _u64ResponseStart = 0;
+  _u32Rand = 0x2545F491;
+  resetStats();
+}
+
+void SimSlaveFarm::resetStats()
+{
+  _u32Frames = 0;
+  _u32Answered = 0;
+  _u64BusyUs = 0;
+  _u64Bytes = 0;
+}
+
+/**
+Reading a healthy meter would report for a field, before adj[] scaling.
+*/
+float SimSlaveFarm::nominal(uint8_t u8Field)
+{
+  switch (u8Field)
+  {
+  case ModbusMeter::ku8FieldWatt:
+    return 1520.5f;
+  case ModbusMeter::ku8FieldWattHour:
+    return 123456.7f;
+  case ModbusMeter::ku8FieldPf:
+    return 0.95f;
+  case ModbusMeter::ku8FieldVarh:
+    return 2345.6f;
+  case ModbusMeter::ku8FieldI0:
+  case ModbusMeter::ku8FieldI1:
+  case ModbusMeter::ku8FieldI2:
+    return 5.1f + 0.1f * (u8Field - ModbusMeter::ku8FieldI0);
+  case ModbusMeter::ku8FieldV0:
+  case ModbusMeter::ku8FieldV1:
+  case ModbusMeter::ku8FieldV2:
+    return 230.1f - 0.3f * (u8Field - ModbusMeter::ku8FieldV0);
+  case ModbusMeter::ku8FieldFreq:
+    return 50.02f;
+  }
+  if (u8Field >= ModbusMeter::ku8FieldChr)
+  {
+    return 1.0f + 0.1f * ((u8Field - ModbusMeter::ku8FieldChr) % 7);
+  }
+  if (u8Field >= ModbusMeter::ku8FieldVunbr)
+  {
+    return 0.4f;
+  }
+  if (u8Field >= ModbusMeter::ku8FieldThdir)
+  {
+    return 8.5f;
+  }
+  return 2.1f;
+}
+
+/**
+Harmonic table entry of a given order, in percent of the fundamental.
+*/
+float SimSlaveFarm::harmonic(uint8_t u8Order)
+{
+  return 100.0f / u8Order;
+}
+
+/**
+Add a slave answering like a meter of type mType.
+
+Types that take their addresses from mt[] (and dt[] for the manual type)
+need the same arrays that will be passed to readMeterData().
+
+@return false if the type is unknown
+*/
+bool SimSlaveFarm::addSlave(uint8_t u8Id, uint8_t mType, const uint16_t *mt, const uint8_t *dt, uint8_t u8SlaveIndex)
+{
+  const ModbusMeter::meterProfile *profile = ModbusMeter::findProfile(mType);
+  simSlave &slave = _slaves[u8Id];
+  uint8_t k;
+
+  slave.regs.clear();
+  slave.u32LatencyUs = 5000;
+  slave.u8DropPct = 0;
+  slave.u8CrcPct = 0;
+  slave.u8ExceptionPct = 0;
+  slave.bStrict = false;
+  slave.u32Baud = _u32Baud;
+  slave.u8Format = _u8Format;
+
+  if (!profile && mType == 0xff && mt && dt)
+  {
+    for (k = 0; k < ModbusMeter::ku8MeterFields; k++)
+    {
+      uint16_t w[4];
+      encodeValue(dt[k], nominal(k), w);
+      for (uint8_t i = 0; i < regdecode_qty(dt[k]); i++)
+        slave.regs[mt[k] + i] = w[i];
+    }
+    return true;
+  }
+  if (!profile)
+  {
+    _slaves.erase(u8Id);
+    return false;
+  }
+
+  for (k = 0; k < profile->u8Fields; k++)
+  {
+    const ModbusMeter::meterField *f = &profile->fields[k];
+    uint16_t u16Address;
+    uint16_t w[4];
+
+    if (!regdecode_qty(f->u8Type))
+      continue;
+
+    u16Address = (profile->u8Flags & ModbusMeter::ku8ProfileMtAddress) ? mt[f->u8Field] : f->u16Address;
+    u16Address += profile->u16SlaveStride * u8SlaveIndex;
+
+    if (f->u8Flags & ModbusMeter::ku8FieldHarmonic)
+    {
+      // fill the whole table once, order h holding harmonic(h)
+      for (uint8_t h = 1; h <= ku8SimHarmonics; h++)
+      {
+        encodeValue(f->u8Type, harmonic(h) * f->fDivisor, w);
+        for (uint8_t i = 0; i < regdecode_qty(f->u8Type); i++)
+          slave.regs[u16Address + h * profile->u8HarmonicRegs + i] = w[i];
+      }
+      continue;
+    }
+
+    encodeValue(f->u8Type, nominal(f->u8Field) * f->fDivisor, w);
+    for (uint8_t i = 0; i < regdecode_qty(f->u8Type); i++)
+      slave.regs[u16Address + i] = w[i];
+  }
+  return true;
+}
+
+void SimSlaveFarm::setLatency(uint8_t u8Id, uint32_t u32Us)
+{
+  _slaves[u8Id].u32LatencyUs = u32Us;
+}
+
+/**
+Inject faults: percentage of requests left unanswered, answered with a
+corrupt CRC, or answered with exception 0x04 (slave device failure).
+*/
+void SimSlaveFarm::setFaults(uint8_t u8Id, uint8_t u8DropPct, uint8_t u8CrcPct, uint8_t u8ExceptionPct)
+{
+  _slaves[u8Id].u8DropPct = u8DropPct;
+  _slaves[u8Id].u8CrcPct = u8CrcPct;
+  _slaves[u8Id].u8ExceptionPct = u8ExceptionPct;
+}
+
+/**
+A strict slave rejects reads touching registers outside its map with
+exception 0x02, like meters with holes in their register space.
+*/
+void SimSlaveFarm::setStrict(uint8_t u8Id, bool bStrict)
+{
+  _slaves[u8Id].bStrict = bStrict;
+}
+
+/**
+Serial configuration a slave listens in; requests sent in another one are
+noise to it and go unanswered. Slaves start in the farm's configuration.
+*/
+void SimSlaveFarm::setSerial(uint8_t u8Id, uint32_t u32Baud, uint8_t u8Format)
+{
+  _slaves[u8Id].u32Baud = u32Baud;
+  _slaves[u8Id].u8Format = u8Format;
+}
+
+/**
+Reconfigure the master's side of the line, for ModbusMeter::setSerialSwitch().
+*/
+void SimSlaveFarm::setLine(uint32_t u32Baud, uint8_t u8Format)
+{
+  _u32Baud = u32Baud;
+  _u8Format = u8Format;
+  _u32CharUs = (11UL * 1000000UL + u32Baud - 1) / u32Baud;
+}
+
+void SimSlaveFarm::setRegister(uint8_t u8Id, uint16_t u16Address, uint16_t u16Value)
+{
+  _slaves[u8Id].regs[u16Address] = u16Value;
+}
+
+uint8_t SimSlaveFarm::roll()
+{
+  // xorshift32; deterministic so benchmark runs are repeatable
+  _u32Rand ^= _u32Rand << 13;
+  _u32Rand ^= _u32Rand >> 17;
+  _u32Rand ^= _u32Rand << 5;
+  return _u32Rand % 100;
+}
+
+size_t SimSlaveFarm::write(uint8_t b)
+{
+  _request.push_back(b);
+  return 1;
+}
+
+size_t SimSlaveFarm::write(const uint8_t *buffer, size_t size)
+{
+  _request.insert(_request.end(), buffer, buffer + size);
+  return size;
+}
+
+/**
+Transmit the collected request: the caller is held for the wire time of
+the request, like a UART flush(), then the addressed slave prepares its
+answer.
+*/
+void SimSlaveFarm::flush()
+{
+  if (_request.empty())
+  {
+    return;
+  }
+
+  _u64BusyUs += (uint64_t)_request.size() * _u32CharUs;
+  _u64Bytes += _request.size();
+  hostAdvanceMicros((uint64_t)_request.size() * _u32CharUs);
+  handleRequest();
+  _request.clear();
+}
+
+void SimSlaveFarm::handleRequest()
+{
+  uint16_t u16CRC;
+
+  std::vector<uint8_t> response;
+
+  _u32Frames++;
+  if (_request.size() != 8 || crc16_block(0xFFFF, &_request[0], 8) != 0)
+  {
+    return;
+  }
+
+  // a request nobody answers leaves a late answer to an earlier one on the line;
+  // a slave listening in another serial configuration sees only noise
+  std::map<uint8_t, simSlave>::iterator it = _slaves.find(_request[0]);
+  if (it != _slaves.end() && (it->second.u32Baud != _u32Baud || it->second.u8Format != _u8Format))
+  {
+    return;
+  }
+  response.push_back(_request[0]);
+  if (!answer(_request[0], &_request[1], 5, response))
+  {
+    return;
+  }
+  simSlave &slave = _slaves[_request[0]];
+  _response.swap(response);
+  _rxPos = 0;
+
+  u16CRC = crc16_block(0xFFFF, &_response[0], _response.size());
+  if (roll() < slave.u8CrcPct)
+  {
+    u16CRC ^= 0x5A5A;
+  }
+  _response.push_back(lowByte(u16CRC));
+  _response.push_back(highByte(u16CRC));
+
+  _u32Answered++;
+  _u64BusyUs += (uint64_t)_response.size() * _u32CharUs;
+  _u64Bytes += _response.size();
+  _u64ResponseStart = hostMicros64() + slave.u32LatencyUs + _u32CharUs;
+}
+
+/**
+Append the response PDU (function code onward) of slave u8Id to a read
+request PDU, applying its drop and exception faults. Shared by the RTU
+path and SimGateway.
+
+@param u8Len length of pdu; a read request is 5 bytes
+@param latencyUs receives the slave's response latency; may be 0
+@return false if the slave does not exist or drops the request
+*/
+bool SimSlaveFarm::answer(uint8_t u8Id, const uint8_t *pdu, uint8_t u8Len, std::vector<uint8_t> &response, uint32_t *latencyUs)
+{
+  std::map<uint8_t, simSlave>::iterator it = _slaves.find(u8Id);
+  uint16_t u16Address;
+  uint16_t u16Qty;
+  uint8_t u8Fn;
+  uint16_t i;
+
+  if (it == _slaves.end() || u8Len != 5)
+  {
+    return false;
+  }
+  simSlave &slave = it->second;
+
+  if (roll() < slave.u8DropPct)
+  {
+    return false;
+  }
+  if (latencyUs)
+  {
+    *latencyUs = slave.u32LatencyUs;
+  }
+
+  u8Fn = pdu[0];
+  u16Address = word(pdu[1], pdu[2]);
+  u16Qty = word(pdu[3], pdu[4]);
+
+  if ((u8Fn != 0x03 && u8Fn != 0x04) || u16Qty < 1 || u16Qty > 125)
+  {
+    response.push_back(u8Fn | 0x80);
+    response.push_back(0x01);
+  }
+  else if (roll() < slave.u8ExceptionPct)
+  {
+    response.push_back(u8Fn | 0x80);
+    response.push_back(0x04);
+  }
+  else
+  {
+    bool bHole = false;
+
+    if (slave.bStrict)
+    {
+      for (i = 0; i < u16Qty; i++)
+      {
+        if (!slave.regs.count((uint16_t)(u16Address + i)))
+          bHole = true;
+      }
+    }
+
+    if (bHole)
+    {
+      response.push_back(u8Fn | 0x80);
+      response.push_back(0x02);
+    }
+    else
+    {
+      response.push_back(u8Fn);
+      response.push_back((uint8_t)(u16Qty * 2));
+      for (i = 0; i < u16Qty; i++)
+      {
+        std::map<uint16_t, uint16_t>::iterator r = slave.regs.find((uint16_t)(u16Address + i));
+        uint16_t u16Value = (r == slave.regs.end()) ? 0 : r->second;
+        response.push_back(highByte(u16Value));
+        response.push_back(lowByte(u16Value));
+      }
+    }
+  }
+  return true;
+}
+
+/**
+Number of response bytes that have crossed the wire by now.
+*/
+size_t SimSlaveFarm::arrived()
+{
+  uint64_t u64Now = hostMicros64();
+  size_t n;
+
+  if (_response.empty() || u64Now < _u64ResponseStart)
+  {
+    return 0;
+  }
+  n = (size_t)((u64Now - _u64ResponseStart) / _u32CharUs) + 1;
+  return (n < _response.size()) ? n : _response.size();
+}
+
+int SimSlaveFarm::available()
+{
+  return (int)(arrived() - _rxPos);
+}
+
+int SimSlaveFarm::read()
+{
+  if (_rxPos < arrived())
+  {
+    return _response[_rxPos++];
+  }
+  return -1;
+}
+
+int SimSlaveFarm::peek()
+{
+  if (_rxPos < arrived())
+  {
+    return _response[_rxPos];
+  }
+  return -1;
+}
+
+size_t SimSlaveFarm::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t n = arrived() - _rxPos;
+
+  if (n > length)
+  {
+    n = length;
+  }
+  memcpy(buffer, &_response[_rxPos], n);
+  _rxPos += n;
+  return n;
+}
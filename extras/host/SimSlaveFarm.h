@@ -0,0 +1,89 @@
+/*
+  SimSlaveFarm.h - simulated Modbus RTU slaves behind a Stream
+
+  The farm stands in for an RS-485 port in host builds. Requests written by
+  ModbusMeter are decoded when flush() is called; the addressed slave answers
+  from a register image built from the library's own meter profiles, with
+  every field set to a plausible reading. Bytes become readable at the pace
+  of the configured baud rate after the slave's response latency, and faults
+  can be injected per slave.
+*/
+
+#ifndef SimSlaveFarm_h
+#define SimSlaveFarm_h
+
+#include <map>
+#include <vector>
+
+#include "ModbusMeter_ESP32.h"
+
+class SimSlaveFarm : public Stream
+{
+public:
+  explicit SimSlaveFarm(uint32_t u32Baud);
+
+  bool addSlave(uint8_t u8Id, uint8_t mType, const uint16_t *mt = 0, const uint8_t *dt = 0, uint8_t u8SlaveIndex = 0);
+  void setLatency(uint8_t u8Id, uint32_t u32Us);
+  void setFaults(uint8_t u8Id, uint8_t u8DropPct, uint8_t u8CrcPct, uint8_t u8ExceptionPct);
+  void setStrict(uint8_t u8Id, bool bStrict);
+  void setRegister(uint8_t u8Id, uint16_t u16Address, uint16_t u16Value);
+  void setSerial(uint8_t u8Id, uint32_t u32Baud, uint8_t u8Format);
+  void setLine(uint32_t u32Baud, uint8_t u8Format);
+  bool answer(uint8_t u8Id, const uint8_t *pdu, uint8_t u8Len, std::vector<uint8_t> &response, uint32_t *latencyUs = 0);
+
+  static float nominal(uint8_t u8Field);
+  static float harmonic(uint8_t u8Order);
+  static const uint8_t ku8SimHarmonics = 40; ///< orders present in simulated harmonic tables
+
+  // Stream
+  size_t write(uint8_t b) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(uint8_t *buffer, size_t length) override;
+  void flush() override;
+  using Print::write;
+
+  // wire statistics since construction or resetStats()
+  uint32_t frames() const { return _u32Frames; }
+  uint32_t answered() const { return _u32Answered; }
+  uint64_t busyUs() const { return _u64BusyUs; }
+  uint64_t bytesOnWire() const { return _u64Bytes; }
+  uint32_t charUs() const { return _u32CharUs; }
+  void resetStats();
+
+private:
+  typedef struct
+  {
+    std::map<uint16_t, uint16_t> regs;
+    uint32_t u32LatencyUs;
+    uint8_t u8DropPct;
+    uint8_t u8CrcPct;
+    uint8_t u8ExceptionPct;
+    bool bStrict; ///< answer illegal data address for unmapped registers
+    uint32_t u32Baud; ///< serial configuration the slave listens in
+    uint8_t u8Format;
+  } simSlave;
+
+  std::map<uint8_t, simSlave> _slaves;
+  std::vector<uint8_t> _request;
+  std::vector<uint8_t> _response;
+  size_t _rxPos;
+  uint64_t _u64ResponseStart; ///< arrival time of the first response byte
+  uint32_t _u32CharUs;
+  uint32_t _u32Baud;     ///< configuration of the master's UART; see setLine()
+  uint8_t _u8Format;
+  uint32_t _u32Rand;
+
+  uint32_t _u32Frames;
+  uint32_t _u32Answered;
+  uint64_t _u64BusyUs;
+  uint64_t _u64Bytes;
+
+  uint8_t roll();
+  void handleRequest();
+  size_t arrived();
+};
+
+#endif
@@ -0,0 +1 @@
+/* driver/uart.h - empty stand-in for the ESP-IDF UART driver on a host build */
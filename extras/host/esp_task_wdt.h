@@ -0,0 +1 @@
+/* esp_task_wdt.h - empty stand-in for the ESP-IDF task watchdog on a host build */
@@ -0,0 +1,148 @@
+/**
+@file
+Column Aggregation Kernels
+
+@defgroup util_aggregate "util/aggregate.h": Column Aggregation Kernels
+@code#include "util/aggregate.h"@endcode
+
+This header file provides reductions over contiguous float columns, one
+value per meter. Each kernel keeps AGGREGATE_LANES independent partial
+results so the compiler can map the main loop onto SIMD registers without
+-ffast-math; the partials are combined once at the end. Sums are therefore
+accumulated in a different order than a plain loop and may differ from it
+in the last bits.
+
+*/
+
+
+#ifndef _UTIL_AGGREGATE_H_
+#define _UTIL_AGGREGATE_H_
+
+
+/** @ingroup util_aggregate
+    Number of partial results per kernel.
+*/
+#define AGGREGATE_LANES 8
+
+
+/** @ingroup util_aggregate
+    Sum of a column.
+
+    @param x column
+    @param u16Count number of values
+    @return sum
+*/
+static inline float aggregate_sum(const float *__restrict x, uint16_t u16Count)
+{
+  float acc[AGGREGATE_LANES] = {0};
+  float fSum = 0;
+  uint16_t i = 0;
+  uint8_t l;
+
+  for (; i < (u16Count & ~(AGGREGATE_LANES - 1)); i += AGGREGATE_LANES)
+    for (l = 0; l < AGGREGATE_LANES; l++)
+      acc[l] += x[i + l];
+  for (; i < u16Count; i++)
+    fSum += x[i];
+  for (l = 0; l < AGGREGATE_LANES; l++)
+    fSum += acc[l];
+  return fSum;
+}
+
+
+/** @ingroup util_aggregate
+    Sum of absolute values and dot product with the absolute values of a
+    weight column, the two terms of a weighted mean.
+
+    @param x values
+    @param w weights; their absolute value is used
+    @param u16Count number of values
+    @param pfWeights receives the sum of |w|
+    @return sum of x * |w|
+*/
+static inline float aggregate_dot_abs(const float *__restrict x, const float *__restrict w, uint16_t u16Count, float *pfWeights)
+{
+  float acc[AGGREGATE_LANES] = {0};
+  float wacc[AGGREGATE_LANES] = {0};
+  float fDot = 0;
+  float fWeights = 0;
+  uint16_t i = 0;
+  uint8_t l;
+
+  for (; i < (u16Count & ~(AGGREGATE_LANES - 1)); i += AGGREGATE_LANES)
+    for (l = 0; l < AGGREGATE_LANES; l++)
+    {
+      float a = (w[i + l] < 0) ? -w[i + l] : w[i + l];
+      acc[l] += x[i + l] * a;
+      wacc[l] += a;
+    }
+  for (; i < u16Count; i++)
+  {
+    float a = (w[i] < 0) ? -w[i] : w[i];
+    fDot += x[i] * a;
+    fWeights += a;
+  }
+  for (l = 0; l < AGGREGATE_LANES; l++)
+  {
+    fDot += acc[l];
+    fWeights += wacc[l];
+  }
+  *pfWeights = fWeights;
+  return fDot;
+}
+
+
+/** @ingroup util_aggregate
+    Smallest and largest value of a column. Values of exactly 0 are treated
+    as absent (unused phase, meter not read yet).
+
+    @param x column
+    @param u16Count number of values
+    @param pfMin receives the minimum; unchanged if every value is 0
+    @param pfMax receives the maximum; unchanged if every value is 0
+    @return true if at least one value was non-zero
+*/
+static inline bool aggregate_minmax(const float *__restrict x, uint16_t u16Count, float *pfMin, float *pfMax)
+{
+  float lo[AGGREGATE_LANES], hi[AGGREGATE_LANES];
+  float fLo = 3.4e38f, fHi = -3.4e38f;
+  uint16_t i = 0;
+  uint8_t l;
+
+  for (l = 0; l < AGGREGATE_LANES; l++)
+  {
+    lo[l] = fLo;
+    hi[l] = fHi;
+  }
+  for (; i < (u16Count & ~(AGGREGATE_LANES - 1)); i += AGGREGATE_LANES)
+    for (l = 0; l < AGGREGATE_LANES; l++)
+    {
+      // zeros become values that cannot win, keeping the lanes branch-free
+      float vl = (x[i + l] != 0) ? x[i + l] : 3.4e38f;
+      float vh = (x[i + l] != 0) ? x[i + l] : -3.4e38f;
+      lo[l] = (vl < lo[l]) ? vl : lo[l];
+      hi[l] = (vh > hi[l]) ? vh : hi[l];
+    }
+  for (; i < u16Count; i++)
+  {
+    float v = x[i];
+    fLo = (v != 0 && v < fLo) ? v : fLo;
+    fHi = (v != 0 && v > fHi) ? v : fHi;
+  }
+  for (l = 0; l < AGGREGATE_LANES; l++)
+  {
+    fLo = (lo[l] < fLo) ? lo[l] : fLo;
+    fHi = (hi[l] > fHi) ? hi[l] : fHi;
+  }
+
+  if (fLo > fHi)
+  {
+    return false;
+  }
+  *pfMin = fLo;
+  *pfMax = fHi;
+  return true;
+}
+
+
+#endif /* _UTIL_AGGREGATE_H_ */
@@ -0,0 +1,70 @@
+/**
+@file
+Bump Allocator
+
+@defgroup util_arena "util/arena.h": Bump Allocator
+@code#include "util/arena.h"@endcode
+
+This header file provides a bump allocator over a caller-supplied buffer.
+Allocations are made once at start-up and never freed individually, so
+several instances can carve exactly sized tables out of one static block
+without heap fragmentation.
+
+*/
+
+
+#ifndef _UTIL_ARENA_H_
+#define _UTIL_ARENA_H_
+
+
+/** @ingroup util_arena
+    Buffer and fill level of an arena.
+*/
+typedef struct __mbArena
+{
+  uint8_t *pu8Base; ///< start of the buffer
+  uint32_t u32Size; ///< size of the buffer [bytes]
+  uint32_t u32Used; ///< bytes handed out, alignment padding included
+} mbArena;
+
+
+/** @ingroup util_arena
+    Attach an arena to a buffer.
+
+    @param arena arena to set up
+    @param buf storage
+    @param u32Size size of buf [bytes]
+*/
+static inline void arena_init(mbArena *arena, void *buf, uint32_t u32Size)
+{
+  arena->pu8Base = (uint8_t *)buf;
+  arena->u32Size = u32Size;
+  arena->u32Used = 0;
+}
+
+
+/** @ingroup util_arena
+    Take zeroed memory from an arena.
+
+    @param arena arena to allocate from
+    @param u32Size bytes needed
+    @param u8Align alignment, a power of two
+    @return memory, or 0 if the arena is exhausted
+*/
+static inline void *arena_alloc(mbArena *arena, uint32_t u32Size, uint8_t u8Align)
+{
+  uintptr_t uStart = ((uintptr_t)arena->pu8Base + arena->u32Used + u8Align - 1) & ~(uintptr_t)(u8Align - 1);
+  uint32_t u32Offset = (uint32_t)(uStart - (uintptr_t)arena->pu8Base);
+
+  if (u32Offset > arena->u32Size || arena->u32Size - u32Offset < u32Size)
+  {
+    return 0;
+  }
+
+  arena->u32Used = u32Offset + u32Size;
+  memset((void *)uStart, 0, u32Size);
+  return (void *)uStart;
+}
+
+
+#endif /* _UTIL_ARENA_H_ */
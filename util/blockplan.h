@@ -0,0 +1,105 @@
+/**
+@file
+Register Block Planning
+
+@defgroup util_blockplan "util/blockplan.h": Register Block Planning
+@code#include "util/blockplan.h"@endcode
+
+This header file provides functions for coalescing a set of register spans
+into the fewest Modbus block reads (function 0x03/0x04).
+
+Every request frame costs a fixed overhead on the wire: the 8-byte request,
+the 5-byte response header and CRC, two silent intervals and the slave
+turnaround. Reading a register that is not needed costs 2 bytes. Two spans
+are merged whenever the registers skipped between them are cheaper than a
+second frame and the merged block still fits into a single PDU.
+
+*/
+
+
+#ifndef _UTIL_BLOCKPLAN_H_
+#define _UTIL_BLOCKPLAN_H_
+
+
+/** @ingroup util_blockplan
+    Contiguous range of 16-bit registers.
+*/
+typedef struct __mbRegSpan
+{
+  uint16_t u16Address; ///< first register address
+  uint8_t u8Qty;       ///< number of registers
+} mbRegSpan;
+
+
+/** @ingroup util_blockplan
+    Merge register spans into block reads.
+
+    Spans may be given in any order and may overlap or repeat. The planner
+    visits them in address order and starts a new block when the next span
+    would push the block past @p u8MaxQty registers or when the gap in front
+    of it costs more than @p u16FrameCost bytes.
+
+    @param fields spans to read
+    @param u8Fields number of spans
+    @param blocks receives the planned blocks (at most @p u8Fields entries)
+    @param u8FieldBlock receives, for every span, the index of its block
+    @param u8MaxQty largest block allowed (125 for function 0x03/0x04)
+    @param u16FrameCost overhead of one extra frame [bytes]; 0 merges only
+           adjacent or overlapping spans
+    @return number of blocks
+*/
+static inline uint8_t blockplan_build(const mbRegSpan *fields, uint8_t u8Fields,
+                                      mbRegSpan *blocks, uint8_t *u8FieldBlock,
+                                      uint8_t u8MaxQty, uint16_t u16FrameCost)
+{
+  uint8_t u8Order[256];
+  uint8_t u8Blocks = 0;
+  uint32_t u32BlockStart = 0;
+  uint32_t u32BlockEnd = 0;
+  uint8_t i, j;
+
+  // insertion sort of span indices by address; sets are small
+  for (i = 0; i < u8Fields; i++)
+  {
+    j = i;
+    while (j > 0 && fields[u8Order[j - 1]].u16Address > fields[i].u16Address)
+    {
+      u8Order[j] = u8Order[j - 1];
+      j--;
+    }
+    u8Order[j] = i;
+  }
+
+  for (i = 0; i < u8Fields; i++)
+  {
+    const mbRegSpan *f = &fields[u8Order[i]];
+    uint32_t u32Start = f->u16Address;
+    uint32_t u32End = u32Start + f->u8Qty;
+
+    if (u8Blocks)
+    {
+      uint32_t u32Gap = (u32Start > u32BlockEnd) ? (u32Start - u32BlockEnd) : 0;
+      uint32_t u32NewEnd = (u32End > u32BlockEnd) ? u32End : u32BlockEnd;
+
+      if ((u32NewEnd - u32BlockStart) <= u8MaxQty && (u32Gap * 2) <= u16FrameCost)
+      {
+        u32BlockEnd = u32NewEnd;
+        blocks[u8Blocks - 1].u8Qty = (uint8_t)(u32BlockEnd - u32BlockStart);
+        u8FieldBlock[u8Order[i]] = u8Blocks - 1;
+        continue;
+      }
+    }
+
+    u32BlockStart = u32Start;
+    u32BlockEnd = u32End;
+    blocks[u8Blocks].u16Address = f->u16Address;
+    blocks[u8Blocks].u8Qty = f->u8Qty;
+    u8FieldBlock[u8Order[i]] = u8Blocks;
+    u8Blocks++;
+  }
+
+  return u8Blocks;
+}
+
+
+#endif /* _UTIL_BLOCKPLAN_H_ */
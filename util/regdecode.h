@@ -0,0 +1,169 @@
+/**
+@file
+Register Data Type Decoding
+
+@defgroup util_regdecode "util/regdecode.h": Register Data Type Decoding
+@code#include "util/regdecode.h"@endcode
+
+This header file provides functions for converting consecutive 16-bit
+registers into numeric values. Data type codes follow the table documented
+for the dt[] argument of ModbusMeter::readMeterData(); words are passed in
+the order they were received.
+
+*/
+
+
+#ifndef _UTIL_REGDECODE_H_
+#define _UTIL_REGDECODE_H_
+
+
+/** @ingroup util_regdecode
+    Four register energy counter in modulo-10000 digits, least significant
+    register first (Schneider PM800 INT64 MOD10). Not part of the dt[] table.
+*/
+#define REGDECODE_MOD10K 0x80
+
+
+/** @ingroup util_regdecode
+    Number of registers occupied by a data type.
+
+    @param uint8_t u8Type data type code
+    @return register count; 0 for N/A or unknown types
+*/
+static inline uint8_t regdecode_qty(uint8_t u8Type)
+{
+  if (u8Type >= 1 && u8Type <= 4)
+    return 1;
+  if ((u8Type >= 5 && u8Type <= 12) || (u8Type >= 21 && u8Type <= 24))
+    return 2;
+  if ((u8Type >= 13 && u8Type <= 20) || (u8Type >= 25 && u8Type <= 28) || u8Type == REGDECODE_MOD10K)
+    return 4;
+  return 0;
+}
+
+
+/** @ingroup util_regdecode
+    Swap the two bytes of a register.
+*/
+static inline uint16_t regdecode_swap(uint16_t w)
+{
+  return (uint16_t)((w << 8) | (w >> 8));
+}
+
+
+/** @ingroup util_regdecode
+    Word and byte order of a data type.
+
+    Little-endian variants reverse the register order (bit 0), byte swap
+    variants reverse the bytes inside every register (bit 1). Within each
+    size group the variants are numbered big-endian, little-endian,
+    big-endian byte swap, little-endian byte swap.
+
+    @param u8Type data type code
+    @return 0..3; 0 for single register and unknown types
+*/
+static inline uint8_t regdecode_variant(uint8_t u8Type)
+{
+  return (u8Type >= 5 && u8Type <= 28) ? (u8Type - 5) & 3 : 0;
+}
+
+
+/** @ingroup util_regdecode
+    Convert the raw bits of a value, its registers concatenated most
+    significant first with the high byte of each register first.
+
+    Only the size and kind of the type matter here; its word and byte
+    order have already been dealt with.
+
+    @param u8Type data type code
+    @param u64 raw bits, right aligned
+    @return decoded value; 0 for N/A or unknown types
+*/
+static inline double regdecode_bits_value(uint8_t u8Type, uint64_t u64)
+{
+  uint32_t u32;
+  float f;
+  double d;
+
+  if (u8Type == 1)
+    return (int16_t)u64;
+  if (u8Type >= 2 && u8Type <= 4)
+    return (uint16_t)u64;
+  if (u8Type == REGDECODE_MOD10K)
+    return (double)((int64_t)(uint16_t)(u64 >> 48) + (int64_t)(uint16_t)(u64 >> 32) * 10000 +
+                    (int64_t)(uint16_t)(u64 >> 16) * 10000 * 10000 + (int64_t)(uint16_t)u64 * 10000 * 10000 * 10000);
+  if (u8Type < 5 || u8Type > 28)
+    return 0;
+
+  switch ((u8Type - 5) >> 2)
+  {
+  case 0:
+    return (int32_t)u64;
+  case 1:
+    return (uint32_t)u64;
+  case 2:
+    return (double)(int64_t)u64;
+  case 3:
+    return (double)u64;
+  case 4:
+    u32 = (uint32_t)u64;
+    memcpy(&f, &u32, sizeof(f));
+    return f;
+  default:
+    memcpy(&d, &u64, sizeof(d));
+    return d;
+  }
+}
+
+
+/** @ingroup util_regdecode
+    Decode a value straight from the payload of a response frame.
+
+    Registers are taken as the big-endian byte pairs they arrive as, with
+    the type's word and byte order applied while assembling, so no word
+    buffer is needed. The caller guarantees that regdecode_qty(u8Type)
+    registers are present.
+
+    @param u8Type data type code
+    @param pu8Data high byte of the value's first register
+    @return decoded value; 0 for N/A or unknown types
+*/
+static inline double regdecode_value_be(uint8_t u8Type, const uint8_t *pu8Data)
+{
+  uint8_t u8Qty = regdecode_qty(u8Type);
+  uint8_t u8Variant = regdecode_variant(u8Type);
+  uint8_t u8Hi = (u8Variant & 2) ? 1 : 0; // byte swap variants carry the low byte first
+  uint64_t u64 = 0;
+
+  for (uint8_t i = 0; i < u8Qty; i++)
+  {
+    const uint8_t *r = pu8Data + 2 * ((u8Variant & 1) ? u8Qty - 1 - i : i);
+    u64 = (u64 << 16) | (uint16_t)((r[u8Hi] << 8) | r[u8Hi ^ 1]);
+  }
+  return regdecode_bits_value(u8Type, u64);
+}
+
+
+/** @ingroup util_regdecode
+    Decode registers into a value.
+
+    @param uint8_t u8Type data type code
+    @param w first register; regdecode_qty(u8Type) registers are read
+    @return decoded value; 0 for N/A or unknown types
+*/
+static inline double regdecode_value(uint8_t u8Type, const uint16_t *w)
+{
+  uint8_t u8Qty = regdecode_qty(u8Type);
+  uint8_t u8Variant = regdecode_variant(u8Type);
+  uint64_t u64 = 0;
+
+  for (uint8_t i = 0; i < u8Qty; i++)
+  {
+    uint16_t r = w[(u8Variant & 1) ? u8Qty - 1 - i : i];
+    u64 = (u64 << 16) | ((u8Variant & 2) ? regdecode_swap(r) : r);
+  }
+  return regdecode_bits_value(u8Type, u64);
+}
+
+
+#endif /* _UTIL_REGDECODE_H_ */
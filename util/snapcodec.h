@@ -0,0 +1,467 @@
+/**
+@file
+Snapshot Batch Codec
+
+@defgroup util_snapcodec "util/snapcodec.h": Snapshot Batch Codec
+@code#include "util/snapcodec.h"@endcode
+
+This header file provides a compact binary format for batches of meter
+readings, for the uplink instead of hand-written JSON around md[]/pd[].
+The encoder streams records into a caller-supplied buffer without heap
+allocations; the decoder is the same code on the receiving side, ESP32 or
+Linux. A batch decodes on its own, so a lost batch costs only its records.
+
+Batch layout:
+
+    version          1 byte, SNAPCODEC_VERSION
+    field count      1 byte
+    field modes      1 byte per field: SNAPCODEC_XOR, or the number of
+                     decimals (0..9) of a fixed-point field
+    records          until the end of the batch
+
+Record layout:
+
+    time             zigzag varint; the first record holds the time itself,
+                     the second the delta to the first, later ones the
+                     change of the delta (delta-of-delta), so a fixed
+                     polling period costs one byte
+    presence bitmap  one bit per field, LSB first; a missing field is
+                     decoded as absent, e.g. a field not in u64Valid
+    change bitmap    one bit per field; set for present fields that differ
+                     from the last value sent in this batch
+    values           one per changed field, in field order:
+                     XOR fields: control byte (leading zero bytes << 4 |
+                     significant bytes) and the significant bytes of the
+                     IEEE 754 bits XOR the previous value, as in
+                     MeterHistory; exact, NaN included
+                     fixed-point fields: zigzag varint of the change of
+                     round(value * 10^decimals); NaN is sent as absent
+
+meterData and pqData are a time stamp followed by packed floats, so a
+reading goes in as
+
+    snapcodec_put(&enc, md[i].mdt, &md[i].watt, md[i].u64Valid);
+
+*/
+
+
+#ifndef _UTIL_SNAPCODEC_H_
+#define _UTIL_SNAPCODEC_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/** @ingroup util_snapcodec
+    Format version written into and required in every batch.
+*/
+#define SNAPCODEC_VERSION 1
+
+
+/** @ingroup util_snapcodec
+    Most fields per record; pqData has 41.
+*/
+#define SNAPCODEC_MAX_FIELDS 48
+
+
+/** @ingroup util_snapcodec
+    Field mode: exact float, XOR against the previous value.
+*/
+#define SNAPCODEC_XOR 0x80
+
+
+/** @ingroup util_snapcodec
+    Largest field mode of a fixed-point field.
+*/
+#define SNAPCODEC_MAX_DECIMALS 9
+
+
+/** @ingroup util_snapcodec
+    State shared by encoder and decoder: the format of the batch and the
+    previous record, which the next one is coded against.
+*/
+typedef struct __snapCodec
+{
+  uint8_t *pu8Buf;     ///< batch
+  uint16_t u16Size;    ///< capacity (encoder) or length (decoder) of the batch [bytes]
+  uint16_t u16Used;    ///< bytes written or consumed
+  uint8_t u8Fields;
+  uint8_t u8Modes[SNAPCODEC_MAX_FIELDS];
+  uint16_t u16Records;
+  int64_t i64Time;     ///< time of the previous record
+  int64_t i64Delta;    ///< time delta of the previous record
+  uint32_t u32Last[SNAPCODEC_MAX_FIELDS]; ///< previous value: float bits, or the scaled integer
+} snapCodec;
+
+
+/** @ingroup util_snapcodec
+    Power of ten of a fixed-point field.
+*/
+static inline double snapcodec_scale(uint8_t u8Decimals)
+{
+  double d = 1;
+
+  while (u8Decimals--)
+    d *= 10;
+  return d;
+}
+
+
+/** @ingroup util_snapcodec
+    Append an unsigned varint (LEB128) if it fits.
+
+    @return bytes written; 0 if u16Left is too small
+*/
+static inline uint8_t snapcodec_put_varint(uint8_t *p, uint16_t u16Left, uint64_t u64)
+{
+  uint8_t n = 0;
+
+  do
+  {
+    if (n == u16Left)
+      return 0;
+    p[n++] = (uint8_t)((u64 & 0x7F) | ((u64 >= 0x80) ? 0x80 : 0));
+    u64 >>= 7;
+  } while (u64);
+  return n;
+}
+
+
+/** @ingroup util_snapcodec
+    Read an unsigned varint.
+
+    @return bytes read; 0 if it runs past u16Left or beyond 64 bits
+*/
+static inline uint8_t snapcodec_get_varint(const uint8_t *p, uint16_t u16Left, uint64_t *pu64)
+{
+  uint64_t u64 = 0;
+  uint8_t n = 0;
+
+  do
+  {
+    if (n == u16Left || n == 10)
+      return 0;
+    u64 |= (uint64_t)(p[n] & 0x7F) << (7 * n);
+  } while (p[n++] & 0x80);
+  *pu64 = u64;
+  return n;
+}
+
+
+/** @ingroup util_snapcodec
+    Append the XOR of two IEEE 754 bit patterns if it fits: a control byte
+    (leading zero bytes << 4 | significant bytes), then the significant
+    bytes, high first. Shared with MeterHistory.
+
+    @param x new bits XOR previous bits; must not be 0
+    @return bytes written, 2..5; 0 if u16Left is too small
+*/
+static inline uint8_t snapcodec_put_xor(uint8_t *p, uint16_t u16Left, uint32_t x)
+{
+  uint8_t u8Lead = 0;
+  uint8_t u8Len;
+
+  while (!(x & 0xFF000000UL))
+  {
+    x <<= 8;
+    u8Lead++;
+  }
+  for (u8Len = 4 - u8Lead; !(x & (0xFFUL << (8 * (4 - u8Len)))); u8Len--)
+    ;
+  if (u16Left < 1 + u8Len)
+    return 0;
+  *p++ = (u8Lead << 4) | u8Len;
+  for (uint8_t b = 0; b < u8Len; b++)
+    *p++ = (uint8_t)(x >> (24 - 8 * b));
+  return 1 + u8Len;
+}
+
+
+/** @ingroup util_snapcodec
+    Read an XOR written by snapcodec_put_xor().
+
+    @param px receives the XOR
+    @return bytes read; 0 if it runs past u16Left or the control byte
+            describes more than four bytes
+*/
+static inline uint8_t snapcodec_get_xor(const uint8_t *p, uint16_t u16Left, uint32_t *px)
+{
+  uint8_t u8Lead, u8Len;
+  uint32_t x = 0;
+
+  if (!u16Left)
+    return 0;
+  u8Lead = p[0] >> 4;
+  u8Len = p[0] & 0x0F;
+  if (u16Left < 1 + u8Len || u8Lead + u8Len > 4)
+    return 0;
+  for (uint8_t b = 0; b < u8Len; b++)
+    x |= (uint32_t)p[1 + b] << (24 - 8 * (u8Lead + b));
+  *px = x;
+  return 1 + u8Len;
+}
+
+
+/** @ingroup util_snapcodec
+    Zigzag-map a signed value so that small magnitudes give short varints.
+*/
+static inline uint64_t snapcodec_zigzag(int64_t i64)
+{
+  return ((uint64_t)i64 << 1) ^ (uint64_t)(i64 >> 63);
+}
+
+
+static inline int64_t snapcodec_unzigzag(uint64_t u64)
+{
+  return (int64_t)(u64 >> 1) ^ -(int64_t)(u64 & 1);
+}
+
+
+/** @ingroup util_snapcodec
+    Start a batch.
+
+    @param c encoder state
+    @param buf batch buffer
+    @param u16Size capacity of buf [bytes]
+    @param u8Fields values per record, at most SNAPCODEC_MAX_FIELDS
+    @param modes one SNAPCODEC_XOR or decimals count per field; 0 makes
+           every field SNAPCODEC_XOR
+    @return false if the fields or modes are invalid or the header does not
+            fit
+*/
+static inline bool snapcodec_begin(snapCodec *c, uint8_t *buf, uint16_t u16Size, uint8_t u8Fields, const uint8_t *modes)
+{
+  uint8_t k;
+
+  if (!u8Fields || u8Fields > SNAPCODEC_MAX_FIELDS || u16Size < 2 + u8Fields)
+    return false;
+
+  c->pu8Buf = buf;
+  c->u16Size = u16Size;
+  c->u8Fields = u8Fields;
+  buf[0] = SNAPCODEC_VERSION;
+  buf[1] = u8Fields;
+  for (k = 0; k < u8Fields; k++)
+  {
+    c->u8Modes[k] = modes ? modes[k] : SNAPCODEC_XOR;
+    if (c->u8Modes[k] != SNAPCODEC_XOR && c->u8Modes[k] > SNAPCODEC_MAX_DECIMALS)
+      return false;
+    buf[2 + k] = c->u8Modes[k];
+  }
+  c->u16Used = 2 + u8Fields;
+  c->u16Records = 0;
+  c->i64Time = 0;
+  c->i64Delta = 0;
+  memset(c->u32Last, 0, sizeof(c->u32Last));
+  return true;
+}
+
+
+/** @ingroup util_snapcodec
+    Append a record. Nothing is written unless the whole record fits; the
+    caller then sends the batch and starts a new one.
+
+    @param c encoder state
+    @param i64Time time stamp, e.g. mdt
+    @param values u8Fields floats
+    @param u64Present bit k set if values[k] holds a reading
+    @return false if the record does not fit
+*/
+static inline bool snapcodec_put(snapCodec *c, int64_t i64Time, const float *values, uint64_t u64Present)
+{
+  uint8_t u8Bitmap = (c->u8Fields + 7) / 8;
+  uint32_t u32Next[SNAPCODEC_MAX_FIELDS];
+  uint8_t *p = c->pu8Buf + c->u16Used;
+  uint16_t u16Left = c->u16Size - c->u16Used;
+  uint8_t *present, *changed;
+  int64_t i64Delta = i64Time - c->i64Time;
+  uint64_t u64Time;
+  uint8_t n, k;
+
+  // time: absolute, then delta, then delta of delta
+  if (c->u16Records == 0)
+    u64Time = snapcodec_zigzag(i64Time);
+  else if (c->u16Records == 1)
+    u64Time = snapcodec_zigzag(i64Delta);
+  else
+    u64Time = snapcodec_zigzag(i64Delta - c->i64Delta);
+  if (!(n = snapcodec_put_varint(p, u16Left, u64Time)) || u16Left - n < 2 * u8Bitmap)
+    return false;
+  p += n;
+  u16Left -= n + 2 * u8Bitmap;
+
+  present = p;
+  changed = p + u8Bitmap;
+  memset(p, 0, 2 * u8Bitmap);
+  p += 2 * u8Bitmap;
+
+  for (k = 0; k < c->u8Fields; k++)
+  {
+    uint32_t x;
+
+    u32Next[k] = c->u32Last[k];
+    if (!(u64Present & (1ULL << k)))
+      continue;
+
+    if (c->u8Modes[k] == SNAPCODEC_XOR)
+    {
+      memcpy(&u32Next[k], &values[k], sizeof(uint32_t));
+      present[k >> 3] |= 1 << (k & 7);
+      x = u32Next[k] ^ c->u32Last[k];
+      if (!x)
+        continue;
+      changed[k >> 3] |= 1 << (k & 7);
+
+      if (!(n = snapcodec_put_xor(p, u16Left, x)))
+        return false;
+      p += n;
+      u16Left -= n;
+    }
+    else
+    {
+      double d = values[k] * snapcodec_scale(c->u8Modes[k]);
+
+      if (isnan(d) || d > 2147483647.0 || d < -2147483648.0)
+        continue;
+      present[k >> 3] |= 1 << (k & 7);
+      u32Next[k] = (uint32_t)(int32_t)lrint(d);
+      if (u32Next[k] == c->u32Last[k])
+        continue;
+      changed[k >> 3] |= 1 << (k & 7);
+
+      if (!(n = snapcodec_put_varint(p, u16Left, snapcodec_zigzag((int64_t)(int32_t)u32Next[k] - (int32_t)c->u32Last[k]))))
+        return false;
+      p += n;
+      u16Left -= n;
+    }
+  }
+
+  memcpy(c->u32Last, u32Next, c->u8Fields * sizeof(uint32_t));
+  if (c->u16Records)
+    c->i64Delta = i64Delta;
+  c->i64Time = i64Time;
+  c->u16Records++;
+  c->u16Used = (uint16_t)(p - c->pu8Buf);
+  return true;
+}
+
+
+/** @ingroup util_snapcodec
+    Open a received batch for reading.
+
+    @param c decoder state
+    @param buf batch
+    @param u16Len length of the batch [bytes]
+    @return false if the header is not a valid batch of this version
+*/
+static inline bool snapcodec_open(snapCodec *c, const uint8_t *buf, uint16_t u16Len)
+{
+  uint8_t k;
+
+  if (u16Len < 2 || buf[0] != SNAPCODEC_VERSION || !buf[1] || buf[1] > SNAPCODEC_MAX_FIELDS || u16Len < 2 + buf[1])
+    return false;
+
+  c->pu8Buf = (uint8_t *)buf;
+  c->u16Size = u16Len;
+  c->u8Fields = buf[1];
+  for (k = 0; k < c->u8Fields; k++)
+  {
+    c->u8Modes[k] = buf[2 + k];
+    if (c->u8Modes[k] != SNAPCODEC_XOR && c->u8Modes[k] > SNAPCODEC_MAX_DECIMALS)
+      return false;
+  }
+  c->u16Used = 2 + c->u8Fields;
+  c->u16Records = 0;
+  c->i64Time = 0;
+  c->i64Delta = 0;
+  memset(c->u32Last, 0, sizeof(c->u32Last));
+  return true;
+}
+
+
+/** @ingroup util_snapcodec
+    Read the next record. Fields that are absent keep whatever values[]
+    held; their bit in *pu64Present is clear.
+
+    @param c decoder state
+    @param pi64Time receives the time stamp
+    @param values receives u8Fields floats
+    @param pu64Present receives the presence bitmap
+    @return false at the end of the batch or if it is truncated
+*/
+static inline bool snapcodec_next(snapCodec *c, int64_t *pi64Time, float *values, uint64_t *pu64Present)
+{
+  uint8_t u8Bitmap = (c->u8Fields + 7) / 8;
+  const uint8_t *p = c->pu8Buf + c->u16Used;
+  uint16_t u16Left = c->u16Size - c->u16Used;
+  const uint8_t *present, *changed;
+  uint64_t u64;
+  int64_t i64;
+  uint8_t n, k;
+
+  if (!u16Left || !(n = snapcodec_get_varint(p, u16Left, &u64)) || u16Left - n < 2 * u8Bitmap)
+    return false;
+  p += n;
+  u16Left -= n + 2 * u8Bitmap;
+
+  i64 = snapcodec_unzigzag(u64);
+  if (c->u16Records == 0)
+  {
+    c->i64Time = i64;
+  }
+  else
+  {
+    // unsigned: a corrupt batch must not overflow a signed add
+    c->i64Delta = (c->u16Records == 1) ? i64 : (int64_t)((uint64_t)c->i64Delta + (uint64_t)i64);
+    c->i64Time = (int64_t)((uint64_t)c->i64Time + (uint64_t)c->i64Delta);
+  }
+
+  present = p;
+  changed = p + u8Bitmap;
+  p += 2 * u8Bitmap;
+  *pu64Present = 0;
+
+  for (k = 0; k < c->u8Fields; k++)
+  {
+    if (!(present[k >> 3] & (1 << (k & 7))))
+      continue;
+    *pu64Present |= 1ULL << k;
+
+    if (changed[k >> 3] & (1 << (k & 7)))
+    {
+      if (c->u8Modes[k] == SNAPCODEC_XOR)
+      {
+        uint32_t x;
+
+        if (!(n = snapcodec_get_xor(p, u16Left, &x)))
+          return false;
+        p += n;
+        u16Left -= n;
+        c->u32Last[k] ^= x;
+      }
+      else
+      {
+        if (!(n = snapcodec_get_varint(p, u16Left, &u64)))
+          return false;
+        p += n;
+        u16Left -= n;
+        // modulo 2^32 for the same reason
+        c->u32Last[k] += (uint32_t)snapcodec_unzigzag(u64);
+      }
+    }
+
+    if (c->u8Modes[k] == SNAPCODEC_XOR)
+      memcpy(&values[k], &c->u32Last[k], sizeof(float));
+    else
+      values[k] = (float)((int32_t)c->u32Last[k] / snapcodec_scale(c->u8Modes[k]));
+  }
+
+  *pi64Time = c->i64Time;
+  c->u16Records++;
+  c->u16Used = (uint16_t)(p - c->pu8Buf);
+  return true;
+}
+
+
+#endif /* _UTIL_SNAPCODEC_H_ */